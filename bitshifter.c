@@ -13,7 +13,7 @@ int  align_bitshifted_track(BYTE *track_start, int track_length, BYTE **aligned_
 BYTE ShiftCopyXBitsFromPBtoQC(BYTE **p1, BYTE *p1bit, BYTE **p2, BYTE *p2bit, int NumDataBits, BYTE mode);
 BYTE find_end_of_bitshifted_sync(BYTE **pt, BYTE *gcr_end);
 BYTE find_bitshifted_sync(BYTE **pt, BYTE *gcr_end);
-int  isImageAligned(BYTE *track_buffer);
+int  isImageAligned(BYTE *track_buffer, size_t *track_length, nib_options *opt);
 
 #ifndef min
 #define min(a,b)  (((a) < (b))? (a) : (b))
@@ -30,45 +30,32 @@ int  isImageAligned(BYTE *track_buffer);
 //       or no sync found.
 int isTrackBitshifted(BYTE *track_start, int track_length)
 {
-	BYTE *pt, *track_end;
-	int numSyncs = 0; // Number of found syncs.
+	bitstream track;
+	size_t sync, sync_end;
 
-	pt = track_start;                           // pt -> start of track data
-	track_end = track_start + track_length - 1; // track_end -> last valid track data byte
+	// Check if all syncs end on byte boundary. Syncs are found 64 bit
+	// positions at a time, see bits_find_ones().
+	bitstream_init(&track, track_start, (size_t)track_length * 8);
 
-	// Check if all syncs end on byte boundary. A sync is at least 10 bits long and
-	// therefore cannot start on the last track byte.
-	while (pt < track_end)
+	sync = bits_find_ones(&track, 0, SYNC_MIN_BITS);
+	while (sync != BITS_NOT_FOUND)
 	{
-		// Search for sync between pt and track_end.
-		// Returns bit position 1-8 of sync start at (updated) pt if sync is found,
-		// returns 0 if no sync found. Bit positions are numbered 1-8.
-		find_bitshifted_sync(&pt, track_end);
+		sync_end = sync + bits_count_ones(&track, sync, track.bits);
 
-		if (pt < track_end)
-		{
-			// sync found (there can't be a sync if pt==track_end)
-			numSyncs++;
+		// Track image ends with sync.
+		if (sync_end >= track.bits)
+			break;
 
-			// A sync is at least 10 bits long and therefore cannot end on the same
-			// track byte.
-			pt++;
+		if (sync_end & 7)
+			return 1; // data sector is bitshifted
 
-			// Determine if number of final '1' sync bits in first byte where a '0'
-			// bit occurs is 0, or 8 if track image ends with sync.
-			if (find_end_of_bitshifted_sync(&pt, track_end)%8 != 0)
-				return 1; // data sector is bitshifted
-		}
+		sync = bits_find_ones(&track, sync_end, SYNC_MIN_BITS);
 	}
 
-	// Return 0 if no sync found.
-	if (numSyncs == 0) return 0;
-
-	// All data bytes (non-sync) are correctly aligned.
+	// All data bytes (non-sync) are correctly aligned, or no sync found.
 	return 0;
 }
 
-
 // Align a track that is possibly bitshifted (sectors not sync aligned).
 // Pad bits are inserted before syncs until last sync byte ends on byte
 // boundary, hence the first byte of following data sector starts on the
@@ -96,11 +83,13 @@ int isTrackBitshifted(BYTE *track_start, int track_length)
 //  -1: empty track detected.
 int align_bitshifted_kf_track(BYTE *track_start, int track_length, BYTE **aligned_track_start, int *aligned_track_length)
 {
-	BYTE *sourcedata, *src_end, *pt;
-	int SSB;
+	BYTE rotated[NIB_TRACK_LENGTH];
+	BYTE wrap[6];
+	BYTE *src_end, *pt, *wp;
+	int SSB, start, i;
 	int res = 1; // Default return value.
 
-	if ((track_start == NULL) || (track_length == 0))
+	if ((track_start == NULL) || (track_length == 0) || (track_length > NIB_TRACK_LENGTH))
 	{
 		printf("{nodata}");
 		*aligned_track_start = track_start;
@@ -108,35 +97,43 @@ int align_bitshifted_kf_track(BYTE *track_start, int track_length, BYTE **aligne
 		return -1; // empty track detected
 	}
 
-	// Have two copies of (bitshifted) source track data in memory.
-	sourcedata = malloc(track_length*2);
-	memcpy(sourcedata             , track_start, track_length);
-	memcpy(sourcedata+track_length, track_start, track_length);
-
-	pt = sourcedata; // Work pointer on source data
-	src_end = sourcedata + track_length - 1; // Pointer -> last source byte
+	pt = track_start; // Work pointer on source data
+	src_end = track_start + track_length - 1; // Pointer -> last source byte
 
 	// Get out of possible initial sync on track cycle.
-	while ((*pt & 0xff) && (pt < src_end))
-		(*pt)++;
+	while ((*pt == 0xff) && (pt < src_end))
+		pt++;
 
 	// Find first sync.
 	//
 	// Possible syncs on track cycle:
 	//   1.1111.1111|track cycle|1000.0000
 	//     0001.1111|track cycle|1111.1000
-	//     0000.0001|track cycle|1111.1111.1  <-- use (src_end+2) for this one
-	//     0000.0000|track cycle|1111.1111.11 <-- use (src_end+2) for this one
+	//     0000.0001|track cycle|1111.1111.1  <-- needs the first bytes again
+	//     0000.0000|track cycle|1111.1111.11 <-- needs the first bytes again
+	//
+	// The track is searched in place. The last positions, where the sync
+	// runs into the track start, are searched in a small copy of the last
+	// two and first four bytes instead of a second copy of the track.
 	//
-	// Returns updated pt pointing to first sync start.
 	// Returns SYNC START BIT (SSB) = bit position 1-8 of sync start at
 	//   pt if sync is found, or 0 if no sync found.
-	//
-	// On return: pt<=src_end+1 (first byte of second track copy),
-	//            because we skipped initial sync in while loop above.
-	SSB = find_bitshifted_sync(&pt, src_end+2);
+	SSB = find_bitshifted_sync(&pt, src_end);
+	start = pt - track_start;
+
+	if ((SSB == 0) && (track_length > 2))
+	{
+		for (i = 0; i < 6; i++)
+			wrap[i] = track_start[(track_length - 2 + i) % track_length];
 
-	//printf("\nsourcedata=0x%x | pt=0x%x.%d | src_end=0x%x | #%d\n", sourcedata, pt, SSB, src_end, track_length);
+		wp = wrap + ((start > track_length - 2) ? start - (track_length - 2) : 0);
+		SSB = find_bitshifted_sync(&wp, wrap + 4);
+
+		// A sync at the first track byte again is searched up to here.
+		if (wp > wrap + 2)
+			SSB = 0;
+		start = (track_length - 2 + (wp - wrap)) % track_length;
+	}
 
 	// Return if no sync found (no alignment without sync).
 	if (SSB == 0)
@@ -146,13 +143,18 @@ int align_bitshifted_kf_track(BYTE *track_start, int track_length, BYTE **aligne
 		*aligned_track_length = track_length;
 		res = 0; // sync not found, non-aligned track returned.
 	}
+	else if (start == 0)
+		res = align_bitshifted_track(track_start, track_length, aligned_track_start, aligned_track_length);
 	else
-		res = align_bitshifted_track(pt, track_length, aligned_track_start, aligned_track_length);
-
-	//BYTE *tmp = *aligned_track_start+*aligned_track_length-1;
-	//printf("aligned_track_start=0x%x | end=0x%x | #%d\n", *aligned_track_start, tmp, *aligned_track_length);
+	{
+		// Rotate the track to start at the first sync.
+		memcpy(rotated, track_start + start, track_length - start);
+		memcpy(rotated + track_length - start, track_start, start);
 
-	free(sourcedata);
+		res = align_bitshifted_track(rotated, track_length, aligned_track_start, aligned_track_length);
+		if (aligned_track_start == NULL)
+			memcpy(track_start, rotated, track_length);
+	}
 
 	return res;
 }
@@ -184,7 +186,7 @@ int align_bitshifted_track(BYTE *track_start, int track_length, BYTE **aligned_t
 {
 	BYTE *nibdata;
 	BYTE *pt, *p1, *p2;
-	BYTE *gcr_end, *gcr_end2, *sync_start, *sync_end;
+	BYTE *gcr_end, *sync_start, *sync_end;
 	BYTE p1bit, p2bit, first_sync;
 	size_t SSB, LSB;
 	size_t NumDataBits, NumPadBits, NumSyncBits;
@@ -197,7 +199,6 @@ int align_bitshifted_track(BYTE *track_start, int track_length, BYTE **aligned_t
 	memset(nibdata, 0, track_length*2);
 
 	gcr_end  = track_start + track_length - 1; // Pointer -> last source byte
-	gcr_end2 = nibdata + track_length - 1;     // Pointer -> last target byte
 
 	pt = track_start; // Work pointer on source data
 	p1 = track_start; // p1 -> source (unaligned track data)
@@ -207,6 +208,8 @@ int align_bitshifted_track(BYTE *track_start, int track_length, BYTE **aligned_t
 	p2bit = 0; // No used bits so far in first target byte (*p2)
 
 	first_sync = 1; // Flag for identifying first found sync.
+	sync_end = track_start;
+	LSB = 0;
 
 	// Loop while (aligned) source track bytes available.
 	while (p1 <= gcr_end)
@@ -285,18 +288,18 @@ int align_bitshifted_track(BYTE *track_start, int track_length, BYTE **aligned_t
 					first_sync = 0;
 					if (NumDataBits > 0)
 					{
-						if (NumDataBits%8 == 0) printf("0:%d ", NumDataBits/8);
-						else printf("0:%d.%d ", NumDataBits/8, NumDataBits%8);
+						if (NumDataBits%8 == 0) printf("0:%d ", (int)(NumDataBits/8));
+						else printf("0:%d.%d ", (int)(NumDataBits/8), (int)(NumDataBits%8));
 					}
-					if (NumSyncBits%8 == 0) printf("%d:", NumSyncBits/8);
-					else printf("%d.%d:", NumSyncBits/8, NumSyncBits%8);
+					if (NumSyncBits%8 == 0) printf("%d:", (int)(NumSyncBits/8));
+					else printf("%d.%d:", (int)(NumSyncBits/8), (int)(NumSyncBits%8));
 				}
 				else
 				{
-					if (NumDataBits%8 == 0) printf("%d ", NumDataBits/8);
-					else printf("%d.%d ", NumDataBits/8, NumDataBits%8);
-					if (NumSyncBits%8 == 0) printf("%d:", NumSyncBits/8);
-					else printf("%d.%d:", NumSyncBits/8, NumSyncBits%8);
+					if (NumDataBits%8 == 0) printf("%d ", (int)(NumDataBits/8));
+					else printf("%d.%d ", (int)(NumDataBits/8), (int)(NumDataBits%8));
+					if (NumSyncBits%8 == 0) printf("%d:", (int)(NumSyncBits/8));
+					else printf("%d.%d:", (int)(NumSyncBits/8), (int)(NumSyncBits%8));
 				}
 			}
 			// printf("SSB=%d LSB=%d #DataBits=%d(%d.%d) #SyncBits=%d #PadBits=%d \n",
@@ -331,9 +334,9 @@ int align_bitshifted_track(BYTE *track_start, int track_length, BYTE **aligned_t
 				if (p1 == track_start)
 					printf("0:"); // no sync on track
 				if ((8-LSB) != 0)
-					printf("%d.%d\n", pt - sync_end, (8-LSB) );
+					printf("%d.%d\n", (int)(pt - sync_end), (int)(8-LSB) );
 				else
-					printf("%d\n", pt - sync_end );
+					printf("%d\n", (int)(pt - sync_end) );
 			}
 
 			// Copy last source bytes to target.
@@ -363,7 +366,7 @@ int align_bitshifted_track(BYTE *track_start, int track_length, BYTE **aligned_t
 			// Generate verbose output if flagged.
 			if (verbose > 2)
 			{
-				printf("P.B=0x%x.%d | gcr_end=0x%x | nibdata=0x%x | Q.C=0x%x.%d | #%d\n", p1, p1bit, gcr_end, nibdata, p2, p2bit, NumDataBits);
+				printf("P.B=%p.%d | gcr_end=%p | nibdata=%p | Q.C=%p.%d | #%d\n", (void *)p1, p1bit, (void *)gcr_end, (void *)nibdata, (void *)p2, p2bit, (int)NumDataBits);
 			}
 
 			// Don't forget last bits of last byte (target memory was initialized with zeros by memset).
@@ -391,8 +394,8 @@ int align_bitshifted_track(BYTE *track_start, int track_length, BYTE **aligned_t
 		// Generate verbose output if flagged.
 		if (verbose > 2)
 		{
-			printf(">>> 0x%x..0x%x..0x%x\n", nibdata             , *aligned_track_length, nibdata             +*aligned_track_length-1);
-			printf(">>> 0x%x..0x%x..0x%x\n", *aligned_track_start, *aligned_track_length, *aligned_track_start+*aligned_track_length-1);
+			printf(">>> %p..0x%x..%p\n", (void *)nibdata             , *aligned_track_length, (void *)(nibdata             +*aligned_track_length-1));
+			printf(">>> %p..0x%x..%p\n", (void *)*aligned_track_start, *aligned_track_length, (void *)(*aligned_track_start+*aligned_track_length-1));
 		}
 	}
 
@@ -419,58 +422,45 @@ int align_bitshifted_track(BYTE *track_start, int track_length, BYTE **aligned_t
 BYTE
 ShiftCopyXBitsFromPBtoQC(BYTE **p, BYTE *b, BYTE **q, BYTE *c, int NumDataBits, BYTE mode)
 {
-	BYTE db, d;
+	bitstream src, dest;
+	size_t srcbit, destbit;
+
+	if (NumDataBits <= 0)
+		return 1;
 
-	// Loop while bits are to be copied (return if target buffer is full, see below)
-	while (NumDataBits > 0)
+	// If target Q.C byte is full move Q (pointer) to next byte and reset C (used bits)
+	if (*c == 8)
 	{
-		// If target Q.C byte is full move Q (pointer) to next byte and reset C (used bits)
-		if (*c == 8)
-		{
-			*c = 0;
-			(*q)++;
-		}
+		*c = 0;
+		(*q)++;
+	}
 
-		// Determine which bits to insert/copy.
-		if (mode == 0) db = 0;         // Mode  0: Insert '0' bits (before sync)
-		else if (mode == 1) db = 0xff; // Mode  1: Insert '1' bits (sync)
-		else db = **p;                 // Mode 99: Copy (bitshifted) track data
-
-		// Copy bits from 'db' to Q, but no more than 'db' has, and at most NumDataBits:
-		// > Number of used bits in target byte Q.C = *c
-		// > Number of free bits in target byte Q.C = (8-*c)
-		// > 0 <= C <= 7 (see above)
-		// > *b = Next bit position to be copied from 'db' (1 <= B <= 8)
-		// > [ ((Q << C) & 0xff00) + new bits from db ] >> C
-		**q = ( ( (int)((**q) >> (8-*c)) << 8) | (((int)db << (*b-1)) & 0xff) ) >> *c;
-
-		// Determine number 'd' of copied bits (lowest value of following):
-		// - At most (8-*c) free bits in Q were filled
-		// - At most (9-*b) bits could be copied from db
-		// - At most NumDataBits were left to be copied
-		d = min(min(8-*c, 9-*b), NumDataBits);
-		// Now: 1 <= d <= 8
-
-		// Update source position P.B
-		if (mode > 0)
-		{
-			*b += d; // Add number of copied bits: 1 <= B <= 9 (because of min(..,9-*b) above)
-			*p += *b/9; // Move P only if B points to next byte's first bit (9)
-			if (*b == 9) *b = 1; // Reset B if it points to next byte's first bit (P just updated)
-		}
+	// Source and target only span the bits we touch, so nothing beyond
+	// them is read or written. Bit B (1-8) at P is stream bit B-1.
+	srcbit = *b - 1;
+	bitstream_init(&src, *p, srcbit + NumDataBits);
+	bitstream_init(&dest, *q, *c + NumDataBits);
 
-		// 'd' bits added/copied, update NumDataBits and C (bit counter)
-		NumDataBits -= d;
-		*c += d;
+	if (mode == 0)
+		bits_fill(&dest, *c, NumDataBits, 0);    // Mode  0: Insert '0' bits (before sync)
+	else if (mode == 1)
+		bits_fill(&dest, *c, NumDataBits, 1);    // Mode  1: Insert '1' bits (sync)
+	else
+		bits_copy(&dest, *c, &src, srcbit, NumDataBits); // Mode 99: Copy (bitshifted) track data
 
-		// At most (8-*c) free bits in Q were filled (see above)
-		// If target Q.C byte is full move Q (pointer) to next byte and reset C (used bits)
-		if (*c == 8)
-		{
-			*c = 0;
-			(*q)++;
-		}
+	// Update source position P.B, sync bits are taken from the source too
+	if (mode > 0)
+	{
+		srcbit += NumDataBits;
+		*p += srcbit >> 3;
+		*b = (BYTE)((srcbit & 7) + 1);
 	}
+
+	// Update target position Q.C
+	destbit = *c + NumDataBits;
+	*q += destbit >> 3;
+	*c = (BYTE)(destbit & 7);
+
 	return 1;
 }
 
@@ -510,6 +500,60 @@ find_end_of_bitshifted_sync(BYTE **pt, BYTE *gcr_end)
 }
 
 
+// Number of leading and trailing '1' bits of a byte.
+static const BYTE leading_ones[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 7, 8
+};
+
+static const BYTE trailing_ones[256] = {
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 6,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 7,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 6,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+	0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 8
+};
+
+// Sync start bit (1-8) by trailing '1' bits of the first and leading '1' bits
+// of the second track byte, see find_bitshifted_sync().
+// 8 still needs the MSB of the third byte to be checked.
+static const BYTE sync_start_bit_table[9][9] = {
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 8 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 7 },
+	{ 0, 0, 0, 0, 0, 0, 0, 6, 6 },
+	{ 0, 0, 0, 0, 0, 0, 5, 5, 5 },
+	{ 0, 0, 0, 0, 0, 4, 4, 4, 4 },
+	{ 0, 0, 0, 0, 3, 3, 3, 3, 3 },
+	{ 0, 0, 0, 2, 2, 2, 2, 2, 2 },
+	{ 0, 0, 1, 1, 1, 1, 1, 1, 1 }
+};
+
 // Search for sync between *pt and gcr_end.
 // Returns bit position 1-8 of sync start at (updated) *pt if sync is found,
 // returns 0 if no sync found. Bit positions are numbered 1-8.
@@ -526,82 +570,82 @@ find_bitshifted_sync(BYTE **pt, BYTE *gcr_end)
 	        111.1111111
 	         11.11111111
 	          1.11111111.1
+
+	   All of them are looked up at once from the first two bytes.
 	*/
 
-	BYTE sync_start_bit = 0;
+	BYTE sync_start_bit;
 
-	while ( ((*pt) < gcr_end) && (!sync_start_bit) )
+	while ((*pt) < gcr_end)
 	{
-		// 11111111.11
-		if ( (*pt)[0] == 0xff && ((*pt)[1] & 0xc0) == 0xc0 )
-			sync_start_bit = 1; // bits numbered 1-8
-
-		// 1111111.111
-		else if ( ((*pt)[0] & 0x7f) == 0x7f && ((*pt)[1] & 0xe0) == 0xe0 )
-			sync_start_bit = 2; // bits numbered 1-8
-
-		// 111111.1111
-		else if ( ((*pt)[0] & 0x3f) == 0x3f && ((*pt)[1] & 0xf0) == 0xf0 )
-			sync_start_bit = 3; // bits numbered 1-8
-
-		// 11111.11111
-		else if ( ((*pt)[0] & 0x1f) == 0x1f && ((*pt)[1] & 0xf8) == 0xf8 )
-			sync_start_bit = 4; // bits numbered 1-8
-
-		// 1111.111111
-		else if ( ((*pt)[0] & 0x0f) == 0x0f && ((*pt)[1] & 0xfc) == 0xfc )
-			sync_start_bit = 5; // bits numbered 1-8
-
-		// 111.1111111
-		else if ( ((*pt)[0] & 0x07) == 0x07 && ((*pt)[1] & 0xfe) == 0xfe )
-			sync_start_bit = 6; // bits numbered 1-8
-
-		// 11.11111111
-		else if ( ((*pt)[0] & 0x03) == 0x03 && (*pt)[1] == 0xff )
-			sync_start_bit = 7; // bits numbered 1-8
-
-		// 1.11111111.1
-		else if ( ((*pt)+1) < gcr_end )
-			if ( ((*pt)[0] & 0x01) == 0x01
-				&& (*pt)[1] == 0xff
-				&& ((*pt)[2] & 0x80) == 0x80 )
-					sync_start_bit = 8; // bits numbered 1-8
-
-		if (!sync_start_bit) (*pt)++;
+		sync_start_bit = sync_start_bit_table[trailing_ones[(*pt)[0]]][leading_ones[(*pt)[1]]];
+
+		// 1.11111111.1 needs a third byte
+		if ((sync_start_bit == 8) && !((((*pt) + 1) < gcr_end) && (((*pt)[2] & 0x80) == 0x80)))
+			sync_start_bit = 0;
+
+		if (sync_start_bit)
+			return sync_start_bit;
+
+		(*pt)++;
 	}
 
-	return sync_start_bit;
+	return 0;
 }
 
 
-// Check sector alignment of a whole disk image.
-// Disk image starts at 'track_buffer' pointer.
-// Each track has to be NIB_TRACK_LENGTH bytes long.
-int isImageAligned(BYTE *track_buffer)
+// Tracks handed to check_track_aligned(), with the result per track.
+typedef struct
+{
+	BYTE *track_buffer;
+	size_t *track_length;
+	BYTE shifted[MAX_HALFTRACKS_1541 + 2];
+} aligned_job;
+
+static void check_track_aligned(void *arg, int track)
 {
-	int track;
+	aligned_job *job = arg;
 
-	BYTE *gcr_start;
-	int imgres;
+	job->shifted[track] = 0;
+	if (job->track_length[track])
+		job->shifted[track] = (BYTE) isTrackBitshifted(job->track_buffer + (track * NIB_TRACK_LENGTH),
+			job->track_length[track]);
+}
+
+// Check sector alignment of a whole disk image.
+// Disk image starts at 'track_buffer' pointer, each track at a multiple
+// of NIB_TRACK_LENGTH bytes with its length in 'track_length'.
+// Every halftrack from start_track to end_track in 'opt' is checked, as sync_tracks()
+// walks them. The tracks are checked in parallel, the report is printed in order.
+// Returns 1 if no track is bitshifted.
+int isImageAligned(BYTE *track_buffer, size_t *track_length, nib_options *opt)
+{
+	aligned_job job;
+	int track, shifted;
 
 	printf("\nChecking sector alignment...\n");
 
-	imgres = 1;
+	job.track_buffer = track_buffer;
+	job.track_length = track_length;
+	for_each_track(check_track_aligned, &job, opt->start_track, opt->end_track, 1, opt->threads);
 
-	for (track = start_track; track <= end_track; track += track_inc)
+	shifted = 0;
+	for (track = opt->start_track; track <= opt->end_track; track ++)
 	{
-		printf("%4.1f: ",(float) track / 2);
-
-		gcr_start = track_buffer + (track * NIB_TRACK_LENGTH);
+		if (!track_length[track])
+			continue;
 
-		if (!isTrackBitshifted(gcr_start, NIB_TRACK_LENGTH))
-			printf("aligned\n");
-		else
+		if (job.shifted[track])
 		{
-			printf("bitshifted\n");
-			imgres = 0;
+			printf("%4.1f: bitshifted\n", (float) track / 2);
+			shifted++;
 		}
+		else if (verbose)
+			printf("%4.1f: aligned\n", (float) track / 2);
 	}
 
-	return imgres;
+	if (!shifted)
+		printf("All tracks aligned\n");
+
+	return !shifted;
 }
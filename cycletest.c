@@ -0,0 +1,153 @@
+/*
+    CYCLETEST - regression test for the raw track cycle search
+	part of the NIBTOOLS package
+
+	The track is placed right in front of an inaccessible page, so any read
+	past the end of the data crashes instead of going unnoticed.
+*/
+
+#ifdef HAVE_MMAP
+#define _DEFAULT_SOURCE	/* MAP_ANONYMOUS */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "mnibarch.h"
+#include "gcr.h"
+#include "nibtools.h"
+#include "prot.h"
+
+nib_disk *disk;
+int reduce_badgcr, reduce_gap;
+int align, force_align;
+int skip_halftracks;
+int verbose;
+int align_disk;
+int ihs;
+int mode;
+int unformat_passes;
+int capacity_margin;
+int align_delay;
+BYTE fillbyte = 0xfe;
+BYTE drive = 8;
+char * cbm_adapter = "";
+int use_floppycode_srq = 0;
+int override_srq = 0;
+int track_match=0;
+int read_killer=1;
+int backwards=0;
+
+#define TEST_PERIOD 6200
+#define TEST_CAP_MIN 5900
+#define TEST_CAP_MAX 6500
+
+static int failed = 0;
+static nib_options opt;
+
+/* returns a track buffer whose last byte is followed by an unreadable page */
+static BYTE *
+guarded_track(void)
+{
+#ifdef HAVE_MMAP
+	long page = sysconf(_SC_PAGESIZE);
+	size_t size = (NIB_TRACK_LENGTH + page - 1) / page * page;
+	BYTE *base;
+
+	base = mmap(NULL, size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+	if (mprotect(base + size, page, PROT_NONE) != 0)
+		return NULL;
+	return base + size - NIB_TRACK_LENGTH;
+#else
+	return malloc(NIB_TRACK_LENGTH);
+#endif
+}
+
+/* sync free data without the repeats check_valid_data() rejects */
+static void
+fill_test_track(BYTE *track, size_t period)
+{
+	size_t i;
+
+	srand(1541);
+	for (i = 0; i < NIB_TRACK_LENGTH; i++)
+	{
+		if (i >= period)
+			track[i] = track[i - period];
+		else
+			track[i] = (BYTE) (0x01 + rand() % 0xfd);
+	}
+}
+
+static void
+check_cycle(const char *name, BYTE *track, size_t offset, size_t want_start, size_t want_length)
+{
+	BYTE *cycle_start, *cycle_stop;
+	size_t length;
+
+	cycle_start = track + offset;
+	cycle_stop = NULL;
+	length = find_track_cycle_raw(&cycle_start, &cycle_stop, TEST_CAP_MIN, TEST_CAP_MAX,
+		NIB_TRACK_LENGTH - offset, &opt);
+
+	if ((length != want_length) || (cycle_start != track + want_start) ||
+		(cycle_stop != cycle_start + want_length))
+	{
+		printf("FAIL %s%s: start %d length %d, expected start %d length %d\n",
+			name, opt.raw_cycle_legacy ? " (legacy)" : "",
+			(int) (cycle_start - track), (int) length, (int) want_start, (int) want_length);
+		failed++;
+	}
+	else
+		printf("ok   %s%s\n", name, opt.raw_cycle_legacy ? " (legacy)" : "");
+}
+
+void
+usage(void)
+{
+	printf("usage: cycletest\n");
+	exit(1);
+}
+
+int ARCH_MAINDECL
+main(int argc, char **argv)
+{
+	BYTE *track;
+	size_t last;
+
+	if (!(track = guarded_track()))
+	{
+		printf("Couldn't allocate track buffer\n");
+		exit(1);
+	}
+
+	opt.gap_match_length = 7;
+	/* last offset whose match still fits in front of the guard page */
+	last = NIB_TRACK_LENGTH - TEST_PERIOD - opt.gap_match_length - 3;
+
+	for (opt.raw_cycle_legacy = 0; opt.raw_cycle_legacy <= 1; opt.raw_cycle_legacy++)
+	{
+		fill_test_track(track, TEST_PERIOD);
+		check_cycle("full track", track, 0, 0, TEST_PERIOD);
+		check_cycle("offset track", track, 1000, 1000, TEST_PERIOD);
+		check_cycle("match at end of data", track, last, last, TEST_PERIOD);
+		check_cycle("match past end of data", track, last + 1, last + 1, NIB_TRACK_LENGTH - last - 1);
+		check_cycle("short tail", track, NIB_TRACK_LENGTH - 4, NIB_TRACK_LENGTH - 4, 4);
+
+		fill_test_track(track, NIB_TRACK_LENGTH);
+		check_cycle("no cycle", track, 0, 0, NIB_TRACK_LENGTH);
+		check_cycle("no cycle, offset", track, 3000, 3000, NIB_TRACK_LENGTH - 3000);
+	}
+
+	if (failed)
+		printf("%d test(s) failed\n", failed);
+	exit(failed ? 1 : 0);
+}
@@ -4,6 +4,10 @@
 	contains routines used by nibtools to read/write files on the host
 */
 
+#ifdef HAVE_MMAP
+#define _POSIX_C_SOURCE 200112L	/* mmap(), posix_madvise() */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,9 +22,19 @@
 #include "prot.h"
 #include "crc.h"
 #include "md5.h"
-//#include "bitshifter.c"
-
-void parseargs(char *argv[])
+#include "lz.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "bitshifter.c"
+
+void parseargs(char *argv[], nib_options *opt)
 {
 	int count;
 	double st, et;
@@ -34,8 +48,9 @@ void parseargs(char *argv[])
 			break;
 
 		case '$':
-			sync_align_buffer = 1;
-			printf("* Force sync align tracks\n");
+			opt->sync_align_buffer = atoi(&(*argv)[2]);
+			if(!opt->sync_align_buffer) opt->sync_align_buffer=1;
+			printf("* Force sync align tracks%s\n", (opt->sync_align_buffer==2) ? " (bitshift aligner)" : "");
 			break;
 
 		case 'B':
@@ -49,29 +64,45 @@ void parseargs(char *argv[])
 			break;
 
 		case 'h':
-			if(track_inc == 1) track_inc = 2;
-			else track_inc = 1;
-			printf("* Toggle halftracks (increment=%d)\n",track_inc);
+			if(opt->track_inc == 1) opt->track_inc = 2;
+			else opt->track_inc = 1;
+			printf("* Toggle halftracks (increment=%d)\n",opt->track_inc);
 			break;
 
 		case 'I':
-			increase_sync = atoi(&(*argv)[2]);
-			if(!increase_sync) increase_sync=1;
-			printf("* Fix/increase short syncs by %d\n", increase_sync);
+			opt->increase_sync = atoi(&(*argv)[2]);
+			if(!opt->increase_sync) opt->increase_sync=1;
+			printf("* Fix/increase short syncs by %d\n", opt->increase_sync);
+			break;
+
+		case 'j':
+			opt->threads = atoi(&(*argv)[2]);
+			if(opt->threads < 1) opt->threads = 1;
+			if(opt->threads > MAX_THREADS) opt->threads = MAX_THREADS;
+#ifndef HAVE_PTHREAD
+			printf("* No thread support in this build, using 1 thread\n");
+			opt->threads = 1;
+#else
+			printf("* Using %d threads\n", opt->threads);
+#endif
+			break;
+
+		case 'Z':
+			parse_nbz_level(&(*argv)[2], opt);
 			break;
 
 		case 'S':
 			if (!(*argv)[2]) usage();
 			st = atof(&(*argv)[2])*2;
-			start_track = (int)st;
-			printf("* Start track set to %.1f (%d)\n", st/2, start_track);
+			opt->start_track = (int)st;
+			printf("* Start track set to %.1f (%d)\n", st/2, opt->start_track);
 			break;
 
 		case 'E':
 			if (!(*argv)[2]) usage();
 			et = atof(&(*argv)[2])*2;
-			end_track = (int)et;
-			printf("* End track set to %.1f (%d)\n", et/2, end_track);
+			opt->end_track = (int)et;
+			printf("* End track set to %.1f (%d)\n", et/2, opt->end_track);
 			break;
 
 		case 'u':
@@ -80,7 +111,7 @@ void parseargs(char *argv[])
 			unformat_passes = atoi(&(*argv)[2]);
 			if(!unformat_passes) unformat_passes = 1;
 			printf("* Unformat passes = %d\n", unformat_passes);
-			track_inc = 1;
+			opt->track_inc = 1;
 			break;
 
 		case 'R':
@@ -101,47 +132,47 @@ void parseargs(char *argv[])
 			{
 				case 'x':
 					printf("V-MAX!\n");
-					memset(align_map, ALIGN_VMAX, MAX_TRACKS_1541+1);
-					fix_gcr = 0;
-					presync = 1;
+					memset(opt->align_map, ALIGN_VMAX, MAX_TRACKS_1541+1);
+					opt->fix_gcr = 0;
+					opt->presync = 1;
 					break;
 
 				case 'c':
 					printf("V-MAX! (CINEMAWARE)\n");
-					memset(align_map, ALIGN_VMAX_CW, MAX_TRACKS_1541+1);
-					fix_gcr = 0;
-					presync = 1;
+					memset(opt->align_map, ALIGN_VMAX_CW, MAX_TRACKS_1541+1);
+					opt->fix_gcr = 0;
+					opt->presync = 1;
 					break;
 
 				case 'g':
 				case 'm':
 					printf("SecuriSpeed/Early Rainbow Arts\n"); /* turn off reduction for track > 36 */
-					for(count = 36; count <= MAX_TRACKS_1541+1; count ++)
+					for(count = 36; count <= MAX_TRACKS_1541; count ++)
 					{
-						reduce_map[count] = REDUCE_NONE;
-						align_map[count] = ALIGN_AUTOGAP;
+						opt->reduce_map[count] = REDUCE_NONE;
+						opt->align_map[count] = ALIGN_AUTOGAP;
 					}
-					fix_gcr = 0;
+					opt->fix_gcr = 0;
 					break;
 
 				case 'v':
 					printf("VORPAL (NEWER)\n");
-					memset(align_map, ALIGN_AUTOGAP, MAX_TRACKS_1541+1);
-					align_map[18] = ALIGN_NONE;
+					memset(opt->align_map, ALIGN_AUTOGAP, MAX_TRACKS_1541+1);
+					opt->align_map[18] = ALIGN_NONE;
 					break;
 
 				case'r':
 					printf("RAPIDLOK\n"); /* don't reduce sync, but everything else */
 					//for(count = 1; count <= MAX_TRACKS_1541; count ++)
 					//	reduce_map[count] = REDUCE_BAD | REDUCE_GAP;
-					memset(align_map, ALIGN_RAPIDLOK, MAX_TRACKS_1541+1);
+					memset(opt->align_map, ALIGN_RAPIDLOK, MAX_TRACKS_1541+1);
 					break;
 
 				case'p':
 					printf("Pirateslayer\n");
-					align_map[2] = ALIGN_PSLAYER;
-					align_map[36] = ALIGN_PSLAYER;
-					align_map[37] = ALIGN_PSLAYER;
+					opt->align_map[2] = ALIGN_PSLAYER;
+					opt->align_map[36] = ALIGN_PSLAYER;
+					opt->align_map[37] = ALIGN_PSLAYER;
 					break;
 
 				default:
@@ -156,61 +187,61 @@ void parseargs(char *argv[])
 			if ((*argv)[2] == '0')
 			{
 				printf("sector 0\n");
-				memset(align_map, ALIGN_SEC0, MAX_TRACKS_1541+1);
+				memset(opt->align_map, ALIGN_SEC0, MAX_TRACKS_1541+1);
 			}
 			else if ((*argv)[2] == 'g')
 			{
 				printf("gap\n");
-				memset(align_map, ALIGN_GAP, MAX_TRACKS_1541+1);
+				memset(opt->align_map, ALIGN_GAP, MAX_TRACKS_1541+1);
 			}
 			else if ((*argv)[2] == 'w')
 			{
 				printf("longest bad GCR run\n");
-				memset(align_map, ALIGN_BADGCR, MAX_TRACKS_1541+1);
+				memset(opt->align_map, ALIGN_BADGCR, MAX_TRACKS_1541+1);
 			}
 			else if ((*argv)[2] == 's')
 			{
 				printf("longest sync\n");
-				memset(align_map, ALIGN_LONGSYNC, MAX_TRACKS_1541+1);
+				memset(opt->align_map, ALIGN_LONGSYNC, MAX_TRACKS_1541+1);
 			}
 			else if ((*argv)[2] == 'a')
 			{
 				printf("autogap\n");
-				memset(align_map, ALIGN_AUTOGAP, MAX_TRACKS_1541+1);
+				memset(opt->align_map, ALIGN_AUTOGAP, MAX_TRACKS_1541+1);
 			}
 			else if ((*argv)[2] == 'n')
 			{
 				printf("raw (no alignment, use NIB start)\n");
-				memset(align_map, ALIGN_RAW, MAX_TRACKS_1541+1);
+				memset(opt->align_map, ALIGN_RAW, MAX_TRACKS_1541+1);
 			}
 			else
 				printf("Unknown alignment parameter\n");
 			break;
 
 		case 'r':
-			reduce_sync = atoi(&(*argv)[2]);
-			if(reduce_sync)
+			opt->reduce_sync = atoi(&(*argv)[2]);
+			if(opt->reduce_sync)
 			{
-				printf("* Reduce sync to %d bytes\n", reduce_sync);
+				printf("* Reduce sync to %d bytes\n", opt->reduce_sync);
 			}
 			else
 			{
 				printf("* Disabled sync reduction\n");
 				for(count = 1; count <= MAX_TRACKS_1541; count ++)
-				reduce_map[count] &= ~REDUCE_SYNC;
+				opt->reduce_map[count] &= ~REDUCE_SYNC;
 			}
 			break;
 
 		case '0':
 			printf("* Reduce bad GCR enabled\n");
 			for(count = 1; count <= MAX_TRACKS_1541; count ++)
-				reduce_map[count] |= REDUCE_BAD;
+				opt->reduce_map[count] |= REDUCE_BAD;
 			break;
 
 		case 'g':
 			printf("* Reduce gaps enabled\n");
 			for(count = 1; count <= MAX_TRACKS_1541; count ++)
-				reduce_map[count] |= REDUCE_GAP;
+				opt->reduce_map[count] |= REDUCE_GAP;
 			break;
 
 		case 'D':
@@ -221,16 +252,16 @@ void parseargs(char *argv[])
 
 		case 'G':
 			if (!(*argv)[2]) usage();
-			gap_match_length = atoi(&(*argv)[2]);
-			printf("* Gap match length set to %d\n", gap_match_length);
+			opt->gap_match_length = atoi(&(*argv)[2]);
+			printf("* Gap match length set to %d\n", opt->gap_match_length);
 			break;
 
 		case 'f':
 			if (!(*argv)[2])
-				fix_gcr = 0;
+				opt->fix_gcr = 0;
 			else
-				fix_gcr = atoi(&(*argv)[2]);
-			printf("* Enabled level %d 'bad' GCR reproduction.\n", fix_gcr);
+				opt->fix_gcr = atoi(&(*argv)[2]);
+			printf("* Enabled level %d 'bad' GCR reproduction.\n", opt->fix_gcr);
 			break;
 
 		case 'v':
@@ -244,37 +275,47 @@ void parseargs(char *argv[])
 			break;
 
 		case 'c':
-			auto_capacity_adjust = 0;
+			opt->auto_capacity_adjust = 0;
 			printf("* Disabled automatic capacity adjustment\n");
 			break;
 
 		case 'm':
 			if (!(*argv)[2])
-				extra_capacity_margin = 0;
+				opt->extra_capacity_margin = 0;
 			else
-				extra_capacity_margin = atoi(&(*argv)[2]);
-			printf("* Changed extra capacity margin to %d\n", extra_capacity_margin);
+				opt->extra_capacity_margin = atoi(&(*argv)[2]);
+			printf("* Changed extra capacity margin to %d\n", opt->extra_capacity_margin);
 			break;
 
 		case 'M':
 			printf("* Minimum capacity ignore on\n");
-			cap_min_ignore = 1;
+			opt->cap_min_ignore = 1;
+			break;
+
+		case 'L':
+			printf("* Use legacy raw track cycle search\n");
+			opt->raw_cycle_legacy = 1;
+			break;
+
+		case 'l':
+			printf("* Compare tracks by banded alignment\n");
+			opt->compare_banded = 1;
 			break;
 
 		case 'o':
 			printf("* Use old hard-coded G64 format\n");
-			old_g64 = 1;
+			opt->old_g64 = 1;
 			break;
 
 		case 'T':
 			if (!(*argv)[2]) usage();
-			skew = (atoi(&(*argv)[2]));
-			if((skew > 200) || (skew < 0))
+			opt->skew = (atoi(&(*argv)[2]));
+			if((opt->skew > 200) || (opt->skew < 0))
 			{
 				printf("Skew must be between 1 and 200ms\n");
-				skew = 0;
+				opt->skew = 0;
 			}
-			printf("* Skew set to %dms\n",skew);
+			printf("* Skew set to %dms\n",opt->skew);
 		case 't':
 			if(!ihs) align_disk = 1;
 			printf("* Attempt timer-based track alignment\n");
@@ -287,29 +328,29 @@ void parseargs(char *argv[])
 			break;
 
 		case 'C':
-			rpm_real = atoi(&(*argv)[2]);
-			printf("* Simulate track capacity: %dRPM\n",rpm_real);
+			opt->rpm_real = atoi(&(*argv)[2]);
+			printf("* Simulate track capacity: %dRPM\n",opt->rpm_real);
 			break;
 
 		case 'F':
 			/* override FAT track detection */
-			fattrack = atoi(&(*argv)[2]);
-			if(!fattrack)
+			opt->fattrack = atoi(&(*argv)[2]);
+			if(!opt->fattrack)
 			{
 				printf("* FAT tracks disabled\n");
-				fattrack=99;
+				opt->fattrack=99;
 			}
 			else
 			{
-				printf("* Insert FAT track on %d/%.2f/%d\n",fattrack,fattrack+0.5,fattrack+1);
-				fattrack*=2;
+				printf("* Insert FAT track on %d/%.2f/%d\n",opt->fattrack,opt->fattrack+0.5,opt->fattrack+1);
+				opt->fattrack*=2;
 			}
 			break;
 
 		case 'x':
-			presync = atoi(&(*argv)[2]);
-			if(!presync) presync=1;
-			printf("* Add short sync bytes to start of each track:%d\n",presync);
+			opt->presync = atoi(&(*argv)[2]);
+			if(!opt->presync) opt->presync=1;
+			printf("* Add short sync bytes to start of each track:%d\n",opt->presync);
 			break;
 
 		case 'b':
@@ -344,6 +385,23 @@ void parseargs(char *argv[])
 	}
 }
 
+void parse_nbz_level(char *arg, nib_options *opt)
+{
+	/* -Z takes a level from 1 to NBZ_MAX_LEVEL, anything else is a usage error */
+	char *end;
+	long level;
+
+	level = strtol(arg, &end, 10);
+	if ((end == arg) || (*end) || (level < 1) || (level > NBZ_MAX_LEVEL))
+	{
+		printf("Invalid NBZ compression level '%s', use 1 to %d\n", arg, NBZ_MAX_LEVEL);
+		usage();
+	}
+
+	opt->nbz_level = (int)level;
+	printf("* NBZ compression level %d\n", opt->nbz_level);
+}
+
 void switchusage(void)
 {
 	printf(
@@ -353,19 +411,59 @@ void switchusage(void)
 	" -G[n]: Alternate gap match length\n"
 	" -C[n]: Simulate 'n' RPM track capacity\n"
 	" -T[n]: Track skew simulation (in ms, max 200ms)\n"
+	" -j[n]: Process tracks with 'n' threads\n"
+	" -Z[n]: NBZ compression level 'n' (1 fastest - 6 smallest)\n"
  	" -g: Enable gap reduction\n"
  	" -0: Enable bad GCR run reduction\n"
  	" -r: Disable automatic sync reduction\n"
 	" -f: Disable automatic bad GCR simulation\n"
+	" -L: Use legacy raw track cycle search\n"
+	" -l: Compare tracks by banded alignment\n"
 	" -v: Verbose (output more detailed info)\n");
 }
 
-int load_file(char *filename, BYTE *file_buffer)
+/*
+	Make a whole image file available in memory. Where possible the file is
+	mapped copy-on-write, so tracks come straight from the page cache and
+	only pages that get modified are ever copied. Otherwise it is read in
+	one go.
+*/
+int open_image(char *filename, image_file *image)
 {
-	int size;
 	FILE *fpin;
+	long size;
+#ifdef HAVE_MMAP
+	struct stat st;
+	int fd;
+#endif
+
+	image->data = NULL;
+	image->size = 0;
+	image->mapped = 0;
+
+#ifdef HAVE_MMAP
+	if ((fd = open(filename, O_RDONLY)) >= 0)
+	{
+		if ((fstat(fd, &st) == 0) && (st.st_size > 0))
+		{
+			image->data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			if (image->data != MAP_FAILED)
+			{
+				image->size = st.st_size;
+				image->mapped = 1;
+			}
+		}
+		close(fd);
 
-	printf("Loading \"%s\"...\n",filename);
+		if (image->mapped)
+		{
+			/* start reading ahead the whole image */
+			posix_madvise(image->data, image->size, POSIX_MADV_WILLNEED);
+			return 1;
+		}
+		image->data = NULL;
+	}
+#endif
 
 	if ((fpin = fopen(filename, "rb")) == NULL)
 	{
@@ -377,39 +475,87 @@ int load_file(char *filename, BYTE *file_buffer)
 	size = ftell(fpin);
 	rewind(fpin);
 
-	if (fread(file_buffer, size, 1, fpin) != 1) {
-			printf("unable to read file\n");
-			return 0;
+	if ((size <= 0) || (!(image->data = malloc(size))) || (fread(image->data, size, 1, fpin) != 1))
+	{
+		printf("unable to read file\n");
+		free(image->data);
+		image->data = NULL;
+		fclose(fpin);
+		return 0;
 	}
+	fclose(fpin);
+
+	image->size = size;
+	return 1;
+}
+
+void close_image(image_file *image)
+{
+#ifdef HAVE_MMAP
+	if (image->mapped)
+		munmap(image->data, image->size);
+	else
+#endif
+		free(image->data);
+
+	image->data = NULL;
+	image->size = 0;
+	image->mapped = 0;
+}
+
+int load_file(char *filename, BYTE *file_buffer)
+{
+	/* copies a whole file into the caller's buffer, the tools themselves use open_image() */
+	image_file image;
+	int size;
+
+	printf("Loading \"%s\"...\n",filename);
+
+	if (!open_image(filename, &image))
+		return 0;
+
+	size = (int)image.size;
+	memcpy(file_buffer, image.data, size);
+	close_image(&image);
 
 	printf("Successfully loaded %d bytes.", size);
-	fclose(fpin);
 	return size;
 }
 
-int read_nib(BYTE *file_buffer, int file_buffer_size, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+/* NIB tracks are handed to parse_nib() by one of these, in file order */
+typedef size_t (*nib_fetch)(void *source, int t_index, BYTE *track_buffer);
+
+static int parse_nib(BYTE *header, size_t header_size, nib_fetch fetch, void *source, nib_disk *disk)
 {
 	int track, t_index=0, h_index=0;
+	size_t available;
 
 	printf("\nParsing NIB data...\n");
 
-	if (memcmp(file_buffer, "MNIB-1541-RAW", 13) != 0)
+	if ((header_size < 0x100) || (memcmp(header, "MNIB-1541-RAW", 13) != 0))
 	{
 		printf("Not valid NIB data!\n");
 		return 0;
 	}
 	else
-		printf("NIB file version %d\n", file_buffer[13]);
+		printf("NIB file version %d\n", header[13]);
 
-	while(file_buffer[0x10+h_index])
+	while((0x10+h_index < 0x100) && (header[0x10+h_index]))
 	{
-		track = file_buffer[0x10+h_index];
-		track_density[track] = (BYTE)(file_buffer[0x10 + h_index + 1]);
-		track_density[track] %= BM_MATCH;  	 /* discard unused BM_MATCH mark */
+		track = header[0x10+h_index];
+		if(track > MAX_HALFTRACKS_1541 + 1)
+		{
+			printf("Invalid track %d in NIB header\n", track);
+			return 0;
+		}
 
-		memcpy(track_buffer + (track * NIB_TRACK_LENGTH),
-			file_buffer + (t_index * NIB_TRACK_LENGTH) + 0x100,
-			NIB_TRACK_LENGTH);
+		disk->track_density[track] = (BYTE)(header[0x10 + h_index + 1]);
+		disk->track_density[track] %= BM_MATCH;  	 /* discard unused BM_MATCH mark */
+
+		/* a truncated file leaves the rest of the track empty */
+		available = fetch(source, t_index, disk->track_buffer + (track * NIB_TRACK_LENGTH));
+		memset(disk->track_buffer + (track * NIB_TRACK_LENGTH) + available, 0, NIB_TRACK_LENGTH - available);
+		invalidate_track_index(disk, track);
 
 		h_index+=2;
 		t_index++;
@@ -418,70 +564,325 @@ int read_nib(BYTE *file_buffer, int file_buffer_size, BYTE *track_buffer, BYTE *
 	return 1;
 }
 
-int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+typedef struct
+{
+	BYTE *data;
+	size_t size;
+} nib_buffer;
+
+static size_t fetch_nib_buffer(void *source, int t_index, BYTE *track_buffer)
 {
-	int track, pass_density, pass, nibsize, temp_track_inc, numtracks;
+	nib_buffer *nib = source;
+	size_t offset, available;
+
+	offset = (t_index * NIB_TRACK_LENGTH) + 0x100;
+	available = (offset < nib->size) ? nib->size - offset : 0;
+	if(available > NIB_TRACK_LENGTH) available = NIB_TRACK_LENGTH;
+
+	memcpy(track_buffer, nib->data + offset, available);
+	return available;
+}
+
+int read_nib(BYTE *file_buffer, int file_buffer_size, nib_disk *disk)
+{
+	nib_buffer nib;
+
+	nib.data = file_buffer;
+	nib.size = (file_buffer_size > 0) ? file_buffer_size : 0;
+	return parse_nib(file_buffer, nib.size, fetch_nib_buffer, &nib, disk);
+}
+
+/* parse a NIB file straight from the image in memory, without a copy in file_buffer */
+int read_nib_file(char *filename, nib_disk *disk)
+{
+	image_file image;
+	int result;
+
+	printf("Loading \"%s\"...\n",filename);
+
+	if (!open_image(filename, &image))
+		return 0;
+
+	printf("Successfully loaded %d bytes.", (int)image.size);
+	result = read_nib(image.data, (int)image.size, disk);
+	close_image(&image);
+	return result;
+}
+/* state shared by the NBZ track workers */
+typedef struct
+{
+	image_file *image;
+	nib_disk *disk;
+	BYTE *block[NBZ_MAX_ENTRIES];	/* compressed tracks when writing */
+	DWORD length[NBZ_MAX_ENTRIES];
+	DWORD crc[NBZ_MAX_ENTRIES];
+	BYTE bad[NBZ_MAX_ENTRIES];
+} nbz_job;
+
+static DWORD get_dword(BYTE *buf)
+{
+	return (DWORD)buf[0] | ((DWORD)buf[1] << 8) | ((DWORD)buf[2] << 16) | ((DWORD)buf[3] << 24);
+}
+
+static int nbz_entries(image_file *image)
+{
+	/* number of tracks in an indexed NBZ header, -1 if it is not usable */
+	int entries = 0;
+
+	if(image->data[14] != NBZ_VERSION)
+	{
+		printf("Unsupported NBZ file version %d\n", image->data[14]);
+		return -1;
+	}
+
+	while((entries < NBZ_MAX_ENTRIES) && (image->data[0x10 + (entries * 2)]))
+	{
+		if(image->data[0x10 + (entries * 2)] > MAX_HALFTRACKS_1541 + 1)
+		{
+			printf("Invalid track %d in NBZ header\n", image->data[0x10 + (entries * 2)]);
+			return -1;
+		}
+		entries++;
+	}
+
+	if(0x100 + (size_t)(entries * NBZ_ENTRY_SIZE) > image->size)
+	{
+		printf("NBZ track table is truncated\n");
+		return -1;
+	}
+	return entries;
+}
+
+static void uncompress_nbz_track(void *arg, int entry)
+{
+	nbz_job *job = arg;
+	BYTE *table = job->image->data + 0x100 + (entry * NBZ_ENTRY_SIZE);
+	int track = job->image->data[0x10 + (entry * 2)];
+	BYTE *track_buffer = job->disk->track_buffer + (track * NIB_TRACK_LENGTH);
+	BYTE packed[PACK_MAX_SIZE(NIB_TRACK_LENGTH)];
+	DWORD offset = get_dword(table);
+	DWORD length = get_dword(table + 4);
+	size_t size = 0;
+
+	job->disk->track_density[track] = job->image->data[0x10 + (entry * 2) + 1] % BM_MATCH;
+
+	if((offset <= job->image->size) && (length <= job->image->size - offset) &&
+		(size = LZ_UncompressSafe(job->image->data + offset, packed, length, sizeof(packed))))
+		size = unpack_GCR_track(packed, size, track_buffer, NIB_TRACK_LENGTH);
+
+	/* each track is a block of its own, so a damaged one leaves the others intact */
+	if((size != NIB_TRACK_LENGTH) || (crcFast(track_buffer, NIB_TRACK_LENGTH) != get_dword(table + 8)))
+	{
+		memset(track_buffer, 0, NIB_TRACK_LENGTH);
+		job->bad[entry] = 1;
+	}
+	invalidate_track_index(job->disk, track);
+}
+
+typedef struct
+{
+	image_file *image;
+	size_t used;
+	LZ_UncompressState lz;
+} nbz_stream;
+
+static size_t fetch_nbz_stream(void *source, int t_index, BYTE *track_buffer)
+{
+	nbz_stream *stream = source;
+	unsigned int inused;
+	int size;
+
+	size = LZ_UncompressStream(&stream->lz, stream->image->data + stream->used,
+		stream->image->size - stream->used, &inused, track_buffer, NIB_TRACK_LENGTH);
+	stream->used += inused;
+
+	/* damaged data ends the file, like a truncated NIB */
+	if(size < 0)
+	{
+		stream->used = stream->image->size;
+		return 0;
+	}
+	return size;
+}
+
+static int read_legacy_nbz(image_file *image, nib_disk *disk)
+{
+	nbz_stream *stream;
+	BYTE header[0x100];
+	unsigned int inused;
+	int result, size;
+
+	if(!(stream = malloc(sizeof(nbz_stream))))
+	{
+		printf("Could not allocate NBZ buffer\n");
+		return 0;
+	}
+	stream->image = image;
+	stream->used = 0;
+	LZ_UncompressInit(&stream->lz);
+
+	size = LZ_UncompressStream(&stream->lz, image->data, image->size, &inused, header, sizeof(header));
+	stream->used = inused;
+	result = parse_nib(header, (size > 0) ? size : 0, fetch_nbz_stream, stream, disk);
+
+	free(stream);
+	return result;
+}
+
+int read_nbz(char *filename, nib_disk *disk)
+{
+	image_file image;
+	nbz_job job;
+	int entries, entry;
+	int result = 0;
+
+	printf("Loading \"%s\"...\n",filename);
+
+	if (!open_image(filename, &image))
+		return 0;
+
+	printf("Successfully loaded %d bytes.", (int)image.size);
+
+	if ((image.size < 0x100) || (memcmp(image.data, NBZ_MAGIC, 13) != 0))
+	{
+		/* legacy NBZ is a single LZ block over a whole NIB file, unpack it straight into the tracks */
+		result = read_legacy_nbz(&image, disk);
+		close_image(&image);
+		return result;
+	}
+
+	printf("\nParsing NBZ data...\n");
+	printf("NBZ file version %d\n", image.data[14]);
+
+	if((entries = nbz_entries(&image)) >= 0)
+	{
+		memset(&job, 0, sizeof(job));
+		job.image = &image;
+		job.disk = disk;
+
+		crcInit();
+		for_each_track(uncompress_nbz_track, &job, 0, entries - 1, 1, disk->opt.threads);
+
+		for (entry = 0; entry < entries; entry++)
+		{
+			if(job.bad[entry])
+				printf("Track %4.1f is damaged in NBZ file, left empty\n", (float) image.data[0x10 + (entry * 2)] / 2);
+		}
+		printf("Successfully parsed NBZ data for %d tracks\n", entries);
+		result = 1;
+	}
+	close_image(&image);
+	return result;
+}
+
+int read_nbz_track(char *filename, nib_disk *disk, int halftrack)
+{
+	/* unpacks a single track, only indexed NBZ files can be read this way */
+	image_file image;
+	nbz_job job;
+	int entries, entry;
+	int result = 0;
+
+	if (!open_image(filename, &image))
+		return 0;
+
+	if ((image.size < 0x100) || (memcmp(image.data, NBZ_MAGIC, 13) != 0))
+	{
+		printf("%s is not an indexed NBZ file\n", filename);
+		close_image(&image);
+		return 0;
+	}
+
+	entries = nbz_entries(&image);
+	for (entry = 0; entry < entries; entry++)
+	{
+		if(image.data[0x10 + (entry * 2)] == halftrack)
+		{
+			memset(&job, 0, sizeof(job));
+			job.image = &image;
+			job.disk = disk;
+
+			crcInit();
+			uncompress_nbz_track(&job, entry);
+			if(job.bad[entry])
+				printf("Track %4.1f is damaged in NBZ file\n", (float) halftrack / 2);
+			else
+				result = 1;
+			break;
+		}
+	}
+	if((entries >= 0) && (entry == entries))
+		printf("Track %4.1f is not in NBZ file\n", (float) halftrack / 2);
+
+	close_image(&image);
+	return result;
+}
+
+
+int read_nb2(char *filename, nib_disk *disk)
+{
+	int track, pass_density, pass, temp_track_inc, numtracks;
 	int header_entry = 0;
-	char header[0x100];
-	BYTE nibdata[0x2000];
+	BYTE *header;
+	BYTE *nibdata;
 	BYTE tmpdata[0x2000];
 	BYTE diskid[2], dummy;
-	FILE *fpin;
-	size_t errors, best_err, best_pass;
+	image_file image;
+	size_t errors, best_err, best_pass, offset;
 	size_t length, best_len;
-	char errorstring[0x1000];
+	sector_report report;
 
 	printf("\nReading NB2 file...");
 
 	temp_track_inc = 1;  /* all nb2 files contain halftracks */
 
-	if ((fpin = fopen(filename, "rb")) == NULL)
-	{
-		printf("Couldn't open input file %s!\n", filename);
+	if (!open_image(filename, &image))
 		return 0;
-	}
 
-	if (fread(header, sizeof(header), 1, fpin) != 1)
+	header = image.data;
+	if (image.size < 0x100)
 	{
 		printf("unable to read NIB header\n");
+		close_image(&image);
 		return 0;
 	}
 
 	if (memcmp(header, "MNIB-1541-RAW", 13) != 0)
 	{
 		printf("input file %s isn't an NB2 data file!\n", filename);
+		close_image(&image);
 		return 0;
 	}
 
 	/* Determine number of tracks in image (estimated by filesize) */
-	fseek(fpin, 0, SEEK_END);
-	nibsize = ftell(fpin);
-	numtracks = (nibsize - NIB_HEADER_SIZE) / (NIB_TRACK_LENGTH * 16);
+	numtracks = (image.size - NIB_HEADER_SIZE) / (NIB_TRACK_LENGTH * 16);
 	temp_track_inc = 1;
-	printf("\n%d track image (filesize = %d bytes)\n", numtracks, nibsize);
+	printf("\n%d track image (filesize = %d bytes)\n", numtracks, (int)image.size);
+	invalidate_track_index(disk, -1);
 
 	/* get disk id */
-	rewind(fpin);
-	fseek(fpin, sizeof(header) + (17 * 2 * NIB_TRACK_LENGTH * 16) + (8 * NIB_TRACK_LENGTH), SEEK_SET);
-	fread(tmpdata, NIB_TRACK_LENGTH, 1, fpin);
-
-	if (!extract_id(tmpdata, diskid))
+	offset = 0x100 + (17 * 2 * NIB_TRACK_LENGTH * 16) + (8 * NIB_TRACK_LENGTH);
+	if ((offset + NIB_TRACK_LENGTH > image.size) || (!extract_id(image.data + offset, diskid)))
 	{
 			printf("Cannot find directory sector.\n");
+			close_image(&image);
 			return 0;
 	}
 	if(verbose) printf("\ndiskid: %c%c\n", diskid[0], diskid[1]);
 
-	rewind(fpin);
-	if (fread(header, sizeof(header), 1, fpin) != 1) {
-		printf("unable to read NB2 header\n");
-		return 0;
-	}
+	/* each track holds 16 passes, four for each density */
+	offset = 0x100;
 
-	for (track = 2; track <= end_track; track += temp_track_inc)
+	for (track = 2; track <= disk->opt.end_track; track += temp_track_inc)
 	{
+		if (offset + (16 * NIB_TRACK_LENGTH) > image.size)
+		{
+			printf("\nNB2 file ends before track %4.1f\n", (float) track / 2);
+			break;
+		}
+
 		/* get density from header or use default */
-		track_density[track] = (BYTE)(header[0x10 + (header_entry * 2) + 1]);
+		disk->track_density[track] = (BYTE)(header[0x10 + (header_entry * 2) + 1]);
 		header_entry++;
 
 		best_pass = 0;
@@ -490,36 +891,34 @@ int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 
 		if(verbose) printf("\n%4.1f:",(float) track / 2);
 
-		/* contains 16 passes of track, four for each density */
 		for(pass_density = 0; pass_density < 4; pass_density ++)
 		{
 			if(verbose) printf(" (%d)", pass_density);
 
-			for(pass = 0; pass <= 3; pass ++)
+			for(pass = 0; pass <= 3; pass ++, offset += NIB_TRACK_LENGTH)
 			{
-				/* get track from file */
-				if(pass_density == track_density[track])
+				/* only the passes in the track's density are looked at, in place */
+				if(pass_density == disk->track_density[track])
 				{
-					fread(nibdata, NIB_TRACK_LENGTH, 1, fpin);
+					nibdata = image.data + offset;
 
 					length = extract_GCR_track(tmpdata, nibdata,
 						&dummy,
 						track/2,
-						capacity_min[track_density[track]&3],
-						capacity_max[track_density[track]&3]);
+						capacity_min[disk->track_density[track]&3],
+						capacity_max[disk->track_density[track]&3],
+						&disk->align, &disk->opt);
 
-					errors = check_errors(tmpdata, length, track, diskid, errorstring);
+					errors = check_sectors(tmpdata, length, track, diskid, &report, NULL);
 
 					if( (pass == 1) || (errors < best_err) )
 					{
-						//track_length[track] = 0x2000;
-						memcpy(track_buffer + (track * NIB_TRACK_LENGTH), nibdata, NIB_TRACK_LENGTH);
+						//disk->track_length[track] = 0x2000;
+						memcpy(disk->track_buffer + (track * NIB_TRACK_LENGTH), nibdata, NIB_TRACK_LENGTH);
 						best_pass = pass;
 						best_err = errors;
 					}
 				}
-				else
-					fread(tmpdata, NIB_TRACK_LENGTH, 1, fpin);
 			}
 		}
 
@@ -527,66 +926,57 @@ int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 		if(verbose)
 		{
 			printf(" (");
-			if(track_density[track] & BM_NO_SYNC) printf("NOSYNC!");
-			if(track_density[track] & BM_FF_TRACK) printf("KILLER!");
+			if(disk->track_density[track] & BM_NO_SYNC) printf("NOSYNC!");
+			if(disk->track_density[track] & BM_FF_TRACK) printf("KILLER!");
 
-			printf("%d:%d) (pass %d, %d errors) %.1d%%", track_density[track]&3, track_length[track],
+			printf("%d:%d) (pass %d, %d errors) %.1d%%", disk->track_density[track]&3, disk->track_length[track],
 				best_pass, best_err,
-				((track_length[track] / capacity[track_density[track]&3]) * 100));
+				((disk->track_length[track] / capacity[disk->track_density[track]&3]) * 100));
 		}
 	}
-	fclose(fpin);
+	close_image(&image);
 	printf("\nSuccessfully loaded NB2 file\n");
 	return 1;
 }
 
-int read_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+int read_g64(char *filename, nib_disk *disk)
 {
-	int track, g64maxtrack, g64tracks, headersize;
+	int track, g64maxtrack, g64tracks;
 	int pointer=0;
-	BYTE header[0x7f0];
-	BYTE length_record[2];
-	FILE *fpin;
+	BYTE *header;
+	image_file image;
 
 	printf("\nReading G64 file...");
 
-	if ((fpin = fopen(filename, "rb")) == NULL)
-	{
-		printf("Couldn't open input file %s!\n", filename);
+	if (!open_image(filename, &image))
 		return 0;
-	}
 
-	if (fread(header, sizeof(header), 1, fpin) != 1)
+	header = image.data;
+	if (image.size < 0x7f0)
 	{
 		printf("unable to read G64 header\n");
+		close_image(&image);
 		return 0;
 	}
 
 	if (memcmp(header, "GCR-1541", 8) != 0)
 	{
 		printf("input file %s isn't a G64 data file!\n", filename);
+		close_image(&image);
 		return 0;
 	}
 
 	if (memcmp(header+0x2ac, "EXT", 3) == 0)
 	{
 		printf("\nExtended SPS G64 detected");
-		headersize=0x7f0;
 		//sync_align_buffer=1;
 	}
-	else
-		headersize=0x2ac;
+
+	invalidate_track_index(disk, -1);
 
 	g64tracks = (char)header[0x9];
 	g64maxtrack = (BYTE)header[0xb] << 8 | (BYTE)header[0xa];
 	if(verbose) printf("\nTracks:%d\nSize:%d\n", g64tracks, g64maxtrack);
-	rewind(fpin);
-
-	if (fread(header, headersize, 1, fpin) != 1)
-	{
-		printf("unable to read G64 header\n");
-		return 0;
-	}
 
 	if(g64maxtrack>NIB_TRACK_LENGTH)
 	{
@@ -594,58 +984,56 @@ int read_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 			//return 0;
 	}
 
-	for (track = 2; track <= g64tracks; track++, pointer += 4)
+	for (track = 2; (track <= g64tracks) && (track <= MAX_HALFTRACKS_1541 + 1); track++, pointer += 4)
 	{
 		int pointer2 = *(int*)(header+0xc+pointer);
 		int tmpLength;
 
 		/* check to see if track exists in file, else skip it */
-		if(!pointer2)
+		if((pointer2 <= 0) || ((size_t)pointer2 + 2 > image.size))
 		{
-			track_length[track]=0;
+			disk->track_length[track]=0;
 			continue;
 		}
 
 		/* get density from header */
-		track_density[track] = header[0x15c + pointer];
-
-		fseek(fpin, pointer2, SEEK_SET);
-		//printf("\nDEBUG: filepointer=%d\n",pointer2);
+		disk->track_density[track] = header[0x15c + pointer];
 
 		/* get length */
-		fread(length_record, 2, 1, fpin);
-		tmpLength = length_record[1] << 8 | length_record[0];
+		tmpLength = image.data[pointer2+1] << 8 | image.data[pointer2];
 
 		if(tmpLength>NIB_TRACK_LENGTH)
 		{
 			tmpLength = NIB_TRACK_LENGTH;
 			//printf(" skipping extra data");
 		}
-		track_length[track] = tmpLength;
+		if((size_t)(pointer2 + 2 + tmpLength) > image.size)
+			tmpLength = image.size - pointer2 - 2;
+		disk->track_length[track] = tmpLength;
 
-		/* get track from file */
-		fread(track_buffer + (track * NIB_TRACK_LENGTH), tmpLength, 1, fpin);
+		/* get track from the image */
+		memcpy(disk->track_buffer + (track * NIB_TRACK_LENGTH), image.data + pointer2 + 2, tmpLength);
 
 		/* output some specs */
 		if(verbose)
 		{
 			printf("%4.1f: ",(float) track/2);
-			if(track_density[track] & BM_NO_SYNC) printf("NOSYNC!");
-			if(track_density[track] & BM_FF_TRACK) printf("KILLER!");
-			printf("%d (density:%d)\n", track_length[track], track_density[track]);
+			if(disk->track_density[track] & BM_NO_SYNC) printf("NOSYNC!");
+			if(disk->track_density[track] & BM_FF_TRACK) printf("KILLER!");
+			printf("%d (density:%d)\n", disk->track_length[track], disk->track_density[track]);
 		}
 	}
-	fclose(fpin);
+	close_image(&image);
 	printf("Successfully loaded G64 file\n");
 	return 1;
 }
 
 
-int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+int read_d64(char *filename, nib_disk *disk)
 {
 	int track, sector, sector_ref;
 	BYTE buffer[256];
-	BYTE gcrdata[NIB_TRACK_LENGTH];
+	BYTE *gcrdata;
 	BYTE errorinfo[MAXBLOCKSONDISK];
 	BYTE id[3] = { 0, 0, 0 };
 	int error, d64size, last_track, cur_sector=0;
@@ -662,6 +1050,7 @@ int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 
 	/* here we get to rebuild tracks from scratch */
 	memset(errorinfo, SECTOR_OK, sizeof(errorinfo));
+	invalidate_track_index(disk, -1);
 
 	/* determine d64 image size */
 	fseek(fpin, 0, SEEK_END);
@@ -703,8 +1092,8 @@ int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 	sector_ref = 0;
 	for (track = 1; track <= last_track; track++)
 	{
-		// clear buffers
-		memset(gcrdata, 0x55, sizeof(gcrdata));
+		// sectors are encoded straight into the track buffer
+		gcrdata = disk->track_buffer + (track * 2 * NIB_TRACK_LENGTH);
 		errorstring[0] = '\0';
 
 		for (sector = 0; sector < sector_map[track]; sector++)
@@ -730,27 +1119,24 @@ int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *tr
 		}
 
 		// calculate track length
-		track_length[track*2] = sector_map[track] * (SECTOR_SIZE + sector_gap_length[track]);
+		disk->track_length[track*2] = sector_map[track] * (SECTOR_SIZE + sector_gap_length[track]);
 
 		// no half tracks in D64, so clear them
-		track_length[(track*2)+1] = 0;
+		disk->track_length[(track*2)+1] = 0;
 
 		// use default densities for D64
-		track_density[track*2] = speed_map[track];
-
-		// write track
-		memcpy(track_buffer + (track * 2 * NIB_TRACK_LENGTH), gcrdata, track_length[track*2]);
+		disk->track_density[track*2] = speed_map[track];
 		//printf("%s", errorstring);
 	}
 
 	// "unformat" last 5 tracks on 35 track disk
 	if (last_track == 35)
 	{
-		for (track = 36 * 2; track <= end_track; track += 2)
+		for (track = 36 * 2; track <= disk->opt.end_track; track += 2)
 		{
-			memset(track_buffer + (track * NIB_TRACK_LENGTH), 0, NIB_TRACK_LENGTH);
-			track_density[track] = (2 | BM_NO_SYNC);
-			track_length[track] = 0;
+			memset(disk->track_buffer + (track * NIB_TRACK_LENGTH), 0, NIB_TRACK_LENGTH);
+			disk->track_density[track] = (2 | BM_NO_SYNC);
+			disk->track_length[track] = 0;
 		}
 	}
 	fclose(fpin);
@@ -772,6 +1158,7 @@ int save_file(char *filename, BYTE *file_buffer, int length)
 		if(!(fwrite(file_buffer, length, 1, fpout)))
 		{
 			printf("Couldn't write to output file %s!\n", filename);
+			fclose(fpout);
 			return 0;
 		}
 
@@ -780,46 +1167,357 @@ int save_file(char *filename, BYTE *file_buffer, int length)
 		return 1;
 }
 
-int write_nib(BYTE*file_buffer, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+static int make_nib_header(BYTE *header, nib_disk *disk, char *magic)
 {
-    /*	writes contents of buffers into NIB file, with header and density information
-			it does not process the track
-    */
-
+	/* fills in a 0x100 byte NIB style header and returns the number of tracks in it */
 	int track;
-	char header[0x100];
 	int header_entry = 0;
 
-	printf("\nConverting to NIB format...\n");
-
 	/* clear header */
-	memset(header, 0, sizeof(header));
+	memset(header, 0, 0x100);
+	memcpy(header, magic, 13);
+	header[13] = 3;
 
 	/* header now contains whether halftracks were read */
-	if(track_inc == 1)
-		sprintf(header, "MNIB-1541-RAW%c%c%c", 3, 0, 1);
-	else
-		sprintf(header, "MNIB-1541-RAW%c%c%c", 3, 0, 0);
+	header[15] = (disk->opt.track_inc == 1) ? 1 : 0;
 
-	for (track = start_track; track <= end_track; track += track_inc)
+	for (track = disk->opt.start_track; track <= disk->opt.end_track; track += disk->opt.track_inc)
 	{
 		header[0x10 + (header_entry * 2)] = (BYTE)track;
-		header[0x10 + (header_entry * 2) + 1] = track_density[track];
-
-		/* process and save track to disk */
-		memcpy(file_buffer + sizeof(header) + (NIB_TRACK_LENGTH * header_entry),
-			track_buffer + (NIB_TRACK_LENGTH * track), NIB_TRACK_LENGTH);
-
+		header[0x10 + (header_entry * 2) + 1] = disk->track_density[track];
 		header_entry++;
 	}
+	return header_entry;
+}
+
+int write_nib(BYTE*file_buffer, nib_disk *disk)
+{
+	/*	like write_nib_file(), but into the caller's buffer, which must hold the whole NIB image
+			returns the size of the image
+	*/
+
+	BYTE header[0x100];
+	int entries, entry;
+
+	printf("\nConverting to NIB format...\n");
+
+	entries = make_nib_header(header, disk, "MNIB-1541-RAW");
+
 	memcpy(file_buffer, header, sizeof(header));
+	for (entry = 0; entry < entries; entry++)
+		memcpy(file_buffer + sizeof(header) + (NIB_TRACK_LENGTH * entry),
+			disk->track_buffer + (NIB_TRACK_LENGTH * header[0x10 + (entry * 2)]), NIB_TRACK_LENGTH);
 	printf("Successfully parsed data to NIB format\n");
 
-	return (sizeof(header) + (header_entry * NIB_TRACK_LENGTH));
+	return (sizeof(header) + (entries * NIB_TRACK_LENGTH));
+}
+
+int write_nib_file(char *filename, nib_disk *disk)
+{
+	/*	writes contents of buffers into NIB file, with header and density information
+			it does not process the track, the tracks go straight from the buffers to the file
+	*/
+
+	BYTE header[0x100];
+	FILE *fpout;
+	int entries, entry, written;
+
+	printf("\nConverting to NIB format...\n");
+
+	entries = make_nib_header(header, disk, "MNIB-1541-RAW");
+	printf("Successfully parsed data to NIB format\n");
+
+	/* create output file */
+	if ((fpout = fopen(filename, "wb")) == NULL)
+	{
+		printf("Couldn't create output file %s!\n", filename);
+		return 0;
+	}
+
+	written = (fwrite(header, sizeof(header), 1, fpout) == 1);
+	for (entry = 0; (written) && (entry < entries); entry++)
+		written = (fwrite(disk->track_buffer + (NIB_TRACK_LENGTH * header[0x10 + (entry * 2)]), NIB_TRACK_LENGTH, 1, fpout) == 1);
+
+	fclose(fpout);
+
+	if(!written)
+	{
+		printf("Couldn't write to output file %s!\n", filename);
+		return 0;
+	}
+
+	printf("Successfully saved file %s\n", filename);
+	return 1;
+}
+
+static void compress_nbz_track(void *arg, int entry)
+{
+	/*	packs one track and compresses it as an LZ stream of its own,
+			the block grows by what each chunk of the packed track compresses to
+	*/
+	nbz_job *job = arg;
+	BYTE *track_buffer = job->disk->track_buffer + (job->image->data[0x10 + (entry * 2)] * NIB_TRACK_LENGTH);
+	BYTE packed[PACK_MAX_SIZE(NIB_TRACK_LENGTH)];
+	BYTE out[LZ_STREAM_BOUND(NBZ_CHUNK)];
+	BYTE *block;
+	LZ_CompressState *lz;
+	size_t size, used, chunk, coded, length;
+
+	/* the stream coder works in fixed memory, unlike LZ_CompressFast() */
+	if(!(lz = malloc(sizeof(LZ_CompressState))))
+		return;
+	LZ_CompressInit(lz, job->disk->opt.nbz_level);
+
+	job->crc[entry] = crcFast(track_buffer, NIB_TRACK_LENGTH);
+	size = pack_GCR_track(track_buffer, NIB_TRACK_LENGTH, packed);
+
+	used = length = 0;
+	do
+	{
+		chunk = (size - used < NBZ_CHUNK) ? size - used : NBZ_CHUNK;
+		if(chunk)
+			coded = LZ_CompressStream(lz, packed + used, chunk, out);
+		else
+			coded = LZ_CompressEnd(lz, out);
+		used += chunk;
+
+		if(coded)
+		{
+			if(!(block = realloc(job->block[entry], length + coded)))
+			{
+				free(job->block[entry]);
+				job->block[entry] = NULL;
+				break;
+			}
+			memcpy(block + length, out, coded);
+			job->block[entry] = block;
+			length += coded;
+		}
+	} while(chunk);
+
+	job->length[entry] = length;
+	free(lz);
 }
 
+static void free_nbz_blocks(nbz_job *job, int entries)
+{
+	int entry;
+
+	for (entry = 0; entry < entries; entry++)
+		free(job->block[entry]);
+}
 
-int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+int write_nbz(char *filename, nib_disk *disk)
+{
+	/*	writes an indexed NBZ file, every track packed and compressed on its own */
+
+	BYTE header[0x100];
+	DWORD table[NBZ_MAX_ENTRIES * (NBZ_ENTRY_SIZE / 4)];
+	image_file image;
+	nbz_job job;
+	FILE *fpout;
+	DWORD offset;
+	int entries, entry, written;
+
+	printf("\nConverting to NBZ format...\n");
+
+	entries = make_nib_header(header, disk, NBZ_MAGIC);
+	header[14] = NBZ_VERSION;
+
+	memset(&job, 0, sizeof(job));
+	image.data = header;
+	image.size = sizeof(header);
+	job.image = &image;
+	job.disk = disk;
+
+	crcInit();
+	for_each_track(compress_nbz_track, &job, 0, entries - 1, 1, disk->opt.threads);
+
+	for (entry = 0; entry < entries; entry++)
+	{
+		if(!job.block[entry])
+		{
+			printf("Could not allocate NBZ buffer\n");
+			free_nbz_blocks(&job, entries);
+			return 0;
+		}
+	}
+
+	/* blocks follow the table back to back */
+	offset = sizeof(header) + (entries * NBZ_ENTRY_SIZE);
+	for (entry = 0; entry < entries; entry++)
+	{
+		table[entry * 3] = offset;
+		table[entry * 3 + 1] = job.length[entry];
+		table[entry * 3 + 2] = job.crc[entry];
+		offset += job.length[entry];
+	}
+
+	if ((fpout = fopen(filename, "wb")) == NULL)
+	{
+		printf("Couldn't create output file %s!\n", filename);
+		free_nbz_blocks(&job, entries);
+		return 0;
+	}
+
+	/* an empty disk is just the header */
+	written = (fwrite(header, sizeof(header), 1, fpout) == 1);
+	if((written) && (entries))
+		written = (write_dword(fpout, table, entries * NBZ_ENTRY_SIZE) == 0);
+	for (entry = 0; (written) && (entry < entries); entry++)
+		written = (fwrite(job.block[entry], job.length[entry], 1, fpout) == 1);
+
+	fclose(fpout);
+	free_nbz_blocks(&job, entries);
+
+	if(!written)
+	{
+		printf("Couldn't write to output file %s!\n", filename);
+		return 0;
+	}
+
+	printf("Successfully saved NBZ file %s (%d bytes)\n", filename, (int)offset);
+	return 1;
+}
+
+
+
+/* allocate an empty disk image, all tracks zeroed */
+nib_disk *new_disk(void)
+{
+	nib_disk *disk;
+
+	if(!(disk = calloc(1, sizeof(nib_disk))))
+	{
+		printf("Error: Could not allocate memory for disk image.\n");
+		return NULL;
+	}
+
+	/* options every tool starts from, the rest default to zero */
+	disk->opt.extra_capacity_margin = 5;
+	disk->opt.threads = 1;
+	disk->opt.nbz_level = NBZ_LEVEL;
+
+	return disk;
+}
+
+void free_disk(nib_disk *disk)
+{
+	free(disk);
+}
+
+/* work list shared by the threads of for_each_track() */
+typedef struct
+{
+	void (*handler)(void *arg, int track);
+	void *arg;
+	int next;
+	int last;
+	int step;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
+} track_jobs;
+
+static void *
+track_worker(void *arg)
+{
+	track_jobs *jobs = arg;
+	int track;
+
+	for(;;)
+	{
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock(&jobs->lock);
+#endif
+		track = jobs->next;
+		jobs->next += jobs->step;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock(&jobs->lock);
+#endif
+		if(track > jobs->last) break;
+		jobs->handler(jobs->arg, track);
+	}
+	return NULL;
+}
+
+/*
+	Call handler(arg, track) for track = first, first+step, ... up to last.
+	Tracks are handed out one at a time to 'jobs' threads, so slow protection
+	tracks don't hold up a whole batch. With more than one job the handler
+	must only touch data of its own track and must not print.
+*/
+void for_each_track(void (*handler)(void *arg, int track), void *arg, int first, int last, int step, int jobs)
+{
+	track_jobs list;
+#ifdef HAVE_PTHREAD
+	pthread_t worker[MAX_THREADS];
+	int started = 0;
+#endif
+
+	list.handler = handler;
+	list.arg = arg;
+	list.next = first;
+	list.last = last;
+	list.step = step;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&list.lock, NULL);
+
+	if(jobs > MAX_THREADS) jobs = MAX_THREADS;
+	if(jobs > 1)
+	{
+		for (started = 0; started < jobs - 1; started ++)
+			if(pthread_create(&worker[started], NULL, track_worker, &list)) break;
+	}
+#endif
+
+	/* this thread works too, and finishes alone if no worker could be started */
+	track_worker(&list);
+
+#ifdef HAVE_PTHREAD
+	while(started)
+		pthread_join(worker[--started], NULL);
+
+	pthread_mutex_destroy(&list.lock);
+#endif
+}
+
+/* tracks handed to extract_d64_track() */
+typedef struct
+{
+	nib_disk *disk;
+	int offset;
+	BYTE *id;
+	int first_block[MAX_TRACKS_1541 + 1];
+	BYTE *d64data;
+	BYTE *sector_error;
+} d64_job;
+
+static void
+extract_d64_track(void *arg, int track)
+{
+	d64_job *job = arg;
+	BYTE rawdata[260];
+	track_index *tindex;
+	int sector, block;
+
+	/* tracks moved out of the image by the offset have no blocks */
+	if (track+job->offset < 2 || track+job->offset > 80)
+		return;
+
+	tindex = disk_track_index(job->disk, track+job->offset*2);
+	block = job->first_block[track/2];
+
+	for (sector = 0; sector < sector_map[track/2]; sector++, block++)
+	{
+		memset(rawdata, 0,sizeof(rawdata));
+		job->sector_error[block] = convert_indexed_sector(tindex, rawdata, track/2, sector, job->id);
+		memcpy(job->d64data + (block * 256), rawdata+1 , 256);
+	}
+}
+
+int write_d64(char *filename, nib_disk *disk)
 {
     /*	writes contents of buffers into D64 file, with errorblock information (if detected) */
 
@@ -832,18 +1530,18 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 	int save_40_tracks = 0;
 	int blockindex = 0;
 	int offset = 0;
-	BYTE *cycle_start;	/* start position of cycle    */
-	BYTE *cycle_stop;	/* stop  position of cycle +1 */
+	int jobs = disk->opt.threads;
 	BYTE id[4];
-	BYTE rawdata[260];
-	BYTE d64data[MAXBLOCKSONDISK * 256], *d64ptr;
+	BYTE d64data[MAXBLOCKSONDISK * 256];
 	BYTE errorinfo[MAXBLOCKSONDISK], errorcode;
+	BYTE sector_error[MAXBLOCKSONDISK];
 	int blocks_to_save;
+	d64_job job;
 
 	printf("\nWriting D64 file...\n");
 
 	memset(errorinfo, 0,sizeof(errorinfo));
-	memset(rawdata, 0,sizeof(rawdata));
+	memset(sector_error, 0,sizeof(sector_error));
 	memset(d64data, 0,sizeof(d64data));
 
 	/* create output file */
@@ -854,12 +1552,12 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 	}
 
 	/* get disk id */
-	if (!extract_id(track_buffer + (18*2*NIB_TRACK_LENGTH), id))
+	if (!extract_id(disk->track_buffer + (18*2*NIB_TRACK_LENGTH), id))
 	{
 		int track = id[0];
 		//printf("debug: dir track really=%d\n",track);
 		offset = 18 - track;
-		if (!offset || !extract_id(track_buffer + ((18+offset)*2*NIB_TRACK_LENGTH), id))
+		if (!offset || !extract_id(disk->track_buffer + ((18+offset)*2*NIB_TRACK_LENGTH), id))
 		{
 			printf("Cannot find directory sector.\n");
 			return 0;
@@ -872,13 +1570,29 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 	}
 	//printf("debug: diskid=%s\n",id);
 
-	d64ptr = d64data;
-	for (track = start_track; track <= 40*2; track += 2)
+	memset(&job, 0, sizeof(job));
+	job.disk = disk;
+	job.offset = offset;
+	job.id = id;
+	job.d64data = d64data;
+	job.sector_error = sector_error;
+
+	/* place the sectors of each track in the image */
+	for (track = disk->opt.start_track; track <= 40*2; track += 2)
 	{
-		cycle_start = track_buffer + ((track+offset*2) * NIB_TRACK_LENGTH);
-		cycle_stop = track_buffer + ((track+offset*2) * NIB_TRACK_LENGTH) + track_length[track+offset*2];
-		//printf("debug: start=%d, stop=%d\n",cycle_start,cycle_stop);
+		if (track+offset < 2 || track+offset > 80) continue;
+		job.first_block[track/2] = blockindex;
+		blockindex += sector_map[track/2];
+	}
+	blockindex = 0;
 
+	/* decode all tracks first, the sector dump below is printed in order */
+	if(verbose > 2) jobs = 1;
+	if(jobs > 1)
+		for_each_track(extract_d64_track, &job, disk->opt.start_track, 40*2, 2, jobs);
+
+	for (track = disk->opt.start_track; track <= 40*2; track += 2)
+	{
 		if(verbose) printf("%.2d (%d):" ,track/2, capacity[speed_map[track/2]]);
 
 		if (track+offset < 2 || track+offset > 80)
@@ -887,12 +1601,14 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 			errorinfo[blockindex] = SYNC_NOT_FOUND;
 		}
 		else
-		for (sector = 0; sector < sector_map[track/2]; sector++)
 		{
+		  if(jobs == 1) extract_d64_track(&job, track);
+
+		  for (sector = 0; sector < sector_map[track/2]; sector++)
+		  {
 			if(verbose) printf("%d", sector);
 
-			memset(rawdata, 0,sizeof(rawdata));
-			errorcode = convert_GCR_sector(cycle_start, cycle_stop, rawdata, track/2, sector, id);
+			errorcode = sector_error[blockindex];
 			errorinfo[blockindex] = errorcode;	/* OK by default */
 
 			if (errorcode != SECTOR_OK)
@@ -928,11 +1644,8 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 						printf("Error %.1x on Track %d, Sector %d\n", errorcode, track/2, sector);
 				}
 
-			/* dump to buffer */
-			memcpy(d64ptr, rawdata+1 , 256);
-			d64ptr += 256;
-
 			blockindex++;
+		  }
 		}
 		if(verbose) printf("\n");
 	}
@@ -968,7 +1681,108 @@ int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 }
 
 
-int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+/* tracks handed to encode_g64_track() */
+typedef struct
+{
+	nib_disk *disk;
+	size_t track_maxlen;
+	int slot[MAX_HALFTRACKS_1541 + 2];	/* position in the image, -1 if not stored */
+	BYTE *gcr_tracks;	/* one length word and track_maxlen bytes per slot */
+} g64_job;
+
+static void
+encode_g64_track(void *arg, int track)
+{
+	g64_job *job = arg;
+	BYTE *gcr_track;
+	BYTE buffer[NIB_TRACK_LENGTH];
+	BYTE fill;
+	size_t track_len, track_capacity, badgcr;
+	int added_sync;
+	sync_lengthen sync_stats;
+
+	if(job->slot[track] < 0) return;
+	gcr_track = job->gcr_tracks + (job->slot[track] * (job->track_maxlen + 2));
+
+	fill = job->disk->track_buffer[(track * NIB_TRACK_LENGTH) + job->disk->track_length[track] - 1];
+	memset(buffer, fill, sizeof(buffer));
+
+	track_len = job->disk->track_length[track];
+	if(track_len>job->track_maxlen) track_len=job->track_maxlen;
+
+	memcpy(buffer, job->disk->track_buffer + (track * NIB_TRACK_LENGTH), track_len);
+
+	/* user display */
+	if(verbose)
+	{
+		printf("\n%4.1f: (", (float)track/2);
+		printf("%d", job->disk->track_density[track]&3);
+		if ( (job->disk->track_density[track]&3) != speed_map[track/2]) printf("!");
+		printf(":%d) ", job->disk->track_length[track]);
+		if (job->disk->track_density[track] & BM_NO_SYNC) printf("NOSYNC ");
+		if (job->disk->track_density[track] & BM_FF_TRACK) printf("KILLER ");
+	}
+
+	/* process/compress GCR data */
+	if(job->disk->opt.increase_sync)
+	{
+		added_sync = lengthen_sync_by(buffer, track_len, job->track_maxlen, job->disk->opt.increase_sync, &sync_stats);
+		track_len += added_sync;
+		if(verbose) printf("[+sync:%d]", added_sync);
+		if((verbose>1)&&(sync_stats.syncs))
+			printf("(syncs:%d,%d-%d)", (int)sync_stats.syncs, (int)sync_stats.shortest, (int)sync_stats.longest);
+	}
+
+	badgcr = check_bad_gcr(buffer, track_len, &job->disk->opt);
+	if(verbose>1) printf("(weak:%d)",badgcr);
+
+	/* the image can hold the whole track, unless we simulate a real drive */
+	track_capacity = job->track_maxlen;
+	if(job->disk->opt.rpm_real)
+	{
+		switch (job->disk->track_density[track]&3)
+		{
+			case 0:
+				track_capacity = (size_t)(DENSITY0/job->disk->opt.rpm_real);
+				break;
+			case 1:
+				track_capacity = (size_t)(DENSITY1/job->disk->opt.rpm_real);
+				break;
+			case 2:
+				track_capacity = (size_t)(DENSITY2/job->disk->opt.rpm_real);
+				break;
+			case 3:
+				track_capacity = (size_t)(DENSITY3/job->disk->opt.rpm_real);
+			break;
+		}
+
+		if(track_capacity > job->track_maxlen)
+			track_capacity = job->track_maxlen;
+	}
+
+	track_len = compress_halftrack(track, buffer, job->disk->track_density[track], track_len, track_capacity, &job->disk->opt);
+	if((verbose)&&(job->disk->opt.rpm_real)) printf("(%d)", track_len);
+	if(verbose>1) printf("(fill:$%.2x)",fill);
+
+	gcr_track[0] = (BYTE) (track_len % 256);
+	gcr_track[1] = (BYTE) (track_len / 256);
+
+	/* apply skew, if specified */
+	//if(skew)
+	//{
+	//	skewbytes = skew * (capacity[track_density[track]&3] / 200);
+	//	if(skewbytes > track_len)
+	//		skewbytes = skewbytes - track_len;
+	//printf(" {skew=%d} ", skewbytes);
+	//}
+	//memcpy(gcr_track+2, buffer+skewbytes, track_len-skewbytes);
+	//memcpy(gcr_track+2+track_len-skewbytes, buffer, skewbytes);
+
+	/* unformatted tracks are simulated with a full buffer, only the slot is stored */
+	memcpy(gcr_track+2, buffer, (track_len > job->track_maxlen) ? job->track_maxlen : track_len);
+}
+
+int write_g64(char *filename, nib_disk *disk)
 {
 	/* writes contents of buffers into G64 file, with header and density information */
 
@@ -982,14 +1796,12 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 	BYTE header[12];
 	DWORD gcr_track_p[MAX_HALFTRACKS_1541] = {0};
 	DWORD gcr_speed_p[MAX_HALFTRACKS_1541] = {0};
-	//BYTE gcr_track[G64_TRACK_MAXLEN + 2];
-	BYTE gcr_track[NIB_TRACK_LENGTH + 2];
-	size_t track_len, badgcr;
 	//size_t skewbytes=0;
-	int index=0, track, added_sync=0, addsyncloops;
+	int index=0, track;
+	int jobs = disk->opt.threads;
 	FILE * fpout;
-	BYTE buffer[NIB_TRACK_LENGTH];
-	size_t raw_track_size[4] = { 6250, 6666, 7142, 7692 };
+	g64_job job;
+	//size_t raw_track_size[4] = { 6250, 6666, 7142, 7692 };
 	//char errorstring[0x1000];
 
 	printf("Writing G64 file...\n");
@@ -1004,8 +1816,8 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 	/* determine max track size (old VICE can't handle) */
 	//for (index= 0; index < MAX_HALFTRACKS_1541; index += track_inc)
 	//{
-	//	if(track_length[index+2] > G64_TRACK_MAXLEN)
-	//		G64_TRACK_MAXLEN = track_length[index+2];
+	//	if(disk->track_length[index+2] > G64_TRACK_MAXLEN)
+	//		G64_TRACK_MAXLEN = disk->track_length[index+2];
 	//}
 	printf("G64 Track Length = %d", G64_TRACK_MAXLEN);
 
@@ -1024,13 +1836,17 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 	}
 
 	/* Create track and speed tables */
-	for (track = 0; track < MAX_HALFTRACKS_1541; track +=track_inc)
+	for (track = 0; track < MAX_HALFTRACKS_1541 + 2; track ++)
+		job.slot[track] = -1;
+
+	for (track = 0; track < MAX_HALFTRACKS_1541; track +=disk->opt.track_inc)
 	{
 		/* calculate track positions and speed zone data */
-		if((!old_g64)&&(!track_length[track+2])) continue;
+		if((!disk->opt.old_g64)&&(!disk->track_length[track+2])) continue;
 
+		job.slot[track+2] = index;
 		gcr_track_p[track] = 0xc + (MAX_TRACKS_1541 * 16) + (index++ * (G64_TRACK_MAXLEN + 2));
-		gcr_speed_p[track] = track_density[track+2]&3;
+		gcr_speed_p[track] = disk->track_density[track+2]&3;
 	}
 
 	/* write headers */
@@ -1046,104 +1862,33 @@ int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *t
 		return 0;
 	}
 
-	/* shuffle raw GCR between formats */
-	for (track = 2; track <= MAX_HALFTRACKS_1541+1; track +=track_inc)
+	job.disk = disk;
+	job.track_maxlen = G64_TRACK_MAXLEN;
+	job.gcr_tracks = calloc(index ? index : 1, G64_TRACK_MAXLEN + 2);
+	if(!job.gcr_tracks)
 	{
-		fillbyte = track_buffer[(track * NIB_TRACK_LENGTH) + track_length[track] - 1];
-		memset(buffer, fillbyte, sizeof(buffer));
-
-		track_len = track_length[track];
-		if(track_len>G64_TRACK_MAXLEN) track_len=G64_TRACK_MAXLEN;
-
-		if((!old_g64)&&(!track_len)) continue;
-
-		memcpy(buffer, track_buffer + (track * NIB_TRACK_LENGTH), track_len);
-
-		/* user display */
-		if(verbose)
-		{
-			printf("\n%4.1f: (", (float)track/2);
-			printf("%d", track_density[track]&3);
-			if ( (track_density[track]&3) != speed_map[track/2]) printf("!");
-			printf(":%d) ", track_length[track]);
-			if (track_density[track] & BM_NO_SYNC) printf("NOSYNC ");
-			if (track_density[track] & BM_FF_TRACK) printf("KILLER ");
-		}
-
-		/* process/compress GCR data */
-		if(increase_sync)
-		{
-			for(addsyncloops=0;addsyncloops<increase_sync;addsyncloops++)
-			{
-				added_sync = lengthen_sync(buffer, track_len, G64_TRACK_MAXLEN);
-				track_len += added_sync;
-				if(verbose) printf("[+sync:%d]", added_sync);
-			}
-		}
-
-		badgcr = check_bad_gcr(buffer, track_len);
-		if(verbose>1) printf("(weak:%d)",badgcr);
-
-		if(rpm_real)
-		{
-			//capacity[speed_map[track/2]] = raw_track_size[speed_map[track/2]];
-			switch (track_density[track])
-			{
-				case 0:
-					capacity[speed_map[track/2]] = (size_t)(DENSITY0/rpm_real);
-					break;
-				case 1:
-					capacity[speed_map[track/2]] = (size_t)(DENSITY1/rpm_real);
-					break;
-				case 2:
-					capacity[speed_map[track/2]] = (size_t)(DENSITY2/rpm_real);
-					break;
-				case 3:
-					capacity[speed_map[track/2]] = (size_t)(DENSITY3/rpm_real);
-				break;
-			}
-
-			if(capacity[speed_map[track/2]] > G64_TRACK_MAXLEN)
-				capacity[speed_map[track/2]] = G64_TRACK_MAXLEN;
-
-			track_len = compress_halftrack(track, buffer, track_density[track], track_len);
-			if(verbose) printf("(%d)", track_len);
-		}
-		else
-		{
-			capacity[speed_map[track/2]] = G64_TRACK_MAXLEN;
-			track_len = compress_halftrack(track, buffer, track_density[track], track_len);
-		}
-		if(verbose>1) printf("(fill:$%.2x)",fillbyte);
-
-		gcr_track[0] = (BYTE) (track_len % 256);
-		gcr_track[1] = (BYTE) (track_len / 256);
-
-		/* apply skew, if specified */
-		//if(skew)
-		//{
-		//	skewbytes = skew * (capacity[track_density[track]&3] / 200);
-		//	if(skewbytes > track_len)
-		//		skewbytes = skewbytes - track_len;
-		//printf(" {skew=%d} ", skewbytes);
-		//}
-		//memcpy(gcr_track+2, buffer+skewbytes, track_len-skewbytes);
-		//memcpy(gcr_track+2+track_len-skewbytes, buffer, skewbytes);
+		printf("Cannot allocate G64 track buffer.\n");
+		return 0;
+	}
 
-		memcpy(gcr_track+2, buffer, track_len);
+	/* shuffle raw GCR between formats, the track display is printed while encoding */
+	if(verbose) jobs = 1;
+	for_each_track(encode_g64_track, &job, 2, MAX_HALFTRACKS_1541+1, disk->opt.track_inc, jobs);
 
-		if (fwrite(gcr_track, (G64_TRACK_MAXLEN + 2), 1, fpout) != 1)
-		{
-			printf("Cannot write track data.\n");
-			return 0;
-		}
+	/* all tracks are stored back to back behind the headers */
+	if ((index) && (fwrite(job.gcr_tracks, (G64_TRACK_MAXLEN + 2) * index, 1, fpout) != 1))
+	{
+		printf("Cannot write track data.\n");
+		free(job.gcr_tracks);
+		return 0;
 	}
+	free(job.gcr_tracks);
 	fclose(fpout);
 	printf("\nSuccessfully saved G64 file\n");
 	return 1;
 }
 
-size_t compress_halftrack(int halftrack, BYTE *track_buffer, BYTE density, size_t length)
+size_t compress_halftrack(int halftrack, BYTE *track_buffer, BYTE density, size_t length, size_t track_capacity, nib_options *opt)
 {
 	size_t orglen;
 	BYTE gcrdata[NIB_TRACK_LENGTH];
@@ -1158,37 +1903,37 @@ size_t compress_halftrack(int halftrack, BYTE *track_buffer, BYTE density, size_
 		/* If our track contains sync, we reduce to a minimum of 32 bits
 		   less is too short for some loaders including CBM, but only 10 bits are technically required */
 		orglen = length;
-		if ( (length > (capacity[density&3])) && (!(density & BM_NO_SYNC)) &&
-			(reduce_map[halftrack/2] & REDUCE_SYNC) )
+		if ( (length > (track_capacity)) && (!(density & BM_NO_SYNC)) &&
+			(opt->reduce_map[halftrack/2] & REDUCE_SYNC) )
 		{
 			/* reduce sync marks within the track */
-			length = reduce_runs(gcrdata, length, capacity[density&3], reduce_sync, 0xff);
+			length = reduce_runs(gcrdata, length, track_capacity, opt->reduce_sync, 0xff);
 			if(verbose) printf("(sync:-%d)", orglen - length);
 		}
 
 		/* reduce bad GCR runs */
 		orglen = length;
-		if ( (length > (capacity[density&3])) &&
-			(reduce_map[halftrack/2] & REDUCE_BAD) )
+		if ( (length > (track_capacity)) &&
+			(opt->reduce_map[halftrack/2] & REDUCE_BAD) )
 		{
-			length = reduce_runs(gcrdata, length, capacity[density&3], 0, 0x00);
+			length = reduce_runs(gcrdata, length, track_capacity, 0, 0x00);
 			if(verbose) printf("(badgcr-%d)", orglen - length);
 		}
 
 		/* reduce sector gaps -  they occur at the end of every sector and vary from 4-19 bytes, typically  */
 		orglen = length;
-		if ( (length > (capacity[density&3])) &&
-			(reduce_map[halftrack/2] & REDUCE_GAP) )
+		if ( (length > (track_capacity)) &&
+			(opt->reduce_map[halftrack/2] & REDUCE_GAP) )
 		{
-			length = reduce_gaps(gcrdata, length, capacity[density & 3]);
+			length = reduce_gaps(gcrdata, length, track_capacity);
 			if(verbose) printf("(gap-%d)", orglen - length);
 		}
 
 		/* still not small enough, we have to truncate the end (reduce tail) */
 		orglen = length;
-		if (length > capacity[density&3])
+		if (length > track_capacity)
 		{
-			length = capacity[density&3];
+			length = track_capacity;
 			if(verbose) printf("(trunc-%d)", orglen - length);
 		}
 	}
@@ -1205,126 +1950,233 @@ size_t compress_halftrack(int halftrack, BYTE *track_buffer, BYTE density, size_
 	return length;
 }
 
-int sync_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+int sync_tracks(nib_disk *disk)
 {
 	int track;
-	BYTE temp_buffer[NIB_TRACK_LENGTH*2];
-	//BYTE *nibdata_aligned; // aligned track
-	//int aligned_len;       // aligned track length
+	size_t cycle_bits;
+	track_view view;
+	BYTE temp_buffer[NIB_TRACK_LENGTH];
+	BYTE *nibdata_aligned; // aligned track
+	int aligned_len;       // aligned track length
+	int bitshifted;        // any track needs Arnd's aligner
 
 	printf("\nByte-syncing tracks...\n");
-	for (track = start_track; track <= end_track; track ++)
+	bitshifted = (disk->opt.sync_align_buffer==2) && (!isImageAligned(disk->track_buffer, disk->track_length, &disk->opt));
+
+	for (track = disk->opt.start_track; track <= disk->opt.end_track; track ++)
 	{
-		if(track_length[track])
+		if(disk->track_length[track])
 		{
-			if(verbose) printf("\n%4.1f: (%d) ",(float) track/2, track_length[track]);
+			if(verbose) printf("\n%4.1f: (%d) ",(float) track/2, disk->track_length[track]);
 
-			if(track_length[track]==NIB_TRACK_LENGTH) continue;
+			if(disk->track_length[track]==NIB_TRACK_LENGTH) continue;
 
-			check_bad_gcr(track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]);
+			invalidate_track_index(disk, track);
+			check_bad_gcr(disk->track_buffer+(track*NIB_TRACK_LENGTH), disk->track_length[track], &disk->opt);
 
-			/* Pete's version */
-			if(!sync_align(track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]))
+			if(disk->opt.sync_align_buffer==2)
 			{
-					printf("{nosync}");
-					continue;
+				/* Arnd's version */
+				if ((bitshifted) && (isTrackBitshifted(disk->track_buffer+(track*NIB_TRACK_LENGTH), disk->track_length[track])))
+				{
+					printf("[bitshifted] ");
+					if(align_bitshifted_kf_track(disk->track_buffer+(track*NIB_TRACK_LENGTH), disk->track_length[track], &nibdata_aligned, &aligned_len) > 0)
+					{
+						if(aligned_len > NIB_TRACK_LENGTH)
+						{
+							aligned_len = NIB_TRACK_LENGTH;
+							printf("aligned data too long, truncated ");
+						}
+						memcpy(disk->track_buffer+(track*NIB_TRACK_LENGTH), nibdata_aligned, aligned_len);
+						disk->track_length[track] = aligned_len;
+						free(nibdata_aligned);
+					}
+				}
+				/* end Arnd version */
+			}
+			else
+			{
+				/* Pete's version */
+				if(!sync_align(disk->track_buffer+(track*NIB_TRACK_LENGTH), disk->track_length[track]))
+				{
+						printf("{nosync}");
+						continue;
+				}
+				/* end Pete's version */
+			}
+
+			/* data holding more than one revolution is cut at the exact bit length */
+			if (disk->track_length[track] > capacity_max[disk->track_density[track]&3] + CAP_ALLOWANCE)
+			{
+				cycle_bits = find_track_cycle_bits(disk->track_buffer+(track*NIB_TRACK_LENGTH), disk->track_length[track],
+					capacity_min[disk->track_density[track]&3] - CAP_ALLOWANCE,
+					capacity_max[disk->track_density[track]&3] + CAP_ALLOWANCE, temp_buffer);
+				if (cycle_bits)
+				{
+					if(verbose) printf("{%d bits} ", (int)cycle_bits);
+					disk->track_length[track] = (cycle_bits + 7) / 8;
+					memcpy(disk->track_buffer+(track*NIB_TRACK_LENGTH), temp_buffer, disk->track_length[track]);
+				}
 			}
-			/* end Pete's version */
-
-			/* Arnd's version */
-			//if (isTrackBitshifted(track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]))
-			//{
-			//	printf("[bitshifted] ");
-			//	align_bitshifted_kf_track(track_buffer+(track*NIB_TRACK_LENGTH), track_length[track], &nibdata_aligned, &aligned_len);
-
-			//	if(aligned_len<0x2000)
-			//		track_length[track] = aligned_len;
-			//	else
-			//	{
-			//		aligned_len = 0x2000;
-			//		printf("aligned data too long, truncated ");
-			//	}
-			//	memcpy(track_buffer+(track*NIB_TRACK_LENGTH), nibdata_aligned, aligned_len);
-			//}
-			//else continue; // Continue if track is aligned or if no sync found.
-			/* end Arnd version */
-
-			/* re-extract/align data, since KF images are just index to index */
-			memcpy(temp_buffer, track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]);
-			memcpy(temp_buffer+track_length[track], track_buffer+(track*NIB_TRACK_LENGTH), track_length[track]);
-
-			track_length[track] = extract_GCR_track(
-						track_buffer + (track * NIB_TRACK_LENGTH),
-						temp_buffer,
-						&track_alignment[track],
-						track/2,
-						capacity_min[track_density[track]&3],
-						capacity_max[track_density[track]&3] );
 
-			printf("(%d)",track_length[track]);
+			/* re-align data, since KF images are just index to index */
+			memcpy(temp_buffer, disk->track_buffer+(track*NIB_TRACK_LENGTH), disk->track_length[track]);
+
+			if (!check_formatted(temp_buffer, disk->track_length[track]))
+			{
+				disk->track_length[track] = 0;
+				continue;
+			}
+			view.data = temp_buffer;
+			view.length = disk->track_length[track];
+
+			/* killer tracks are repeated to full length, as extract_GCR_track() returns them */
+			if (check_sync_flags(temp_buffer, 0, disk->track_length[track]) & BM_FF_TRACK)
+			{
+				if(verbose) printf("KILLER! ");
+				view_copy(&view, 0, disk->track_buffer + (track * NIB_TRACK_LENGTH), NIB_TRACK_LENGTH);
+				disk->track_length[track] = NIB_TRACK_LENGTH;
+			}
+			else
+				disk->track_length[track] = align_GCR_track(
+							disk->track_buffer + (track * NIB_TRACK_LENGTH),
+							&view,
+							&disk->track_alignment[track],
+							track/2,
+							&disk->align, &disk->opt);
+
+			printf("(%d)",disk->track_length[track]);
 		}
 	}
 	if(verbose) printf("\n");
 	return 1;
 }
 
-int align_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+/* align_tracks() pass, tracks aligned in parallel keep their handler output in their own state */
+typedef struct
 {
-	int track;
+	nib_disk *disk;
+	int quiet;
+	align_state state[MAX_HALFTRACKS_1541 + 2];
+} align_job;
+
+static void
+align_one_track(void *arg, int track)
+{
+	align_job *job = arg;
+	nib_disk *disk = job->disk;
+	align_state *state = &disk->align;
 	BYTE nibdata[NIB_TRACK_LENGTH];
 
-	memset(nibdata, 0, sizeof(nibdata));
+	if(job->quiet)
+	{
+		state = &job->state[track];
+		memset(state, 0, sizeof(align_state));
+		state->quiet = 1;
+	}
+
+	memcpy(nibdata, disk->track_buffer+(track*NIB_TRACK_LENGTH), NIB_TRACK_LENGTH);
+	memset(disk->track_buffer + (track * NIB_TRACK_LENGTH), 0x00, NIB_TRACK_LENGTH);
+	invalidate_track_index(disk, track);
+
+	/* process track cycle */
+	disk->track_length[track] = extract_GCR_track(
+		disk->track_buffer + (track * NIB_TRACK_LENGTH),
+		nibdata,
+		&disk->track_alignment[track],
+		track/2,
+		capacity_min[disk->track_density[track]&3],
+		capacity_max[disk->track_density[track]&3],
+		state, &disk->opt
+	);
+}
+
+static void
+print_track_alignment(nib_disk *disk, int track)
+{
+	/* output some specs */
+	if((verbose)&&(disk->track_length[track]>0))
+	{
+		printf("%4.1f: ",(float) track/2);
+		if(disk->track_density[track] & BM_NO_SYNC) printf("NOSYNC:");
+		if(disk->track_density[track] & BM_FF_TRACK) printf("KILLER:");
+		printf("(%d:", disk->track_density[track]&3);
+		printf("%d) ", disk->track_length[track]);
+		printf("[align=%s]\n",alignments[disk->track_alignment[track]]);
+	}
+}
+
+int align_tracks(nib_disk *disk)
+{
+	align_job *job;
+	int track;
+	int jobs = disk->opt.threads;
+
 	printf("Aligning tracks...\n");
 
-	//for (track = start_track; track <= end_track; track ++)
-	for (track = 1; track <= 84; track ++)
+	/* detailed output is printed from inside the track handlers */
+	if(verbose > 1) jobs = 1;
+
+	if(!(job = calloc(1, sizeof(align_job))))
 	{
-		memcpy(nibdata, track_buffer+(track*NIB_TRACK_LENGTH), NIB_TRACK_LENGTH);
-		memset(track_buffer + (track * NIB_TRACK_LENGTH), 0x00, NIB_TRACK_LENGTH);
+		printf("Could not allocate memory for track alignment.\n");
+		return 0;
+	}
+	job->disk = disk;
+	job->quiet = (jobs > 1);
 
-		/* process track cycle */
-		track_length[track] = extract_GCR_track(
-			track_buffer + (track * NIB_TRACK_LENGTH),
-			nibdata,
-			&track_alignment[track],
-			track/2,
-			capacity_min[track_density[track]&3],
-			capacity_max[track_density[track]&3]
-		);
+	if(jobs > 1)
+	{
+		for_each_track(align_one_track, job, 1, 84, 1, jobs);
 
-		/* output some specs */
-		if((verbose)&&(track_length[track]>0))
+		/* print in track order what the handlers would have printed */
+		for (track = 1; track <= 84; track ++)
 		{
-			printf("%4.1f: ",(float) track/2);
-			if(track_density[track] & BM_NO_SYNC) printf("NOSYNC:");
-			if(track_density[track] & BM_FF_TRACK) printf("KILLER:");
-			printf("(%d:", track_density[track]&3);
-			printf("%d) ", track_length[track]);
-			printf("[align=%s]\n",alignments[track_alignment[track]]);
+			if((verbose) && (disk->track_length[track] == NIB_TRACK_LENGTH) &&
+				(check_sync_flags(disk->track_buffer + (track * NIB_TRACK_LENGTH), 0, NIB_TRACK_LENGTH) & BM_FF_TRACK))
+				printf("KILLER! ");
+
+			/* the RapidLok TV standard found on one track is reported on the next ones */
+			if(job->state[track].rl_tv) disk->align.rl_tv = job->state[track].rl_tv;
+			job->state[track].rl_tv = disk->align.rl_tv;
+			print_align_report(&job->state[track]);
+
+			print_track_alignment(disk, track);
 		}
+		free(job);
+		return 1;
+	}
+
+	//for (track = start_track; track <= end_track; track ++)
+	for (track = 1; track <= 84; track ++)
+	{
+		align_one_track(job, track);
+		print_track_alignment(disk, track);
 	}
+	free(job);
 	return 1;
 }
 
-int rig_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment)
+int rig_tracks(nib_disk *disk)
 {
 	int track;
 
 	printf("Rigging tracks...\n");
 
-	for (track = start_track; track <= end_track; track ++)
+	for (track = disk->opt.start_track; track <= disk->opt.end_track; track ++)
 	{
-		if(track_length[track]==0) continue;
+		if(disk->track_length[track]==0) continue;
 
-		if(track_length[track] < capacity[track_density[track]&3])
+		invalidate_track_index(disk, track);
+		if(disk->track_length[track] < capacity[disk->track_density[track]&3])
 		{
-			memset(track_buffer + (track*NIB_TRACK_LENGTH) + track_length[track], 0x55, capacity[track_density[track]&3]);
-			//printf("Padded %d bytes\n", capacity[track_density[track]&3]-track_length[track]);
-			track_length[track] = capacity[track_density[track]&3];
+			memset(disk->track_buffer + (track*NIB_TRACK_LENGTH) + disk->track_length[track], 0x55, capacity[disk->track_density[track]&3]);
+			//printf("Padded %d bytes\n", capacity[disk->track_density[track]&3]-disk->track_length[track]);
+			disk->track_length[track] = capacity[disk->track_density[track]&3];
 		}
 
-		memcpy(track_buffer + (track*NIB_TRACK_LENGTH) + track_length[track],
-			track_buffer + (track*NIB_TRACK_LENGTH), NIB_TRACK_LENGTH - track_length[track]);
+		memcpy(disk->track_buffer + (track*NIB_TRACK_LENGTH) + disk->track_length[track],
+			disk->track_buffer + (track*NIB_TRACK_LENGTH), NIB_TRACK_LENGTH - disk->track_length[track]);
 	}
 	return 1;
 
@@ -1373,7 +2225,7 @@ int write_dword(FILE *fd, DWORD * buf, int num)
 	return 0;
 }
 
-unsigned int crc_dir_track(BYTE *track_buffer, size_t *track_length)
+unsigned int crc_dir_track(nib_disk *disk)
 {
 	/* this calculates a CRC32 for the BAM and first directory sector, which is sufficient to differentiate most disks */
 
@@ -1382,11 +2234,12 @@ unsigned int crc_dir_track(BYTE *track_buffer, size_t *track_length)
 	BYTE id[3];
 	BYTE rawdata[260];
 	BYTE errorcode;
+	track_index *tindex;
 
 	crcInit();
 
 	/* get disk id */
-	if (!extract_id(track_buffer + (18 * 2 * NIB_TRACK_LENGTH), id))
+	if (!extract_id(disk->track_buffer + (18 * 2 * NIB_TRACK_LENGTH), id))
 	{
 		printf("Cannot find directory sector.\n");
 		return 0;
@@ -1394,27 +2247,23 @@ unsigned int crc_dir_track(BYTE *track_buffer, size_t *track_length)
 
 	memset(data, 0, sizeof(data));
 
+	tindex = disk_track_index(disk, 18*2);
+
 	/* t18s0 */
 	memset(rawdata, 0, sizeof(rawdata));
-	errorcode = convert_GCR_sector(
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH),
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH) + track_length[18*2],
-		rawdata, 18, 0, id);
+	errorcode = convert_indexed_sector(tindex, rawdata, 18, 0, id);
 	memcpy(data, rawdata+1 , 256);
 
 	/* t18s1 */
 	memset(rawdata, 0, sizeof(rawdata));
-	errorcode = convert_GCR_sector(
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH),
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH) + track_length[18*2],
-		rawdata, 18, 1, id);
+	errorcode = convert_indexed_sector(tindex, rawdata, 18, 1, id);
 	memcpy(data+256, rawdata+1, 256);
 
 	result = crcFast(data, sizeof(data));
 	return result;
 }
 
-unsigned int crc_all_tracks(BYTE *track_buffer, size_t *track_length)
+unsigned int crc_all_tracks(nib_disk *disk)
 {
 	/* this calculates a CRC32 for all sectors on the disk */
 
@@ -1424,28 +2273,28 @@ unsigned int crc_all_tracks(BYTE *track_buffer, size_t *track_length)
 	BYTE id[3];
 	BYTE rawdata[260];
 	BYTE errorcode;
+	track_index *tindex;
 
 	memset(data, 0, sizeof(data));
 	crcInit();
 
 	/* get disk id */
-	if (!extract_id(track_buffer + (18*2 * NIB_TRACK_LENGTH), id))
+	if (!extract_id(disk->track_buffer + (18*2 * NIB_TRACK_LENGTH), id))
 	{
 		printf("Cannot find directory sector.\n");
 		return 0;
 	}
 
 	index = valid = 0;
-	for (track = start_track; track <= 35*2; track += 2)
+	for (track = disk->opt.start_track; track <= 35*2; track += 2)
 	{
+		tindex = disk_track_index(disk, track);
+
 		for (sector = 0; sector < sector_map[track/2]; sector++)
 		{
 			memset(rawdata, 0, sizeof(rawdata));
 
-			errorcode = convert_GCR_sector(
-				track_buffer + (track * NIB_TRACK_LENGTH),
-				track_buffer + (track * NIB_TRACK_LENGTH) + track_length[track],
-				rawdata, track/2, sector, id);
+			errorcode = convert_indexed_sector(tindex, rawdata, track/2, sector, id);
 
 			memcpy(data+(index*256), rawdata+1, 256);
 			index++;
@@ -1462,7 +2311,7 @@ unsigned int crc_all_tracks(BYTE *track_buffer, size_t *track_length)
 	return result;
 }
 
-unsigned int md5_dir_track(BYTE *track_buffer, size_t *track_length, unsigned char *result)
+unsigned int md5_dir_track(nib_disk *disk, unsigned char *result)
 {
 	/* this calculates a MD5 hash of the BAM and first directory sector, which is sufficient to differentiate most disks */
 
@@ -1470,38 +2319,35 @@ unsigned int md5_dir_track(BYTE *track_buffer, size_t *track_length, unsigned ch
 	BYTE id[3];
 	BYTE rawdata[260];
 	BYTE errorcode;
+	track_index *tindex;
 
 	crcInit();
 	memset(data, 0, sizeof(data));
 
 	/* get disk id */
-	if (!extract_id(track_buffer + (18*2 * NIB_TRACK_LENGTH), id))
+	if (!extract_id(disk->track_buffer + (18*2 * NIB_TRACK_LENGTH), id))
 	{
 		printf("Cannot find directory sector.\n");
 		return 0;
 	}
 
+	tindex = disk_track_index(disk, 18*2);
+
 	/* t18s0 */
 	memset(rawdata, 0, sizeof(rawdata));
-	errorcode = convert_GCR_sector(
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH),
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH) + track_length[18*2],
-		rawdata, 18, 0, id);
+	errorcode = convert_indexed_sector(tindex, rawdata, 18, 0, id);
 	memcpy(data, rawdata+1 , 256);
 
 	/* t18s1 */
 	memset(rawdata, 0, sizeof(rawdata));
-	errorcode = convert_GCR_sector(
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH),
-		track_buffer + ((18*2) * NIB_TRACK_LENGTH) + track_length[18*2],
-		rawdata, 18, 1, id);
+	errorcode = convert_indexed_sector(tindex, rawdata, 18, 1, id);
 	memcpy(data+256, rawdata+1, 256);
 
 	md5(data, sizeof(data), result);
 	return 1;
 }
 
-unsigned int md5_all_tracks(BYTE *track_buffer, size_t *track_length, unsigned char *result)
+unsigned int md5_all_tracks(nib_disk *disk, unsigned char *result)
 {
 	/* this calculates an MD5 hash for all sectors on the disk */
 
@@ -1510,28 +2356,28 @@ unsigned int md5_all_tracks(BYTE *track_buffer, size_t *track_length, unsigned c
 	BYTE id[3];
 	BYTE rawdata[260];
 	BYTE errorcode;
+	track_index *tindex;
 
 	crcInit();
 	memset(data, 0, sizeof(data));
 
 	/* get disk id */
-	if (!extract_id(track_buffer + (18*2 * NIB_TRACK_LENGTH), id))
+	if (!extract_id(disk->track_buffer + (18*2 * NIB_TRACK_LENGTH), id))
 	{
 		printf("Cannot find directory sector.\n");
 		return 0;
 	}
 
 	index = valid = 0;
-	for (track = start_track; track <= 35*2; track += 2)
+	for (track = disk->opt.start_track; track <= 35*2; track += 2)
 	{
+		tindex = disk_track_index(disk, track);
+
 		for (sector = 0; sector < sector_map[track/2]; sector++)
 		{
 			memset(rawdata, 0, sizeof(rawdata));
 
-			errorcode = convert_GCR_sector(
-				track_buffer + (track * NIB_TRACK_LENGTH),
-				track_buffer + (track * NIB_TRACK_LENGTH) + track_length[track],
-				rawdata, track/2, sector, id);
+			errorcode = convert_indexed_sector(tindex, rawdata, track/2, sector, id);
 
 			memcpy(data+(index*256), rawdata+1, 256);
 			index++;
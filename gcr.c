@@ -54,24 +54,6 @@ BYTE speed_map[MAX_TRACKS_1541 + 1] = {
 	0, 0, 0, 0, 0, 0, 0				/* 36 - 42 (non-standard) */
 };
 
-BYTE align_map[MAX_TRACKS_1541 + 1] = {
-	0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/*  1 - 10 */
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/* 11 - 20 */
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/* 21 - 30 */
-	0, 0, 0, 0, 0, 0,					/* 31 - 35 */
-	0,	0, 0, 0, 0, 0						/* 37 - 42  */
-};
-
-BYTE reduce_map[MAX_TRACKS_1541 + 1] = {
-	0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/*  1 - 10 */
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/* 11 - 20 */
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/* 21 - 30 */
-	0, 0, 0, 0, 0, 0,					/* 31 - 35 */
-	0,	0, 0, 0, 0, 0						/* 37 - 42  */
-};
-
 char alignments[][20] = { "NONE", "GAP", "SEC0", "SYNC", "BADGCR", "VMAX", "AUTO", "VMAX-CW", "RAW", "PIRATESLAYER", "RAPIDLOK"};
 
 /* Burst Nibbler defaults
@@ -85,22 +67,7 @@ size_t capacity_min[] =		{ (int) (DENSITY0 / 305), (int) (DENSITY1 / 305), (int)
 size_t capacity[] = 			{ (int) (DENSITY0 / 300), (int) (DENSITY1 / 300), (int) (DENSITY2 / 300), (int) (DENSITY3 / 300) };
 size_t capacity_max[] =	{ (int) (DENSITY0 / 295), (int) (DENSITY1 / 295), (int) (DENSITY2 / 295), (int) (DENSITY3 / 295) };
 
-/* Nibble-to-GCR conversion table */
-static BYTE GCR_conv_data[16] = {
-	0x0a, 0x0b, 0x12, 0x13,
-	0x0e, 0x0f, 0x16, 0x17,
-	0x09, 0x19, 0x1a, 0x1b,
-	0x0d, 0x1d, 0x1e, 0x15
-};
-
-/* GCR-to-Nibble conversion tables */
-static BYTE GCR_decode_high[32] = {
-	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-	0xff, 0x80, 0x00, 0x10, 0xff, 0xc0, 0x40, 0x50,
-	0xff, 0xff, 0x20, 0x30, 0xff, 0xf0, 0x60, 0x70,
-	0xff, 0x90, 0xa0, 0xb0, 0xff, 0xd0, 0xe0, 0xff
-};
-
+/* GCR-to-Nibble conversion table, 0xff for bad codes */
 static BYTE GCR_decode_low[32] = {
 	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
 	0xff, 0x08, 0x00, 0x01, 0xff, 0x0c, 0x04, 0x05,
@@ -108,6 +75,99 @@ static BYTE GCR_decode_low[32] = {
 	0xff, 0x09, 0x0a, 0x0b, 0xff, 0x0d, 0x0e, 0xff
 };
 
+/* Combined 10-bit GCR-to-byte table, both 5-bit codes decoded in one lookup.
+   Low 8 bits are the decoded byte, GCR_BAD_HIGH/GCR_BAD_LOW flag bad nybbles */
+#define GCR_BAD_HIGH	0x100
+#define GCR_BAD_LOW		0x200
+static const unsigned short GCR_decode_byte[1024] = {
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff,
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff,
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff,
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff,
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff,
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff,
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff,
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff,
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x088, 0x080, 0x081, 0x2ff, 0x08c, 0x084, 0x085,
+	0x2ff, 0x2ff, 0x082, 0x083, 0x2ff, 0x08f, 0x086, 0x087, 0x2ff, 0x089, 0x08a, 0x08b, 0x2ff, 0x08d, 0x08e, 0x2ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x008, 0x000, 0x001, 0x2ff, 0x00c, 0x004, 0x005,
+	0x2ff, 0x2ff, 0x002, 0x003, 0x2ff, 0x00f, 0x006, 0x007, 0x2ff, 0x009, 0x00a, 0x00b, 0x2ff, 0x00d, 0x00e, 0x2ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x018, 0x010, 0x011, 0x2ff, 0x01c, 0x014, 0x015,
+	0x2ff, 0x2ff, 0x012, 0x013, 0x2ff, 0x01f, 0x016, 0x017, 0x2ff, 0x019, 0x01a, 0x01b, 0x2ff, 0x01d, 0x01e, 0x2ff,
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x0c8, 0x0c0, 0x0c1, 0x2ff, 0x0cc, 0x0c4, 0x0c5,
+	0x2ff, 0x2ff, 0x0c2, 0x0c3, 0x2ff, 0x0cf, 0x0c6, 0x0c7, 0x2ff, 0x0c9, 0x0ca, 0x0cb, 0x2ff, 0x0cd, 0x0ce, 0x2ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x048, 0x040, 0x041, 0x2ff, 0x04c, 0x044, 0x045,
+	0x2ff, 0x2ff, 0x042, 0x043, 0x2ff, 0x04f, 0x046, 0x047, 0x2ff, 0x049, 0x04a, 0x04b, 0x2ff, 0x04d, 0x04e, 0x2ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x058, 0x050, 0x051, 0x2ff, 0x05c, 0x054, 0x055,
+	0x2ff, 0x2ff, 0x052, 0x053, 0x2ff, 0x05f, 0x056, 0x057, 0x2ff, 0x059, 0x05a, 0x05b, 0x2ff, 0x05d, 0x05e, 0x2ff,
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff,
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x028, 0x020, 0x021, 0x2ff, 0x02c, 0x024, 0x025,
+	0x2ff, 0x2ff, 0x022, 0x023, 0x2ff, 0x02f, 0x026, 0x027, 0x2ff, 0x029, 0x02a, 0x02b, 0x2ff, 0x02d, 0x02e, 0x2ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x038, 0x030, 0x031, 0x2ff, 0x03c, 0x034, 0x035,
+	0x2ff, 0x2ff, 0x032, 0x033, 0x2ff, 0x03f, 0x036, 0x037, 0x2ff, 0x039, 0x03a, 0x03b, 0x2ff, 0x03d, 0x03e, 0x2ff,
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x0f8, 0x0f0, 0x0f1, 0x2ff, 0x0fc, 0x0f4, 0x0f5,
+	0x2ff, 0x2ff, 0x0f2, 0x0f3, 0x2ff, 0x0ff, 0x0f6, 0x0f7, 0x2ff, 0x0f9, 0x0fa, 0x0fb, 0x2ff, 0x0fd, 0x0fe, 0x2ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x068, 0x060, 0x061, 0x2ff, 0x06c, 0x064, 0x065,
+	0x2ff, 0x2ff, 0x062, 0x063, 0x2ff, 0x06f, 0x066, 0x067, 0x2ff, 0x069, 0x06a, 0x06b, 0x2ff, 0x06d, 0x06e, 0x2ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x078, 0x070, 0x071, 0x2ff, 0x07c, 0x074, 0x075,
+	0x2ff, 0x2ff, 0x072, 0x073, 0x2ff, 0x07f, 0x076, 0x077, 0x2ff, 0x079, 0x07a, 0x07b, 0x2ff, 0x07d, 0x07e, 0x2ff,
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x098, 0x090, 0x091, 0x2ff, 0x09c, 0x094, 0x095,
+	0x2ff, 0x2ff, 0x092, 0x093, 0x2ff, 0x09f, 0x096, 0x097, 0x2ff, 0x099, 0x09a, 0x09b, 0x2ff, 0x09d, 0x09e, 0x2ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x0a8, 0x0a0, 0x0a1, 0x2ff, 0x0ac, 0x0a4, 0x0a5,
+	0x2ff, 0x2ff, 0x0a2, 0x0a3, 0x2ff, 0x0af, 0x0a6, 0x0a7, 0x2ff, 0x0a9, 0x0aa, 0x0ab, 0x2ff, 0x0ad, 0x0ae, 0x2ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x0b8, 0x0b0, 0x0b1, 0x2ff, 0x0bc, 0x0b4, 0x0b5,
+	0x2ff, 0x2ff, 0x0b2, 0x0b3, 0x2ff, 0x0bf, 0x0b6, 0x0b7, 0x2ff, 0x0b9, 0x0ba, 0x0bb, 0x2ff, 0x0bd, 0x0be, 0x2ff,
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x0d8, 0x0d0, 0x0d1, 0x2ff, 0x0dc, 0x0d4, 0x0d5,
+	0x2ff, 0x2ff, 0x0d2, 0x0d3, 0x2ff, 0x0df, 0x0d6, 0x0d7, 0x2ff, 0x0d9, 0x0da, 0x0db, 0x2ff, 0x0dd, 0x0de, 0x2ff,
+	0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x2ff, 0x0e8, 0x0e0, 0x0e1, 0x2ff, 0x0ec, 0x0e4, 0x0e5,
+	0x2ff, 0x2ff, 0x0e2, 0x0e3, 0x2ff, 0x0ef, 0x0e6, 0x0e7, 0x2ff, 0x0e9, 0x0ea, 0x0eb, 0x2ff, 0x0ed, 0x0ee, 0x2ff,
+	0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff,
+	0x3ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x1ff, 0x3ff, 0x1ff, 0x1ff, 0x3ff
+};
+
+/* Byte-to-10-bit-GCR table, the 5-bit codes of both nybbles:
+   0x0a, 0x0b, 0x12, 0x13, 0x0e, 0x0f, 0x16, 0x17,
+   0x09, 0x19, 0x1a, 0x1b, 0x0d, 0x1d, 0x1e, 0x15 */
+static const unsigned short GCR_encode_byte[256] = {
+	0x14a, 0x14b, 0x152, 0x153, 0x14e, 0x14f, 0x156, 0x157, 0x149, 0x159, 0x15a, 0x15b, 0x14d, 0x15d, 0x15e, 0x155,
+	0x16a, 0x16b, 0x172, 0x173, 0x16e, 0x16f, 0x176, 0x177, 0x169, 0x179, 0x17a, 0x17b, 0x16d, 0x17d, 0x17e, 0x175,
+	0x24a, 0x24b, 0x252, 0x253, 0x24e, 0x24f, 0x256, 0x257, 0x249, 0x259, 0x25a, 0x25b, 0x24d, 0x25d, 0x25e, 0x255,
+	0x26a, 0x26b, 0x272, 0x273, 0x26e, 0x26f, 0x276, 0x277, 0x269, 0x279, 0x27a, 0x27b, 0x26d, 0x27d, 0x27e, 0x275,
+	0x1ca, 0x1cb, 0x1d2, 0x1d3, 0x1ce, 0x1cf, 0x1d6, 0x1d7, 0x1c9, 0x1d9, 0x1da, 0x1db, 0x1cd, 0x1dd, 0x1de, 0x1d5,
+	0x1ea, 0x1eb, 0x1f2, 0x1f3, 0x1ee, 0x1ef, 0x1f6, 0x1f7, 0x1e9, 0x1f9, 0x1fa, 0x1fb, 0x1ed, 0x1fd, 0x1fe, 0x1f5,
+	0x2ca, 0x2cb, 0x2d2, 0x2d3, 0x2ce, 0x2cf, 0x2d6, 0x2d7, 0x2c9, 0x2d9, 0x2da, 0x2db, 0x2cd, 0x2dd, 0x2de, 0x2d5,
+	0x2ea, 0x2eb, 0x2f2, 0x2f3, 0x2ee, 0x2ef, 0x2f6, 0x2f7, 0x2e9, 0x2f9, 0x2fa, 0x2fb, 0x2ed, 0x2fd, 0x2fe, 0x2f5,
+	0x12a, 0x12b, 0x132, 0x133, 0x12e, 0x12f, 0x136, 0x137, 0x129, 0x139, 0x13a, 0x13b, 0x12d, 0x13d, 0x13e, 0x135,
+	0x32a, 0x32b, 0x332, 0x333, 0x32e, 0x32f, 0x336, 0x337, 0x329, 0x339, 0x33a, 0x33b, 0x32d, 0x33d, 0x33e, 0x335,
+	0x34a, 0x34b, 0x352, 0x353, 0x34e, 0x34f, 0x356, 0x357, 0x349, 0x359, 0x35a, 0x35b, 0x34d, 0x35d, 0x35e, 0x355,
+	0x36a, 0x36b, 0x372, 0x373, 0x36e, 0x36f, 0x376, 0x377, 0x369, 0x379, 0x37a, 0x37b, 0x36d, 0x37d, 0x37e, 0x375,
+	0x1aa, 0x1ab, 0x1b2, 0x1b3, 0x1ae, 0x1af, 0x1b6, 0x1b7, 0x1a9, 0x1b9, 0x1ba, 0x1bb, 0x1ad, 0x1bd, 0x1be, 0x1b5,
+	0x3aa, 0x3ab, 0x3b2, 0x3b3, 0x3ae, 0x3af, 0x3b6, 0x3b7, 0x3a9, 0x3b9, 0x3ba, 0x3bb, 0x3ad, 0x3bd, 0x3be, 0x3b5,
+	0x3ca, 0x3cb, 0x3d2, 0x3d3, 0x3ce, 0x3cf, 0x3d6, 0x3d7, 0x3c9, 0x3d9, 0x3da, 0x3db, 0x3cd, 0x3dd, 0x3de, 0x3d5,
+	0x2aa, 0x2ab, 0x2b2, 0x2b3, 0x2ae, 0x2af, 0x2b6, 0x2b7, 0x2a9, 0x2b9, 0x2ba, 0x2bb, 0x2ad, 0x2bd, 0x2be, 0x2b5
+};
+
 
 int
 find_sync(BYTE ** gcr_pptr, BYTE * gcr_end)
@@ -164,69 +224,283 @@ find_header(BYTE ** gcr_pptr, BYTE * gcr_end)
 	return (*gcr_pptr < gcr_end);
 }
 
+/*
+	Sync run list: one pass over the data records every sync that find_sync()
+	would stop at, as (start, length, following byte). Stretches without any
+	0xff byte are skipped 8 bytes at a time. A list can also cover a circular
+	track view, then offsets past the revolution wrap around to its start.
+*/
+#define LIST_BYTE(list, i) ((list)->gcr_start[(!(list)->period || (i) < (list)->period) ? (i) : (i) % (list)->period])
+
+static void
+scan_runs(sync_list * list)
+{
+	unsigned long long word;
+	size_t i, start, length;
+
+	length = list->length;
+	list->num_runs = 0;
+	list->overflow = 0;
+
+	i = 0;
+	while (i < length)
+	{
+		/* skip words that contain no 0xff byte */
+		while ((i + 8 <= length) && (!list->period || (i % list->period) + 8 <= list->period))
+		{
+			memcpy(&word, &LIST_BYTE(list, i), 8);
+			word = ~word;
+			if ((word - 0x0101010101010101ULL) & ~word & 0x8080808080808080ULL)
+				break;
+			i += 8;
+		}
+
+		while (i < length && LIST_BYTE(list, i) != 0xff)
+			i++;
+		if (i >= length)
+			break;
+
+		start = i;
+		while (i < length && LIST_BYTE(list, i) == 0xff)
+			i++;
+
+		/* a single 0xff is only a sync if the byte before ends with a 1 bit */
+		if ((i - start < 2) && ((start == 0) || !(LIST_BYTE(list, start - 1) & 0x01)))
+			continue;
+
+		if (list->num_runs == MAX_SYNC_RUNS)
+		{
+			list->overflow = 1;
+			break;
+		}
+		list->runs[list->num_runs].pos = start;
+		list->runs[list->num_runs].len = i - start;
+		list->runs[list->num_runs].next = (i < length) ? LIST_BYTE(list, i) : 0;
+		list->num_runs++;
+	}
+}
+
 void
-convert_4bytes_to_GCR(BYTE * buffer, BYTE * ptr)
+scan_sync_runs(sync_list * list, BYTE * gcrdata, size_t length)
+{
+	list->gcr_start = gcrdata;
+	list->length = length;
+	list->period = 0;
+	scan_runs(list);
+}
+
+/* syncs over 'length' bytes of a circular view, starting at its offset 0 */
+void
+scan_sync_runs_view(sync_list * list, track_view * view, size_t length)
+{
+	list->gcr_start = view->data;
+	list->length = length;
+	list->period = view->length;
+	scan_runs(list);
+}
+
+/* last position from which find_sync()/find_header() still stop at this run */
+static size_t
+sync_run_last(sync_run * run)
+{
+	return (run->len > 1) ? run->pos + run->len - 2 : run->pos - 1;
+}
+
+/* move cursor to the first run that a search starting at pos can reach */
+static void
+seek_sync_run(sync_list * list, size_t pos, int * cursor)
+{
+	while ((*cursor > 0) && (sync_run_last(&list->runs[*cursor - 1]) >= pos))
+		(*cursor)--;
+	while ((*cursor < list->num_runs) && (sync_run_last(&list->runs[*cursor]) < pos))
+		(*cursor)++;
+}
+
+/* find_sync()/find_header() on list offsets, for syncs past a full list */
+static int
+find_sync_raw(sync_list * list, size_t * pos, int header)
+{
+	while (1)
+	{
+		if (*pos + 1 + header >= list->length)
+		{
+			*pos = list->length;
+			return 0;	/* not found */
+		}
+
+		if ((LIST_BYTE(list, *pos) & 0x01) && (LIST_BYTE(list, *pos + 1) == 0xff) &&
+			(!header || LIST_BYTE(list, *pos + 2) == 0x52))
+			break;
+
+		(*pos)++;
+	}
+
+	(*pos)++;
+
+	while (!header && *pos < list->length && LIST_BYTE(list, *pos) == 0xff)
+		(*pos)++;
+
+	return (*pos < list->length);
+}
+
+/*
+	Same results as find_sync()/find_header() with gcr_end at the end of the
+	list, but stepping through the run list and working on offsets. The cursor
+	is the run index to continue from and makes sequential searches O(1).
+*/
+int
+find_sync_offset(sync_list * list, size_t * pos, int * cursor)
+{
+	sync_run *run;
+
+	seek_sync_run(list, *pos, cursor);
+
+	if (*cursor == list->num_runs)
+	{
+		if (list->overflow)
+			return find_sync_raw(list, pos, 0);
+
+		*pos = list->length;
+		return 0;	/* not found */
+	}
+
+	run = &list->runs[(*cursor)++];
+	*pos = run->pos + run->len;
+	return (*pos < list->length);
+}
+
+int
+find_header_offset(sync_list * list, size_t * pos, int * cursor)
+{
+	sync_run *run;
+
+	seek_sync_run(list, *pos, cursor);
+
+	while ((*cursor < list->num_runs) && (list->runs[*cursor].next != 0x52 ||
+		list->runs[*cursor].pos + list->runs[*cursor].len >= list->length))
+		(*cursor)++;
+
+	if (*cursor == list->num_runs)
+	{
+		if (list->overflow)
+			return find_sync_raw(list, pos, 1);
+
+		*pos = list->length;
+		return 0;	/* not found */
+	}
+
+	/* like find_header(), stop at the last 0xff before the 0x52 */
+	run = &list->runs[(*cursor)++];
+	*pos = run->pos + run->len - 1;
+	return 1;
+}
+
+int
+find_sync_cursor(sync_list * list, BYTE ** gcr_pptr, int * cursor)
+{
+	size_t pos;
+	int found;
+
+	pos = *gcr_pptr - list->gcr_start;
+	found = find_sync_offset(list, &pos, cursor);
+	*gcr_pptr = list->gcr_start + pos;
+	return found;
+}
+
+int
+find_header_cursor(sync_list * list, BYTE ** gcr_pptr, int * cursor)
 {
-	*ptr = GCR_conv_data[(*buffer) >> 4] << 3;
-	*ptr |= GCR_conv_data[(*buffer) & 0x0f] >> 2;
-	ptr++;
+	size_t pos;
+	int found;
 
-	*ptr = GCR_conv_data[(*buffer) & 0x0f] << 6;
-	buffer++;
-	*ptr |= GCR_conv_data[(*buffer) >> 4] << 1;
-	*ptr |= GCR_conv_data[(*buffer) & 0x0f] >> 4;
-	ptr++;
+	pos = *gcr_pptr - list->gcr_start;
+	found = find_header_offset(list, &pos, cursor);
+	*gcr_pptr = list->gcr_start + pos;
+	return found;
+}
 
-	*ptr = GCR_conv_data[(*buffer) & 0x0f] << 4;
-	buffer++;
-	*ptr |= GCR_conv_data[(*buffer) >> 4] >> 1;
-	ptr++;
+void
+convert_4bytes_to_GCR(BYTE * buffer, BYTE * ptr)
+{
+	convert_bytes_to_GCR(buffer, ptr, 1);
+}
 
-	*ptr = GCR_conv_data[(*buffer) >> 4] << 7;
-	*ptr |= GCR_conv_data[(*buffer) & 0x0f] << 2;
-	buffer++;
-	*ptr |= GCR_conv_data[(*buffer) >> 4] >> 3;
-	ptr++;
+/*
+	Bulk encoder: converts 'quintets' groups of 4 bytes into 5 GCR bytes each.
+	The four 10-bit codes of a group are packed into one 40-bit word and stored.
+*/
+void
+convert_bytes_to_GCR(BYTE * buffer, BYTE * ptr, int quintets)
+{
+	unsigned long long word;
+	int i;
 
-	*ptr = GCR_conv_data[(*buffer) >> 4] << 5;
-	*ptr |= GCR_conv_data[(*buffer) & 0x0f];
+	for (i = 0; i < quintets; i++)
+	{
+		word = ((unsigned long long) GCR_encode_byte[buffer[0]] << 30) |
+			((unsigned long long) GCR_encode_byte[buffer[1]] << 20) |
+			((unsigned long long) GCR_encode_byte[buffer[2]] << 10) |
+			GCR_encode_byte[buffer[3]];
+
+		ptr[0] = (BYTE) (word >> 32);
+		ptr[1] = (BYTE) (word >> 24);
+		ptr[2] = (BYTE) (word >> 16);
+		ptr[3] = (BYTE) (word >> 8);
+		ptr[4] = (BYTE) word;
+
+		buffer += 4;
+		ptr += 5;
+	}
 }
 
 int
 convert_4bytes_from_GCR(BYTE * gcr, BYTE * plain)
 {
-	BYTE hnibble, lnibble;
-	int badGCR, nConverted;
+	/* number of good bytes before the first bad one */
+	return (convert_GCR_quintets(gcr, plain, 1) / 2);
+}
 
-	badGCR = 0;
+/*
+	Bulk decoder: converts 'quintets' groups of 5 GCR bytes into 4 bytes each.
+	Each group is loaded once as a 40-bit word and split into four 10-bit codes.
+	Returns the index of the first bad nybble, or quintets*8 if all are good.
+*/
+int
+convert_GCR_quintets(BYTE * gcr, BYTE * plain, int quintets)
+{
+	unsigned long long word;
+	unsigned short b0, b1, b2, b3;
+	int i, n, firstbad;
 
-	hnibble = GCR_decode_high[gcr[0] >> 3];
-	lnibble = GCR_decode_low[((gcr[0] << 2) | (gcr[1] >> 6)) & 0x1f];
-	if ((hnibble == 0xff || lnibble == 0xff) && !badGCR)
-		badGCR = 1;
-	*plain++ = hnibble | lnibble;
+	firstbad = quintets * 8;
 
-	hnibble = GCR_decode_high[(gcr[1] >> 1) & 0x1f];
-	lnibble = GCR_decode_low[((gcr[1] << 4) | (gcr[2] >> 4)) & 0x1f];
-	if ((hnibble == 0xff || lnibble == 0xff) && !badGCR)
-		badGCR = 2;
-	*plain++ = hnibble | lnibble;
+	for (i = 0; i < quintets; i++)
+	{
+		word = ((unsigned long long) gcr[0] << 32) | ((unsigned long long) gcr[1] << 24) |
+			((unsigned long long) gcr[2] << 16) | ((unsigned long long) gcr[3] << 8) | gcr[4];
 
-	hnibble = GCR_decode_high[((gcr[2] << 1) | (gcr[3] >> 7)) & 0x1f];
-	lnibble = GCR_decode_low[(gcr[3] >> 2) & 0x1f];
-	if ((hnibble == 0xff || lnibble == 0xff) && !badGCR)
-		badGCR = 3;
-	*plain++ = hnibble | lnibble;
+		b0 = GCR_decode_byte[(word >> 30) & 0x3ff];
+		b1 = GCR_decode_byte[(word >> 20) & 0x3ff];
+		b2 = GCR_decode_byte[(word >> 10) & 0x3ff];
+		b3 = GCR_decode_byte[word & 0x3ff];
 
-	hnibble = GCR_decode_high[((gcr[3] << 3) | (gcr[4] >> 5)) & 0x1f];
-	lnibble = GCR_decode_low[gcr[4] & 0x1f];
-	if ((hnibble == 0xff || lnibble == 0xff) && !badGCR)
-		badGCR = 4;
-	*plain++ = hnibble | lnibble;
+		plain[0] = (BYTE) b0;
+		plain[1] = (BYTE) b1;
+		plain[2] = (BYTE) b2;
+		plain[3] = (BYTE) b3;
 
-	nConverted = (badGCR == 0) ? 4 : (badGCR - 1);
+		/* only the first bad nybble is of interest, so locate it lazily */
+		if ((firstbad == quintets * 8) && ((b0 | b1 | b2 | b3) & (GCR_BAD_HIGH | GCR_BAD_LOW)))
+		{
+			b0 = (b0 >> 8) | ((b1 >> 8) << 2) | ((b2 >> 8) << 4) | ((b3 >> 8) << 6);
+			for (n = 0; !(b0 & (1 << n)); n++);
+			firstbad = (i * 8) + n;
+		}
 
-	return (nConverted);
+		gcr += 5;
+		plain += 4;
+	}
+	return firstbad;
 }
 
 int
@@ -246,8 +520,7 @@ extract_id(BYTE * gcr_track, BYTE * id)
 		if (!find_sync(&gcr_ptr, gcr_end))
 			return 0;
 
-		convert_4bytes_from_GCR(gcr_ptr, header);
-		convert_4bytes_from_GCR(gcr_ptr + 5, header + 4);
+		convert_GCR_quintets(gcr_ptr, header, 2);
 
 		if (header[0] == 0x08 && header[2] == 0)
 		   id[0] = header[3];
@@ -281,23 +554,178 @@ extract_cosmetic_id(BYTE * gcr_track, BYTE * id)
 	return 1;
 }
 
+/*
+	Per-track sector index: one linear pass over the track records every
+	header mark with its decoded header and the position of the data block
+	that follows. Sector lookups then only walk the short header list
+	instead of rescanning the track for each sector.
+
+	The caller owns the index. Tracks of a disk image keep theirs in
+	nib_disk, see disk_track_index().
+*/
+static void
+index_header(track_index * index, size_t pos, sector_header * entry, sync_list * syncs, int * sync_cursor)
+{
+	BYTE *gcr_ptr, *gcr_end;
+
+	gcr_ptr = index->gcr_start + pos;
+	gcr_end = index->gcr_start + index->length;
+
+	entry->pos = pos;
+	memset(entry->header, 0, sizeof(entry->header));
+	convert_GCR_quintets(gcr_ptr, entry->header, 2);
+
+	/* header contains no bad GCR, since it can be false positive checksum match */
+	entry->bad_gcr = (bad_gcr_map(gcr_ptr - 1, 10, NULL) != 0);
+
+	/* data block will always be the data following header, else take first sync */
+	if ((syncs != NULL) ? find_sync_cursor(syncs, &gcr_ptr, sync_cursor) : find_sync(&gcr_ptr, gcr_end))
+		entry->data_pos = gcr_ptr - index->gcr_start;
+	else
+		entry->data_pos = index->first_sync;
+}
+
+track_index *
+index_track(track_index * index, BYTE * gcr_start, size_t length)
+{
+	BYTE *gcr_ptr, *gcr_last, *gcr_end;
+	sync_list syncs;
+	size_t pos;
+	int cursor;
+
+	index->gcr_start = gcr_start;
+	index->length = length;
+	index->num_headers = 0;
+	index->overflow = 0;
+	gcr_end = gcr_start + length;
+	scan_sync_runs(&syncs, gcr_start, length);
+
+	/* check for at least one sync */
+	gcr_ptr = gcr_start;
+	cursor = 0;
+	index->has_sync = find_sync_cursor(&syncs, &gcr_ptr, &cursor);
+	index->first_sync = gcr_ptr - gcr_start;
+
+	/* longest stretch without sync */
+	index->sync_gap_max = 0;
+	gcr_last = gcr_ptr = gcr_start;
+	cursor = 0;
+	while (gcr_ptr < gcr_end)
+	{
+		find_sync_cursor(&syncs, &gcr_ptr, &cursor);
+		if ((size_t)(gcr_ptr - gcr_last) > index->sync_gap_max)
+			index->sync_gap_max = gcr_ptr - gcr_last;
+		gcr_last = gcr_ptr;
+	}
+
+	/* all header marks */
+	cursor = 0;
+	for (pos = 0; pos + 10 < length; pos++)
+	{
+		if ((gcr_start[pos] == 0xff) && (gcr_start[pos + 1] == 0x52))
+		{
+			if (index->num_headers == MAX_INDEX_HEADERS)
+			{
+				index->overflow = 1;
+				break;
+			}
+			pos++;
+			index_header(index, pos, &index->headers[index->num_headers++], &syncs, &cursor);
+		}
+	}
+	return index;
+}
+
+/*
+	Sector index of a halftrack, built on first use and kept until the
+	track is changed. Anything that rewrites track data or length in
+	place calls invalidate_track_index(). Each slot belongs to one
+	halftrack, so workers on different tracks never share an index.
+*/
+track_index *
+disk_track_index(nib_disk * disk, int track)
+{
+	track_index *index = &disk->index[track];
+	BYTE *gcr_start = disk->track_buffer + (track * NIB_TRACK_LENGTH);
+
+	if ((!disk->index_valid[track]) ||
+		(index->gcr_start != gcr_start) || (index->length != disk->track_length[track]))
+	{
+		index_track(index, gcr_start, disk->track_length[track]);
+		disk->index_valid[track] = 1;
+	}
+	return index;
+}
+
+/* drop the index of a halftrack, or of all halftracks for track -1 */
+void
+invalidate_track_index(nib_disk * disk, int track)
+{
+	if (track < 0)
+		memset(disk->index_valid, 0, sizeof(disk->index_valid));
+	else
+		disk->index_valid[track] = 0;
+}
+
+/* step through header marks in track order, entry must hold the previous one */
+int
+next_indexed_header(track_index * index, int * cursor, sector_header * entry)
+{
+	BYTE *gcr_start;
+	size_t pos;
+
+	if (*cursor < index->num_headers)
+	{
+		*entry = index->headers[(*cursor)++];
+		return 1;
+	}
+
+	if (!index->overflow)
+		return 0;
+
+	/* more header marks than the index holds, continue on the raw data */
+	gcr_start = index->gcr_start;
+	for (pos = entry->pos + 1; pos + 10 < index->length; pos++)
+	{
+		if ((gcr_start[pos] == 0xff) && (gcr_start[pos + 1] == 0x52))
+		{
+			index_header(index, pos + 1, entry, NULL, NULL);
+			(*cursor)++;
+			return 1;
+		}
+	}
+	return 0;
+}
+
 BYTE
 convert_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, BYTE *d64_sector, int track, int sector, BYTE *id)
+{
+	track_index index;
+
+	if ((gcr_cycle == NULL) || (gcr_cycle <= gcr_start))
+		return SYNC_NOT_FOUND;
+
+	return convert_indexed_sector(index_track(&index, gcr_start, gcr_cycle - gcr_start),
+		d64_sector, track, sector, id);
+}
+
+BYTE
+convert_indexed_sector(track_index * index, BYTE * d64_sector, int track, int sector, BYTE * id)
 {
  	// we should later try to repair some common GCR errors
  	//	1) tri-bit error, in which 01110 is misinterpreted as 01000
 	// 2) low frequency error, in which 10010 is misinterpreted as 11000
 
-	BYTE header[10];        /* block header */
+	sector_header entry;
+	BYTE *header;           /* block header */
 	BYTE hdr_chksum;        /* header checksum */
 	BYTE blk_chksum;        /* block  checksum */
-	BYTE *gcr_ptr, *gcr_end;
+	BYTE *gcr_ptr;
 	BYTE *sectordata;
 	BYTE error_code;
-	size_t track_len;
-	int i, j;
+	int i, cursor;
 
-	if ((gcr_cycle == NULL) || (gcr_cycle <= gcr_start))
+	if (!index->length)
 		return SYNC_NOT_FOUND;
 
 	/* initialize sector data with Original Format Pattern */
@@ -309,39 +737,26 @@ convert_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, BYTE *d64_sector, int track
 		blk_chksum ^= d64_sector[i + 1];
 	d64_sector[257] = blk_chksum;
 
-	/* setup pointers */
-	track_len = gcr_cycle - gcr_start;
-	gcr_ptr = gcr_start;
-	gcr_end = gcr_start + track_len;
-	error_code = SECTOR_OK;
-
 	/* Check for at least one Sync */
-	if (!find_sync(&gcr_ptr, gcr_end))
+	if (!index->has_sync)
 		return SYNC_NOT_FOUND;
 
 	/* Try to find a good block header for Track/Sector */
 	error_code = HEADER_NOT_FOUND;
+	header = entry.header;
 
-	//for (gcr_ptr = gcr_start; gcr_ptr < gcr_end-1; gcr_ptr++)
-	for (gcr_ptr = gcr_start; gcr_ptr < gcr_end-10; gcr_ptr++)
+	cursor = 0;
+	while (next_indexed_header(index, &cursor, &entry))
 	{
-		if ((gcr_ptr[0] == 0xff) && (gcr_ptr[1] == 0x52))
+		if ((header[0] == 0x08) && (header[2] == sector) && (header[3] == track) )
 		{
-			gcr_ptr++;
-			memset(header, 0, 10);
-
-			convert_4bytes_from_GCR(gcr_ptr, header);
-			convert_4bytes_from_GCR(gcr_ptr+5, header+4);
-
-			if ((header[0] == 0x08) && (header[2] == sector) && (header[3] == track) )
-			{
-				/* this is the header we are searching for */
-				error_code = SECTOR_OK;
-				break;
-			}
-			if(verbose>2) printf("{1:%.2x, 2:%.2x, 3:%.2x, 4:%.2x, 5:%.2x}{I:%.2x, T:%.2d, S:%.2d}\n",
-				gcr_ptr[1], gcr_ptr[2], gcr_ptr[3], gcr_ptr[4], gcr_ptr[5], header[0],header[3],header[2]);
+			/* this is the header we are searching for */
+			error_code = SECTOR_OK;
+			break;
 		}
+		gcr_ptr = index->gcr_start + entry.pos;
+		if(verbose>2) printf("{1:%.2x, 2:%.2x, 3:%.2x, 4:%.2x, 5:%.2x}{I:%.2x, T:%.2d, S:%.2d}\n",
+			gcr_ptr[1], gcr_ptr[2], gcr_ptr[3], gcr_ptr[4], gcr_ptr[5], header[0],header[3],header[2]);
 	}
 
 	if(error_code != SECTOR_OK)
@@ -360,28 +775,20 @@ convert_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, BYTE *d64_sector, int track
 		error_code = (error_code == SECTOR_OK) ? ID_MISMATCH : error_code;
 
 	/* verify that our header contains no bad GCR, since it can be false positive checksum match */
-	for(j = 0; j < 10; j++)
-	{
-		if (is_bad_gcr(gcr_ptr - 1, 10, j))
-			error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
-	}
+	if (entry.bad_gcr)
+		error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
 
 	/* done with header checks */
 	if((error_code != SECTOR_OK) && (error_code != ID_MISMATCH))
 		return error_code;
 
-	/* check for data sector, it will always be the data following header */
-	if (!find_sync(&gcr_ptr, gcr_end))
-	{
-		gcr_ptr = gcr_start;
-		if (!find_sync(&gcr_ptr, gcr_end))
-			return DATA_NOT_FOUND;
-	}
+	/* data sector position was resolved when indexing */
+	gcr_ptr = index->gcr_start + entry.data_pos;
+
+	convert_GCR_quintets(gcr_ptr, d64_sector, 65);
 
 	for (i = 0, sectordata = d64_sector; i < 65; i++)
 	{
-		convert_4bytes_from_GCR(gcr_ptr, sectordata);
-
 		if(verbose>3)
 			printf("%.4x: %.2x%.2x%.2x%.2x%.2x --- %.2x%.2x%.2x%.2x\n", (i*4),
 				gcr_ptr[0], gcr_ptr[1], gcr_ptr[2], gcr_ptr[3], gcr_ptr[4],
@@ -403,11 +810,9 @@ convert_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, BYTE *d64_sector, int track
 		error_code = (error_code == SECTOR_OK) ? BAD_DATA_CHECKSUM : error_code;
 
 	/* verify that our data contains no bad GCR, since it can be false positive checksum match */
-	for(j = 0; j < 320; j++)
-	{
-		if (is_bad_gcr(gcr_ptr - 325, 320, j))
-			error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
-	}
+	if (bad_gcr_map(gcr_ptr - 325, 320, NULL))
+		error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
+
 	return error_code;
 }
 
@@ -415,11 +820,14 @@ void
 convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * diskID, int error)
 {
 	int i;
-	BYTE buf[4], databuf[0x104], chksum;
+	BYTE buf[8], databuf[0x104], chksum;
 	BYTE tempID[3];
 
 	memcpy(tempID, diskID, 3);
-	memset(ptr, 0x55, SECTOR_SIZE + sector_gap_length[track]);	/* 'unformat' GCR sector */
+
+	/* 'unformat' GCR sector, a complete sector overwrites all of it below */
+	if ((error == SYNC_NOT_FOUND) || (error == HEADER_NOT_FOUND) || (error == DATA_NOT_FOUND))
+		memset(ptr, 0x55, SECTOR_SIZE + sector_gap_length[track]);
 
 	if (error == SYNC_NOT_FOUND)
 		return;
@@ -447,13 +855,11 @@ convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * d
 		if (error == BAD_HEADER_CHECKSUM)
 			buf[1] ^= 0xff;
 
-		convert_4bytes_to_GCR(buf, ptr);
-		ptr += 5;
-		buf[0] = tempID[1];
-		buf[1] = tempID[0];
-		buf[2] = buf[3] = 0x0f;
-		convert_4bytes_to_GCR(buf, ptr);
-		ptr += 5;
+		buf[4] = tempID[1];
+		buf[5] = tempID[0];
+		buf[6] = buf[7] = 0x0f;
+		convert_bytes_to_GCR(buf, ptr, 2);
+		ptr += 10;
 		memset(ptr, 0x55, HEADER_GAP_LENGTH);	/* Header Gap */
 		ptr += HEADER_GAP_LENGTH;
 	}
@@ -466,11 +872,9 @@ convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * d
 
 	chksum = 0;
 	databuf[0] = 0x07;
+	memcpy(databuf + 1, buffer, 0x100);
 	for (i = 0; i < 0x100; i++)
-	{
-		databuf[i + 1] = buffer[i];
 		chksum ^= buffer[i];
-	}
 
 	if (error == BAD_DATA_CHECKSUM)
 		chksum ^= 0xff;
@@ -479,66 +883,117 @@ convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * d
 	databuf[0x102] = 0;	/* 2 bytes filler */
 	databuf[0x103] = 0;
 
-	for (i = 0; i < 65; i++)
-	{
-		convert_4bytes_to_GCR(databuf + (4 * i), ptr);
-		ptr += 5;
-	}
+	convert_bytes_to_GCR(databuf, ptr, 65);
+	ptr += 325;
 
 	memset(ptr, 0x55, sector_gap_length[track]);	 /* tail gap*/
-	ptr += sector_gap_length[track];
-	//memset(ptr, 0x55, SECTOR_GAP_LENGTH);	 /* tail gap*/
-	//ptr += SECTOR_GAP_LENGTH;
 }
 
-size_t
-find_track_cycle_headers(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
+/*
+	Track cycle search over header (or sync) positions. The match_length
+	bytes at every position are hashed, and prefix hashes over that sequence
+	compare a candidate's whole run of remaining positions in one step. Hash
+	matches are confirmed with memcmp.
+*/
+static size_t
+find_track_cycle_marks(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, int headers, int match_length)
 {
 	BYTE *nib_track;	/* start of nibbled track data */
-	BYTE *start_pos;	/* start of periodic area */
-	BYTE *cycle_pos;	/* start of cycle repetition */
 	BYTE *stop_pos;		/* maximum position allowed for cycle */
-	BYTE *data_pos;		/* cycle search variable */
-	BYTE *p1, *p2;		/* local pointers for comparisons */
+	BYTE *pos;
+	sync_list syncs;	/* syncs up to stop_pos */
+	size_t *marks;		/* offset of track start and every header/sync */
+	unsigned long long *prefix, *power, hash;
+	int num_marks, max_marks, cursor, start, data, len, lo, hi, k;
 
 	nib_track = *cycle_start;
-	stop_pos = nib_track + NIB_TRACK_LENGTH - gap_match_length;
-	cycle_pos = NULL;
+	stop_pos = nib_track + NIB_TRACK_LENGTH - match_length;
+
+	max_marks = NIB_TRACK_LENGTH / 2 + 2;
+	marks = malloc(max_marks * sizeof(size_t));
+	prefix = malloc((max_marks + 1) * sizeof(unsigned long long));
+	power = malloc((max_marks + 1) * sizeof(unsigned long long));
+	if ((marks == NULL) || (prefix == NULL) || (power == NULL))
+	{
+		printf("Couldn't allocate memory for cycle search\n");
+		goto notfound;
+	}
+
+	/* the first comparison always starts at the beginning of the track */
+	scan_sync_runs(&syncs, nib_track, stop_pos - nib_track);
+	marks[0] = 0;
+	num_marks = 1;
+	pos = nib_track;
+	cursor = 0;
+	while ((num_marks < max_marks) &&
+		(headers ? find_header_cursor(&syncs, &pos, &cursor) : find_sync_cursor(&syncs, &pos, &cursor)))
+		marks[num_marks++] = pos - nib_track;
+
+	prefix[0] = 0;
+	power[0] = 1;
+	for (k = 0; k < num_marks; k++)
+	{
+		hash = 14695981039346656037ULL;
+		for (len = 0; len < match_length; len++)
+			hash = (hash ^ nib_track[marks[k] + len]) * 1099511628211ULL;
+
+		prefix[k + 1] = prefix[k] * 0x9e3779b97f4a7c15ULL + hash;
+		power[k + 1] = power[k] * 0x9e3779b97f4a7c15ULL;
+	}
 
-	/* try to find a normal track cycle  */
-	for (start_pos = nib_track;; find_header(&start_pos, stop_pos))
+	/* try to find a normal track cycle */
+	for (start = 0; start < num_marks; start++)
 	{
-		if ((data_pos = start_pos + cap_min) >= stop_pos)
+		if ((pos = nib_track + marks[start] + cap_min) >= stop_pos)
 			break;	/* no cycle found */
 
-		while (find_header(&data_pos, stop_pos))
+		cursor = 0;
+		if (!(headers ? find_header_cursor(&syncs, &pos, &cursor) : find_sync_cursor(&syncs, &pos, &cursor)))
+			continue;
+
+		/* index of the first candidate */
+		lo = start + 1;
+		hi = num_marks - 1;
+		while (lo < hi)
+		{
+			data = (lo + hi) / 2;
+			if (nib_track + marks[data] < pos)
+				lo = data + 1;
+			else
+				hi = data;
+		}
+
+		for (data = lo; data < num_marks; data++)
 		{
-			p1 = start_pos;
-			cycle_pos = data_pos;
+			/* all remaining positions must match, too */
+			len = num_marks - data;
+			if (prefix[start + len] - prefix[start] * power[len] !=
+				prefix[data + len] - prefix[data] * power[len])
+				continue;
 
-			for (p2 = cycle_pos; p2 < stop_pos;)
+			for (k = 0; k < len; k++)
 			{
-				/* try to match all remaining syncs, too */
-				if (memcmp(p1, p2, gap_match_length) != 0)
-				{
-					cycle_pos = NULL;
-					break;
-				}
-				if (!find_header(&p1, stop_pos))
-					break;
-				if (!find_header(&p2, stop_pos))
+				if (memcmp(nib_track + marks[start + k], nib_track + marks[data + k], match_length) != 0)
 					break;
 			}
 
-			if ((cycle_pos != NULL) && (check_valid_data(data_pos, gap_match_length)))
+			if ((k == len) && (check_valid_data(nib_track + marks[data], match_length)))
 			{
-				*cycle_start = start_pos;
-				*cycle_stop = cycle_pos;
-				return (cycle_pos - start_pos);
+				*cycle_start = nib_track + marks[start];
+				*cycle_stop = nib_track + marks[data];
+				free(marks);
+				free(prefix);
+				free(power);
+				return (*cycle_stop - *cycle_start);
 			}
 		}
 	}
 
+notfound:
+	free(marks);
+	free(prefix);
+	free(power);
+
 	/* we got nothing useful, return it all */
 	*cycle_start = nib_track;
 	*cycle_stop = nib_track + NIB_TRACK_LENGTH;
@@ -546,71 +1001,151 @@ find_track_cycle_headers(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min
 }
 
 size_t
-find_track_cycle_syncs(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
+find_track_cycle_headers(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max, nib_options *opt)
 {
-	BYTE *nib_track;	/* start of nibbled track data */
-	BYTE *start_pos;	/* start of periodic area */
-	BYTE *cycle_pos;	/* start of cycle repetition */
-	BYTE *stop_pos;		/* maximum position allowed for cycle */
-	BYTE *data_pos;		/* cycle search variable */
-	BYTE *p1, *p2;		/* local pointers for comparisons */
+	return find_track_cycle_marks(cycle_start, cycle_stop, cap_min, 1, opt->gap_match_length);
+}
 
-	nib_track = *cycle_start;
-	stop_pos = nib_track + NIB_TRACK_LENGTH - gap_match_length;
-	cycle_pos = NULL;
+size_t
+find_track_cycle_syncs(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max, nib_options *opt)
+{
+	return find_track_cycle_marks(cycle_start, cycle_stop, cap_min, 0, opt->gap_match_length);
+}
 
-	/* try to find a normal track cycle  */
-	for (start_pos = nib_track;; find_sync(&start_pos, stop_pos))
-	{
-		if ((data_pos = start_pos + cap_min) >= stop_pos)
-			break;	/* no cycle found */
+/*
+	Raw cycle search: finds the first p1, and for it the first p2 at least
+	cap_min + CAP_ALLOWANCE further, where gap_match_length bytes match and
+	check_valid_data() accepts p2. All windows are hashed with a rolling hash
+	and sorted once, so each p1 only looks up its candidates.
+	'available' is the number of track bytes from *cycle_start on, the earlier
+	passes may have moved it into the track.
+*/
+typedef struct
+{
+	unsigned int hash;
+	unsigned int pos;
+} window_hash;
 
-		while (find_sync(&data_pos, stop_pos))
-		{
-			p1 = start_pos;
-			cycle_pos = data_pos;
+static int
+compare_window_hash(const void * a, const void * b)
+{
+	const window_hash *wa = (const window_hash *) a;
+	const window_hash *wb = (const window_hash *) b;
 
-			for (p2 = cycle_pos; p2 < stop_pos;)
-			{
-				/* try to match all remaining syncs, too */
-				if (memcmp(p1, p2, gap_match_length) != 0)
-				{
-					cycle_pos = NULL;
-					break;
-				}
-				if (!find_sync(&p1, stop_pos))
-					break;
-				if (!find_sync(&p2, stop_pos))
-					break;
-			}
+	if (wa->hash != wb->hash)
+		return (wa->hash < wb->hash) ? -1 : 1;
+	if (wa->pos != wb->pos)
+		return (wa->pos < wb->pos) ? -1 : 1;
+	return 0;
+}
+
+/* check_valid_data() looks 3 bytes past the match, so a match must end this far before the data */
+#define CYCLE_LOOKAHEAD 3
+
+size_t
+find_track_cycle_raw(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max, size_t available, nib_options *opt)
+{
+	BYTE *nib_track;	/* start of nibbled track data */
+	unsigned int *hashes;	/* rolling hash of the window at each position */
+	window_hash *windows;	/* cycle candidates, sorted by hash and position */
+	unsigned int hash, power;
+	size_t length, distance, num_windows, p1, lo, hi, mid;
+	int gap_match_length = opt->gap_match_length;
+	int i;
+
+	nib_track = *cycle_start;
+	if (opt->raw_cycle_legacy || (gap_match_length < 1) ||
+		((size_t) gap_match_length + CYCLE_LOOKAHEAD >= available))
+		return find_track_cycle_raw_legacy(cycle_start, cycle_stop, cap_min, cap_max, available, opt);
+
+	/* windows that can be compared and checked without leaving the data */
+	length = available - gap_match_length - CYCLE_LOOKAHEAD + 1;
+	distance = cap_min + CAP_ALLOWANCE;
+
+	hashes = malloc(length * sizeof(unsigned int));
+	windows = malloc(length * sizeof(window_hash));
+	if ((hashes == NULL) || (windows == NULL))
+	{
+		free(hashes);
+		free(windows);
+		return find_track_cycle_raw_legacy(cycle_start, cycle_stop, cap_min, cap_max, available, opt);
+	}
+
+	hash = 0;
+	power = 1;
+	for (i = 0; i < gap_match_length; i++)
+	{
+		hash = hash * 257 + nib_track[i];
+		if (i) power *= 257;
+	}
+
+	num_windows = 0;
+	for (p1 = 0; p1 < length; p1++)
+	{
+		hashes[p1] = hash;
+		if (p1 >= distance)
+		{
+			windows[num_windows].hash = hash;
+			windows[num_windows].pos = (unsigned int) p1;
+			num_windows++;
+		}
+		hash = (hash - nib_track[p1] * power) * 257 + nib_track[p1 + gap_match_length];
+	}
+	qsort(windows, num_windows, sizeof(window_hash), compare_window_hash);
+
+	for (p1 = 0; p1 + distance < length; p1++)
+	{
+		/* first candidate with this hash at or after p1 + distance */
+		lo = 0;
+		hi = num_windows;
+		while (lo < hi)
+		{
+			mid = (lo + hi) / 2;
+			if ((windows[mid].hash < hashes[p1]) ||
+				((windows[mid].hash == hashes[p1]) && (windows[mid].pos < p1 + distance)))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
 
-			if ((cycle_pos != NULL) && (check_valid_data(data_pos, gap_match_length)))
+		for (; (lo < num_windows) && (windows[lo].hash == hashes[p1]); lo++)
+		{
+			/* only a real match is worth checking, like the legacy search */
+			if ((memcmp(nib_track + p1, nib_track + windows[lo].pos, gap_match_length) == 0) &&
+				(check_valid_data(nib_track + windows[lo].pos, gap_match_length)))
 			{
-				*cycle_start = start_pos;
-				*cycle_stop = cycle_pos;
-				return (cycle_pos - start_pos);
+				*cycle_start = nib_track + p1;
+				*cycle_stop = nib_track + windows[lo].pos;
+				free(hashes);
+				free(windows);
+				return (*cycle_stop - *cycle_start);
 			}
 		}
 	}
+	free(hashes);
+	free(windows);
 
-	/* we got nothing useful, return it all */
+	/* we got nothing useful */
 	*cycle_start = nib_track;
-	*cycle_stop = nib_track + NIB_TRACK_LENGTH;
-	return NIB_TRACK_LENGTH;
+	*cycle_stop = nib_track + available;
+	return available;
 }
 
 size_t
-find_track_cycle_raw(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max)
+find_track_cycle_raw_legacy(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max, size_t available, nib_options *opt)
 {
 	BYTE *nib_track;	/* start of nibbled track data */
 	BYTE *start_pos;	/* start of periodic area */
 	BYTE *cycle_pos;	/* start of cycle repetition */
 	BYTE *stop_pos;		/* maximum position allowed for cycle */
 	BYTE *p1, *p2;		/* local pointers for comparisons */
+	int gap_match_length = opt->gap_match_length;
 
 	nib_track = *cycle_start;
 	start_pos = nib_track;
-	stop_pos = nib_track + NIB_TRACK_LENGTH - gap_match_length;
+	stop_pos = nib_track;
+	if ((gap_match_length >= 0) && ((size_t) gap_match_length + CYCLE_LOOKAHEAD < available))
+		stop_pos += available - gap_match_length - CYCLE_LOOKAHEAD + 1;
 	cycle_pos = NULL;
 
 	/* try to find a track cycle ignoring sync  */
@@ -638,8 +1173,109 @@ find_track_cycle_raw(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, si
 
 	/* we got nothing useful */
 	*cycle_start = nib_track;
-	*cycle_stop = nib_track + NIB_TRACK_LENGTH;
-	return NIB_TRACK_LENGTH;
+	*cycle_stop = nib_track + available;
+	return available;
+}
+
+/*
+	Bit-level cycle search for reads whose revolution is not a whole number
+	of bytes (syncless or bitshifted tracks). The read is packed into 64-bit
+	words and compared with itself shifted by every candidate length in bits,
+	counting mismatches with XOR and popcount over the same number of bits.
+	Returns one revolution in bits, 0 if none, and copies it to 'aligned'
+	with the last byte completed from the start of the revolution.
+*/
+static int
+popcount64(unsigned long long x)
+{
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int) ((x * 0x0101010101010101ULL) >> 56);
+}
+
+/* mismatching bits between the first 'bits' bits and those at 'offset', stops at 'limit' */
+static size_t
+count_bit_mismatch(unsigned long long * words, size_t offset, size_t bits, size_t limit)
+{
+	unsigned long long diff;
+	size_t mismatch, num_words, q, r, i;
+
+	q = offset >> 6;
+	r = offset & 63;
+	num_words = (bits + 63) / 64;
+	mismatch = 0;
+
+	for (i = 0; (i < num_words) && (mismatch < limit); i++)
+	{
+		diff = words[q + i] << r;
+		if (r)
+			diff |= words[q + i + 1] >> (64 - r);
+		diff ^= words[i];
+
+		if ((i == num_words - 1) && (bits & 63))
+			diff &= ~0ULL << (64 - (bits & 63));
+
+		mismatch += popcount64(diff);
+	}
+	return mismatch;
+}
+
+size_t
+find_track_cycle_bits(BYTE * track, size_t length, size_t cap_min, size_t cap_max, BYTE * aligned)
+{
+	unsigned long long words[NIB_TRACK_LENGTH / 8 + 2];
+	size_t total, overlap, period, period_max, best_period;
+	size_t mismatch, best, i, bytes;
+
+	if (length > NIB_TRACK_LENGTH)
+		length = NIB_TRACK_LENGTH;
+	total = length * 8;
+	if (total < CYCLE_BITS_OVERLAP)
+		return 0;
+
+	/* all candidates are compared over the same number of bits */
+	period_max = cap_max * 8;
+	if (period_max > total - CYCLE_BITS_OVERLAP)
+		period_max = total - CYCLE_BITS_OVERLAP;
+	overlap = total - period_max;
+
+	memset(words, 0, sizeof(words));
+	for (i = 0; i < length; i++)
+		words[i >> 3] |= (unsigned long long) track[i] << (56 - 8 * (i & 7));
+
+	/* don't match gap or other filler that repeats within a few bytes */
+	for (i = 1; i <= 64; i++)
+	{
+		if (count_bit_mismatch(words, i, overlap - 64, overlap) * CYCLE_BITS_TOLERANCE < overlap - 64)
+			return 0;
+	}
+
+	best_period = 0;
+	best = overlap;
+	for (period = cap_min * 8; period <= period_max; period++)
+	{
+		mismatch = count_bit_mismatch(words, period, overlap, best);
+		if (mismatch < best)
+		{
+			best = mismatch;
+			best_period = period;
+		}
+	}
+
+	/* allow for a few weak bits, but nothing that looks like noise */
+	if ((best_period == 0) || (best * CYCLE_BITS_TOLERANCE >= overlap))
+		return 0;
+
+	if (aligned != NULL)
+	{
+		bytes = (best_period + 7) / 8;
+		memcpy(aligned, track, bytes);
+		if (best_period & 7)
+			aligned[bytes - 1] = (track[bytes - 1] & (0xff << (8 - (best_period & 7)))) |
+				(track[0] >> (best_period & 7));
+	}
+	return best_period;
 }
 
 int
@@ -672,69 +1308,414 @@ check_valid_data(BYTE * data, int matchlen)
 	return 1;
 }
 
+/*
+	Circular track view helpers: view_span() returns 'length' contiguous
+	bytes at pos, pointing into the view unless they wrap around the end,
+	in which case they are copied to scratch. view_copy() materializes the
+	track rotated to pos.
+*/
 BYTE *
-find_sector0(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen)
+view_span(track_view * view, size_t pos, size_t length, BYTE * scratch)
+{
+	pos %= view->length;
+	if (pos + length <= view->length)
+		return view->data + pos;
+
+	view_copy(view, pos, scratch, length);
+	return scratch;
+}
+
+void
+view_copy(track_view * view, size_t pos, BYTE * destination, size_t length)
+{
+	size_t chunk;
+
+	pos %= view->length;
+	while (length)
+	{
+		chunk = view->length - pos;
+		if (chunk > length)
+			chunk = length;
+
+		memcpy(destination, view->data + pos, chunk);
+		destination += chunk;
+		length -= chunk;
+		pos = 0;
+	}
+}
+
+/*
+	Bitstream helpers. Bits are numbered from the MSB of the first byte,
+	the way they come off the disk. All work is done on 64-bit words
+	assembled from up to 9 bytes; bits outside the stream read as zero
+	and are never written.
+*/
+void
+bitstream_init(bitstream * stream, BYTE * data, size_t bits)
+{
+	stream->data = data;
+	stream->bits = bits;
+}
+
+/* up to 8 bytes at byte offset 'pos', big endian, zero past the end */
+static unsigned long long
+load_bytes64(bitstream * stream, size_t pos)
+{
+	unsigned long long word;
+	size_t bytes, i;
+	BYTE *p;
+
+	bytes = (stream->bits + 7) >> 3;
+	p = stream->data + pos;
+	if (pos + 8 <= bytes)
+		return ((unsigned long long) p[0] << 56) | ((unsigned long long) p[1] << 48) |
+			((unsigned long long) p[2] << 40) | ((unsigned long long) p[3] << 32) |
+			((unsigned long long) p[4] << 24) | ((unsigned long long) p[5] << 16) |
+			((unsigned long long) p[6] << 8) | (unsigned long long) p[7];
+
+	word = 0;
+	for (i = 0; (i < 8) && (pos + i < bytes); i++)
+		word |= (unsigned long long) p[i] << (56 - 8 * i);
+	return word;
+}
+
+/* next 'count' bits (1-64) at 'pos', right aligned */
+unsigned long long
+bits_extract(bitstream * stream, size_t pos, int count)
+{
+	unsigned long long word;
+	size_t byte;
+	int shift;
+
+	if (pos >= stream->bits)
+		return 0;
+
+	byte = pos >> 3;
+	shift = (int) (pos & 7);
+	word = load_bytes64(stream, byte);
+	if (shift)
+	{
+		word <<= shift;
+		if (byte + 8 < (stream->bits + 7) >> 3)
+			word |= stream->data[byte + 8] >> (8 - shift);
+	}
+
+	/* mask off what lies beyond the end of the stream */
+	if (stream->bits - pos < 64)
+		word &= ~0ULL << (64 - (stream->bits - pos));
+
+	return word >> (64 - count);
+}
+
+/* store the low 'count' bits (1-56) of value at 'pos' */
+void
+bits_deposit(bitstream * stream, size_t pos, unsigned long long value, int count)
+{
+	unsigned long long word, mask;
+	size_t byte, i, bytes;
+	int shift;
+
+	if (pos >= stream->bits)
+		return;
+	if ((size_t) count > stream->bits - pos)
+	{
+		value >>= count - (int) (stream->bits - pos);
+		count = (int) (stream->bits - pos);
+	}
+
+	byte = pos >> 3;
+	shift = (int) (pos & 7);
+	mask = (~0ULL >> shift) & (~0ULL << (64 - shift - count));
+	word = load_bytes64(stream, byte);
+	word = (word & ~mask) | ((value << (64 - shift - count)) & mask);
+
+	bytes = (size_t) (shift + count + 7) >> 3;
+	for (i = 0; i < bytes; i++)
+		stream->data[byte + i] = (BYTE) (word >> (56 - 8 * i));
+}
+
+/* store 64 bits at a byte aligned 'pos' */
+static void
+store_bits64(bitstream * stream, size_t pos, unsigned long long word)
+{
+	BYTE *p;
+	int i;
+
+	if (pos + 64 > stream->bits)
+	{
+		bits_deposit(stream, pos, word >> 32, 32);
+		bits_deposit(stream, pos + 32, word & 0xffffffffULL, 32);
+		return;
+	}
+
+	p = stream->data + (pos >> 3);
+	for (i = 0; i < 8; i++)
+		p[i] = (BYTE) (word >> (56 - 8 * i));
+}
+
+/* copy 'count' bits, up to 56 at a time, from the back if 'backwards' */
+static void
+copy_bit_chunks(bitstream * dest, size_t dest_pos, bitstream * src, size_t src_pos, size_t count, int backwards)
 {
-	BYTE *pos, *buffer_end, *sync_last;
+	size_t done, chunk;
 
-	pos = work_buffer;
-	buffer_end = work_buffer + 2 * tracklen - 10;
+	if (backwards)
+	{
+		while (count)
+		{
+			chunk = (count > 56) ? 56 : count;
+			count -= chunk;
+			bits_deposit(dest, dest_pos + count, bits_extract(src, src_pos + count, (int) chunk), (int) chunk);
+		}
+		return;
+	}
+
+	for (done = 0; done < count; done += chunk)
+	{
+		chunk = (count - done > 56) ? 56 : count - done;
+		bits_deposit(dest, dest_pos + done, bits_extract(src, src_pos + done, (int) chunk), (int) chunk);
+	}
+}
+
+/*
+	Copy 'count' bits between any two bit positions. Whole 64-bit words
+	are stored when the destination starts on a byte. An overlapping copy
+	within one stream must pass the same bitstream as src and dest so the
+	direction can be chosen.
+*/
+void
+bits_copy(bitstream * dest, size_t dest_pos, bitstream * src, size_t src_pos, size_t count)
+{
+	size_t words, i;
+	int backwards;
+
+	backwards = (src == dest) && (dest_pos > src_pos) && (dest_pos < src_pos + count);
+
+	if (dest_pos & 7)
+	{
+		copy_bit_chunks(dest, dest_pos, src, src_pos, count, backwards);
+		return;
+	}
+
+	words = count >> 6;
+	if (backwards)
+	{
+		copy_bit_chunks(dest, dest_pos + words * 64, src, src_pos + words * 64, count & 63, 1);
+		for (i = words; i-- > 0; )
+			store_bits64(dest, dest_pos + i * 64, bits_extract(src, src_pos + i * 64, 64));
+	}
+	else
+	{
+		for (i = 0; i < words; i++)
+			store_bits64(dest, dest_pos + i * 64, bits_extract(src, src_pos + i * 64, 64));
+		copy_bit_chunks(dest, dest_pos + words * 64, src, src_pos + words * 64, count & 63, 0);
+	}
+}
+
+void
+bits_fill(bitstream * stream, size_t pos, size_t count, int value)
+{
+	size_t done, chunk;
+
+	for (done = 0; done < count; done += chunk)
+	{
+		chunk = (count - done > 56) ? 56 : count - done;
+		bits_deposit(stream, pos + done, value ? ~0ULL : 0, (int) chunk);
+	}
+}
+
+/* shift the whole stream left (count > 0) or right (count < 0), filling with zero */
+void
+bits_shift(bitstream * stream, int count)
+{
+	size_t n;
+
+	if (count > 0)
+	{
+		n = ((size_t) count < stream->bits) ? (size_t) count : stream->bits;
+		bits_copy(stream, 0, stream, n, stream->bits - n);
+		bits_fill(stream, stream->bits - n, n, 0);
+	}
+	else if (count < 0)
+	{
+		n = ((size_t) -count < stream->bits) ? (size_t) -count : stream->bits;
+		bits_copy(stream, n, stream, 0, stream->bits - n);
+		bits_fill(stream, 0, n, 0);
+	}
+}
+
+/* length of the run of 1 bits starting at 'pos', counting at most 'max' */
+size_t
+bits_count_ones(bitstream * stream, size_t pos, size_t max)
+{
+	unsigned long long word;
+	size_t ones;
+
+	if (pos >= stream->bits)
+		return 0;
+
+	ones = 0;
+	while ((ones < max) && (pos + ones < stream->bits))
+	{
+		word = bits_extract(stream, pos + ones, 64);
+		if (word == ~0ULL)
+		{
+			ones += 64;
+			continue;
+		}
+
+		while ((word >> 56) == 0xff)
+		{
+			word <<= 8;
+			ones += 8;
+		}
+		while (word & 0x8000000000000000ULL)
+		{
+			word <<= 1;
+			ones++;
+		}
+		break;
+	}
+	return (ones < max) ? ones : max;
+}
+
+/* first bit position >= pos where the 'count' (1-32) bit pattern starts */
+size_t
+bits_find(bitstream * stream, size_t pos, unsigned long pattern, int count)
+{
+	unsigned long long word, mask;
+	int offset;
+
+	mask = (1ULL << count) - 1;
+	pattern &= mask;
+
+	/* each word covers 65-count start positions */
+	while (pos + count <= stream->bits)
+	{
+		word = bits_extract(stream, pos, 64);
+		for (offset = 0; offset <= 64 - count; offset++)
+		{
+			if (((word >> (64 - count - offset)) & mask) == pattern)
+			{
+				if (pos + offset + count > stream->bits)
+					return BITS_NOT_FOUND;
+				return pos + offset;
+			}
+		}
+		pos += 65 - count;
+	}
+	return BITS_NOT_FOUND;
+}
+
+/*
+	First bit position >= pos where at least 'count' (1-64) 1 bits in a
+	row start, as in a sync mark. ANDing the word with itself shifted
+	leaves a bit set only where a long enough run begins, so 65-count
+	start positions are tested at once.
+*/
+size_t
+bits_find_ones(bitstream * stream, size_t pos, int count)
+{
+	unsigned long long word;
+	int run, step, offset;
+
+	while (pos + count <= stream->bits)
+	{
+		word = bits_extract(stream, pos, 64);
+		for (run = 1; run < count; run += step)
+		{
+			step = (run < count - run) ? run : count - run;
+			word &= word << step;
+		}
+		word &= ~0ULL << (count - 1);
+
+		if (word)
+		{
+			for (offset = 0; !(word & 0xff00000000000000ULL); offset += 8)
+				word <<= 8;
+			for (; !(word & 0x8000000000000000ULL); offset++)
+				word <<= 1;
+
+			if (pos + offset + count > stream->bits)
+				return BITS_NOT_FOUND;
+			return pos + offset;
+		}
+		pos += 65 - count;
+	}
+	return BITS_NOT_FOUND;
+}
+
+BYTE *
+find_sector0(track_view * view, size_t * p_sectorlen)
+{
+	size_t pos, prev, buffer_end, tracklen;
+	sync_list syncs;
+	int cursor;
+
+	/* search two revolutions, wrapping around the view */
+	tracklen = view->length;
+	pos = 0;
+	buffer_end = (2 * tracklen > 10) ? 2 * tracklen - 10 : 0;
 	*p_sectorlen = 0;
+	scan_sync_runs_view(&syncs, view, buffer_end);
+	cursor = 0;
 
-	if (!find_sync(&pos, buffer_end))
+	if (!find_sync_offset(&syncs, &pos, &cursor))
 		return NULL;
 
-	sync_last = pos;
-
 	/* try to find sector 0 */
 	while (pos < buffer_end)
 	{
-		if (!find_sync(&pos, buffer_end))
+		if (!find_sync_offset(&syncs, &pos, &cursor))
 			return NULL;
-		if (pos[0] == 0x52 && (pos[1] & 0xc0) == 0x40 &&
-		  (pos[2] & 0x0f) == 0x05 && (pos[3] & 0xfc) == 0x28)
+		if (VIEW_BYTE(view, pos) == 0x52 && (VIEW_BYTE(view, pos + 1) & 0xc0) == 0x40 &&
+		  (VIEW_BYTE(view, pos + 2) & 0x0f) == 0x05 && (VIEW_BYTE(view, pos + 3) & 0xfc) == 0x28)
 		{
 			/* this is inaccurate if sector 0 is the first thing found */
-			/* *p_sectorlen = pos - sync_last; GCR_BLOCK_LEN;  */
 			*p_sectorlen = GCR_BLOCK_LEN;
 			break;
 		}
-		sync_last = pos;
 	}
 
 	/* find last GCR byte before sync */
 	do
 	{
 		pos -= 1;
-		if (pos == work_buffer)
+		if (pos == 0)
 			pos += tracklen;
-	} while (*pos == 0xff);
+	} while (VIEW_BYTE(view, pos) == 0xff);
 
 	/* move to first sync byte */
 	pos += 1;
-	while (pos >= work_buffer + tracklen)
+	while (pos >= tracklen)
 		pos -= tracklen;
 
-	if(*(pos-1)&1)
-		return pos - 1;  // go to  last byte that contains first few bits of sync
+	prev = (pos == 0) ? tracklen - 1 : pos - 1;
+	if(view->data[prev]&1)
+		return view->data + prev;  // go to  last byte that contains first few bits of sync
 	else
-		return pos; // return at first full byte of sync
+		return view->data + pos; // return at first full byte of sync
 }
 
 BYTE *
-find_sector_gap(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen)
+find_sector_gap(track_view * view, size_t * p_sectorlen)
 {
 	size_t gap, maxgap;
-	BYTE *pos;
-	BYTE *buffer_end;
-	BYTE *sync_last;
-	BYTE *sync_max;
-
-	pos = work_buffer;
-	buffer_end = work_buffer + 2 * tracklen - 10;
+	size_t pos, prev, buffer_end, tracklen;
+	size_t sync_last;
+	size_t sync_max;
+	sync_list syncs;
+	int cursor;
+
+	/* search two revolutions, wrapping around the view */
+	tracklen = view->length;
+	pos = 0;
+	buffer_end = (2 * tracklen > 10) ? 2 * tracklen - 10 : 0;
 	*p_sectorlen = 0;
+	scan_sync_runs_view(&syncs, view, buffer_end);
+	cursor = 0;
 
-	if (!find_sync(&pos, buffer_end))
+	if (!find_sync_offset(&syncs, &pos, &cursor))
 		return NULL;
 
 	sync_last = pos;
@@ -744,7 +1725,7 @@ find_sector_gap(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen)
 	/* try to find biggest (sector) gap */
 	while (pos < buffer_end)
 	{
-		if (!find_header(&pos, buffer_end))
+		if (!find_header_offset(&syncs, &pos, &cursor))
 			break;
 
 		gap = pos - sync_last;
@@ -765,31 +1746,35 @@ find_sector_gap(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen)
 	do
 	{
 		pos -= 1;
-		if (pos == work_buffer)
+		if (pos == 0)
 			pos += tracklen;
 
-	} while (*pos == 0xff);
+	} while (VIEW_BYTE(view, pos) == 0xff);
 
 	/* move to first sync GCR byte */
 	pos += 1;
-	while (pos >= work_buffer + tracklen)
+	while (pos >= tracklen)
 		pos -= tracklen;
 
-	if(*(pos-1)&1)
-		return pos - 1;  // go to  last byte that contains first few bits of sync
+	prev = (pos == 0) ? tracklen - 1 : pos - 1;
+	if(view->data[prev]&1)
+		return view->data + prev;  // go to  last byte that contains first few bits of sync
 	else
-		return pos; // return at first full byte of sync
+		return view->data + pos; // return at first full byte of sync
 }
 
 /* checks if there is any reasonable section of formatted (GCR) data */
 int check_formatted(BYTE *gcrdata, size_t length)
 {
 	size_t i, run = 0;
+	BYTE badmap[BAD_GCR_MAP_SIZE(NIB_TRACK_LENGTH * 2)];
+
+	bad_gcr_map(gcrdata, length, badmap);
 
 	/* try to find longest good gcr run */
 	for (i = 0; i < length; i++)
 	{
-		if (is_bad_gcr(gcrdata, length, i))
+		if (BAD_GCR_AT(badmap, i))
 			run = 0;
 		else
 			run++;
@@ -809,30 +1794,19 @@ int check_formatted(BYTE *gcrdata, size_t length)
    [Return] length of copied track fragment
 */
 size_t
-extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_t cap_min, size_t cap_max)
+extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_t cap_min, size_t cap_max, align_state *state, nib_options *opt)
 {
-	BYTE work_buffer[NIB_TRACK_LENGTH*2];	/* working buffer */
+	BYTE bit_buffer[NIB_TRACK_LENGTH];	/* revolution found by bit-level search */
 	BYTE *cycle_start;	/* start position of cycle */
 	BYTE *cycle_stop;	/* stop position of cycle  */
-	BYTE *sector0_pos;	/* position of sector 0 */
-	BYTE *sectorgap_pos;/* position of sector gap */
-	BYTE *longsync_pos;	/* position of longest sync run */
-	BYTE *badgap_pos;	/* position of bad gcr bit run */
-	BYTE *marker_pos;	/* generic marker used by protection handlers */
+	track_view view;	/* the cycle, seen as a circular track */
 	size_t track_len;
-	size_t sector0_len;	/* length of gap before sector 0 */
-	size_t sectorgap_len;	/* length of longest gap */
+	size_t cycle_bits;	/* revolution length in bits */
 	BYTE fake_density = 0;
-	int i ,j;
-
-	sector0_pos = NULL;
-	sectorgap_pos = NULL;
-	longsync_pos = NULL;
-	badgap_pos = NULL;
-	marker_pos = NULL;
+	int i;
 
 	/* ignore minumum capacity by RPM/density */
-	if(!cap_min_ignore)
+	if(!opt->cap_min_ignore)
 	{
 		cap_min -= CAP_ALLOWANCE;
 		cap_max += CAP_ALLOWANCE;
@@ -845,25 +1819,23 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 	/* if this track is all sync, return */
 	if(check_sync_flags(source, fake_density, NIB_TRACK_LENGTH) & BM_FF_TRACK)
 	{
-		if(verbose) printf("KILLER! ");
+		if((verbose) && (!state->quiet)) printf("KILLER! ");
 		memcpy(destination, source, NIB_TRACK_LENGTH);
 		return NIB_TRACK_LENGTH;
 	}
 
 	cycle_start = source;
-	memset(work_buffer, 0, sizeof(work_buffer));
-	memcpy(work_buffer, cycle_start, NIB_TRACK_LENGTH);
 
 	/* find cycle */
 	if(verbose>1) printf("H");
-	find_track_cycle_headers(&cycle_start, &cycle_stop, cap_min, cap_max);
+	find_track_cycle_headers(&cycle_start, &cycle_stop, cap_min, cap_max, opt);
 	track_len = cycle_stop - cycle_start;
 
 	/* second pass to find a cycle in track w/non-standard headers */
 	if ((track_len > cap_max) || (track_len < cap_min))
 	{
 		if(verbose>1) printf("/S");
-		find_track_cycle_syncs(&cycle_start, &cycle_stop, cap_min, cap_max);
+		find_track_cycle_syncs(&cycle_start, &cycle_stop, cap_min, cap_max, opt);
 		track_len = cycle_stop - cycle_start;
 	}
 
@@ -871,11 +1843,25 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 	if ((track_len > cap_max) || (track_len < cap_min))
 	{
 		if(verbose>1) printf("/R");
-		find_track_cycle_raw(&cycle_start, &cycle_stop, cap_min, cap_max);
+		find_track_cycle_raw(&cycle_start, &cycle_stop, cap_min, cap_max, source + NIB_TRACK_LENGTH - cycle_start, opt);
 		track_len = cycle_stop - cycle_start;
 	}
 
-	if (track_len <= cap_min)
+	/* fourth pass for revolutions that are not a whole number of bytes */
+	if ((track_len > cap_max) || (track_len < cap_min))
+	{
+		if(verbose>1) printf("/B");
+		cycle_bits = find_track_cycle_bits(source, NIB_TRACK_LENGTH, cap_min, cap_max, bit_buffer);
+		if (cycle_bits)
+		{
+			if(verbose>2) printf("[%d bits] ", (int)cycle_bits);
+			cycle_start = bit_buffer;
+			track_len = (cycle_bits + 7) / 8;
+		}
+	}
+
+	/* bit_buffer only holds the revolution found, there is nothing to pad it with */
+	if ((track_len <= cap_min) && (cycle_start != bit_buffer))
 	{
 		if(verbose>1) printf("/+");
 		track_len += (cap_max-cap_min)/2;
@@ -889,92 +1875,130 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 			printf("[SHORT, min=%d>%d] ", cap_min, track_len);
 
 		printf("{cycle:");
-		for(i=0;i<gap_match_length;i++)
+		for(i=0;i<opt->gap_match_length;i++)
 			printf("%.2x",cycle_start[i]);
 		printf("}");
 	}
 
-	/* copy twice the data to work buffer */
-	memcpy(work_buffer, cycle_start, track_len);
-	memcpy(work_buffer + track_len, cycle_start, track_len);
+	view.data = cycle_start;
+	view.length = track_len;
+	return align_GCR_track(destination, &view, align, track, state, opt);
+}
+
+/*
+   Align one track revolution, given as a circular view, to sector gap,
+   sector 0 or a protection marker and copy it rotated to destination.
+   [Return] length of copied track
+*/
+size_t
+align_GCR_track(BYTE *destination, track_view *view, BYTE *align, int track, align_state *state, nib_options *opt)
+{
+	BYTE shift_buffer[NIB_TRACK_LENGTH];	/* private copy for bit shifting handlers */
+	track_view shifted;
+	BYTE *sector0_pos;	/* position of sector 0 */
+	BYTE *sectorgap_pos;/* position of sector gap */
+	BYTE *marker_pos;	/* generic marker used by protection handlers */
+	size_t track_len;
+	size_t sector0_len;	/* length of gap before sector 0 */
+	size_t sectorgap_len;	/* length of longest gap */
+	BYTE method;	/* forced alignment, may fall back below */
+	int i ,j;
+
+	sector0_pos = NULL;
+	sectorgap_pos = NULL;
+	marker_pos = NULL;
+	track_len = view->length;
+	method = opt->align_map[track];
+	state->rapidlok = 0;
+	state->rl_version = 0;
+	state->report[0] = '\0';
 
 	/* print sector0 offset from beginning of data (for index hole check) */
 	if(verbose>1)
 	{
-		sector0_pos = find_sector0(work_buffer, track_len, &sector0_len);
-		printf("{sec0=%.4d;len=%d} ",(int)(sector0_pos - work_buffer), sector0_len);
+		sector0_pos = find_sector0(view, &sector0_len);
+		printf("{sec0=%.4d;len=%d} ",(int)(sector0_pos - view->data), sector0_len);
 	}
 
 	/* forced track alignments */
-	if (align_map[track] != ALIGN_NONE)
+	if (method != ALIGN_NONE)
 	{
-		if (align_map[track] == ALIGN_VMAX_CW)
+		if (method == ALIGN_VMAX_CW)
 		{
 			*align = ALIGN_VMAX_CW;
-			marker_pos = align_vmax_cw(work_buffer, track_len);
+			marker_pos = align_vmax_cw(view);
 
 			if(!marker_pos)
-				align_map[track] = ALIGN_VMAX;
+				method = ALIGN_VMAX;
 		}
 
-		if (align_map[track] == ALIGN_VMAX)
+		if (method == ALIGN_VMAX)
 		{
 			*align = ALIGN_VMAX;
-			marker_pos = align_vmax_new(work_buffer, track_len);
+			marker_pos = align_vmax_new(view);
 		}
 
-		if (align_map[track] == ALIGN_PSLAYER)
+		if (method == ALIGN_PSLAYER)
 		{
 			*align = ALIGN_PSLAYER;
-			marker_pos = align_pirateslayer(work_buffer, track_len);
-		}
+			/* the handler shifts the data, keep the source untouched */
+			memcpy(shift_buffer, view->data, track_len);
+			shifted.data = shift_buffer;
+			shifted.length = track_len;
+			marker_pos = align_pirateslayer(&shifted, state);
+			if (marker_pos)
+			{
+				view_copy(&shifted, marker_pos - shift_buffer, destination, track_len);
+				goto aligned;
+			}
+		}
 
-		if (align_map[track] == ALIGN_RAPIDLOK)
+		if (method == ALIGN_RAPIDLOK)
 		{
 			*align = ALIGN_RAPIDLOK;
-			marker_pos = align_rl_special(work_buffer, track_len);
+			marker_pos = align_rl_special(view, state);
 		}
 
-		if (align_map[track] == ALIGN_AUTOGAP)
+		if (method == ALIGN_AUTOGAP)
 		{
 			*align = ALIGN_AUTOGAP;
-			marker_pos = auto_gap(work_buffer, track_len);
+			marker_pos = auto_gap(view);
 		}
 
-		if (align_map[track] == ALIGN_LONGSYNC)
+		if (method == ALIGN_LONGSYNC)
 		{
 			*align = ALIGN_LONGSYNC;
-			marker_pos = find_long_sync(work_buffer, track_len);
+			marker_pos = find_long_sync(view);
 		}
 
-		if (align_map[track] == ALIGN_BADGCR)
+		if (method == ALIGN_BADGCR)
 		{
 			*align = ALIGN_BADGCR;
-			marker_pos = find_bad_gap(work_buffer, track_len);
+			marker_pos = find_bad_gap(view);
 		}
 
-		if (align_map[track] == ALIGN_GAP)
+		if (method == ALIGN_GAP)
 		{
 			*align = ALIGN_GAP;
-			marker_pos = find_sector_gap(work_buffer, track_len, &sectorgap_len);
+			marker_pos = find_sector_gap(view, &sectorgap_len);
 		}
 
-		if (align_map[track] == ALIGN_SEC0)
+		if (method == ALIGN_SEC0)
 		{
 			*align = ALIGN_SEC0;
-			marker_pos = find_sector0(work_buffer, track_len, &sector0_len);
+			marker_pos = find_sector0(view, &sector0_len);
 		}
 
-		if (align_map[track] == ALIGN_RAW)
+		if (method == ALIGN_RAW)
 		{
 			*align = ALIGN_RAW;
-			marker_pos = work_buffer;
+			marker_pos = view->data;
 		}
 
 		/* we found a protection track */
 		if (marker_pos)
 		{
-			memcpy(destination, marker_pos, track_len);
+			view_copy(view, marker_pos - view->data, destination, track_len);
 			goto aligned;
 		}
 	}
@@ -983,7 +2007,7 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 	//if (track_len == NIB_TRACK_LENGTH)
 	//{
 		/* if there is sync, align to the longest one */
-		//marker_pos = find_long_sync(work_buffer, track_len);
+		//marker_pos = find_long_sync(view);
 		//if (marker_pos)
 		//{
 		//	memcpy(destination, marker_pos, track_len);
@@ -992,7 +2016,7 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 		//}
 
 		/* we aren't dealing with a normal track here, so autogap it */
-		//marker_pos = auto_gap(work_buffer, track_len);
+		//marker_pos = auto_gap(view);
 		//if (marker_pos)
 		//{
 		//	memcpy(destination, marker_pos, track_len);
@@ -1002,13 +2026,13 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 	//}
 
 	/* try to guess original alignment on "normal" sized tracks */
-	sector0_pos = find_sector0(work_buffer, track_len, &sector0_len);
-	sectorgap_pos = find_sector_gap(work_buffer, track_len, &sectorgap_len);
+	sector0_pos = find_sector0(view, &sector0_len);
+	sectorgap_pos = find_sector_gap(view, &sectorgap_len);
 
 	if(verbose>1)
-		printf("{gap=%.4d;len=%d) ", (int)(sectorgap_pos-work_buffer), (int)sectorgap_len);
+		printf("{gap=%.4d;len=%d) ", (int)(sectorgap_pos - view->data), (int)sectorgap_len);
 
-	if((sectorgap_pos-work_buffer == sector0_pos-work_buffer) &&
+	if((sectorgap_pos == sector0_pos) &&
 		(sectorgap_pos != NULL) &&	(sector0_pos != NULL) && (verbose>1))
 		printf("(sec0=gap) ");
 
@@ -1016,7 +2040,7 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 	if (sectorgap_len > GCR_BLOCK_DATA_LEN + SIGNIFICANT_GAPLEN_DIFF)
 	{
 		*align = ALIGN_GAP;
-		memcpy(destination, sectorgap_pos, track_len);
+		view_copy(view, sectorgap_pos - view->data, destination, track_len);
 		goto aligned;
 	}
 
@@ -1024,20 +2048,20 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 	if (sector0_len != 0)
 	{
 		*align = ALIGN_SEC0;
-		memcpy(destination, sector0_pos, track_len);
+		view_copy(view, sector0_pos - view->data, destination, track_len);
 		goto aligned;
 	}
 
 	/* no sector 0 found, use gap anyway */
 	if (sectorgap_len)
 	{
-		memcpy(destination, sectorgap_pos, track_len);
+		view_copy(view, sectorgap_pos - view->data, destination, track_len);
 		*align = ALIGN_GAP;
 		goto aligned;
 	}
 
 	/* if there is sync, align to the longest one */
-	//marker_pos = find_long_sync(work_buffer, track_len);
+	//marker_pos = find_long_sync(view);
 	//if (marker_pos)
 	//{
 	//	memcpy(destination, marker_pos, track_len);
@@ -1046,16 +2070,16 @@ extract_GCR_track(BYTE *destination, BYTE *source, BYTE *align, int track, size_
 	//}
 
 	/* we aren't dealing with a normal track here, so autogap it */
-	marker_pos = auto_gap(work_buffer, track_len);
+	marker_pos = auto_gap(view);
 	if (marker_pos)
 	{
-		memcpy(destination, marker_pos, track_len);
+		view_copy(view, marker_pos - view->data, destination, track_len);
 		*align = ALIGN_AUTOGAP;
 		goto aligned;
 	}
 
 	/* we give up, just return everything */
-	memcpy(destination, work_buffer, track_len);
+	view_copy(view, 0, destination, track_len);
 	*align = ALIGN_NONE;
 	goto aligned;
 
@@ -1064,7 +2088,7 @@ aligned:
 	if(verbose>1)
 	{
 		if(verbose>1) printf("{align:");
-		while((i<gap_match_length) && (i<(int)track_len))
+		while((i<opt->gap_match_length) && (i<(int)track_len))
 		{
 			if(destination[j] != 0xff)
 			{
@@ -1078,43 +2102,85 @@ aligned:
 	return track_len;
 }
 
+/* add one 0xff byte to every sync mark, see lengthen_sync_by() */
 size_t
 lengthen_sync(BYTE *buffer, size_t length, size_t length_max)
 {
-        size_t added;
-        BYTE *source, *newp, *end;
-        BYTE newbuf[NIB_TRACK_LENGTH];
+	return lengthen_sync_by(buffer, length, length_max, 1, NULL);
+}
 
-        added = 0;
-        end = buffer + length - 1;
-        source = buffer;
-        newp = newbuf;
+/*
+	Add count 0xff bytes to the end of every sync mark, moving the track
+	in place only once. If the track would grow past length_max, every
+	sync gets as many whole rounds as fit and the first syncs on the
+	track share what is left. A sync running into the end of the buffer
+	continues at the start, the track is a loop.
+*/
+size_t
+lengthen_sync_by(BYTE *buffer, size_t length, size_t length_max, int count, sync_lengthen *result)
+{
+	size_t i, out, sync, extra, run, first, newlen;
+	sync_lengthen stats;
 
-        if (length >= length_max)
-                return 0;
+	memset(&stats, 0, sizeof(stats));
 
-        /* wrap alignment */
-        //if( ((*(end-1) & 0x01) == 0x01) && (*source == 0xff) && (*(source+1) != 0xff) )
-        //{
-        //        *(newp++) = 0xff;
-        //        added++;
-        //}
-        //*(newp++) = *(source++);
+	if (length_max > NIB_TRACK_LENGTH)
+		length_max = NIB_TRACK_LENGTH;
+
+	if ((!length) || (count < 1) || (length >= length_max))
+		goto done;
+
+	for (i = 0; i < length; i++)
+		if ((buffer[i] == 0xff) && (buffer[(i + 1) % length] != 0xff))
+			stats.syncs++;
+
+	if (!stats.syncs)
+		goto done;
+
+	stats.rounds = count;
+	if ((size_t)count * stats.syncs > length_max - length)
+	{
+		stats.rounds = (int)((length_max - length) / stats.syncs);
+		stats.partial = (length_max - length) % stats.syncs;
+	}
+	stats.added = (size_t)stats.rounds * stats.syncs + stats.partial;
+	newlen = length + stats.added;
 
-        do
-        {
-				//if(((*(source-1)&0x01)==0x01)&&(*source==0xff)&&(*(source+1)!= 0xff)&&(length+added<=length_max))
-                if((*source==0xff)&&(*(source+1)!= 0xff))
-                {
-                        *(newp++) = 0xff;
-                        added++;
-                }
-                *(newp++) = *(source++);
+	/* work from the back, nothing is overwritten before it is read */
+	out = newlen;
+	sync = stats.syncs;
+	for (i = length; i-- > 0; )
+	{
+		if ((buffer[i] == 0xff) && (buffer[(i + 1) % length] != 0xff))
+		{
+			sync--;
+			extra = stats.rounds + (sync < stats.partial);
+			out -= extra;
+			memset(buffer + out, 0xff, extra);
+		}
+		buffer[--out] = buffer[i];
+	}
 
-        } while (source <= end);
+	/* measure the new syncs, starting just after one ends */
+	for (i = 0; !((buffer[i] == 0xff) && (buffer[(i + 1) % newlen] != 0xff)); i++);
+	first = i + 1;
+	stats.shortest = newlen;
+	for (i = run = 0; i <= newlen; i++)
+	{
+		if ((i < newlen) && (buffer[(first + i) % newlen] == 0xff))
+			run++;
+		else if (run)
+		{
+			if (run < stats.shortest) stats.shortest = run;
+			if (run > stats.longest) stats.longest = run;
+			run = 0;
+		}
+	}
 
-        memcpy(buffer, newbuf, length+added);
-        return added;
+done:
+	if (result)
+		*result = stats;
+	return stats.added;
 }
 
 
@@ -1203,24 +2269,94 @@ strip_runs(BYTE * buffer, size_t length, size_t length_max, size_t minrun, BYTE
 	return skipped;
 }
 
-/* try to shorten inert data until length <= length_max */
+/*
+	Shorten runs of target in one pass, with the same result as calling
+	strip_runs() until length <= length_max. Every full strip_runs() pass
+	takes one byte from each run still longer than minrun. The last pass
+	stops once the track is one byte under length_max, so only the first
+	runs still eligible give up another byte. Counting runs by how far
+	they exceed minrun is enough to replay this.
+*/
 size_t
 reduce_runs(BYTE * buffer, size_t length, size_t length_max, size_t minrun, BYTE target)
 {
 	/* minrun is number of bytes to leave behind */
-	size_t skipped;
+	size_t *runs_over;
+	size_t i, end, out, over, cut, eligible, passes, partial, pass, newlen;
 
-	do
+	if (length <= length_max)
+		return (length);
+
+	/* runs_over[n] is the number of runs exactly n bytes longer than minrun */
+	if (!(runs_over = calloc(length + 1, sizeof(size_t))))
+	{
+		printf("Error allocating memory for run reduction\n");
+		return (length);
+	}
+
+	eligible = 0;
+	for (i = 0; i < length; i = end)
+	{
+		for (end = i; (end < length) && (buffer[end] == target); end++);
+		if (end == i)
+			end++;
+		else if (end - i > minrun)
+		{
+			runs_over[end - i - minrun]++;
+			eligible++;
+		}
+	}
+
+	/* replay the strip_runs() passes on the counts only */
+	newlen = length;
+	passes = 0;
+	partial = 0;
+	for (pass = 1; eligible > 0; pass++)
+	{
+		if (eligible > newlen - length_max + 1)
+		{
+			partial = newlen - length_max + 1;
+			newlen -= partial;
+			break;
+		}
+
+		newlen -= eligible;
+		passes++;
+		if (newlen <= length_max)
+			break;
+
+		eligible -= runs_over[pass];
+	}
+	free(runs_over);
+
+	/* then cut every run down in a single compacting pass */
+	for (i = out = 0; i < length; i = end)
 	{
-		if (length <= length_max)
-			return (length);
+		for (end = i; (end < length) && (buffer[end] == target); end++);
+		if (end == i)
+		{
+			buffer[out++] = buffer[i];
+			end++;
+			continue;
+		}
+
+		cut = 0;
+		if (end - i > minrun)
+		{
+			over = end - i - minrun;
+			cut = (over < passes) ? over : passes;
+			if ((over > passes) && partial)
+			{
+				cut++;
+				partial--;
+			}
+		}
 
-		skipped = strip_runs(buffer, length, length_max, minrun, target);
-		length -= skipped;
+		memset(buffer + out, target, end - i - cut);
+		out += end - i - cut;
 	}
-	while (skipped > 0 && length > length_max);
 
-	return (length);
+	return (out);
 }
 
 size_t
@@ -1232,6 +2368,9 @@ strip_gaps(BYTE * buffer, size_t length)
 	skipped = 0;
 	end = buffer + length;
 
+	if (length < 2)
+		return 0;
+
 	/* this is crude, I know */
 	/* this will find a sync that is of sufficient length and strip the byte before it */
 	/* this can damage real data if done too much and will damage signatures before a sync */
@@ -1242,26 +2381,103 @@ strip_gaps(BYTE * buffer, size_t length)
 		else
 			*buffer++ = *source;
 	}
+
+	/* the last two bytes can't precede a sync, keep them */
+	*buffer++ = *source++;
+	*buffer++ = *source++;
 	return skipped;
 }
 
-/* try to shorten tail gaps until length <= length_max */
+/*
+	Shorten tail gaps in one pass, with the same result as calling
+	strip_gaps() until length <= length_max. Each strip_gaps() pass eats
+	one more non-sync byte in front of every sync of two or more bytes,
+	until it reaches the previous such sync. Single 0xff bytes on the way
+	just join the sync. So counting the non-sync bytes between long syncs
+	is enough to know how many passes are needed.
+*/
 size_t
 reduce_gaps(BYTE * buffer, size_t length, size_t length_max)
 {
-	size_t skipped;
+	size_t *gaps_of;
+	size_t i, end, gap, sync, out, eat, eligible, passes, newlen;
 
-	do
+	if (length <= length_max)
+		return (length);
+
+	/* gaps_of[n] is the number of long syncs with n non-sync bytes before them */
+	if (!(gaps_of = calloc(length + 1, sizeof(size_t))))
 	{
-		if (length <= length_max)
-			return (length);
+		printf("Error allocating memory for gap reduction\n");
+		return (length);
+	}
+
+	eligible = 0;
+	for (i = gap = 0; i < length; i = end)
+	{
+		for (end = i; (end < length) && (buffer[end] == 0xff); end++);
+		if (end == i)
+		{
+			gap++;
+			end++;
+		}
+		else if (end - i >= 2)
+		{
+			if (gap)
+			{
+				gaps_of[gap]++;
+				eligible++;
+			}
+			gap = 0;
+		}
+	}
+
+	/* replay the strip_gaps() passes on the counts only */
+	newlen = length;
+	passes = 0;
+	while (eligible > 0)
+	{
+		newlen -= eligible;
+		passes++;
+		if (newlen <= length_max)
+			break;
+
+		eligible -= gaps_of[passes];
+	}
+	free(gaps_of);
 
-		skipped = strip_gaps(buffer, length);
-		length -= skipped;
+	/* then drop the last 'passes' non-sync bytes before each long sync */
+	for (i = out = 0; i < length; i = end)
+	{
+		/* find the next sync of two or more bytes */
+		for (sync = i, gap = 0; sync < length; sync = end)
+		{
+			for (end = sync; (end < length) && (buffer[end] == 0xff); end++);
+			if (end - sync >= 2)
+				break;
+			if (end == sync)
+			{
+				gap++;
+				end++;
+			}
+		}
+
+		eat = (sync < length) ? ((gap < passes) ? gap : passes) : 0;
+		for (; i < sync; i++)
+		{
+			if (buffer[i] != 0xff)
+			{
+				if (gap-- <= eat)
+					continue;
+			}
+			buffer[out++] = buffer[i];
+		}
+
+		for (; i < end; i++)
+			buffer[out++] = buffer[i];
 	}
-	while (skipped > 0 && length > length_max);
 
-	return (length);
+	return (out);
 }
 
 /*
@@ -1297,43 +2513,282 @@ check_sync_flags(BYTE *gcrdata, int density, size_t length)
 	return ((BYTE)(density & 0xff));
 }
 
+/* eight identical bytes without sync, presync or weak GCR are plain matches */
+static int
+clean_word_match(BYTE *p1, BYTE *p2, BYTE *map1, size_t pos1, BYTE *map2, size_t pos2)
+{
+	unsigned long long w1, w2;
+	unsigned int bits1, bits2;
+
+	memcpy(&w1, p1, 8);
+	memcpy(&w2, p2, 8);
+	if (w1 != w2)
+		return 0;
+
+	w1 = ~w1;
+	if ((w1 - 0x0101010101010101ULL) & ~w1 & 0x8080808080808080ULL)
+		return 0;
+
+	if ((p1[8] == 0xff) || (p2[8] == 0xff))
+		return 0;
+
+	bits1 = map1[pos1 >> 3];
+	if (pos1 & 7)
+		bits1 |= map1[(pos1 >> 3) + 1] << 8;
+	bits2 = map2[pos2 >> 3];
+	if (pos2 & 7)
+		bits2 |= map2[(pos2 >> 3) + 1] << 8;
+
+	return !(((bits1 >> (pos1 & 7)) | (bits2 >> (pos2 & 7))) & 0xff);
+}
+
+/*
+	Banded alignment of two tracks. Unlike the greedy walk it resyncs after
+	a dropped or inserted byte, which costs one gap difference. Sync, presync
+	and weak GCR bytes are skipped for free and 0x55/0xaa pairs align as
+	bitshifts. Stops early once every remaining path costs more than max_diff.
+	Only two rows of the band are kept, each cell carries the counts of its
+	best path, so memory does not grow with the track length.
+	Returns 0 if the tracks are too different in length for the band.
+*/
+#define COMPARE_INF 0x7fffffff
+
+typedef struct
+{
+	int cost;
+	int byte_match, byte_diff, sync_diff, shift_diff, presync_diff, gap_diff, badgcr_diff;
+} compare_cell;
+
+static BYTE
+skip_class(BYTE *track, size_t length, BYTE *badmap, size_t pos)
+{
+	if (track[pos] == 0xff)
+		return 1;
+	if ((pos + 1 < length) && (track[pos + 1] == 0xff))
+		return 2;
+	if (BAD_GCR_AT(badmap, pos))
+		return 3;
+	return 0;
+}
+
+int
+compare_tracks_banded(BYTE *track1, BYTE *track2, size_t length1, size_t length2, size_t max_diff, track_compare *result)
+{
+	BYTE badmap1[BAD_GCR_MAP_SIZE(NIB_TRACK_LENGTH)];
+	BYTE badmap2[BAD_GCR_MAP_SIZE(NIB_TRACK_LENGTH)];
+	BYTE skip1[NIB_TRACK_LENGTH], skip2[NIB_TRACK_LENGTH];
+	BYTE a, b;
+	compare_cell *cells, *row, *prev, *tmp, *from, *cell, best;
+	int cost, c, row_min;
+	size_t band, width, i, j, w, end_i, end_j;
+
+	memset(result, 0, sizeof(track_compare));
+
+	if (!length1 || !length2)
+	{
+		result->match = 1;
+		return 1;
+	}
+
+	if ((length1 > NIB_TRACK_LENGTH) || (length2 > NIB_TRACK_LENGTH))
+		return 0;
+
+	band = COMPARE_BAND + ((length1 > length2) ? length1 - length2 : length2 - length1);
+	if (band > COMPARE_BAND_MAX)
+		return 0;
+	width = 2 * band + 1;
+
+	if (!(cells = malloc(2 * width * sizeof(compare_cell))))
+		return 0;
+	row = cells;
+	prev = cells + width;
+
+	bad_gcr_map(track1, length1, badmap1);
+	bad_gcr_map(track2, length2, badmap2);
+	for (i = 0; i < length1; i++)
+		skip1[i] = skip_class(track1, length1, badmap1, i);
+	for (j = 0; j < length2; j++)
+		skip2[j] = skip_class(track2, length2, badmap2, j);
+
+	/* cell w of row i is track1[0..i) aligned with track2[0..i+w-band) */
+	memset(&best, 0, sizeof(best));
+	best.cost = COMPARE_INF;
+	end_i = end_j = 0;
+	for (i = 0; i <= length1; i++)
+	{
+		row_min = COMPARE_INF;
+		for (w = 0; w < width; w++)
+		{
+			cell = &row[w];
+			cell->cost = COMPARE_INF;
+			if ((i + w < band) || (i + w - band > length2))
+				continue;
+			j = i + w - band;
+
+			from = NULL;
+			cost = (!i && !j) ? 0 : COMPARE_INF;
+
+			if (i && j && (prev[w].cost < COMPARE_INF))
+			{
+				a = track1[i - 1];
+				b = track2[j - 1];
+				c = prev[w].cost + ((a == b) || ((a == 0x55) && (b == 0xaa)) || ((a == 0xaa) && (b == 0x55)) ? 0 : 1);
+				if (c < cost)
+				{
+					cost = c;
+					from = &prev[w];
+				}
+			}
+
+			if (i && (w + 1 < width) && (prev[w + 1].cost < COMPARE_INF))
+			{
+				c = prev[w + 1].cost + (skip1[i - 1] ? 0 : 1);
+				if (c < cost)
+				{
+					cost = c;
+					from = &prev[w + 1];
+				}
+			}
+
+			if (j && w && (row[w - 1].cost < COMPARE_INF))
+			{
+				c = row[w - 1].cost + (skip2[j - 1] ? 0 : 1);
+				if (c < cost)
+				{
+					cost = c;
+					from = &row[w - 1];
+				}
+			}
+
+			/* classify the step taken into this cell */
+			if (from)
+				*cell = *from;
+			else
+				memset(cell, 0, sizeof(compare_cell));
+			cell->cost = cost;
+
+			if (from == &prev[w])
+			{
+				a = track1[i - 1];
+				b = track2[j - 1];
+				if (a == b)
+				{
+					if (a != 0xff)
+						cell->byte_match++;
+				}
+				else if (((a == 0x55) && (b == 0xaa)) || ((a == 0xaa) && (b == 0x55)))
+					cell->shift_diff++;
+				else
+					cell->byte_diff++;
+			}
+			else if (from == &prev[w + 1])
+			{
+				switch (skip1[i - 1])
+				{
+					case 1: cell->sync_diff++; break;
+					case 2: cell->presync_diff++; break;
+					case 3: cell->badgcr_diff++; break;
+					default: cell->gap_diff++; break;
+				}
+			}
+			else if ((from) && (!skip2[j - 1]))
+				cell->gap_diff++;
+
+			if (cost < row_min)
+				row_min = cost;
+
+			/* either track may end first */
+			if (((i == length1) || (j == length2)) && (cost <= best.cost))
+			{
+				if ((cost < best.cost) || (i + j > end_i + end_j))
+				{
+					best = *cell;
+					end_i = i;
+					end_j = j;
+				}
+			}
+		}
+
+		if (row_min > best.cost)
+			row_min = best.cost;
+		if ((size_t)row_min > max_diff)
+		{
+			result->byte_diff = max_diff + 1;
+			result->truncated = 1;
+			free(cells);
+			return 1;
+		}
+		if (row_min == COMPARE_INF)
+			break;
+
+		tmp = prev;
+		prev = row;
+		row = tmp;
+	}
+
+	result->byte_match = best.byte_match;
+	result->byte_diff = best.byte_diff;
+	result->sync_diff = best.sync_diff;
+	result->shift_diff = best.shift_diff;
+	result->presync_diff = best.presync_diff;
+	result->gap_diff = best.gap_diff;
+	result->badgcr_diff = best.badgcr_diff;
+
+	if ((end_i < length1 - 1) || (end_j < length2 - 1))
+		result->size_diff++;
+
+	if (((result->sync_diff < 0x100) && (result->badgcr_diff < 0x100)) || !best.cost)
+		result->match = 1;
+
+	free(cells);
+	return 1;
+}
+
+/*
+	Both walks return the bytes that could not be matched, byte_diff plus
+	gap_diff. The greedy walk never resyncs, so its gap_diff stays 0.
+*/
 size_t
-compare_tracks(BYTE *track1, BYTE *track2, size_t length1, size_t length2, int same_disk, char *outputstring)
-{
-	size_t match, byte_match, j, k;
-	size_t sync_diff, shift_diff, presync_diff, gap_diff, badgcr_diff, size_diff, byte_diff;
-	size_t offset;
-	char tmpstr[256];
-
-	byte_match = 0;
-	byte_diff = 0;
-	sync_diff = 0;
-	shift_diff = 0;
-	presync_diff = 0;
-	gap_diff = 0;
-	badgcr_diff = 0;
-	size_diff= 0;
-	offset = 0;
-	outputstring[0] = '\0';
+compare_tracks_stats(BYTE *track1, BYTE *track2, size_t length1, size_t length2, int same_disk, size_t max_diff, track_compare *result, nib_options *opt)
+{
+	size_t j, k;
+	BYTE badmap1[BAD_GCR_MAP_SIZE(NIB_TRACK_LENGTH * 2)];
+	BYTE badmap2[BAD_GCR_MAP_SIZE(NIB_TRACK_LENGTH * 2)];
+
+	if (opt->compare_banded && compare_tracks_banded(track1, track2, length1, length2, max_diff, result))
+		return result->byte_diff + result->gap_diff;
+
+	memset(result, 0, sizeof(track_compare));
 
 	if (length1 > 0 && length2 > 0)
 	{
+		bad_gcr_map(track1, length1, badmap1);
+		bad_gcr_map(track2, length2, badmap2);
+
 		for (j = k = 0; (j < length2) && (k < length1); j++, k++)
 		{
+			/* identical plain data is taken a word at a time */
+			while ((track1[j] == track2[k]) && (j + 8 < length1) && (j + 8 < length2) &&
+				(k + 8 < length1) && (k + 8 < length2) && clean_word_match(track1 + j, track2 + k, badmap1, j, badmap2, k))
+			{
+				result->byte_match += 8;
+				j += 8;
+				k += 8;
+			}
+
 			/* we ignore sync length differences */
 			if ((track1[j] == 0xff) && (track2[k] == 0xff) )
 				continue;
 
 			if (track1[j] == 0xff)
 			{
-				sync_diff++;
+				result->sync_diff++;
 				k--;
 				continue;
 			}
 
 			if (track2[k] == 0xff)
 			{
-				//sync_diff++;
 				j--;
 				continue;
 			}
@@ -1341,14 +2796,13 @@ compare_tracks(BYTE *track1, BYTE *track2, size_t length1, size_t length2, int s
 			/* we ignore pre-sync differences */
 			if ( (track1[j] != 0xff) && (track1[j+1] == 0xff) )
 			{
-				presync_diff++;
+				result->presync_diff++;
 				k--;
 				continue;
 			}
 
 			if ( (track2[k] != 0xff)  && (track2[k+1] == 0xff) )
 			{
-				//presync_diff++;
 				j--;
 				continue;
 			}
@@ -1356,27 +2810,26 @@ compare_tracks(BYTE *track1, BYTE *track2, size_t length1, size_t length2, int s
 			/* we ignore inert bitshift differences */
 			if ( ((track1[j] == 0x55) && (track2[k] == 0xaa)) || ((track1[j] == 0xaa) && (track2[k] == 0x55)) )
 			{
-				shift_diff++;
+				result->shift_diff++;
 				continue;
 			}
 
-			/* we ignore bad gcr bytes */
-			if (is_bad_gcr(track1, length1, j))
+			/* we ignore bad gcr bytes (j/k may run past the other track's length) */
+			if ((j < length1) ? BAD_GCR_AT(badmap1, j) : is_bad_gcr(track1, length1, j))
 			{
-				badgcr_diff++;
+				result->badgcr_diff++;
 				k--;
 				continue;
 			}
-			if (is_bad_gcr(track2, length2, k))
+			if ((k < length2) ? BAD_GCR_AT(badmap2, k) : is_bad_gcr(track2, length2, k))
 			{
-				//badgcr_diff++;
 				j--;
 				continue;
 			}
 
 			if (track1[j] == track2[k])
 			{
-				byte_match++;
+				result->byte_match++;
 				continue;
 			}
 
@@ -1384,87 +2837,81 @@ compare_tracks(BYTE *track1, BYTE *track2, size_t length1, size_t length2, int s
 			if(verbose>2)
 				printf("(%.4d:%.2x!=%.2x)",(int)j,track1[j],track2[k]);
 
-			byte_diff++;
+			result->byte_diff++;
+
+			/* the caller only needs to know it is above its limit */
+			if (result->byte_diff > max_diff)
+			{
+				result->truncated = 1;
+				return result->byte_diff + result->gap_diff;
+			}
 		}
 
 		if ( (j < length1 - 1) || (k < length2 - 1))
-			size_diff++;
+			result->size_diff++;
 
 		/* we got to the end of one of them OK and not all sync/bad gcr */
-		if ((j >= length1 - 1 || k >= length2 - 1) && (sync_diff < 0x100 && badgcr_diff < 0x100))
-			match = 1;
+		if ((j >= length1 - 1 || k >= length2 - 1) && (result->sync_diff < 0x100 && result->badgcr_diff < 0x100))
+			result->match = 1;
 	}
 
-	if(byte_match)
-	{
-			sprintf(tmpstr, "(match:%d)", byte_match);
-			strcat(outputstring, tmpstr);
-	}
-
-	if(byte_diff)
-	{
-			sprintf(tmpstr, "(diff:%d)", byte_diff);
-			strcat(outputstring, tmpstr);
-	}
-	else
-		match = 1;
-
-	if (sync_diff)
-	{
-		sprintf(tmpstr, "(sync:%d)", sync_diff);
-		strcat(outputstring, tmpstr);
-	}
-
-	if (shift_diff)
-	{
-		sprintf(tmpstr, "(shift:%d)", shift_diff);
-		strcat(outputstring, tmpstr);
-	}
+	if (!result->byte_diff)
+		result->match = 1;
 
-	if (presync_diff)
-	{
-		sprintf(tmpstr, "(presync:%d}", presync_diff);
-		strcat(outputstring, tmpstr);
-	}
+	return result->byte_diff + result->gap_diff;
+}
 
-	if (gap_diff)
-	{
-		sprintf(tmpstr, "(gap:%d)", gap_diff);
-		strcat(outputstring, tmpstr);
-	}
+size_t
+format_track_compare(track_compare *result, char *outputstring)
+{
+	char *p = outputstring;
+
+	if (result->byte_match)
+		p += sprintf(p, "(match:%d)", (int)result->byte_match);
+	if (result->byte_diff)
+		p += sprintf(p, "(diff:%d)", (int)result->byte_diff);
+	if (result->sync_diff)
+		p += sprintf(p, "(sync:%d)", (int)result->sync_diff);
+	if (result->shift_diff)
+		p += sprintf(p, "(shift:%d)", (int)result->shift_diff);
+	if (result->presync_diff)
+		p += sprintf(p, "(presync:%d}", (int)result->presync_diff);
+	if (result->gap_diff)
+		p += sprintf(p, "(gap:%d)", (int)result->gap_diff);
+	if (result->badgcr_diff)
+		p += sprintf(p, "(weak:%d)", (int)result->badgcr_diff);
+	if (result->size_diff)
+		p += sprintf(p, "(size:%d)", (int)result->size_diff);
+
+	*p = '\0';
+	return p - outputstring;
+}
 
-	if (badgcr_diff)
-	{
-		sprintf(tmpstr, "(weak:%d)", badgcr_diff);
-		strcat(outputstring, tmpstr);
-	}
+size_t
+compare_tracks(BYTE *track1, BYTE *track2, size_t length1, size_t length2, int same_disk, char *outputstring, nib_options *opt)
+{
+	track_compare result;
+	size_t diff;
 
-	if (size_diff)
-	{
-		sprintf(tmpstr, "(size:%d)", size_diff);
-		strcat(outputstring, tmpstr);
-	}
+	diff = compare_tracks_stats(track1, track2, length1, length2, same_disk, COMPARE_ALL, &result, opt);
+	format_track_compare(&result, outputstring);
 
 	//return byte_match + sync_diff + presync_diff + shift_diff + gap_diff + badgcr_diff;
-	return byte_diff;
+	return diff;
 }
 
 size_t
-compare_sectors(BYTE * track1, BYTE * track2, size_t length1, size_t length2, BYTE * id1, BYTE * id2, int track, char * outputstring)
+compare_sectors_stats(BYTE * track1, BYTE * track2, size_t length1, size_t length2, BYTE * id1, BYTE * id2, int track, sector_compare * result,
+	track_index * index1, track_index * index2)
 {
-	int sec_match, numsecs;
-	int sector, error1, error2, empty;
-	int i, j, k;
-	BYTE checksum1, checksum2;
+	int sector, i, j, k;
 	BYTE secbuf1[260], secbuf2[260];
-	char tmpstr[256];
-	unsigned int crcresult1, crcresult2;
+	track_index storage1, storage2;
+	sector_compare_entry *entry;
 
-	sec_match = 0;
-	numsecs = 0;
-	checksum1 = 0;
-	checksum2 = 0;
-	outputstring[0] = '\0';
+	result->track = track;
+	result->num_sectors = 0;
+	result->matches = 0;
 
 	crcInit();
 
@@ -1472,108 +2919,128 @@ compare_sectors(BYTE * track1, BYTE * track2, size_t length1, size_t length2, BY
 		 (length1 == NIB_TRACK_LENGTH) || (length2 == NIB_TRACK_LENGTH))
 		return 0;
 
+	/* tracks of a disk image come with their index, see disk_track_index() */
+	if (index1 == NULL) index1 = index_track(&storage1, track1, length1);
+	if (index2 == NULL) index2 = index_track(&storage2, track2, length2);
+
 	/* check for sector matches */
-	for (sector = 0; sector < sector_map[track/2]; sector++)
+	for (sector = 0; sector < sector_map[track/2] && sector < MAX_TRACK_SECTORS; sector++)
 	{
-		numsecs++;
+		entry = &result->sectors[sector];
+		result->num_sectors++;
 
 		memset(secbuf1, 0, sizeof(secbuf1));
 		memset(secbuf2, 0, sizeof(secbuf2));
-		tmpstr[0] = '\0';
 
-		error1 = convert_GCR_sector(track1, track1+length1, secbuf1, track/2, sector, id1);
-		error2 = convert_GCR_sector(track2, track2+length2, secbuf2, track/2, sector, id2);
+		entry->error1 = convert_indexed_sector(index1, secbuf1, track/2, sector, id1);
+		entry->error2 = convert_indexed_sector(index2, secbuf2, track/2, sector, id2);
 
 		/* compare data returned */
-		checksum1 = 0;
-		checksum2 = 0;
-		empty = 0;
+		entry->checksum1 = 0;
+		entry->checksum2 = 0;
 
 		for (i = 1; i <= 256; i++)
 		{
-			checksum1 ^= secbuf1[i];
-			checksum2 ^= secbuf2[i];
-
-			if (secbuf1[i] == 0x01)
-				empty++;
+			entry->checksum1 ^= secbuf1[i];
+			entry->checksum2 ^= secbuf2[i];
 		}
 
-		crcresult1 = crcFast(&secbuf1[1], 256);
-		crcresult2 = crcFast(&secbuf2[1], 256);
+		entry->crc1 = crcFast(&secbuf1[1], 256);
+		entry->crc2 = crcFast(&secbuf2[1], 256);
 
 		/* continue checking */
-		if ((checksum1 == checksum2) && (error1 == error2) && (crcresult1 == crcresult2))
-		{
-			if(error1 == SECTOR_OK)
-			{
-				/*sprintf(tmpstr,"S%d: sector data match\n",sector);*/
-			}
-			else
-			{
-				sprintf(tmpstr,"T%.1fS%d: Non-CBM (%.2x/E%d)(%.2x/E%d)\n",
-					(float)track/2,sector,checksum1,error1,checksum2,error2);
-			}
-			sec_match++;
-		}
-		else
+		entry->match = ((entry->checksum1 == entry->checksum2) && (entry->error1 == entry->error2) && (entry->crc1 == entry->crc2));
+
+		if (entry->match)
+			result->matches++;
+		else if(verbose)
 		{
-			sprintf(tmpstr, "T%.1fS%d Mismatch (%.2x/E%d/CRC:%x) (%.2x/E%d/CRC:%x)\n",
-				(float)track/2, sector, checksum1, error1, crcresult1, checksum2, error2, crcresult2);
+			printf("T%.1fS%d Mismatch (%.2x/E%d/CRC:%x) (%.2x/E%d/CRC:%x)\n",
+				(float)track/2, sector, entry->checksum1, entry->error1, entry->crc1,
+				entry->checksum2, entry->error2, entry->crc2);
+
+			printf("T%.1fS%d converted from GCR:\n", (float)track/2, sector);
 
-			if(verbose)
+			/* this prints out sectir contents, which is not always terminal compatible */
+			for (i=0; i<256; i+=16)
 			{
-				printf(tmpstr, "T%.1fS%d Mismatch (%.2x/E%d/CRC:%x) (%.2x/E%d/CRC:%x)\n",
-					(float)track/2, sector, checksum1, error1, crcresult1, checksum2, error2, crcresult2);
+				printf("($%.2x) 1:", i);
 
-				printf("T%.1fS%d converted from GCR:\n", (float)track/2, sector);
+				for(j=0; j<16; j++)
+					printf("%.2x ", secbuf1[i+j]);
 
-				/* this prints out sectir contents, which is not always terminal compatible */
-				for (i=0; i<256; i+=16)
+				for(j=0; j<16; j++)
 				{
-					printf("($%.2x) 1:", i);
-
-					for(j=0; j<16; j++)
-						printf("%.2x ", secbuf1[i+j]);
-
-					for(j=0; j<16; j++)
-					{
-						if(secbuf1[i+j] >= 32)
-							printf("%c", secbuf1[i+j]);
-						else
-							printf("%c", secbuf1[i+j]+32);
-					}
+					if(secbuf1[i+j] >= 32)
+						printf("%c", secbuf1[i+j]);
+					else
+						printf("%c", secbuf1[i+j]+32);
+				}
 
-					printf("\n($%.2x) 2:", i);
+				printf("\n($%.2x) 2:", i);
 
-					for(k=0; k<16; k++)
-						printf("%.2x ", secbuf2[i+k]);
+				for(k=0; k<16; k++)
+					printf("%.2x ", secbuf2[i+k]);
 
-					for(k=0; k<16; k++)
-					{
-						if(secbuf2[i+k] >= 32)
-							printf("%c", secbuf2[i+k]);
-						else
-							printf("%c", secbuf2[i+k]+32);
-					}
-					printf("\n");
+				for(k=0; k<16; k++)
+				{
+					if(secbuf2[i+k] >= 32)
+						printf("%c", secbuf2[i+k]);
+					else
+						printf("%c", secbuf2[i+k]+32);
 				}
+				printf("\n");
+			}
 
-				if(verbose>1)
+			if(verbose>1)
+			{
+				for(i=0;i<256;i++)
 				{
-					for(i=0;i<256;i++)
-					{
-						if(secbuf1[i] != secbuf2[i])
-							printf("offset $%.2x: $%.2x!=$%.2x\n", i, secbuf1[i], secbuf2[i]);
-					}
+					if(secbuf1[i] != secbuf2[i])
+						printf("offset $%.2x: $%.2x!=$%.2x\n", i, secbuf1[i], secbuf2[i]);
 				}
-
-				//getchar();
 			}
 		}
-		strcat(outputstring, tmpstr);
 	}
 
-	return sec_match;
+	return result->matches;
+}
+
+size_t
+format_sector_compare(sector_compare * result, char * outputstring)
+{
+	char *p = outputstring;
+	sector_compare_entry *entry;
+	int sector;
+
+	for (sector = 0; sector < result->num_sectors; sector++)
+	{
+		entry = &result->sectors[sector];
+
+		if (!entry->match)
+			p += sprintf(p, "T%.1fS%d Mismatch (%.2x/E%d/CRC:%x) (%.2x/E%d/CRC:%x)\n",
+				(float)result->track/2, sector, entry->checksum1, entry->error1, entry->crc1,
+				entry->checksum2, entry->error2, entry->crc2);
+		else if (entry->error1 != SECTOR_OK)
+			p += sprintf(p, "T%.1fS%d: Non-CBM (%.2x/E%d)(%.2x/E%d)\n",
+				(float)result->track/2, sector, entry->checksum1, entry->error1,
+				entry->checksum2, entry->error2);
+	}
+
+	*p = '\0';
+	return p - outputstring;
+}
+
+size_t
+compare_sectors(BYTE * track1, BYTE * track2, size_t length1, size_t length2, BYTE * id1, BYTE * id2, int track, char * outputstring,
+	track_index * index1, track_index * index2)
+{
+	sector_compare result;
+
+	compare_sectors_stats(track1, track2, length1, length2, id1, id2, track, &result, index1, index2);
+	format_sector_compare(&result, outputstring);
+
+	return result.matches;
 }
 
 char frompetscii(char s)
@@ -1597,72 +3064,108 @@ char topetscii(char s)
 }
 
 
-/* check for CBM DOS errors */
+/* check for CBM DOS errors and empty sectors */
 size_t
-check_errors(BYTE * gcrdata, size_t length, int track, BYTE * id, char * errorstring)
+check_sectors(BYTE * gcrdata, size_t length, int track, BYTE * id, sector_report * report, track_index * tindex)
 {
-	int errors, sector;
-	char tmpstr[16];
+	int i, sector;
 	BYTE secbuf[260], errorcode;
+	track_index index;
 
-	errors = 0;
-	errorstring[0] = '\0';
+	report->track = track;
+	report->num_sectors = 0;
+	report->errors = 0;
+	report->empty = 0;
+	if (tindex == NULL) tindex = index_track(&index, gcrdata, length);
 
-	for (sector = 0; sector < sector_map[track/2]; sector++)
+	for (sector = 0; sector < sector_map[track/2] && sector < MAX_TRACK_SECTORS; sector++)
 	{
-		errorcode = convert_GCR_sector(gcrdata, gcrdata + length, secbuf, (track/2), sector, id);
+		errorcode = convert_indexed_sector(tindex, secbuf, (track/2), sector, id);
+		report->error[sector] = errorcode;
+		report->is_empty[sector] = 0;
+		report->num_sectors++;
 
 		if (errorcode != SECTOR_OK)
 		{
-			errors++;
-			sprintf(tmpstr, "[E%dS%d]", errorcode, sector);
-			strcat(errorstring, tmpstr);
+			report->errors++;
+			continue;
+		}
+
+		/* checks for empty (unused) sector */
+		for (i = 2; i <= 256; i++)
+		{
+			if (secbuf[i] != 0x01)
+				break;
+		}
+
+		if (i == 257)
+		{
+			report->is_empty[sector] = 1;
+			report->empty++;
 		}
 	}
-	return errors;
+	return report->errors;
 }
 
-/* check for CBM DOS empty sectors */
 size_t
-check_empty(BYTE * gcrdata, size_t length, int track, BYTE * id, char * errorstring)
+format_sector_errors(sector_report * report, char * outputstring)
 {
-	int i, empty, sector, errorcode;
-	char tmpstr[16], temp_errorstring[256];
-	BYTE secbuf[260];
-
-	empty = 0;
-	errorstring[0] = '\0';
-	temp_errorstring[0] = '\0';
+	char *p = outputstring;
+	int sector;
 
-	for (sector = 0; sector < sector_map[track / 2]; sector++)
+	for (sector = 0; sector < report->num_sectors; sector++)
 	{
-		errorcode = convert_GCR_sector(gcrdata, gcrdata + length, secbuf, (track / 2), sector, id);
+		if (report->error[sector] != SECTOR_OK)
+			p += sprintf(p, "[E%dS%d]", report->error[sector], sector);
+	}
 
-		if (errorcode == SECTOR_OK)
-		{
-			/* checks for empty (unused) sector */
-			for (i = 2; i <= 256; i++)
-			{
-				if (secbuf[i] != 0x01)
-				{
-					/*printf("%d:%0.2x ",i,secbuf[i]);*/
-					break;
-				}
-			}
+	*p = '\0';
+	return p - outputstring;
+}
 
-			if (i == 257)
-			{
-				sprintf(tmpstr, "%d-", sector);
-				strcat(temp_errorstring, tmpstr);
-				empty++;
-			}
-		}
+size_t
+format_sector_empty(sector_report * report, char * outputstring)
+{
+	char *p = outputstring;
+	int sector;
+
+	*p = '\0';
+	if (!report->empty)
+		return 0;
+
+	p += sprintf(p, "EMPTY:%d (", report->empty);
+	for (sector = 0; sector < report->num_sectors; sector++)
+	{
+		if (report->is_empty[sector])
+			p += sprintf(p, "%d-", sector);
 	}
+	p += sprintf(p, ")");
+
+	return p - outputstring;
+}
+
+/* check for CBM DOS errors */
+size_t
+check_errors(BYTE * gcrdata, size_t length, int track, BYTE * id, char * errorstring, track_index * index)
+{
+	sector_report report;
+
+	check_sectors(gcrdata, length, track, id, &report, index);
+	format_sector_errors(&report, errorstring);
+
+	return report.errors;
+}
+
+/* check for CBM DOS empty sectors */
+size_t
+check_empty(BYTE * gcrdata, size_t length, int track, BYTE * id, char * errorstring, track_index * index)
+{
+	sector_report report;
 
-	if (empty)
-		sprintf(errorstring, "EMPTY:%d (%s)", empty, temp_errorstring);
+	check_sectors(gcrdata, length, track, id, &report, index);
+	format_sector_empty(&report, errorstring);
 
-	return (empty);
+	return report.empty;
 }
 
 /*
@@ -1705,6 +3208,68 @@ is_bad_gcr(BYTE * gcrdata, size_t length, size_t pos)
 	return (mask >= 7);
 }
 
+/*
+	Bad GCR bitmap for a whole buffer: sets bit 'pos' in map for every byte
+	is_bad_gcr() would report, wrapping around to the last byte at pos 0.
+	Works on 8 bytes per step, map may be NULL if only the count is needed.
+*/
+size_t
+bad_gcr_map(BYTE * gcrdata, size_t length, BYTE * map)
+{
+	unsigned long long word, zero, bad;
+	BYTE chunk[8], *src, prev, flags;
+	size_t i, n, total;
+
+	total = 0;
+	if (!length)
+		return 0;
+
+	prev = gcrdata[length - 1];
+
+	for (i = 0; i < length; i += 8)
+	{
+		n = length - i;
+		if (n >= 8)
+			src = gcrdata + i;
+		else
+		{
+			/* pad with 1 bits, they can never form a bad run */
+			memset(chunk, 0xff, sizeof(chunk));
+			memcpy(chunk, gcrdata + i, n);
+			src = chunk;
+		}
+
+		word = ((unsigned long long) src[0] << 56) | ((unsigned long long) src[1] << 48) |
+			((unsigned long long) src[2] << 40) | ((unsigned long long) src[3] << 32) |
+			((unsigned long long) src[4] << 24) | ((unsigned long long) src[5] << 16) |
+			((unsigned long long) src[6] << 8) | src[7];
+
+		/* mark every 0 bit preceded by two more 0 bits, carrying in the previous byte */
+		zero = ~word;
+		bad = zero &
+			((zero >> 1) | ((unsigned long long) (~prev & 1) << 63)) &
+			((zero >> 2) | ((unsigned long long) (~prev & 3) << 62));
+
+		/* fold each byte lane into its lowest bit and gather the lanes, first byte in bit 0 */
+		bad |= (bad >> 4) & 0x0f0f0f0f0f0f0f0fULL;
+		bad |= (bad >> 2) & 0x0303030303030303ULL;
+		bad |= (bad >> 1) & 0x0101010101010101ULL;
+		flags = (BYTE) (((bad & 0x0101010101010101ULL) * 0x8040201008040201ULL) >> 56);
+
+		if (n < 8)
+			flags &= (1 << n) - 1;
+
+		if (map)
+			map[i >> 3] = flags;
+
+		for (; flags; flags &= flags - 1)
+			total++;
+
+		prev = src[7];
+	}
+	return total;
+}
+
 /*
  * Check and "correct" bad GCR bits:
  * substitute bad GCR bytes by 0x00 until next good GCR byte
@@ -1717,10 +3282,8 @@ is_bad_gcr(BYTE * gcrdata, size_t length, size_t pos)
  * is not this precise and it fails the protection checks sometimes.
  */
 
-extern int fix_gcr;
-
 size_t
-check_bad_gcr(BYTE * gcrdata, size_t length)
+check_bad_gcr(BYTE * gcrdata, size_t length, nib_options *opt)
 {
 	/* state machine definitions */
 	enum ebadgcr { S_BADGCR_OK, S_BADGCR_ONCE_BAD, S_BADGCR_LOST };
@@ -1728,20 +3291,26 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 	size_t i, lastpos;
 	size_t total, b_badgcr;
 	size_t n_badgcr;
+	size_t stale;	/* map entries below this may be changed by a fix */
+	BYTE badmap[BAD_GCR_MAP_SIZE(NIB_TRACK_LENGTH * 2)];
 
 	/* if empty we are all "bad" GCR */
 	if(!length)
 		return NIB_TRACK_LENGTH;
 
+	/* fixes below only write at lastpos, which mostly lies behind the current position */
+	bad_gcr_map(gcrdata, length, badmap);
+
 	i = 0;
 	total = 0;
 	lastpos = 0;
+	stale = 0;
 	sbadgcr = S_BADGCR_OK;
 
 	for (i = 0; i < length - 1; i++)
 	{
-		b_badgcr = is_bad_gcr(gcrdata, length, i);
-		n_badgcr = is_bad_gcr(gcrdata, length, i + 1);
+		b_badgcr = (i < stale) ? is_bad_gcr(gcrdata, length, i) : BAD_GCR_AT(badmap, i);
+		n_badgcr = (i + 1 < stale) ? is_bad_gcr(gcrdata, length, i + 1) : BAD_GCR_AT(badmap, i + 1);
 
 		switch (sbadgcr)
 		{
@@ -1750,7 +3319,7 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 				{
 					total++;
 
-					if(fix_gcr > 2)
+					if(opt->fix_gcr > 2)
 					{
 						sbadgcr = S_BADGCR_LOST;  /* most aggressive */
 						gcrdata[lastpos] = 0x00;
@@ -1761,14 +3330,14 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 				break;
 
 			case S_BADGCR_ONCE_BAD:
-				if ((b_badgcr) || ((fix_gcr>3) && (n_badgcr)) )
+				if ((b_badgcr) || ((opt->fix_gcr>3) && (n_badgcr)) )
 				{
 					total++;
 					sbadgcr = S_BADGCR_LOST;
 
-					if(fix_gcr > 1)
+					if(opt->fix_gcr > 1)
 						fix_first_gcr(gcrdata, length, lastpos);
-					else if (fix_gcr > 2)
+					else if (opt->fix_gcr > 2)
 						gcrdata[lastpos] = 0x00;
 				}
 				else
@@ -1776,25 +3345,453 @@ check_bad_gcr(BYTE * gcrdata, size_t length)
 				break;
 
 			case S_BADGCR_LOST:
-				if ((b_badgcr) || ((fix_gcr>3) && (n_badgcr)) )
+				if ((b_badgcr) || ((opt->fix_gcr>3) && (n_badgcr)) )
 				{
 					total++;
 
-					if (fix_gcr)
+					if (opt->fix_gcr)
 						gcrdata[lastpos] = 0x00;
 				}
 				else
 				{
 					sbadgcr = S_BADGCR_OK;
 
-					if(fix_gcr > 1)
+					if(opt->fix_gcr > 1)
 						fix_last_gcr(gcrdata, length, lastpos);
-					else if(fix_gcr > 2)
+					else if(opt->fix_gcr > 2)
 						gcrdata[lastpos] = 0x00;
 				}
 				break;
 		}
+
+		/* a fix at lastpos also changes whether the byte after it is bad */
+		if (opt->fix_gcr)
+			stale = lastpos + 2;
 		lastpos = i;
 	}
 	return total;
 }
+
+/*
+	Checksum-guided repair of a GCR data block (325 bytes after the sync).
+	Every invalid 5-bit code must be replaced. Candidates come from the two
+	common misreads at any bit offset overlapping it, and from every valid
+	code, costed by the number of bits flipped. Combinations are searched
+	depth-first and must restore the block mark and the XOR checksum. The
+	cheapest combination is written back only if no other one within
+	REPAIR_MARGIN of its cost passes, otherwise the block is left alone.
+*/
+static const BYTE GCR_misread[][2] = {
+	{ 0x08, 0x0e },		/* tri-bit error, 01110 read as 01000 */
+	{ 0x18, 0x12 },		/* low frequency error, 10010 read as 11000 */
+};
+
+typedef struct
+{
+	int first;			/* first code changed */
+	int count;			/* number of codes changed, 1 or 2 */
+	BYTE code[2];
+	int cost;
+	BYTE syndrome;		/* change of the checksum syndrome */
+	BYTE mark;			/* change of the block mark */
+} repair_edit;
+
+typedef struct
+{
+	BYTE code[REPAIR_QUINTETS];
+	int bad[REPAIR_MAX_BAD];
+	int num_bad;
+	repair_edit edit[REPAIR_MAX_EDITS];
+	int num_edits;
+	int chosen[REPAIR_MAX_BAD];
+	int best[REPAIR_MAX_BAD];
+	int num_chosen, num_best, best_cost;
+	int found[REPAIR_MAX_BAD * 2 + REPAIR_MARGIN + 1];	/* passing combinations by cost */
+	size_t budget;
+	gcr_repair *result;
+} repair_search;
+
+/* decoded nybble of a code as it counts for the checksum, invalid codes as 0 */
+static BYTE
+repair_nybble(BYTE code)
+{
+	return (GCR_decode_low[code] == 0xff) ? 0 : GCR_decode_low[code];
+}
+
+static void
+add_repair_edit(repair_search * s, int first, int count, BYTE code0, BYTE code1, int cost)
+{
+	repair_edit *e;
+	BYTE code[2], delta;
+	int i, q;
+
+	code[0] = code0;
+	code[1] = code1;
+
+	for (i = 0; i < count; i++)
+	{
+		if ((first + i >= REPAIR_CHECKED) || (GCR_decode_low[code[i]] == 0xff))
+			return;
+	}
+
+	for (i = 0; i < s->num_edits; i++)
+	{
+		e = &s->edit[i];
+		if ((e->first == first) && (e->count == count) && (e->code[0] == code0) &&
+			((count == 1) || (e->code[1] == code1)))
+		{
+			if (cost < e->cost)
+				e->cost = cost;
+			return;
+		}
+	}
+
+	if (s->num_edits >= REPAIR_MAX_EDITS)
+		return;
+
+	e = &s->edit[s->num_edits++];
+	e->first = first;
+	e->count = count;
+	e->code[0] = code0;
+	e->code[1] = code1;
+	e->cost = cost;
+	e->syndrome = 0;
+	e->mark = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		q = first + i;
+		delta = repair_nybble(s->code[q]) ^ repair_nybble(code[i]);
+		if (!(q & 1))
+			delta <<= 4;
+
+		if (q < 2)
+			e->mark ^= delta;
+		else
+			e->syndrome ^= delta;
+	}
+}
+
+static void
+collect_repair_edits(repair_search * s, int q)
+{
+	int bit, first, off, i, v, w;
+	BYTE c;
+
+	/* known misreads at any bit offset overlapping this code */
+	for (bit = q * 5 - 4; bit <= q * 5 + 4; bit++)
+	{
+		if ((bit < 0) || (bit + 5 > REPAIR_CHECKED * 5))
+			continue;
+
+		first = bit / 5;
+		off = bit % 5;
+		v = (s->code[first] << 5) | ((first + 1 < REPAIR_QUINTETS) ? s->code[first + 1] : 0);
+
+		for (i = 0; i < (int)(sizeof(GCR_misread) / sizeof(GCR_misread[0])); i++)
+		{
+			if (((v >> (5 - off)) & 0x1f) != GCR_misread[i][0])
+				continue;
+
+			w = (v & ~(0x1f << (5 - off))) | (GCR_misread[i][1] << (5 - off));
+			if (!off || ((w & 0x1f) == s->code[first + 1]))
+				add_repair_edit(s, first, 1, (BYTE)(w >> 5), 0, 1);
+			else
+				add_repair_edit(s, first, 2, (BYTE)(w >> 5), (BYTE)(w & 0x1f), 1);
+		}
+	}
+
+	/* valid codes one bit away */
+	for (c = 0; c < 32; c++)
+	{
+		if ((GCR_decode_low[c] != 0xff) && (popcount64(c ^ s->code[q]) == 1))
+			add_repair_edit(s, q, 1, c, 0, 2);
+	}
+}
+
+static int
+repair_edit_covers(repair_edit * e, int q)
+{
+	return ((q >= e->first) && (q < e->first + e->count));
+}
+
+static void
+search_repair(repair_search * s, int cost, BYTE syndrome, BYTE mark)
+{
+	repair_edit *e;
+	int b, i, j, k, clash;
+
+	if (s->result->candidates++ >= (long)s->budget)
+	{
+		s->result->truncated = 1;
+		return;
+	}
+
+	/* first invalid code not yet replaced */
+	for (b = 0; b < s->num_bad; b++)
+	{
+		for (j = 0; j < s->num_chosen; j++)
+		{
+			if (repair_edit_covers(&s->edit[s->chosen[j]], s->bad[b]))
+				break;
+		}
+		if (j == s->num_chosen)
+			break;
+	}
+
+	if (b == s->num_bad)
+	{
+		if (syndrome || (mark != 0x07))
+			return;
+
+		if (cost < s->best_cost)
+		{
+			s->best_cost = cost;
+			s->num_best = s->num_chosen;
+			memcpy(s->best, s->chosen, sizeof(s->chosen));
+		}
+		s->found[cost]++;
+		return;
+	}
+
+	for (i = 0; i < s->num_edits; i++)
+	{
+		e = &s->edit[i];
+		if (!repair_edit_covers(e, s->bad[b]) || (cost + e->cost > s->best_cost + REPAIR_MARGIN))
+			continue;
+
+		/* edits may not change the same code twice */
+		for (clash = 0, j = 0; j < s->num_chosen && !clash; j++)
+		{
+			for (k = 0; k < e->count; k++)
+			{
+				if (repair_edit_covers(&s->edit[s->chosen[j]], e->first + k))
+					clash = 1;
+			}
+		}
+		if (clash)
+			continue;
+
+		s->chosen[s->num_chosen++] = i;
+		search_repair(s, cost + e->cost, syndrome ^ e->syndrome, mark ^ e->mark);
+		s->num_chosen--;
+	}
+}
+
+int
+search_GCR_repair(BYTE * gcr, size_t budget, gcr_repair * result)
+{
+	repair_search s;
+	BYTE block[GCR_BLOCK_DATA_LEN + 1], syndrome, mark;
+	repair_edit *e;
+	int q, i, bit, byte;
+
+	memset(result, 0, sizeof(gcr_repair));
+	memset(block, 0, sizeof(block));
+	memcpy(block, gcr, 325);
+
+	s.num_bad = 0;
+	s.num_edits = 0;
+	s.num_chosen = 0;
+	s.num_best = 0;
+	s.best_cost = REPAIR_MAX_BAD * 2;
+	memset(s.found, 0, sizeof(s.found));
+	s.budget = budget;
+	s.result = result;
+
+	syndrome = 0;
+	mark = 0;
+	for (q = 0; q < REPAIR_QUINTETS; q++)
+	{
+		bit = q * 5;
+		s.code[q] = (((block[bit >> 3] << 8) | block[(bit >> 3) + 1]) >> (11 - (bit & 7))) & 0x1f;
+
+		if (q >= REPAIR_CHECKED)
+			continue;
+
+		if (GCR_decode_low[s.code[q]] == 0xff)
+		{
+			result->bad_codes++;
+			if (s.num_bad < REPAIR_MAX_BAD)
+				s.bad[s.num_bad++] = q;
+		}
+
+		byte = repair_nybble(s.code[q]) << ((q & 1) ? 0 : 4);
+		if (q < 2)
+			mark ^= byte;
+		else
+			syndrome ^= byte;
+	}
+
+	/* nothing to go on, or too damaged to search */
+	if (!result->bad_codes || (result->bad_codes > REPAIR_MAX_BAD))
+		return 0;
+
+	for (i = 0; i < s.num_bad; i++)
+		collect_repair_edits(&s, s.bad[i]);
+	result->edits = s.num_edits;
+
+	search_repair(&s, 0, syndrome, mark);
+
+	for (i = s.best_cost; i <= s.best_cost + REPAIR_MARGIN; i++)
+		result->solutions += s.found[i];
+
+	if ((result->solutions != 1) || result->truncated)
+		return 0;
+
+	/* write the repaired codes back */
+	result->cost = s.best_cost;
+	for (i = 0; i < s.num_best; i++)
+	{
+		e = &s.edit[s.best[i]];
+		for (q = 0; q < e->count; q++)
+		{
+			if (s.code[e->first + q] != e->code[q])
+				result->changed++;
+			s.code[e->first + q] = e->code[q];
+		}
+	}
+
+	memset(block, 0, sizeof(block));
+	for (q = 0; q < REPAIR_QUINTETS; q++)
+	{
+		bit = q * 5;
+		byte = s.code[q] << (11 - (bit & 7));
+		block[bit >> 3] |= byte >> 8;
+		block[(bit >> 3) + 1] |= byte & 0xff;
+	}
+	memcpy(gcr, block, 325);
+
+	return 1;
+}
+
+/*
+	Reversible model of a raw track ahead of LZ compression (see NBZ).
+	The track becomes a list of records, each starting with an op byte:
+		PACK_LITERAL | n-1	n raw bytes follow
+		PACK_GCR | n-1		n groups of 4 decoded bytes follow, for 5 GCR bytes each
+		PACK_RUN | len>>8	low byte of len and the repeated byte follow
+	Quintets that don't decode are escaped as literals.
+*/
+static size_t
+pack_run(BYTE * track, size_t pos, size_t length)
+{
+	size_t run;
+
+	for (run = 1; (pos + run < length) && (track[pos + run] == track[pos]) && (run < PACK_MAX_RUN); run++);
+	return run;
+}
+
+static int
+pack_group(BYTE * track, size_t pos, size_t length)
+{
+	BYTE plain[4];
+
+	/* a group only counts if it isn't the start of a sync or gap run */
+	return ((pos + 5 <= length) && (pack_run(track, pos, length) < PACK_MIN_RUN) &&
+		(convert_GCR_quintets(track + pos, plain, 1) == 8));
+}
+
+size_t
+pack_GCR_track(BYTE * track, size_t length, BYTE * packed)
+{
+	BYTE *out, *record;
+	size_t pos, run;
+
+	out = packed;
+	record = NULL;
+	pos = 0;
+
+	while (pos < length)
+	{
+		run = pack_run(track, pos, length);
+
+		if (run >= PACK_MIN_RUN)
+		{
+			*out++ = PACK_RUN | (BYTE) (run >> 8);
+			*out++ = (BYTE) run;
+			*out++ = track[pos];
+			pos += run;
+			record = NULL;
+		}
+		/* a lone group doesn't pay for its record, leave it to the literals */
+		else if ((pack_group(track, pos, length)) &&
+			(((record) && ((*record & PACK_TYPE) == PACK_GCR)) || (pack_group(track, pos + 5, length))))
+		{
+			if ((!record) || ((*record & PACK_TYPE) != PACK_GCR) || ((*record & PACK_COUNT) == PACK_COUNT))
+			{
+				record = out++;
+				*record = PACK_GCR;
+			}
+			else
+				(*record)++;
+
+			convert_GCR_quintets(track + pos, out, 1);
+			out += 4;
+			pos += 5;
+		}
+		else
+		{
+			if ((!record) || ((*record & PACK_TYPE) != PACK_LITERAL) || ((*record & PACK_COUNT) == PACK_COUNT))
+			{
+				record = out++;
+				*record = PACK_LITERAL;
+			}
+			else
+				(*record)++;
+
+			*out++ = track[pos++];
+		}
+	}
+	return (out - packed);
+}
+
+/* Reverses pack_GCR_track(), returns the track length or 0 if 'packed' is damaged */
+size_t
+unpack_GCR_track(BYTE * packed, size_t size, BYTE * track, size_t length)
+{
+	BYTE *end;
+	size_t pos, count, run;
+
+	end = packed + size;
+	pos = 0;
+
+	while (packed < end)
+	{
+		count = (*packed & PACK_COUNT) + 1;
+
+		switch (*packed++ & PACK_TYPE)
+		{
+			case PACK_LITERAL:
+				if ((count > (size_t) (end - packed)) || (pos + count > length))
+					return 0;
+				memcpy(track + pos, packed, count);
+				packed += count;
+				pos += count;
+				break;
+
+			case PACK_GCR:
+				if ((count * 4 > (size_t) (end - packed)) || (pos + (count * 5) > length))
+					return 0;
+				convert_bytes_to_GCR(packed, track + pos, (int) count);
+				packed += count * 4;
+				pos += count * 5;
+				break;
+
+			case PACK_RUN:
+				if (end - packed < 2)
+					return 0;
+				run = ((count - 1) << 8) | packed[0];
+				if (pos + run > length)
+					return 0;
+				memset(track + pos, packed[1], run);
+				packed += 2;
+				pos += run;
+				break;
+
+			default:
+				return 0;
+		}
+	}
+	return pos;
+}
@@ -41,6 +41,16 @@
 #define NIB_TRACK_LENGTH 0x2000
 #define NIB_HEADER_SIZE 0xFF
 
+/* Track model for compression, see pack_GCR_track() */
+#define PACK_LITERAL	0x00
+#define PACK_GCR		0x40
+#define PACK_RUN		0x80
+#define PACK_TYPE		0xc0
+#define PACK_COUNT		0x3f
+#define PACK_MIN_RUN	5
+#define PACK_MAX_RUN	0x3fff
+#define PACK_MAX_SIZE(length) ((length) + ((length) / 64) + 8)	/* all literals, plus slack */
+
 /*
     number of GCR bytes until NO SYNC error
     timer counts down from $d000 to $8000 (20480 cycles)
@@ -86,6 +96,206 @@ speed zone divisors are 13, 14, 15, 16 for densities 3, 2, 1, 0 respectively
 #define GCR_MIN_FORMATTED 16
 /*#define GCR_MIN_FORMATTED 64 */	/* chessmaster track 29 */
 
+/* Bad GCR bitmap, see bad_gcr_map() */
+#define BAD_GCR_MAP_SIZE(length) (((length) + 7) / 8)
+#define BAD_GCR_AT(map, pos) (((map)[(pos) >> 3] >> ((pos) & 7)) & 1)
+
+/* Bit-level cycle search, see find_track_cycle_bits() */
+#define CYCLE_BITS_OVERLAP 512		/* minimum number of bits compared */
+#define CYCLE_BITS_TOLERANCE 32		/* at most 1 in 32 bits may differ */
+
+/* Size of the handler output kept for one track, see align_state */
+#define ALIGN_REPORT_SIZE 128
+
+/* State of the track aligners for one pass over a disk, see align_GCR_track().
+   Tracks aligned in parallel each get their own, with quiet set */
+typedef struct
+{
+	int quiet;	/* keep the handler output in report instead of printing it */
+	int rapidlok;	/* the track went through align_rl_special() */
+	int rl_version;	/* RapidLok version found on the track, 0 if none */
+	int rl_tv;	/* RapidLok TV standard, early versions only have it on track 17 */
+	char report[ALIGN_REPORT_SIZE];
+} align_state;
+
+/* Circular view of one track revolution, see view_span() */
+typedef struct
+{
+	BYTE *data;
+	size_t length;
+} track_view;
+
+#define VIEW_BYTE(view, pos) ((view)->data[((pos) < (view)->length) ? (pos) : (pos) % (view)->length])
+#define VIEW_PTR(view, pos) ((view)->data + (pos) % (view)->length)
+
+/* Bit-addressed track data, bit 0 is the MSB of data[0], see bits_copy() */
+typedef struct
+{
+	BYTE *data;
+	size_t bits;
+} bitstream;
+
+#define BITS_NOT_FOUND ((size_t)-1)
+#define SYNC_MIN_BITS 10		/* a sync mark is at least 10 1 bits */
+
+/* Sync run list, see scan_sync_runs() */
+#define MAX_SYNC_RUNS 512
+
+typedef struct
+{
+	size_t pos;		/* offset of the first 0xff byte */
+	size_t len;		/* number of 0xff bytes */
+	BYTE next;		/* byte following the run, 0 at end of data */
+} sync_run;
+
+typedef struct
+{
+	BYTE *gcr_start;
+	size_t length;
+	size_t period;		/* revolution length of a circular view, else 0 */
+	int num_runs;
+	int overflow;		/* more syncs than MAX_SYNC_RUNS */
+	sync_run runs[MAX_SYNC_RUNS];
+} sync_list;
+
+/* Per-track sector index, see index_track() */
+#define MAX_INDEX_HEADERS 64
+
+typedef struct
+{
+	size_t pos;			/* offset of the header after its 0xff 0x52 mark */
+	size_t data_pos;		/* offset of the data block belonging to it */
+	BYTE header[8];		/* decoded header */
+	BYTE bad_gcr;		/* header contains bad GCR */
+} sector_header;
+
+typedef struct
+{
+	BYTE *gcr_start;
+	size_t length;
+	int has_sync;
+	size_t first_sync;		/* offset after the first sync */
+	size_t sync_gap_max;	/* longest stretch without sync */
+	int num_headers;
+	int overflow;			/* more header marks than MAX_INDEX_HEADERS */
+	sector_header headers[MAX_INDEX_HEADERS];
+} track_index;
+
+/* Processing options of one disk image, set from the command line by parseargs() */
+typedef struct
+{
+	int start_track, end_track, track_inc;	/* halftracks */
+	int fix_gcr;	/* level of bad GCR reproduction */
+	int reduce_sync;	/* sync bytes kept by sync reduction */
+	int increase_sync;	/* sync bytes added to short syncs */
+	int presync;	/* short sync bytes added in front of each track */
+	int gap_match_length;	/* bytes compared by the track cycle search */
+	int cap_min_ignore;
+	int raw_cycle_legacy;	/* use the original brute force raw cycle search */
+	int compare_banded;	/* compare tracks by banded alignment instead of the greedy walk */
+	int sync_align_buffer;	/* 2 for the bitshift aligner */
+	int fattrack;	/* halftrack of a forced FAT track, 0 detects, 99 for none */
+	int skew;	/* simulated track skew in ms */
+	int auto_capacity_adjust;
+	int extra_capacity_margin;
+	int rpm_real;	/* simulated track capacity */
+	int old_g64;
+	int threads;	/* -j */
+	int nbz_level;	/* -Z */
+	BYTE align_map[MAX_TRACKS_1541 + 1];	/* alignment method of each track */
+	BYTE reduce_map[MAX_TRACKS_1541 + 1];	/* REDUCE_ flags of each track */
+} nib_options;
+
+/* One disk image: raw GCR of every halftrack and its metadata, see new_disk() */
+typedef struct
+{
+	nib_options opt;
+	BYTE track_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
+	BYTE track_density[MAX_HALFTRACKS_1541 + 2];
+	BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
+	size_t track_length[MAX_HALFTRACKS_1541 + 2];
+	int fat_track;	/* halftrack copied to the next one, 0 if none */
+	align_state align;	/* aligner state carried from track to track */
+	track_index index[MAX_HALFTRACKS_1541 + 2];	/* sector index of each halftrack, see disk_track_index() */
+	BYTE index_valid[MAX_HALFTRACKS_1541 + 2];
+} nib_disk;
+
+/* Analysis results, see check_sectors(), compare_tracks_stats(), compare_sectors_stats() */
+#define MAX_TRACK_SECTORS 21
+#define COMPARE_ALL ((size_t) -1)	/* no early exit in compare_tracks_stats() */
+#define COMPARE_BAND 32			/* alignment slack on top of the length difference */
+#define COMPARE_BAND_MAX 512
+
+typedef struct
+{
+	int track;			/* halftrack */
+	int num_sectors;
+	int errors;			/* sectors not SECTOR_OK */
+	int empty;			/* good sectors filled with 0x01 */
+	BYTE error[MAX_TRACK_SECTORS];		/* error code per sector */
+	BYTE is_empty[MAX_TRACK_SECTORS];
+} sector_report;
+
+typedef struct
+{
+	size_t byte_match;
+	size_t byte_diff;
+	size_t sync_diff;
+	size_t shift_diff;
+	size_t presync_diff;
+	size_t gap_diff;
+	size_t badgcr_diff;
+	size_t size_diff;
+	int match;			/* walked to the end without too much sync/weak noise */
+	int truncated;		/* stopped early, counts are partial */
+} track_compare;
+
+typedef struct
+{
+	BYTE error1, error2;
+	BYTE checksum1, checksum2;
+	unsigned int crc1, crc2;
+	BYTE match;
+} sector_compare_entry;
+
+typedef struct
+{
+	int track;			/* halftrack */
+	int num_sectors;
+	int matches;
+	sector_compare_entry sectors[MAX_TRACK_SECTORS];
+} sector_compare;
+
+/* Data block repair search, see search_GCR_repair() */
+#define REPAIR_QUINTETS 520		/* 65 groups of 8 codes in a data block */
+#define REPAIR_CHECKED 516		/* block mark, 256 data bytes and checksum */
+#define REPAIR_MAX_BAD 4		/* blocks with more invalid codes are not searched */
+#define REPAIR_MAX_EDITS 96
+#define REPAIR_MARGIN 2			/* a rival this much more costly makes it ambiguous */
+#define REPAIR_BUDGET 200000	/* default search steps per block */
+
+typedef struct
+{
+	int bad_codes;		/* invalid 5-bit codes in the block */
+	int edits;			/* candidate corrections */
+	long candidates;	/* search steps taken */
+	int solutions;		/* passing combinations within REPAIR_MARGIN of the cheapest */
+	int cost;
+	int changed;		/* codes changed by the applied repair */
+	int truncated;		/* budget ran out */
+} gcr_repair;
+
+/* Result of lengthen_sync_by() */
+typedef struct
+{
+	size_t syncs;		/* sync marks on the track */
+	size_t added;		/* 0xff bytes inserted */
+	int rounds;			/* bytes added to every sync */
+	size_t partial;		/* syncs that got one more before length_max was hit */
+	size_t shortest;	/* sync lengths afterwards, in bytes */
+	size_t longest;
+} sync_lengthen;
+
 /* Disk Controller error codes */
 #define SECTOR_OK								0x01	// 00,OK
 #define HEADER_NOT_FOUND			0x02	// 20,READ ERROR
@@ -123,13 +333,9 @@ speed zone divisors are 13, 14, 15, 16 for densities 3, 2, 1, 0 respectively
 extern BYTE sector_map[];
 extern BYTE sector_gap_length[];
 extern BYTE speed_map[];
-extern BYTE align_map[];
-extern BYTE reduce_map[];
 extern size_t capacity[];
 extern size_t capacity_min[];
 extern size_t capacity_max[];\
-extern int gap_match_length;
-extern int cap_min_ignore;
 extern int verbose;
 
 /* enums */
@@ -138,33 +344,73 @@ extern char alignments[][20];
 /* prototypes */
 int find_sync(BYTE ** gcr_pptr, BYTE * gcr_end);
 int find_header(BYTE ** gcr_pptr, BYTE * gcr_end);
+void scan_sync_runs(sync_list * list, BYTE * gcrdata, size_t length);
+void scan_sync_runs_view(sync_list * list, track_view * view, size_t length);
+int find_sync_offset(sync_list * list, size_t * pos, int * cursor);
+int find_header_offset(sync_list * list, size_t * pos, int * cursor);
+int find_sync_cursor(sync_list * list, BYTE ** gcr_pptr, int * cursor);
+int find_header_cursor(sync_list * list, BYTE ** gcr_pptr, int * cursor);
+BYTE * view_span(track_view * view, size_t pos, size_t length, BYTE * scratch);
+void view_copy(track_view * view, size_t pos, BYTE * destination, size_t length);
+void bitstream_init(bitstream * stream, BYTE * data, size_t bits);
+unsigned long long bits_extract(bitstream * stream, size_t pos, int count);
+void bits_deposit(bitstream * stream, size_t pos, unsigned long long value, int count);
+void bits_copy(bitstream * dest, size_t dest_pos, bitstream * src, size_t src_pos, size_t count);
+void bits_fill(bitstream * stream, size_t pos, size_t count, int value);
+void bits_shift(bitstream * stream, int count);
+size_t bits_count_ones(bitstream * stream, size_t pos, size_t max);
+size_t bits_find(bitstream * stream, size_t pos, unsigned long pattern, int count);
+size_t bits_find_ones(bitstream * stream, size_t pos, int count);
 void convert_4bytes_to_GCR(BYTE * buffer, BYTE * ptr);
+void convert_bytes_to_GCR(BYTE * buffer, BYTE * ptr, int quintets);
 int convert_4bytes_from_GCR(BYTE * gcr, BYTE * plain);
+int convert_GCR_quintets(BYTE * gcr, BYTE * plain, int quintets);
 int extract_id(BYTE * gcr_track, BYTE * id);
 int extract_cosmetic_id(BYTE * gcr_track, BYTE * id);
-size_t find_track_cycle_headers(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max);
-size_t find_track_cycle_syncs(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max);
-size_t find_track_cycle_raw(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max);
+size_t find_track_cycle_headers(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max, nib_options * opt);
+size_t find_track_cycle_syncs(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max, nib_options * opt);
+size_t find_track_cycle_raw(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max, size_t available, nib_options * opt);
+size_t find_track_cycle_raw_legacy(BYTE ** cycle_start, BYTE ** cycle_stop, size_t cap_min, size_t cap_max, size_t available, nib_options * opt);
+size_t find_track_cycle_bits(BYTE * track, size_t length, size_t cap_min, size_t cap_max, BYTE * aligned);
 BYTE convert_GCR_sector(BYTE * gcr_start, BYTE * gcr_end, BYTE * d64_sector, int track, int sector, BYTE * id);
+track_index * index_track(track_index * index, BYTE * gcr_start, size_t length);
+track_index * disk_track_index(nib_disk * disk, int track);
+void invalidate_track_index(nib_disk * disk, int track);
+int next_indexed_header(track_index * index, int * cursor, sector_header * entry);
+BYTE convert_indexed_sector(track_index * index, BYTE * d64_sector, int track, int sector, BYTE * id);
 void convert_sector_to_GCR(BYTE * buffer, BYTE * ptr, int track, int sector, BYTE * diskID, int error);
-BYTE * find_sector_gap(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen);
-BYTE * find_sector0(BYTE * work_buffer, size_t tracklen, size_t * p_sectorlen);
-size_t extract_GCR_track(BYTE * destination, BYTE * source, BYTE *align, int halftrack, size_t cap_min, size_t cap_max);
+BYTE * find_sector_gap(track_view * view, size_t * p_sectorlen);
+BYTE * find_sector0(track_view * view, size_t * p_sectorlen);
+size_t extract_GCR_track(BYTE * destination, BYTE * source, BYTE *align, int halftrack, size_t cap_min, size_t cap_max, align_state * state, nib_options * opt);
+size_t align_GCR_track(BYTE * destination, track_view * view, BYTE * align, int halftrack, align_state * state, nib_options * opt);
 int replace_bytes(BYTE * buffer, size_t length, BYTE srcbyte, BYTE dstbyte);
-size_t check_bad_gcr(BYTE * gcrdata, size_t length);
+size_t pack_GCR_track(BYTE * track, size_t length, BYTE * packed);
+size_t unpack_GCR_track(BYTE * packed, size_t size, BYTE * track, size_t length);
+size_t check_bad_gcr(BYTE * gcrdata, size_t length, nib_options * opt);
 BYTE check_sync_flags(BYTE * gcrdata, int density, size_t length);
 void bitshift(BYTE * gcrdata, size_t length, int bits);
-size_t check_errors(BYTE * gcrdata, size_t length, int track, BYTE * id, char * errorstring);
-size_t check_empty(BYTE * gcrdata, size_t length, int track, BYTE * id, char * errorstring);
-size_t compare_tracks(BYTE * track1, BYTE * track2, size_t length1, size_t  length2, int same_disk, char * outputstring);
-size_t compare_sectors(BYTE * track1, BYTE * track2, size_t length1, size_t length2, BYTE * id1, BYTE * id2, int track, char * outputstring);
+size_t check_errors(BYTE * gcrdata, size_t length, int track, BYTE * id, char * errorstring, track_index * index);
+size_t check_empty(BYTE * gcrdata, size_t length, int track, BYTE * id, char * errorstring, track_index * index);
+size_t compare_tracks(BYTE * track1, BYTE * track2, size_t length1, size_t  length2, int same_disk, char * outputstring, nib_options * opt);
+size_t compare_sectors(BYTE * track1, BYTE * track2, size_t length1, size_t length2, BYTE * id1, BYTE * id2, int track, char * outputstring, track_index * index1, track_index * index2);
+size_t check_sectors(BYTE * gcrdata, size_t length, int track, BYTE * id, sector_report * report, track_index * index);
+size_t compare_tracks_stats(BYTE * track1, BYTE * track2, size_t length1, size_t length2, int same_disk, size_t max_diff, track_compare * result, nib_options * opt);
+int compare_tracks_banded(BYTE * track1, BYTE * track2, size_t length1, size_t length2, size_t max_diff, track_compare * result);
+size_t compare_sectors_stats(BYTE * track1, BYTE * track2, size_t length1, size_t length2, BYTE * id1, BYTE * id2, int track, sector_compare * result, track_index * index1, track_index * index2);
+size_t format_sector_errors(sector_report * report, char * outputstring);
+size_t format_sector_empty(sector_report * report, char * outputstring);
+size_t format_track_compare(track_compare * result, char * outputstring);
+size_t format_sector_compare(sector_compare * result, char * outputstring);
+int search_GCR_repair(BYTE * gcr, size_t budget, gcr_repair * result);
 size_t strip_runs(BYTE * buffer, size_t length, size_t length_max, size_t minrun, BYTE target);
 size_t reduce_runs(BYTE * buffer, size_t length, size_t length_max, size_t minrun, BYTE target);
-size_t lengthen_sync(BYTE * buffer, size_t length, size_t length_max);\
+size_t lengthen_sync(BYTE * buffer, size_t length, size_t length_max);
+size_t lengthen_sync_by(BYTE * buffer, size_t length, size_t length_max, int count, sync_lengthen * result);
 size_t kill_partial_sync(BYTE * gcrdata, size_t length, size_t length_max);
 size_t strip_gaps(BYTE * buffer, size_t length);
 size_t reduce_gaps(BYTE * buffer, size_t length, size_t length_max);
 size_t is_bad_gcr(BYTE * gcrdata, size_t length, size_t pos);
+size_t bad_gcr_map(BYTE * gcrdata, size_t length, BYTE * map);
 int check_formatted(BYTE * gcrdata, size_t length);
 int check_valid_data(BYTE * data, int matchlen);
 char topetscii(char s);
@@ -10,6 +10,8 @@
 #include "gcr.h"
 #include "nibtools.h"
 
+extern nib_disk *disk;
+
 int Use_SCPlus_IHS = 0;          // "-j"
 int track_align_report = 0;      // "-x"
 int Deep_Bitrate_SCPlus_IHS = 0; // "-y"
@@ -161,7 +163,7 @@ int TrackAlignmentReport2(CBM_FILE fd, BYTE *buffer)
 	fprintf(fplog, "\nIndex Hole Sensor detected. Starting Track Alignment Analysis.\n\n");
 	printf("\nIndex Hole Sensor detected. Starting Track Alignment Analysis.\n\n");
 
-	if (track_inc == 1)
+	if (disk->opt.track_inc == 1)
 	{
 		printf("    |           Full Track           |       Half Track (+0.5)       \n");
 		printf(" #T +--------------------------------+-------------------------------\n");
@@ -187,9 +189,9 @@ int TrackAlignmentReport2(CBM_FILE fd, BYTE *buffer)
 	}
 
 	// Don't forget to analyze final half track if half tracks are enabled
-	ht = (track_inc == 1) ? 1 : 0;
+	ht = (disk->opt.track_inc == 1) ? 1 : 0;
 
-	for (track = start_track; track <= end_track+ht; track += track_inc)
+	for (track = disk->opt.start_track; track <= disk->opt.end_track+ht; track += disk->opt.track_inc)
 	{
 		step_to_halftrack(fd, track);
 
@@ -361,7 +363,7 @@ int DeepBitrateAnalysis(CBM_FILE fd, char *filename, BYTE *buffer, char *logline
 		dw = 0x0200;
 	}
 
-	for (track = start_track; track <= end_track; track += track_inc)
+	for (track = disk->opt.start_track; track <= disk->opt.end_track; track += disk->opt.track_inc)
 	{
 		step_to_halftrack(fd, track);
 
@@ -474,7 +476,7 @@ int DeepBitrateAnalysis(CBM_FILE fd, char *filename, BYTE *buffer, char *logline
 		printf("\n");
 		fprintf(fplog, "\n");
 
-	} // for (track = start_track; track <= end_track; track += track_inc)
+	} // for (track = disk->opt.start_track; track <= disk->opt.end_track; track += disk->opt.track_inc)
 
 	// Update BRX headers and close
 	for (density=0; density < 4; density++)
@@ -100,6 +100,7 @@
 #include <signal.h>
 #include <time.h>
 #include <ctype.h>
+#include "lz.h"
 
 
 /*************************************************************************
@@ -180,6 +181,35 @@ static int _LZ_ReadVarSize( unsigned int * x, unsigned char * buf )
 }
 
 
+/*************************************************************************
+* _LZ_ReadVarSizeSafe() - Like _LZ_ReadVarSize(), but reads no more than
+* 'size' bytes. Returns 0 if the value is cut off or too big.
+*************************************************************************/
+
+static int _LZ_ReadVarSizeSafe( unsigned int * x, unsigned char * buf,
+    unsigned int size )
+{
+    unsigned int y, b, num_bytes;
+
+    y = 0;
+    num_bytes = 0;
+    do
+    {
+        if( (num_bytes >= size) || (num_bytes >= 5) )
+        {
+            return 0;
+        }
+        b = (unsigned int) (*buf ++);
+        y = (y << 7) | (b & 0x0000007f);
+        ++ num_bytes;
+    }
+    while( b & 0x00000080 );
+
+    *x = y;
+    return num_bytes;
+}
+
+
 
 /*************************************************************************
 *                            PUBLIC FUNCTIONS                            *
@@ -553,3 +583,592 @@ int LZ_Uncompress( unsigned char *in, unsigned char *out, unsigned int insize )
 
     return outpos;
 }
+
+
+/*************************************************************************
+* LZ_UncompressSafe() - Uncompress a block of data using an LZ77 decoder,
+* checking every read and write against the buffer sizes.
+*  in      - Input (compressed) buffer.
+*  out     - Output (uncompressed) buffer.
+*  insize  - Number of input bytes.
+*  outsize - Size of the output buffer.
+* The function returns the size of the uncompressed data, or 0 if the
+* input is damaged or doesn't fit into the output buffer.
+*************************************************************************/
+
+int LZ_UncompressSafe( unsigned char *in, unsigned char *out,
+    unsigned int insize, unsigned int outsize )
+{
+    unsigned char marker, symbol;
+    unsigned int  i, inpos, outpos, length, offset;
+
+    /* Do we have anything to uncompress? */
+    if( insize < 1 )
+    {
+        return 0;
+    }
+
+    /* Get marker symbol from input stream */
+    marker = in[ 0 ];
+    inpos = 1;
+
+    /* Main decompression loop */
+    outpos = 0;
+    while( inpos < insize )
+    {
+        symbol = in[ inpos ++ ];
+        if( symbol == marker )
+        {
+            if( inpos >= insize )
+            {
+                return 0;
+            }
+
+            /* We had a marker byte */
+            if( in[ inpos ] == 0 )
+            {
+                /* It was a single occurrence of the marker byte */
+                if( outpos >= outsize )
+                {
+                    return 0;
+                }
+                out[ outpos ++ ] = marker;
+                ++ inpos;
+            }
+            else
+            {
+                /* Extract true length and offset */
+                if( !(i = _LZ_ReadVarSizeSafe( &length, &in[ inpos ], insize - inpos )) )
+                {
+                    return 0;
+                }
+                inpos += i;
+                if( !(i = _LZ_ReadVarSizeSafe( &offset, &in[ inpos ], insize - inpos )) )
+                {
+                    return 0;
+                }
+                inpos += i;
+
+                if( (offset == 0) || (offset > outpos) || (length > outsize - outpos) )
+                {
+                    return 0;
+                }
+
+                /* Copy corresponding data from history window */
+                for( i = 0; i < length; ++ i )
+                {
+                    out[ outpos ] = out[ outpos - offset ];
+                    ++ outpos;
+                }
+            }
+        }
+        else
+        {
+            /* No marker, plain copy */
+            if( outpos >= outsize )
+            {
+                return 0;
+            }
+            out[ outpos ++ ] = symbol;
+        }
+    }
+
+    return outpos;
+}
+
+
+/*************************************************************************
+*                      STREAMING CODER FUNCTIONS                         *
+* The streams use the same format as LZ_Compress(), so a stream can be   *
+* unpacked with LZ_Uncompress() and the other way around.                *
+*************************************************************************/
+
+#define LZ_STREAM_NONE 0xffff
+
+/* Match offset window, hash chain entries tried per byte and positions
+   looked ahead for a longer match (lazy matching) for levels 1 (fastest)
+   to LZ_STREAM_MAXLEVEL (smallest output) */
+static const unsigned int _LZ_StreamWindow[ LZ_STREAM_MAXLEVEL ] = {
+    0x1000, 0x1000, 0x2000, 0x2000, 0x4000, 0x4000
+};
+static const unsigned int _LZ_StreamDepth[ LZ_STREAM_MAXLEVEL ] = {
+    2, 4, 8, 16, 32, 8192
+};
+static const unsigned int _LZ_StreamLazy[ LZ_STREAM_MAXLEVEL ] = {
+    0, 0, 0, 0, 0, 2
+};
+
+
+/*************************************************************************
+* _LZ_StreamHash() - Hash the three bytes at buf.
+*************************************************************************/
+
+static unsigned int _LZ_StreamHash( unsigned char * buf )
+{
+    unsigned int x;
+
+    x = ((unsigned int) buf[0] << 16) | ((unsigned int) buf[1] << 8) | buf[2];
+    return ((x * 2654435761u) >> 20) & (LZ_STREAM_HASH - 1);
+}
+
+
+/*************************************************************************
+* _LZ_StreamInsert() - Add position pos to the hash chains.
+*************************************************************************/
+
+static void _LZ_StreamInsert( LZ_CompressState *state, unsigned int pos )
+{
+    unsigned int h;
+
+    if( pos + 2 < state->end )
+    {
+        h = _LZ_StreamHash( &state->buf[ pos ] );
+        state->chain[ pos ] = state->head[ h ];
+        state->head[ h ] = (unsigned short) pos;
+    }
+}
+
+
+/*************************************************************************
+* _LZ_StreamSlide() - Drop the oldest window of data from the buffer.
+*************************************************************************/
+
+static void _LZ_StreamSlide( LZ_CompressState *state )
+{
+    unsigned int i;
+
+    memmove( state->buf, &state->buf[ LZ_STREAM_WINDOW ],
+             state->end - LZ_STREAM_WINDOW );
+    memmove( state->chain, &state->chain[ LZ_STREAM_WINDOW ],
+             (state->end - LZ_STREAM_WINDOW) * sizeof(unsigned short) );
+    state->start -= LZ_STREAM_WINDOW;
+    state->end -= LZ_STREAM_WINDOW;
+
+    for( i = 0; i < LZ_STREAM_HASH; ++ i )
+    {
+        state->head[ i ] = (state->head[ i ] == LZ_STREAM_NONE) ||
+            (state->head[ i ] < LZ_STREAM_WINDOW) ? LZ_STREAM_NONE :
+            state->head[ i ] - LZ_STREAM_WINDOW;
+    }
+    for( i = 0; i < state->end; ++ i )
+    {
+        state->chain[ i ] = (state->chain[ i ] == LZ_STREAM_NONE) ||
+            (state->chain[ i ] < LZ_STREAM_WINDOW) ? LZ_STREAM_NONE :
+            state->chain[ i ] - LZ_STREAM_WINDOW;
+    }
+}
+
+
+/*************************************************************************
+* _LZ_StreamMatch() - Find the longest match for the data at pos in the
+* window. Returns its length, or 0 if it is not worth coding.
+*************************************************************************/
+
+static unsigned int _LZ_StreamMatch( LZ_CompressState *state,
+    unsigned int pos, unsigned int *offset )
+{
+    unsigned char *ptr1, *ptr2;
+    unsigned int  index, depth, bytesleft, maxlength;
+    unsigned int  length, bestlength, bestoffset;
+
+    bytesleft = state->end - pos;
+    if( bytesleft < 3 )
+    {
+        return 0;
+    }
+    maxlength = bytesleft < LZ_STREAM_MAXMATCH ? bytesleft : LZ_STREAM_MAXMATCH;
+    ptr1 = &state->buf[ pos ];
+
+    /* Search the hash chain for the longest match in the window */
+    bestlength = 3;
+    bestoffset = 0;
+    index = state->head[ _LZ_StreamHash( ptr1 ) ];
+    for( depth = 0; (index != LZ_STREAM_NONE) && (depth < state->depth) &&
+         (pos - index <= state->window) && (bestlength < maxlength); ++ depth )
+    {
+        ptr2 = &state->buf[ index ];
+        if( ptr2[ bestlength ] == ptr1[ bestlength ] )
+        {
+            length = _LZ_StringCompare( ptr1, ptr2, 0, maxlength );
+            if( length > bestlength )
+            {
+                bestlength = length;
+                bestoffset = pos - index;
+            }
+        }
+        index = state->chain[ index ];
+    }
+
+    /* Was there a good enough match? (same rules as LZ_CompressFast) */
+    if( (bestlength >= 8) ||
+        ((bestlength == 4) && (bestoffset <= 0x0000007f)) ||
+        ((bestlength == 5) && (bestoffset <= 0x00003fff)) ||
+        ((bestlength == 6) && (bestoffset <= 0x001fffff)) ||
+        ((bestlength == 7) && (bestoffset <= 0x0fffffff)) )
+    {
+        *offset = bestoffset;
+        return bestlength;
+    }
+    return 0;
+}
+
+
+/*************************************************************************
+* _LZ_StreamEncode() - Code the buffered data. Unless final is set, enough
+* data is held back to find a full length match at the last position.
+*************************************************************************/
+
+static int _LZ_StreamEncode( LZ_CompressState *state, unsigned char *out,
+    int final )
+{
+    unsigned char symbol;
+    unsigned int  outpos, pos, bytesleft;
+    unsigned int  bestlength, bestoffset, offset, i;
+
+    outpos = 0;
+    while( state->start < state->end )
+    {
+        pos = state->start;
+        bytesleft = state->end - pos;
+        if( !final && (bytesleft <= LZ_STREAM_MAXMATCH) )
+        {
+            break;
+        }
+
+        bestlength = _LZ_StreamMatch( state, pos, &bestoffset );
+
+        /* At the higher levels a match is put off by a literal when one
+           of the next few positions starts a longer one */
+        for( i = 1; (i <= state->lazy) && (bestlength > 0) &&
+             (bestlength < LZ_STREAM_MAXMATCH) && (i < bytesleft); ++ i )
+        {
+            if( _LZ_StreamMatch( state, pos + i, &offset ) > bestlength + i - 1 )
+            {
+                bestlength = 0;
+            }
+        }
+
+        if( bestlength > 0 )
+        {
+            out[ outpos ++ ] = state->marker;
+            outpos += _LZ_WriteVarSize( bestlength, &out[ outpos ] );
+            outpos += _LZ_WriteVarSize( bestoffset, &out[ outpos ] );
+            for( i = 0; i < bestlength; ++ i )
+            {
+                _LZ_StreamInsert( state, pos + i );
+            }
+            state->start += bestlength;
+        }
+        else
+        {
+            /* Output single byte (or two bytes if marker byte) */
+            symbol = state->buf[ pos ];
+            out[ outpos ++ ] = symbol;
+            if( symbol == state->marker )
+            {
+                out[ outpos ++ ] = 0;
+            }
+            _LZ_StreamInsert( state, pos );
+            ++ state->start;
+        }
+    }
+
+    return outpos;
+}
+
+
+/*************************************************************************
+* LZ_CompressInit() - Prepare a stream compressor.
+*  state  - Stream state.
+*  level  - 1 (fastest) to LZ_STREAM_MAXLEVEL (smallest output), 0 for
+*           LZ_STREAM_LEVEL.
+*************************************************************************/
+
+void LZ_CompressInit( LZ_CompressState *state, int level )
+{
+    unsigned int i;
+
+    if( level < 1 )
+    {
+        level = LZ_STREAM_LEVEL;
+    }
+    if( level > LZ_STREAM_MAXLEVEL )
+    {
+        level = LZ_STREAM_MAXLEVEL;
+    }
+    state->window = _LZ_StreamWindow[ level - 1 ];
+    state->depth = _LZ_StreamDepth[ level - 1 ];
+    state->lazy = _LZ_StreamLazy[ level - 1 ];
+
+    for( i = 0; i < LZ_STREAM_HASH; ++ i )
+    {
+        state->head[ i ] = LZ_STREAM_NONE;
+    }
+    for( i = 0; i < LZ_STREAM_BUFFER; ++ i )
+    {
+        state->chain[ i ] = LZ_STREAM_NONE;
+    }
+    state->start = 0;
+    state->end = 0;
+    state->marker = 0;
+    state->started = 0;
+}
+
+
+/*************************************************************************
+* LZ_CompressStream() - Compress the next chunk of a stream.
+*  state  - Stream state, see LZ_CompressInit().
+*  in     - Input (uncompressed) chunk.
+*  insize - Number of input bytes.
+*  out    - Output (compressed) buffer, LZ_STREAM_BOUND(insize) bytes.
+* The marker symbol is the least common byte of the first chunk. Some of
+* the input may be held back until the next call or LZ_CompressEnd().
+* The function returns the number of bytes written to out.
+*************************************************************************/
+
+int LZ_CompressStream( LZ_CompressState *state, unsigned char *in,
+    unsigned int insize, unsigned char *out )
+{
+    unsigned int histogram[ 256 ], outpos, i, n;
+
+    outpos = 0;
+    if( !state->started && (insize > 0) )
+    {
+        /* Find the least common byte, and use it as the marker symbol */
+        for( i = 0; i < 256; ++ i )
+        {
+            histogram[ i ] = 0;
+        }
+        for( i = 0; i < insize; ++ i )
+        {
+            ++ histogram[ in[ i ] ];
+        }
+        for( i = 1; i < 256; ++ i )
+        {
+            if( histogram[ i ] < histogram[ state->marker ] )
+            {
+                state->marker = (unsigned char) i;
+            }
+        }
+        out[ outpos ++ ] = state->marker;
+        state->started = 1;
+    }
+
+    while( insize > 0 )
+    {
+        if( state->end == LZ_STREAM_BUFFER )
+        {
+            _LZ_StreamSlide( state );
+        }
+        n = LZ_STREAM_BUFFER - state->end;
+        if( n > insize )
+        {
+            n = insize;
+        }
+        memcpy( &state->buf[ state->end ], in, n );
+        state->end += n;
+        in += n;
+        insize -= n;
+
+        outpos += _LZ_StreamEncode( state, &out[ outpos ], 0 );
+    }
+
+    return outpos;
+}
+
+
+/*************************************************************************
+* LZ_CompressEnd() - Code the data held back by LZ_CompressStream().
+*  out    - Output (compressed) buffer, LZ_STREAM_BOUND(0) bytes.
+* The function returns the number of bytes written to out.
+*************************************************************************/
+
+int LZ_CompressEnd( LZ_CompressState *state, unsigned char *out )
+{
+    if( !state->started )
+    {
+        return 0;
+    }
+
+    return _LZ_StreamEncode( state, out, 1 );
+}
+
+
+/*************************************************************************
+* _LZ_TokenSize() - Size of the token at buf, 0 if more than n bytes are
+* needed to tell, -1 if it is damaged.
+*************************************************************************/
+
+static int _LZ_TokenSize( unsigned char *buf, unsigned int n,
+    unsigned char marker )
+{
+    unsigned int pos, i, k;
+
+    if( n < 1 )
+    {
+        return 0;
+    }
+    if( buf[ 0 ] != marker )
+    {
+        return 1;
+    }
+    if( n < 2 )
+    {
+        return 0;
+    }
+    if( buf[ 1 ] == 0 )
+    {
+        return 2;
+    }
+
+    /* Marker, length and offset */
+    pos = 1;
+    for( k = 0; k < 2; ++ k )
+    {
+        for( i = 0; ; ++ i )
+        {
+            if( i >= 5 )
+            {
+                return -1;
+            }
+            if( pos >= n )
+            {
+                return 0;
+            }
+            if( !(buf[ pos ++ ] & 0x80) )
+            {
+                break;
+            }
+        }
+    }
+
+    return pos;
+}
+
+
+/*************************************************************************
+* LZ_UncompressInit() - Prepare a stream decompressor.
+*************************************************************************/
+
+void LZ_UncompressInit( LZ_UncompressState *state )
+{
+    state->outpos = 0;
+    state->copylength = 0;
+    state->copyoffset = 0;
+    state->numpending = 0;
+    state->marker = 0;
+    state->started = 0;
+}
+
+
+/*************************************************************************
+* LZ_UncompressStream() - Uncompress the next part of a stream.
+*  state   - Stream state, see LZ_UncompressInit().
+*  in      - Input (compressed) chunk.
+*  insize  - Number of input bytes.
+*  inused  - Set to the number of input bytes consumed. Tokens cut off at
+*            the end of the chunk are kept in the state.
+*  out     - Output (uncompressed) buffer.
+*  outsize - Size of the output buffer. Decoding stops when it is full.
+* The function returns the number of bytes written to out, or -1 if the
+* input is damaged.
+*************************************************************************/
+
+int LZ_UncompressStream( LZ_UncompressState *state, unsigned char *in,
+    unsigned int insize, unsigned int *inused, unsigned char *out,
+    unsigned int outsize )
+{
+    unsigned char *token, symbol;
+    unsigned int  inpos, outpos, length, offset;
+    int size;
+
+    inpos = 0;
+    outpos = 0;
+
+    /* Get marker symbol from input stream */
+    if( !state->started && (insize > 0) )
+    {
+        state->marker = in[ inpos ++ ];
+        state->started = 1;
+    }
+
+    while( outpos < outsize )
+    {
+        /* Continue a string copy */
+        if( state->copylength )
+        {
+            symbol = state->history[ (state->outpos - state->copyoffset) & (LZ_STREAM_HISTORY - 1) ];
+            state->history[ state->outpos ++ & (LZ_STREAM_HISTORY - 1) ] = symbol;
+            out[ outpos ++ ] = symbol;
+            -- state->copylength;
+            continue;
+        }
+
+        /* Get the next token, completing one cut off by the last chunk */
+        if( state->numpending )
+        {
+            while( (state->numpending < sizeof(state->pending)) && (inpos < insize) )
+            {
+                state->pending[ state->numpending ++ ] = in[ inpos ++ ];
+            }
+            size = _LZ_TokenSize( state->pending, state->numpending, state->marker );
+            if( size == 0 )
+            {
+                break;
+            }
+            if( size < 0 )
+            {
+                return -1;
+            }
+
+            /* Give back what belongs to the following tokens */
+            inpos -= state->numpending - size;
+            state->numpending = 0;
+            token = state->pending;
+        }
+        else
+        {
+            if( inpos >= insize )
+            {
+                break;
+            }
+            size = _LZ_TokenSize( &in[ inpos ], insize - inpos, state->marker );
+            if( size == 0 )
+            {
+                memcpy( state->pending, &in[ inpos ], insize - inpos );
+                state->numpending = insize - inpos;
+                inpos = insize;
+                break;
+            }
+            if( size < 0 )
+            {
+                return -1;
+            }
+            token = &in[ inpos ];
+            inpos += size;
+        }
+
+        if( (token[ 0 ] == state->marker) && (size > 2) )
+        {
+            /* Extract true length and offset */
+            size = _LZ_ReadVarSize( &length, &token[ 1 ] );
+            _LZ_ReadVarSize( &offset, &token[ 1 + size ] );
+            if( (offset == 0) || (offset > state->outpos) || (offset > LZ_STREAM_HISTORY) )
+            {
+                return -1;
+            }
+            state->copylength = length;
+            state->copyoffset = offset;
+        }
+        else
+        {
+            /* Plain byte, or a single occurrence of the marker byte */
+            symbol = token[ 0 ];
+            state->history[ state->outpos ++ & (LZ_STREAM_HISTORY - 1) ] = symbol;
+            out[ outpos ++ ] = symbol;
+        }
+    }
+
+    *inused = inpos;
+    return outpos;
+}
@@ -37,6 +37,48 @@ extern "C" {
 #endif
 
 
+/*************************************************************************
+* Streaming coder state
+*************************************************************************/
+
+/* The stream compressor keeps a fixed window and a bounded hash chain
+   table, so its memory use doesn't depend on the amount of data. */
+#define LZ_STREAM_WINDOW   0x4000   /* largest match offset, at the top levels */
+#define LZ_STREAM_BUFFER   (2 * LZ_STREAM_WINDOW)
+#define LZ_STREAM_MAXMATCH 0x100
+#define LZ_STREAM_HASH     0x1000
+#define LZ_STREAM_LEVEL    5        /* default level, see LZ_CompressInit() */
+#define LZ_STREAM_MAXLEVEL 6        /* deepest search plus lazy matching */
+
+/* The stream decompressor history also covers LZ_Compress() offsets */
+#define LZ_STREAM_HISTORY  0x20000
+
+/* Worst case output of one LZ_CompressStream() call */
+#define LZ_STREAM_BOUND(insize) (2 * ((insize) + LZ_STREAM_MAXMATCH) + 1)
+
+typedef struct
+{
+    unsigned char  buf[ LZ_STREAM_BUFFER ];
+    unsigned short head[ LZ_STREAM_HASH ];
+    unsigned short chain[ LZ_STREAM_BUFFER ];
+    unsigned int   start, end;  /* data in buf still to be coded */
+    unsigned int   window, depth, lazy;
+    unsigned char  marker;
+    int            started;
+} LZ_CompressState;
+
+typedef struct
+{
+    unsigned char  history[ LZ_STREAM_HISTORY ];
+    unsigned int   outpos;
+    unsigned int   copylength, copyoffset;
+    unsigned char  pending[ 11 ];  /* token cut off at the end of an input chunk */
+    unsigned int   numpending;
+    unsigned char  marker;
+    int            started;
+} LZ_UncompressState;
+
+
 /*************************************************************************
 * Function prototypes
 *************************************************************************/
@@ -44,6 +86,16 @@ extern "C" {
 int LZ_Compress( unsigned char *in, unsigned char *out, unsigned int insize );
 int LZ_CompressFast( unsigned char *in, unsigned char *out, unsigned int insize);
 int LZ_Uncompress( unsigned char *in, unsigned char *out, unsigned int insize );
+int LZ_UncompressSafe( unsigned char *in, unsigned char *out,
+    unsigned int insize, unsigned int outsize );
+void LZ_CompressInit( LZ_CompressState *state, int level );
+int LZ_CompressStream( LZ_CompressState *state, unsigned char *in,
+    unsigned int insize, unsigned char *out );
+int LZ_CompressEnd( LZ_CompressState *state, unsigned char *out );
+void LZ_UncompressInit( LZ_UncompressState *state );
+int LZ_UncompressStream( LZ_UncompressState *state, unsigned char *in,
+    unsigned int insize, unsigned int *inused, unsigned char *out,
+    unsigned int outsize );
 
 
 #ifdef __cplusplus
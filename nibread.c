@@ -22,18 +22,10 @@ char bitrate_range[4] = { 43 * 2, 31 * 2, 25 * 2, 18 * 2 };
 char bitrate_value[4] = { 0x00, 0x20, 0x40, 0x60 };
 char density_branch[4] = { 0xb1, 0xb5, 0xb7, 0xb9 };
 
-BYTE compressed_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE file_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE track_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE track_density[MAX_HALFTRACKS_1541 + 2];
-BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
-size_t track_length[MAX_HALFTRACKS_1541 + 2];
+nib_disk *disk;
 
 size_t error_retries;
-int file_buffer_size;
-int reduce_sync, reduce_badgcr, reduce_gap;
-int fix_gcr;
-int start_track, end_track, track_inc;
+int reduce_badgcr, reduce_gap;
 int read_killer;
 int align;
 int drivetype;
@@ -41,33 +33,22 @@ int imagetype;
 int mode;
 int force_density;
 int track_match;
-int gap_match_length;
-int cap_min_ignore;
 int interactive_mode;
 int verbose;
 int extended_parallel_test;
 int force_nosync;
 int ihs;
-int auto_capacity_adjust;
 int align_disk;
-int skew;
 int rawmode;
-int rpm_real;
 int unformat_passes;
 int capacity_margin;
 int align_delay;
 int align_report;
-int increase_sync = 0;
-int presync = 0;
 BYTE fillbyte = 0xfe;
 BYTE drive = 8;
 char * cbm_adapter = "";
 int use_floppycode_srq = 0;
 int override_srq = 0;
-int extra_capacity_margin=5;
-int sync_align_buffer=0;
-int fattrack=0;
-int old_g64=0;
 int backwards=0;
 
 BYTE density_map;
@@ -93,10 +74,7 @@ main(int argc, char *argv[])
 	if (argc < 2)
 		usage();
 
-	/* clear heap buffers */
-	memset(compressed_buffer, 0x00, sizeof(compressed_buffer));
-	memset(file_buffer, 0x00, sizeof(file_buffer));
-	memset(track_buffer, 0x00, sizeof(track_buffer));
+	if(!(disk = new_disk())) exit(0);
 
 #ifdef DJGPP
 	fd = 1;
@@ -105,14 +83,14 @@ main(int argc, char *argv[])
 	bump = 1;  /* failing to bump sometimes give us wrong tracks on heavily protected disks */
 	reset = 1;
 
-	start_track = 1 * 2;
-	end_track = 41 * 2;
-	track_inc = 2;
+	disk->opt.start_track = 1 * 2;
+	disk->opt.end_track = 41 * 2;
+	disk->opt.track_inc = 2;
 
-	reduce_sync = 4;
+	disk->opt.reduce_sync = 4;
 	reduce_badgcr = 0;
 	reduce_gap = 0;
-	fix_gcr = 0;
+	disk->opt.fix_gcr = 0;
 	read_killer = 1;
 	error_retries = 10;
 	force_density = 0;
@@ -122,8 +100,8 @@ main(int argc, char *argv[])
 	extended_parallel_test = 0;
 	force_nosync = 0;
 	align = ALIGN_NONE;
-	gap_match_length = 7;
-	cap_min_ignore = 0;
+	disk->opt.gap_match_length = 7;
+	disk->opt.cap_min_ignore = 0;
 	ihs = 0;
 	mode = MODE_READ_DISK;
 	align_report = 0;
@@ -185,8 +163,8 @@ main(int argc, char *argv[])
 			break;
 
 		case 'h':
-			track_inc = 1;
-			end_track = 83;
+			disk->opt.track_inc = 1;
+			disk->opt.end_track = 83;
 			printf("* Using halftracks\n");
 			break;
 
@@ -230,15 +208,15 @@ main(int argc, char *argv[])
 		case 'S':
 			if (!(*argv)[2]) usage();
 			st = atof(&(*argv)[2])*2;
-			start_track = (int)st;
-			printf("* Start track set to %.1f (%d)\n", st/2, start_track);
+			disk->opt.start_track = (int)st;
+			printf("* Start track set to %.1f (%d)\n", st/2, disk->opt.start_track);
 			break;
 
 		case 'E':
 			if (!(*argv)[2]) usage();
 			et = atof(&(*argv)[2])*2;
-			end_track = (int)et;
-			printf("* End track set to %.1f (%d)\n", et/2, end_track);
+			disk->opt.end_track = (int)et;
+			printf("* End track set to %.1f (%d)\n", et/2, disk->opt.end_track);
 			break;
 
 		case 'D':
@@ -249,8 +227,8 @@ main(int argc, char *argv[])
 
 		case 'G':
 			if (!(*argv)[2]) usage();
-			gap_match_length = atoi(&(*argv)[2]);
-			printf("* Gap match length set to %d\n", gap_match_length);
+			disk->opt.gap_match_length = atoi(&(*argv)[2]);
+			printf("* Gap match length set to %d\n", disk->opt.gap_match_length);
 			break;
 
 		case 'v':
@@ -258,6 +236,10 @@ main(int argc, char *argv[])
 			printf("* Verbose mode on\n");
 			break;
 
+		case 'Z':
+			parse_nbz_level(&(*argv)[2], &disk->opt);
+			break;
+
 		case 'e':	// change read retries
 			if (!(*argv)[2]) usage();
 			error_retries = atoi(&(*argv)[2]);
@@ -266,7 +248,12 @@ main(int argc, char *argv[])
 
 		case 'm':
 			printf("* Minimum capacity ignore on\n");
-			cap_min_ignore = 1;
+			disk->opt.cap_min_ignore = 1;
+			break;
+
+		case 'l':
+			printf("* Compare tracks by banded alignment\n");
+			disk->opt.compare_banded = 1;
 			break;
 
 		default:
@@ -377,10 +364,10 @@ main(int argc, char *argv[])
 			printf("Error: Could not allocate memory for Deep Bitrate Scan buffer.\n");
 			exit(0);
 		}
-		DeepBitrateAnalysis(fd,filename,track_buffer,logline);
+		DeepBitrateAnalysis(fd,filename,disk->track_buffer,logline);
 	}
 	else if (track_align_report) // "-x"
-		TrackAlignmentReport2(fd,track_buffer);
+		TrackAlignmentReport2(fd,disk->track_buffer);
 	else
 	{
 		if(!(disk2file(fd, filename)))
@@ -432,14 +419,13 @@ int disk2file(CBM_FILE fd, char *filename)
 
 	if(compare_extension(filename, "NB2"))
 	{
-		track_inc = 1;
+		disk->opt.track_inc = 1;
 		if(!(write_nb2(fd, filename))) return 0;
 	}
 	else if(compare_extension(filename, "NIB"))
 	{
-		if(!(read_floppy(fd, track_buffer, track_density, track_length))) return 0;
-		if(!(file_buffer_size = write_nib(file_buffer, track_buffer, track_density, track_length))) return 0;
-		if(!(save_file(filename, file_buffer, file_buffer_size))) return 0;
+		if(!(read_floppy(fd, disk))) return 0;
+		if(!(write_nib_file(filename, disk))) return 0;
 
 		if(interactive_mode)
 		{
@@ -458,18 +444,15 @@ int disk2file(CBM_FILE fd, char *filename)
 				strcat(newfilename, filenum);
 				strcat(newfilename, ".nib");
 
-				if(!(read_floppy(fd, track_buffer, track_density, track_length))) return 0;
-				if(!(file_buffer_size = write_nib(file_buffer, track_buffer, track_density, track_length))) return 0;
-				if(!(save_file(newfilename, file_buffer, file_buffer_size))) return 0;
+				if(!(read_floppy(fd, disk))) return 0;
+				if(!(write_nib_file(newfilename, disk))) return 0;
 			}
 		}
 	}
 	else
 	{
-		if(!(read_floppy(fd, track_buffer, track_density, track_length))) return 0;
-		if(!(file_buffer_size = write_nib(file_buffer, track_buffer, track_density, track_length))) return 0;
-		if(!(file_buffer_size = LZ_CompressFast(file_buffer, compressed_buffer, file_buffer_size))) return 0;
-		if(!(save_file(filename, compressed_buffer, file_buffer_size))) return 0;
+		if(!(read_floppy(fd, disk))) return 0;
+		if(!(write_nbz(filename, disk))) return 0;
 
 		if(interactive_mode)
 		{
@@ -488,10 +471,8 @@ int disk2file(CBM_FILE fd, char *filename)
 				strcat(newfilename, filenum);
 				strcat(newfilename, ".nbz");
 
-				if(!(read_floppy(fd, track_buffer, track_density, track_length))) return 0;
-				if(!(file_buffer_size = write_nib(file_buffer, track_buffer, track_density, track_length))) return 0;
-				if(!(file_buffer_size = LZ_CompressFast(file_buffer, compressed_buffer, file_buffer_size))) return 0;
-				if(!(save_file(newfilename, compressed_buffer, file_buffer_size))) return 0;
+				if(!(read_floppy(fd, disk))) return 0;
+				if(!(write_nbz(newfilename, disk))) return 0;
 			}
 		}
 	}
@@ -513,7 +494,9 @@ usage(void)
 	     " -k: Disable reading of 'killer' tracks\n"
 	     " -d: Force default densities\n"
 	     " -v: Enable track matching (crude read verify)\n"
+	     " -l: Compare tracks by banded alignment\n"
 	     " -I: Interactive imaging mode\n"
+	     " -Z[n]: NBZ compression level 'n' (1 fastest - 6 smallest)\n"
 //	     " -m: Disable minimum capacity check\n"
 	     " -V: Verbose (output more detailed track data)\n"
 	     " -h: Read halftracks\n"
@@ -16,57 +16,75 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <fcntl.h>
 
 #include "mnibarch.h"
 #include "gcr.h"
 #include "nibtools.h"
-#include "lz.h"
 
 int _dowildcard = 1;
 
-BYTE compressed_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE file_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE track_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE track_density[MAX_HALFTRACKS_1541 + 2];
-BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
-size_t track_length[MAX_HALFTRACKS_1541 + 2];
-int file_buffer_size;
-int start_track, end_track, track_inc;
-int reduce_sync, reduce_badgcr, reduce_gap;
-int fix_gcr, align, force_align;
-int gap_match_length;
-int cap_min_ignore;
+nib_disk *disk;
+int reduce_badgcr, reduce_gap;
+int align, force_align;
 int skip_halftracks;
 int verbose = 0;
-int rpm_real;
 int ihs;
-int auto_capacity_adjust;
 int align_disk;
-int skew;
 int mode;
 int unformat_passes;
 int capacity_margin;
 int align_delay;
-int increase_sync = 0;
-int presync = 0;
 BYTE fillbyte = 0xfe;
 BYTE drive = 8;
 char * cbm_adapter = "";
 int use_floppycode_srq = 0;
 int override_srq = 0;
-int extra_capacity_margin=5;
-int sync_align_buffer=0;
-int fattrack=0;
 int track_match=0;
-int old_g64=0;
 int read_killer=1;
 int backwards=0;
+int repair_batch=0;
+size_t repair_budget=REPAIR_BUDGET;
+
+/* what was done to a sector */
+#define REPAIRED_HEADER		0x01
+#define REPAIRED_DATA		0x02
+#define PATCHED_CHECKSUM	0x04
+#define PATCHED_GCR			0x08
+#define SEARCHED_DATA		0x10
+
+typedef struct
+{
+	BYTE error;			/* error left after repair */
+	int actions;
+	gcr_repair search;	/* last data block search */
+} sector_repair;
+
+sector_repair repair_report[MAXBLOCKSONDISK];
+
+/* output of one track, kept while tracks are repaired in parallel */
+#define REPAIR_LOG_SIZE 0x2000
+
+typedef struct
+{
+	int quiet;		/* keep the output in text instead of printing it */
+	char text[REPAIR_LOG_SIZE];
+} repair_log;
+
+/* tracks handed to repair_track() */
+typedef struct
+{
+	BYTE *id;
+	int first_block[MAX_HALFTRACKS_1541 + 2];
+	repair_log log[MAX_HALFTRACKS_1541 + 2];
+} repair_job;
 
 /* local prototypes */
 int repair(void);
-BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector, BYTE *id);
+BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector, BYTE *id, sector_repair *report, repair_log *log);
+void print_repair_report(void);
 
 int ARCH_MAINDECL
 main(int argc, char **argv)
@@ -74,33 +92,45 @@ main(int argc, char **argv)
 	char inname[256], outname[256];
 	char *dotpos;
 
-	start_track = 1 * 2;
-	end_track = 42 * 2;
-	track_inc = 2;
-	fix_gcr = 1;
-	reduce_sync = 4;
+	if(!(disk = new_disk())) exit(0);
+
+	disk->opt.start_track = 1 * 2;
+	disk->opt.end_track = 42 * 2;
+	disk->opt.track_inc = 2;
+	disk->opt.fix_gcr = 1;
+	disk->opt.reduce_sync = 4;
 	reduce_badgcr = 0;
 	reduce_gap = 0;
 	skip_halftracks = 0;
 	align = ALIGN_NONE;
 	force_align = ALIGN_NONE;
-	gap_match_length = 7;
-	cap_min_ignore = 0;
+	disk->opt.gap_match_length = 7;
+	disk->opt.cap_min_ignore = 0;
 
 	fprintf(stdout,
 		"\nnibrepair - converts a damaged NIB/NB2/G64 to a new 'repaired' G64 file.\n"
 		AUTHOR VERSION "\n\n");
 
-	/* clear heap buffers */
-	memset(compressed_buffer, 0x00, sizeof(compressed_buffer));
-	memset(file_buffer, 0x00, sizeof(file_buffer));
-	memset(track_buffer, 0x00, sizeof(track_buffer));
-
 	/* default is to reduce sync */
-	memset(reduce_map, REDUCE_SYNC, MAX_TRACKS_1541+1);
+	memset(disk->opt.reduce_map, REDUCE_SYNC, MAX_TRACKS_1541+1);
 
 	while (--argc && (*(++argv)[0] == '-'))
-		parseargs(argv);
+	{
+		/* nibrepair only switches */
+		if ((*argv)[1] == 'n')
+		{
+			repair_batch = 1;
+			printf("* Batch mode, only repair what the checksum confirms\n");
+		}
+		else if ((*argv)[1] == 'N')
+		{
+			if (!(*argv)[2]) usage();
+			repair_budget = atol(&(*argv)[2]);
+			printf("* Repair search budget set to %d steps per sector\n", (int)repair_budget);
+		}
+		else
+			parseargs(argv, &disk->opt);
+	}
 
 	if(argc < 1)	usage();
 	strcpy(inname, argv[0]);
@@ -115,31 +145,28 @@ main(int argc, char **argv)
 	/* convert */
 	if (compare_extension(inname, "G64"))
 	{
-		if(!(read_g64(inname, track_buffer, track_density, track_length))) exit(0);
-		if(sync_align_buffer)	sync_tracks(track_buffer, track_density, track_length, track_alignment);
+		if(!(read_g64(inname, disk))) exit(0);
+		if(disk->opt.sync_align_buffer)	sync_tracks(disk);
 	}
 	else if (compare_extension(inname, "NBZ"))
 	{
 		printf("Uncompressing NBZ...\n");
-		if(!(file_buffer_size = load_file(inname, compressed_buffer))) exit(0);
-		if(!(file_buffer_size = LZ_Uncompress(compressed_buffer, file_buffer, file_buffer_size))) exit(0);
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) exit(0);
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
+		if(!(read_nbz(inname, disk))) exit(0);
+		align_tracks(disk);
 	}
 	else if (compare_extension(inname, "NIB"))
 	{
-		if(!(file_buffer_size = load_file(inname, file_buffer))) exit(0);
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) exit(0);
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
+		if(!(read_nib_file(inname, disk))) exit(0);
+		align_tracks(disk);
 	}
 	else if (compare_extension(inname, "NB2"))
 	{
-		if(!(read_nb2(inname, track_buffer, track_density, track_length))) exit(0);
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
+		if(!(read_nb2(inname, disk))) exit(0);
+		align_tracks(disk);
 	}
 	else if (compare_extension(inname, "D64"))
 	{
-		if(!(read_d64(inname, track_buffer, track_density, track_length))) exit(0);
+		if(!(read_d64(inname, disk))) exit(0);
 	}
 	else
 	{
@@ -147,80 +174,187 @@ main(int argc, char **argv)
 		exit(0);
 	}
 
-	if(skip_halftracks) track_inc = 2;
+	if(skip_halftracks) disk->opt.track_inc = 2;
 
 	repair();
-	write_g64(outname, track_buffer, track_density, track_length);
+	write_g64(outname, disk);
 
+	free_disk(disk);
 	return 0;
 }
 
+static void
+repair_printf(repair_log *log, const char *format, ...)
+{
+	va_list args;
+	size_t used;
+
+	va_start(args, format);
+	if (log->quiet)
+	{
+		used = strlen(log->text);
+		vsnprintf(log->text + used, sizeof(log->text) - used, format, args);
+	}
+	else
+		vprintf(format, args);
+	va_end(args);
+}
+
+static void
+repair_track(void *arg, int track)
+{
+	repair_job *job = arg;
+	repair_log *log = &job->log[track];
+	int sector, blockindex;
+	BYTE errorcode;
+
+	blockindex = job->first_block[track];
+	for (sector = 0; sector < sector_map[track/2]; sector++)
+	{
+			//firstpass
+			errorcode = repair_GCR_sector(disk->track_buffer + (track * NIB_TRACK_LENGTH),
+																	disk->track_buffer + (track * NIB_TRACK_LENGTH) + disk->track_length[track],
+																	track/2, sector, job->id, &repair_report[blockindex], log);
+
+			//secondpass
+			if(errorcode != SECTOR_OK)
+			{
+				errorcode = repair_GCR_sector(disk->track_buffer + (track * NIB_TRACK_LENGTH),
+																	disk->track_buffer + (track * NIB_TRACK_LENGTH) + disk->track_length[track],
+																	track/2, sector, job->id, &repair_report[blockindex], log);
+			}
+
+			repair_report[blockindex].error = errorcode;
+
+			switch(errorcode)
+			{
+					case SYNC_NOT_FOUND:
+							repair_printf(log, "T%dS%d Sync not found - Cannot repair\n", track/2, sector);
+							break;
+
+					case HEADER_NOT_FOUND:
+							repair_printf(log, "T%dS%d Header not found - Cannot repair\n", track/2, sector);
+							break;
+
+					case DATA_NOT_FOUND:
+							repair_printf(log, "T%dS%d Data block not found - Cannot repair\n", track/2, sector);
+							break;
+
+					case ID_MISMATCH:
+							repair_printf(log, "T%dS%d Disk ID Mismatch - Cannot repair\n", track/2, sector);
+							break;
+
+					case BAD_GCR_CODE:
+							repair_printf(log, "T%dS%d Illegal GCR - Cannot repair\n", track/2, sector);
+							break;
+
+			}
+			blockindex++;
+	}
+
+	/* repaired sectors were written into the track */
+	invalidate_track_index(disk, track);
+}
+
 int repair(void)
 {
-	int track, sector;
+	int track;
 	int blockindex = 0;
+	int jobs = disk->opt.threads;
 	BYTE id[3];
-	BYTE errorinfo[MAXBLOCKSONDISK], errorcode;
+	repair_job *job;
 
 	printf("\nScanning for errors...\n");
 
 	/* get disk id */
-	if (!extract_id(track_buffer + (18 * 2 * NIB_TRACK_LENGTH), id))
+	if (!extract_id(disk->track_buffer + (18 * 2 * NIB_TRACK_LENGTH), id))
 	{
 		printf("Cannot find directory sector.\n");
 		return 0;
 	}
 
-	for (track = start_track; track <= 35*2 /*end_track*/; track += track_inc)
+	if(!(job = calloc(1, sizeof(repair_job))))
 	{
-		for (sector = 0; sector < sector_map[track/2]; sector++)
-		{
-				//firstpass
-				errorcode = repair_GCR_sector(track_buffer + (track * NIB_TRACK_LENGTH),
-																		track_buffer + (track * NIB_TRACK_LENGTH) + track_length[track],
-																		track/2, sector, id);
+		printf("Could not allocate memory for repair.\n");
+		return 0;
+	}
+	job->id = id;
 
-				//secondpass
-				if(errorcode != SECTOR_OK)
-				{
-					errorcode = repair_GCR_sector(track_buffer + (track * NIB_TRACK_LENGTH),
-																		track_buffer + (track * NIB_TRACK_LENGTH) + track_length[track],
-																		track/2, sector, id);
-				}
+	memset(repair_report, 0, sizeof(repair_report));
 
-				errorinfo[blockindex] = errorcode;
+	for (track = disk->opt.start_track; track <= 35*2 /*disk->opt.end_track*/; track += disk->opt.track_inc)
+	{
+		job->first_block[track] = blockindex;
+		blockindex += sector_map[track/2];
+	}
 
-				switch(errorcode)
-				{
-						case SYNC_NOT_FOUND:
-								printf("T%dS%d Sync not found - Cannot repair\n", track/2, sector);
-								break;
+	/* the checksum search is slow, but questions are only asked one at a time */
+	if(!repair_batch) jobs = 1;
 
-						case HEADER_NOT_FOUND:
-								printf("T%dS%d Header not found - Cannot repair\n", track/2, sector);
-								break;
+	if(jobs > 1)
+	{
+		for (track = disk->opt.start_track; track <= 35*2; track += disk->opt.track_inc)
+			job->log[track].quiet = 1;
 
-						case DATA_NOT_FOUND:
-								printf("T%dS%d Data block not found - Cannot repair\n", track/2, sector);
-								break;
+		for_each_track(repair_track, job, disk->opt.start_track, 35*2, disk->opt.track_inc, jobs);
 
-						case ID_MISMATCH:
-								printf("T%dS%d Disk ID Mismatch - Cannot repair\n", track/2, sector);
-								break;
+		/* print in track order what the tracks would have printed */
+		for (track = disk->opt.start_track; track <= 35*2; track += disk->opt.track_inc)
+			printf("%s", job->log[track].text);
+	}
+	else
+	{
+		for (track = disk->opt.start_track; track <= 35*2; track += disk->opt.track_inc)
+			repair_track(job, track);
+	}
 
-						case BAD_GCR_CODE:
-								printf("T%dS%d Illegal GCR - Cannot repair\n", track/2, sector);
-								break;
+	free(job);
+	print_repair_report();
+	return 0;
+}
 
-				}
-				blockindex++;
+void print_repair_report(void)
+{
+	int track, sector, blockindex = 0;
+	sector_repair *report;
+
+	printf("\nRepair report:\n");
+
+	for (track = disk->opt.start_track; track <= 35*2; track += disk->opt.track_inc)
+	{
+		for (sector = 0; sector < sector_map[track/2]; sector++)
+		{
+			report = &repair_report[blockindex++];
+			if ((!report->actions) && (report->error == SECTOR_OK))
+				continue;
+
+			printf("T%dS%d: E%d", track/2, sector, report->error);
+			if (report->actions & REPAIRED_HEADER) printf(" header checksum repaired,");
+			if (report->actions & REPAIRED_DATA) printf(" data repaired (%d codes),", report->search.changed);
+			if (report->actions & PATCHED_CHECKSUM) printf(" data checksum patched,");
+			if (report->actions & PATCHED_GCR) printf(" bad GCR patched,");
+
+			if (report->actions & SEARCHED_DATA)
+			{
+				printf(" bad codes:%d candidates:%d steps:%ld", report->search.bad_codes,
+					report->search.edits, report->search.candidates);
+				if (!report->search.bad_codes)
+					printf(" (no bad GCR to work from)");
+				else if (report->search.bad_codes > REPAIR_MAX_BAD)
+					printf(" (too damaged)");
+				else if (report->search.truncated)
+					printf(" (budget exhausted)");
+				else if (report->search.solutions > 1)
+					printf(" (ambiguous, %d solutions)", report->search.solutions);
+				else if (!(report->actions & REPAIRED_DATA))
+					printf(" (no solution)");
+			}
+			printf("\n");
 		}
 	}
-
-	return 0;
 }
 
-BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector, BYTE *id)
+BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector, BYTE *id, sector_repair *report, repair_log *log)
 {
 
 	/* Try to repair some common GCR errors
@@ -234,10 +368,13 @@ BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector,
 	BYTE header[10];	/* block header */
 	BYTE hdr_chksum;	/* header checksum */
 	BYTE blk_chksum;	/* block  checksum */
-	BYTE *gcr_ptr, *gcr_end, *gcr_last;
+	BYTE *gcr_ptr, *gcr_end;
 	BYTE *sectordata;
 	BYTE error_code;
-    int i, j;
+	track_index *tindex;
+	track_index sector_index;
+	sector_header entry;
+    int i, j, cursor;
     size_t track_len;
     BYTE d64_sector[260];
     int answer;
@@ -257,45 +394,35 @@ BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector,
 	d64_sector[257] = blk_chksum;
 
 	/* Check for missing SYNCs */
-  	gcr_last = gcr_ptr = gcr_start;
-  	gcr_end = gcr_cycle;
-    while (gcr_ptr < gcr_end)
-    {
-        find_sync(&gcr_ptr, gcr_end);
-        if ((gcr_ptr-gcr_last) > MAX_SYNC_OFFSET)
-            return (SYNC_NOT_FOUND);
-        else
-            gcr_last = gcr_ptr;
-   }
-
-	/* Try to find block header for Track/Sector */
+	gcr_end = gcr_cycle;
+	tindex = index_track(&sector_index, gcr_start, track_len);
+	if (tindex->sync_gap_max > MAX_SYNC_OFFSET)
+		return (SYNC_NOT_FOUND);
+
 	/* Try to find a good block header for Track/Sector */
 	error_code = HEADER_NOT_FOUND;
 
-	for (gcr_ptr = gcr_start; gcr_ptr < gcr_end - 10; gcr_ptr++)
+	cursor = 0;
+	while (next_indexed_header(tindex, &cursor, &entry))
 	{
-		if ((gcr_ptr[0] == 0xff) && (gcr_ptr[1] == 0x52))
+		gcr_ptr = gcr_start + entry.pos;
+		memset(header, 0, 10);
+		memcpy(header, entry.header, sizeof(entry.header));
+
+		if ((header[0] == 0x08) &&
+			(header[2] == sector) &&
+			(header[3] == track) )
 		{
-			gcr_ptr++;
-			memset(header, 0, 10);
-			convert_4bytes_from_GCR(gcr_ptr, header);
-			convert_4bytes_from_GCR(gcr_ptr+5, header+4);
-
-			if ((header[0] == 0x08) &&
-				(header[2] == sector) &&
-				(header[3] == track) )
-			{
-				/* this is the header we are searching for */
-				error_code = SECTOR_OK;
-				break;
-			}
+			/* this is the header we are searching for */
+			error_code = SECTOR_OK;
+			break;
+		}
 
-			if((header[3]>35)&(verbose)) printf(" Header damaged - Track %d out of range\n", header[3]);
-			if((header[2]>21)&(verbose)) printf(" Header damaged - Sector %d out of range\n", header[2]);
+		if((header[3]>35)&(verbose)) repair_printf(log, " Header damaged - Track %d out of range\n", header[3]);
+		if((header[2]>21)&(verbose)) repair_printf(log, " Header damaged - Sector %d out of range\n", header[2]);
 
-			if(verbose>2) printf("{1:%.2x, 2:%.2x, 3:%.2x, 4:%.2x, 5:%.2x}{I:%.2x, T:%.2d, S:%.2d}\n",
-				gcr_ptr[1], gcr_ptr[2], gcr_ptr[3], gcr_ptr[4], gcr_ptr[5], header[0],header[3],header[2]);
-		}
+		if(verbose>2) repair_printf(log, "{1:%.2x, 2:%.2x, 3:%.2x, 4:%.2x, 5:%.2x}{I:%.2x, T:%.2d, S:%.2d}\n",
+			gcr_ptr[1], gcr_ptr[2], gcr_ptr[3], gcr_ptr[4], gcr_ptr[5], header[0],header[3],header[2]);
 	}
 
 	if(error_code != SECTOR_OK)
@@ -308,43 +435,58 @@ BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector,
 
 	if (hdr_chksum != header[5])
 	{
-		printf("T%dS%d Bad Header Checksum $%.2x != $%.2x - Repair (Y/n)? ", track, sector, hdr_chksum, header[5]);
-		fflush(stdin);
-		answer = getchar();
+		repair_printf(log, "T%dS%d Bad Header Checksum $%.2x != $%.2x - Repair (Y/n)? ", track, sector, hdr_chksum, header[5]);
+		if(repair_batch)
+			answer = 'y';
+		else
+		{
+			fflush(stdin);
+			answer = getchar();
+		}
 
 		if(answer != 'n')
 		{
 			/* patch back */
 			header[5] = hdr_chksum;
-			gcr_ptr--;
-			convert_4bytes_from_GCR(header, gcr_ptr);
-			convert_4bytes_from_GCR(header + 4, gcr_ptr + 5);
-			gcr_ptr++;
-			printf("Repaired\n");
+			convert_4bytes_to_GCR(header, gcr_ptr);
+			convert_4bytes_to_GCR(header + 4, gcr_ptr + 5);
+			report->actions |= REPAIRED_HEADER;
+			repair_printf(log, "Repaired\n");
 		}
 		else
-			printf("Not repaired\n");
+			repair_printf(log, "Not repaired\n");
 
 		error_code = (error_code == SECTOR_OK) ? BAD_HEADER_CHECKSUM : error_code;
 	}
 
 	/* verify that our header contains no bad GCR, since it can be false positive checksum match */
-	for(j = 0; j < 10; j++)
-		if (is_bad_gcr(gcr_ptr - 1, 10, j)) error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
+	if (bad_gcr_map(gcr_ptr - 1, 10, NULL)) error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
 
 	/* check for data sector */
 	if (!find_sync(&gcr_ptr, gcr_end))
 		return (DATA_NOT_FOUND);
 
-	for (i = 0, sectordata = d64_sector; i < 65; i++)
-	{
-		if (gcr_ptr >= gcr_end - 5)
-			return (DATA_NOT_FOUND);  /* short sector */
+	if (gcr_ptr + 325 >= gcr_end)
+		return (DATA_NOT_FOUND);  /* short sector */
+
+	convert_GCR_quintets(gcr_ptr, d64_sector, 65);
+
+	/* look for a set of common misreads that makes the checksum come out right */
+	for (i = 1, blk_chksum = 0; i <= 256; i++)
+		blk_chksum ^= d64_sector[i];
 
-		convert_4bytes_from_GCR(gcr_ptr, sectordata);
-		gcr_ptr += 5;
-		sectordata += 4;
+	if ((blk_chksum != d64_sector[257]) || (bad_gcr_map(gcr_ptr, 320, NULL)))
+	{
+		report->actions |= SEARCHED_DATA;
+		if (search_GCR_repair(gcr_ptr, repair_budget, &report->search))
+		{
+			repair_printf(log, "T%dS%d Data repaired (%d codes changed, %ld steps)\n",
+				track, sector, report->search.changed, report->search.candidates);
+			report->actions |= REPAIRED_DATA;
+			convert_GCR_quintets(gcr_ptr, d64_sector, 65);
+		}
 	}
+	gcr_ptr += 325;
 
 	/* check for correct disk ID */
 	if (header[5] != id[0] || header[4] != id[1])
@@ -360,9 +502,14 @@ BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector,
 
 	if (blk_chksum != d64_sector[257])
 	{
-		printf("T%dS%d Bad Data Checksum $%.2x != $%.2x - Repair Checksum, Data, or Neither (c/d/N)? ", track, sector, blk_chksum, d64_sector[257]);
-		fflush(stdin);
-		answer = getchar();
+		repair_printf(log, "T%dS%d Bad Data Checksum $%.2x != $%.2x - Repair Checksum, Data, or Neither (c/d/N)? ", track, sector, blk_chksum, d64_sector[257]);
+		if(repair_batch)
+			answer = 'n';
+		else
+		{
+			fflush(stdin);
+			answer = getchar();
+		}
 
 		if(answer == 'c')
 		{
@@ -375,7 +522,8 @@ BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector,
 				gcr_ptr += 5;
 				sectordata += 4;
 			}
-			printf("Checksum Patched\n");
+			report->actions |= PATCHED_CHECKSUM;
+			repair_printf(log, "Checksum Patched\n");
 		}
 		else if(answer == 'd')
 		{
@@ -384,24 +532,24 @@ BYTE repair_GCR_sector(BYTE *gcr_start, BYTE *gcr_cycle, int track, int sector,
 			{
 				if (is_bad_gcr(gcr_ptr, 320, j))
 				{
-					printf("pos:%d/%d = "BYTETOBINARYPATTERN" "BYTETOBINARYPATTERN, j-1, j, BYTETOBINARY(gcr_ptr[j-1]), BYTETOBINARY(gcr_ptr[j]));
-					printf("\n");
+					repair_printf(log, "pos:%d/%d = "BYTETOBINARYPATTERN" "BYTETOBINARYPATTERN, j-1, j, BYTETOBINARY(gcr_ptr[j-1]), BYTETOBINARY(gcr_ptr[j]));
+					repair_printf(log, "\n");
 				 	gcr_ptr[j] |= 0x80;
-				 	printf("pos:%d/%d = "BYTETOBINARYPATTERN" "BYTETOBINARYPATTERN, j-1, j, BYTETOBINARY(gcr_ptr[j-1]), BYTETOBINARY(gcr_ptr[j]));
-					printf("\n");
-					printf("Bad GCR Patched\n");
+				 	repair_printf(log, "pos:%d/%d = "BYTETOBINARYPATTERN" "BYTETOBINARYPATTERN, j-1, j, BYTETOBINARY(gcr_ptr[j-1]), BYTETOBINARY(gcr_ptr[j]));
+					repair_printf(log, "\n");
+					repair_printf(log, "Bad GCR Patched\n");
+					report->actions |= PATCHED_GCR;
 				}
 			}
 		}
 		else
-			printf("Not repaired\n");
+			repair_printf(log, "Not repaired\n");
 
 		error_code = (error_code == SECTOR_OK) ? BAD_DATA_CHECKSUM : error_code;
 	}
 
 	/* verify that our data contains no bad GCR, since it can be false positive checksum match */
-	for(j = 0; j < 320; j++)
-		if (is_bad_gcr(gcr_ptr - 325, 320, j)) error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
+	if (bad_gcr_map(gcr_ptr - 325, 320, NULL)) error_code = (error_code == SECTOR_OK) ? BAD_GCR_CODE : error_code;
 
 	return (error_code);
 }
@@ -410,6 +558,9 @@ void
 usage(void)
 {
 	printf("usage: nibrepair [options] <filename>\n\n");
+	printf(
+	" -n: Batch mode, never ask (only checksum confirmed repairs)\n"
+	" -N[n]: Repair search budget per sector (default: %d)\n", REPAIR_BUDGET);
 	switchusage();
 	exit(1);
 }
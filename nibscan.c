@@ -14,13 +14,12 @@
 #include "nibtools.h"
 #include "prot.h"
 #include "md5.h"
-#include "lz.h"
 
 int _dowildcard = 1;
 
 char bitrate_range[4] = { 43 * 2, 31 * 2, 25 * 2, 18 * 2 };
 
-int load_image(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+int load_image(char *filename, nib_disk *disk);
 int compare_disks(void);
 int scandisk(void);
 int raw_track_info(BYTE *gcrdata, size_t length);
@@ -28,54 +27,31 @@ int dump_headers(BYTE * gcrdata, size_t length);
 size_t check_fat(int track);
 size_t check_rapidlok(int track);
 
-BYTE compressed_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE file_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE track_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE track_buffer2[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-size_t track_length[MAX_HALFTRACKS_1541 + 2];
-size_t track_length2[MAX_HALFTRACKS_1541 + 2];
-BYTE track_density[MAX_HALFTRACKS_1541 + 2];
-BYTE track_density2[MAX_HALFTRACKS_1541 + 2];
-BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
-BYTE track_alignment2[MAX_HALFTRACKS_1541 + 2];
+nib_disk *disk;
+nib_disk *disk2;
 
 size_t fat_tracks[MAX_HALFTRACKS_1541 + 2];
 size_t rapidlok_tracks[MAX_HALFTRACKS_1541 + 2];
 size_t badgcr_tracks[MAX_HALFTRACKS_1541 + 2];
 
-int start_track, end_track, track_inc;
 int imagetype, mode;
 int align, force_align;
-int file_buffer_size;
-int fix_gcr;
-int reduce_sync;
 int reduce_badgcr;
 int reduce_gap;
 int waitkey = 0;
-int gap_match_length;
 int cap_relax;
 int verbose;
-int rpm_real;
-int auto_capacity_adjust;
-int skew;
 int align_disk;
 int ihs;
 int unformat_passes;
 int capacity_margin;
 int align_delay;
-int cap_min_ignore;
-int increase_sync = 0;
-int presync = 0;
 BYTE fillbyte = 0xfe;
 BYTE drive = 8;
 char * cbm_adapter = "";
 int use_floppycode_srq = 0;
 int override_srq = 0;
-int extra_capacity_margin=5;
-int sync_align_buffer=0;
-int fattrack=0;
 int track_match=0;
-int old_g64=0;
 int read_killer=1;
 int backwards=0;
 
@@ -92,20 +68,22 @@ main(int argc, char *argv[])
 	char file2[256];
 	int i;
 
-	start_track = 1 * 2;
-	end_track = 42 * 2;
-	track_inc = 2;
+	if(!(disk = new_disk()) || !(disk2 = new_disk())) exit(0);
+
+	disk->opt.start_track = 1 * 2;
+	disk->opt.end_track = 42 * 2;
+	disk->opt.track_inc = 2;
 	align = ALIGN_NONE;
 	force_align = ALIGN_NONE;
-	fix_gcr = 0;
-	gap_match_length = 7;
+	disk->opt.fix_gcr = 0;
+	disk->opt.gap_match_length = 7;
 	cap_relax = 0;
 	mode = 0;
-	reduce_sync = 4;
+	disk->opt.reduce_sync = 4;
 	reduce_badgcr = 0;
 	reduce_gap = 0;
 	verbose = 1;
-	cap_min_ignore = 0;
+	disk->opt.cap_min_ignore = 0;
 
 	fprintf(stdout,
 		"\nnibscan - Commodore disk image scanner / comparator\n"
@@ -115,17 +93,14 @@ main(int argc, char *argv[])
 	if (argc < 2)
 		usage();
 
-	/* clear heap buffers */
-	memset(compressed_buffer, 0x00, sizeof(compressed_buffer));
-	memset(file_buffer, 0x00, sizeof(file_buffer));
-	memset(track_buffer, 0x00, sizeof(track_buffer));
-	memset(track_buffer2, 0x00, sizeof(track_buffer2));
-
 	/* default is to reduce sync */
-	memset(reduce_map, REDUCE_SYNC, MAX_TRACKS_1541+1);
+	memset(disk->opt.reduce_map, REDUCE_SYNC, MAX_TRACKS_1541+1);
 
 	while (--argc && (*(++argv)[0] == '-'))
-		parseargs(argv);
+		parseargs(argv, &disk->opt);
+
+	/* both images are processed with the same options */
+	disk2->opt = disk->opt;
 
 	if (argc < 0)	usage();
 	strcpy(file1, argv[0]);
@@ -139,28 +114,28 @@ main(int argc, char *argv[])
 
 	if (mode == 1) 	// compare images
 	{
-		if(!(load_image(file1, track_buffer, track_density, track_length))) exit(0);
-		if(!(load_image(file2, track_buffer2, track_density2, track_length2))) exit(0);
+		if(!(load_image(file1, disk))) exit(0);
+		if(!(load_image(file2, disk2))) exit(0);
 
 		compare_disks();
 
 		/* disk 1 */
 		printf("\n1: %s\n", file1);
 
-		crc_dir = crc_dir_track(track_buffer, track_length);
+		crc_dir = crc_dir_track(disk);
 		printf("BAM/DIR CRC:\t\t\t0x%X\n", crc_dir);
-		crc = crc_all_tracks(track_buffer, track_length);
+		crc = crc_all_tracks(disk);
 		printf("Full CRC:\t\t\t0x%X\n", crc);
 
 		memset(md5_dir_hash_result, 0 , sizeof(md5_dir_hash_result));
-		md5_dir_track(track_buffer, track_length, md5_dir_hash_result);
+		md5_dir_track(disk, md5_dir_hash_result);
 		printf("BAM/DIR MD5:\t\t\t0x");
 		for (i = 0; i < 16; i++)
 		 	printf ("%02x", md5_dir_hash_result[i]);
 		printf("\n");
 
 		memset(md5_hash_result, 0 , sizeof(md5_hash_result));
-		md5_all_tracks(track_buffer, track_length, md5_hash_result);
+		md5_all_tracks(disk, md5_hash_result);
 		printf("Full MD5:\t\t\t0x");
 		for (i = 0; i < 16; i++)
 			printf ("%02x", md5_hash_result[i]);
@@ -168,20 +143,20 @@ main(int argc, char *argv[])
 
 		/* disk 2 */
 		printf("\n2: %s\n", file2);
-		crc2_dir = crc_dir_track(track_buffer2, track_length2);
+		crc2_dir = crc_dir_track(disk2);
 		printf("BAM/DIR CRC:\t\t\t0x%X\n", crc2_dir);
-		crc2 = crc_all_tracks(track_buffer2, track_length2);
+		crc2 = crc_all_tracks(disk2);
 		printf("Full CRC:\t\t\t0x%X\n", crc2);
 
 		memset(md5_dir_hash_result2, 0 , sizeof(md5_dir_hash_result2));
-		md5_dir_track(track_buffer2, track_length2, md5_dir_hash_result2);
+		md5_dir_track(disk2, md5_dir_hash_result2);
 		printf("BAM/DIR MD5:\t\t\t0x");
 		for (i = 0; i < 16; i++)
 		 	printf ("%02x", md5_dir_hash_result2[i]);
 		printf("\n");
 
 		memset(md5_hash_result2, 0 , sizeof(md5_hash_result2));
-		md5_all_tracks(track_buffer2, track_length2, md5_hash_result2);
+		md5_all_tracks(disk2, md5_hash_result2);
 		printf("Full MD5:\t\t\t0x");
 		for (i = 0; i < 16; i++)
 			printf ("%02x", md5_hash_result2[i]);
@@ -210,67 +185,66 @@ main(int argc, char *argv[])
 	}
 	else 	// just scan for errors, etc.
 	{
-		if(!load_image(file1, track_buffer, track_density, track_length)) exit(0);
+		if(!load_image(file1, disk)) exit(0);
 
 		scandisk();
 
 		printf("\n%s\n", file1);
 
-		crc = crc_dir_track(track_buffer, track_length);
+		crc = crc_dir_track(disk);
 		printf("BAM/DIR CRC:\t0x%X\n", crc);
-		crc = crc_all_tracks(track_buffer, track_length);
+		crc = crc_all_tracks(disk);
 		printf("Full CRC:\t0x%X\n", crc);
 
 		memset(md5_hash_result, 0 , sizeof(md5_hash_result));
-		md5_dir_track(track_buffer, track_length, md5_hash_result);
+		md5_dir_track(disk, md5_hash_result);
 		printf("BAM/DIR MD5:\t0x");
 		for (i = 0; i < 16; i++)
 		 	printf ("%02x", md5_hash_result[i]);
 		printf("\n");
 
 		memset(md5_hash_result, 0 , sizeof(md5_hash_result));
-		md5_all_tracks(track_buffer, track_length, md5_hash_result);
+		md5_all_tracks(disk, md5_hash_result);
 		printf("Full MD5:\t0x");
 		for (i = 0; i < 16; i++)
 			printf ("%02x", md5_hash_result[i]);
 		printf("\n");
 	}
 
+	free_disk(disk);
+	free_disk(disk2);
 	exit(0);
 }
 
-int load_image(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+int load_image(char *filename, nib_disk *disk)
 {
 	if (compare_extension(filename, "D64"))
 	{
-		if(!(read_d64(filename, track_buffer, track_density, track_length))) return 0;
+		if(!(read_d64(filename, disk))) return 0;
 	}
 	else if (compare_extension(filename, "G64"))
 	{
-		if(!(read_g64(filename, track_buffer, track_density, track_length))) return 0;
-		if(sync_align_buffer) sync_tracks(track_buffer, track_density, track_length, track_alignment);
+		if(!(read_g64(filename, disk))) return 0;
+		if(disk->opt.sync_align_buffer) sync_tracks(disk);
 	}
 	else if (compare_extension(filename, "NBZ"))
 	{
 		printf("Uncompressing NBZ...\n");
-		if(!(file_buffer_size = load_file(filename, compressed_buffer))) return 0;
-		if(!(file_buffer_size = LZ_Uncompress(compressed_buffer, file_buffer, file_buffer_size))) return 0;
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		if(fattrack!=99) search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_nbz(filename, disk))) return 0;
+		align_tracks(disk);
+		if(disk->opt.fattrack!=99) search_fat_tracks(disk);
 	}
 	else if (compare_extension(filename, "NIB"))
 	{
-		if(!(file_buffer_size = load_file(filename, file_buffer))) return 0;
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		if(fattrack!=99) search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_nib_file(filename, disk))) return 0;
+		align_tracks(disk);
+		if(disk->opt.fattrack!=99) search_fat_tracks(disk);
 	}
 	else if (compare_extension(filename, "NB2"))
 	{
-		if(!(read_nb2(filename, track_buffer, track_density, track_length))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		if(fattrack!=99) search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_nb2(filename, disk))) return 0;
+		align_tracks(disk);
+		if(disk->opt.fattrack!=99) search_fat_tracks(disk);
 	}
 	else
 	{
@@ -301,6 +275,7 @@ compare_disks(void)
 	char dens_mismatches[256];
 	char tmpstr[16];
 	char errorstring[0x1000];
+	sector_report report;
 	BYTE id[3], id2[3], cid[3], cid2[3];
 
 	gcr_mismatches[0] = '\0';
@@ -310,72 +285,73 @@ compare_disks(void)
 	dens_mismatches[0] = '\0';
 
 	/* ignore halftracks in compare */
-	track_inc = 2;
+	disk->opt.track_inc = 2;
 
 	// extract disk id's from track 18
 	memset(id, 0, 3);
-	extract_id(track_buffer + (36 * NIB_TRACK_LENGTH), id);
+	extract_id(disk->track_buffer + (36 * NIB_TRACK_LENGTH), id);
 	memset(id2, 0, 3);
-	extract_id(track_buffer2 + (36 * NIB_TRACK_LENGTH), id2);
+	extract_id(disk2->track_buffer + (36 * NIB_TRACK_LENGTH), id2);
 
 	memset(cid, 0, 3);
-	extract_cosmetic_id(track_buffer + (36 * NIB_TRACK_LENGTH), cid);
+	extract_cosmetic_id(disk->track_buffer + (36 * NIB_TRACK_LENGTH), cid);
 	memset(cid2, 0, 3);
-	extract_cosmetic_id(track_buffer2 + (36 * NIB_TRACK_LENGTH), cid2);
+	extract_cosmetic_id(disk2->track_buffer + (36 * NIB_TRACK_LENGTH), cid2);
 
 	if(waitkey) getchar();
 	printf("\nComparing...\n");
 
-	for (track = start_track; track <= end_track; track ++)
+	for (track = disk->opt.start_track; track <= disk->opt.end_track; track ++)
 	{
-		if(!check_formatted(track_buffer + (track * NIB_TRACK_LENGTH), track_length[track]))
+		if(!check_formatted(disk->track_buffer + (track * NIB_TRACK_LENGTH), disk->track_length[track]))
 		{
-			track_length[track] = 0;
+			disk->track_length[track] = 0;
 			//printf("1 - UNFORMATTED!\n");
 			continue;
 		}
 
-		if(!check_formatted(track_buffer2 + (track * NIB_TRACK_LENGTH), track_length2[track]))
+		if(!check_formatted(disk2->track_buffer + (track * NIB_TRACK_LENGTH), disk2->track_length[track]))
 		{
-			track_length2[track] = 0;
+			disk2->track_length[track] = 0;
 			//printf("2 - UNFORMATTED!\n");
 			continue;
 		}
 
 		printf("%4.1f, Disk 1: (%d) %d\n",
-		 	(float)track/2, track_density[track]&3, track_length[track]);
+		 	(float)track/2, disk->track_density[track]&3, disk->track_length[track]);
 
 		printf("%4.1f, Disk 2: (%d) %d\n",
-		 	(float)track/2, track_density2[track]&3, track_length2[track]);
+		 	(float)track/2, disk2->track_density[track]&3, disk2->track_length[track]);
 
 		numtracks++;
 
 		// check for gcr match (unlikely)
 		gcr_match =
 		  compare_tracks(
-			track_buffer + (track * NIB_TRACK_LENGTH),
-			track_buffer2 + (track * NIB_TRACK_LENGTH),
-			track_length[track],
-			track_length2[track],
+			disk->track_buffer + (track * NIB_TRACK_LENGTH),
+			disk2->track_buffer + (track * NIB_TRACK_LENGTH),
+			disk->track_length[track],
+			disk2->track_length[track],
 			0,
-			errorstring);
+			errorstring,
+			&disk->opt);
 
 		printf("%s", errorstring);
 
 		if(gcr_match)
 		{
-			gcr_percentage = (gcr_match*100)/track_length[track];
+			gcr_percentage = (gcr_match*100)/disk->track_length[track];
 
 			if (gcr_percentage >= 98)
 			{
 				gcr_total++;
-				printf("\n[*>%d%% GCR MATCH*]\n", (gcr_match*100)/track_length[track]);
+				printf("\n[*>%d%% GCR MATCH*]\n", (gcr_match*100)/disk->track_length[track]);
 				sprintf(tmpstr, "%d,", track/2);
 				strcat(gcr_matches, tmpstr);
 			}
 			else
 			{
-				printf("\n[*>%d%% GCR MATCH*]\n", (gcr_match*100)/track_length[track]);
+				printf("\n[*>%d%% GCR MATCH*]\n", (gcr_match*100)/disk->track_length[track]);
 				sprintf(tmpstr, "%d,", track/2);
 				strcat(gcr_mismatches, tmpstr);
 			}
@@ -383,22 +359,26 @@ compare_disks(void)
 
 		if(track/2 <= 35)
 		{
-			errors_d1 += check_errors(track_buffer + (NIB_TRACK_LENGTH * track), track_length[track], track, id, errorstring);
-			errors_d2 += check_errors(track_buffer2 + (NIB_TRACK_LENGTH * track), track_length2[track], track, id2, errorstring);
+			errors_d1 += check_sectors(disk->track_buffer + (NIB_TRACK_LENGTH * track), disk->track_length[track], track, id, &report,
+				disk_track_index(disk, track));
+			errors_d2 += check_sectors(disk2->track_buffer + (NIB_TRACK_LENGTH * track), disk2->track_length[track], track, id2, &report,
+				disk_track_index(disk2, track));
 		}
 
 		/* check for DOS sector matches */
 		if(track/2 <= 35)
 		{
 			sec_match = compare_sectors(
-										track_buffer + (track * NIB_TRACK_LENGTH),
-										track_buffer2 + (track * NIB_TRACK_LENGTH),
-										track_length[track],
-										track_length2[track],
+										disk->track_buffer + (track * NIB_TRACK_LENGTH),
+										disk2->track_buffer + (track * NIB_TRACK_LENGTH),
+										disk->track_length[track],
+										disk2->track_length[track],
 										id,
 										id2,
 										track,
-										errorstring
+										errorstring,
+										disk_track_index(disk, track),
+										disk_track_index(disk2, track)
 										);
 
 			printf("%s", errorstring);
@@ -421,16 +401,16 @@ compare_disks(void)
 			}
 		}
 
-		if(track_density[track] != track_density2[track])
+		if(disk->track_density[track] != disk2->track_density[track])
 		{
-			printf("[Densities do not match: %d != %d]\n", track_density[track], track_density2[track]);
+			printf("[Densities do not match: %d != %d]\n", disk->track_density[track], disk2->track_density[track]);
 			dens_mismatch++;
 			sprintf(tmpstr, "%d,", track / 2);
 			strcat(dens_mismatches, tmpstr);
 		}
 		printf("\n");
 
-		if((!sec_match) || (track_density[track] != track_density2[track]))
+		if((!sec_match) || (disk->track_density[track] != disk2->track_density[track]))
 			if( waitkey) getchar();
 	}
 
@@ -477,6 +457,7 @@ scandisk(void)
 	int defdensity;
 	char errorstring[0x1000];
 	char testfilename[16];
+	sector_report report;
 	FILE *trkout;
 
 	// clear buffers
@@ -489,43 +470,43 @@ scandisk(void)
 
 	// extract disk id from track 18
 	memset(id, 0, 3);
-	extract_id(track_buffer + (36 * NIB_TRACK_LENGTH), id);
+	extract_id(disk->track_buffer + (36 * NIB_TRACK_LENGTH), id);
 	printf("\ndisk id: %s\n", id);
 
 	// collect and print "cosmetic" disk id for comparison
 	memset(cosmetic_id, 0, 3);
-	extract_cosmetic_id(track_buffer + (36 * NIB_TRACK_LENGTH), cosmetic_id);
+	extract_cosmetic_id(disk->track_buffer + (36 * NIB_TRACK_LENGTH), cosmetic_id);
 	printf("cosmetic disk id: %s\n", cosmetic_id);
 
 	if(waitkey) getchar();
 
 	// check each track for various things
-	for (track = start_track; track <= end_track; track ++)
+	for (track = disk->opt.start_track; track <= disk->opt.end_track; track ++)
 	{
-		if(!check_formatted(track_buffer + (track * NIB_TRACK_LENGTH), track_length[track]))
+		if(!check_formatted(disk->track_buffer + (track * NIB_TRACK_LENGTH), disk->track_length[track]))
 		{
 			//printf(":UNFORMATTED\n");
 			continue;
 		}
 		else
-			printf("%4.1f: %d",(float) track/2, track_length[track]);
+			printf("%4.1f: %d",(float) track/2, disk->track_length[track]);
 
-		if (track_length[track] > 0)
+		if (disk->track_length[track] > 0)
 		{
-			track_density[track] = check_sync_flags(track_buffer + (track * NIB_TRACK_LENGTH),
-				track_density[track]&3, track_length[track]);
+			disk->track_density[track] = check_sync_flags(disk->track_buffer + (track * NIB_TRACK_LENGTH),
+				disk->track_density[track]&3, disk->track_length[track]);
 
-			printf(" (density:%d", track_density[track]&3);
+			printf(" (density:%d", disk->track_density[track]&3);
 
-			if (track_density[track] & BM_NO_SYNC)
+			if (disk->track_density[track] & BM_NO_SYNC)
 				printf(":NOSYNC");
-			else if (track_density[track] & BM_FF_TRACK)
+			else if (disk->track_density[track] & BM_FF_TRACK)
 				printf(":KILLER");
 
 			// establish default density and warn
 			defdensity = speed_map[track/2];
 
-			if ((track_density[track] & 3) != defdensity)
+			if ((disk->track_density[track] & 3) != defdensity)
 			{
 				printf("!=%d?) ", defdensity);
 				if(track < 36*2) total_wrong_density++;
@@ -534,18 +515,21 @@ scandisk(void)
 			else
 				printf(") ");
 
-			if(increase_sync)
+			if(disk->opt.increase_sync)
 			{
-				added_sync = lengthen_sync(track_buffer + (NIB_TRACK_LENGTH * track),
-					track_length[track], NIB_TRACK_LENGTH);
+				added_sync = lengthen_sync(disk->track_buffer + (NIB_TRACK_LENGTH * track),
+					disk->track_length[track], NIB_TRACK_LENGTH);
 
 				printf("[sync:%d] ", added_sync);
-				track_length[track] += added_sync;
+				disk->track_length[track] += added_sync;
 			}
 
+			/* the checks below may fix the track in place */
+			invalidate_track_index(disk, track);
+
 			// detect bad GCR '000' bits
 			badgcr_tracks[track] =
-			  check_bad_gcr(track_buffer + (NIB_TRACK_LENGTH * track), track_length[track]);
+			  check_bad_gcr(disk->track_buffer + (NIB_TRACK_LENGTH * track), disk->track_length[track], &disk->opt);
 
 			if (badgcr_tracks[track])
 			{
@@ -565,9 +549,9 @@ scandisk(void)
 			*/
 
 			/* check for FAT track */
-			if(fattrack!=99)
+			if(disk->opt.fattrack!=99)
 			{
-				if (track < end_track - track_inc)
+				if (track < disk->opt.end_track - disk->opt.track_inc)
 				{
 					fat_tracks[track] = check_fat(track);
 					if (fat_tracks[track]) totalfat++;
@@ -580,45 +564,47 @@ scandisk(void)
 				rapidlok tracks are not standard gcr
 				tracks above 35 are always CBM errors
 			*/
-			if(track/2 <= 35)
-				temp_errors = check_errors(track_buffer + (NIB_TRACK_LENGTH * track), track_length[track], track, id, errorstring);
-			else /* everything is a CBM error above track 35 */
+			temp_errors = check_sectors(disk->track_buffer + (NIB_TRACK_LENGTH * track), disk->track_length[track], track, id, &report,
+				disk_track_index(disk, track));
+			if(track/2 > 35) /* everything is a CBM error above track 35 */
 				temp_errors = 0;
 
 			if (temp_errors)
 			{
 				errors += temp_errors;
+				format_sector_errors(&report, errorstring);
 				printf("%s", errorstring);
 				if(waitkey) getchar();
 			}
 
-			temp_empty = check_empty(track_buffer + (NIB_TRACK_LENGTH * track), track_length[track], track, id, errorstring);
+			temp_empty = report.empty;
 			if (temp_empty)
 			{
 				empty += temp_empty;
+				format_sector_empty(&report, errorstring);
 				if(verbose>1) printf(" %s", errorstring);
 			}
 
 			if (verbose>1)
 			{
-					dump_headers(track_buffer + (NIB_TRACK_LENGTH * track), track_length[track]);
-					raw_track_info(track_buffer + (NIB_TRACK_LENGTH * track), track_length[track]);
+					dump_headers(disk->track_buffer + (NIB_TRACK_LENGTH * track), disk->track_length[track]);
+					raw_track_info(disk->track_buffer + (NIB_TRACK_LENGTH * track), disk->track_length[track]);
 			}
 		}
 		else
 		{
-			printf("(%d", track_density[track]&3);
+			printf("(%d", disk->track_density[track]&3);
 			printf(":UNFORMATTED");
 		}
 		printf("\n");
 
 		// process and dump to disk for manual compare
-		//track_length[track] = compress_halftrack(track, track_buffer + (track * NIB_TRACK_LENGTH), track_density[track], track_length[track]);
+		//disk->track_length[track] = compress_halftrack(track, disk->track_buffer + (track * NIB_TRACK_LENGTH), disk->track_density[track], disk->track_length[track]);
 
-		sprintf(testfilename, "raw/tr%.1fd%d", (float) track/2, (track_density[track] & 3));
+		sprintf(testfilename, "raw/tr%.1fd%d", (float) track/2, (disk->track_density[track] & 3));
 		if(NULL != (trkout = fopen(testfilename, "w")))
 		{
-			fwrite(track_buffer + (track * NIB_TRACK_LENGTH), track_length[track], 1, trkout);
+			fwrite(disk->track_buffer + (track * NIB_TRACK_LENGTH), disk->track_length[track], 1, trkout);
 			fclose(trkout);
 		}
 	}
@@ -637,17 +623,20 @@ dump_headers(BYTE * gcrdata, size_t length)
 {
 	BYTE header[10];
 	BYTE *gcr_ptr, *gcr_end;
+	sync_list syncs;
+	int cursor;
 
 	gcr_ptr = gcrdata;
 	gcr_end = gcrdata + length;
+	scan_sync_runs(&syncs, gcrdata, length);
+	cursor = 0;
 
 	do
 	{
-		if (!find_sync(&gcr_ptr, gcr_end))
+		if (!find_sync_cursor(&syncs, &gcr_ptr, &cursor))
 			return 0;
 
-		convert_4bytes_from_GCR(gcr_ptr, header);
-		convert_4bytes_from_GCR(gcr_ptr + 5, header + 4);
+		convert_GCR_quintets(gcr_ptr, header, 2);
 
 		if(header[0] == 0x08) // only parse headers
 			printf("\n%.2x %.2x %.2x %.2x = typ:%.2x -- blh:%.2x -- trk:%.2x -- sec:%.2x -- id:%c%c",
@@ -675,6 +664,7 @@ raw_track_info(BYTE * gcrdata, size_t length)
 	*/
 	size_t bad_cnt = 0;
 	size_t bad_len[NIB_TRACK_LENGTH];
+	BYTE badmap[BAD_GCR_MAP_SIZE(NIB_TRACK_LENGTH)];
 	size_t i, locked;
 
 	memset(sync_len, 0, sizeof(sync_len));
@@ -731,16 +721,18 @@ raw_track_info(BYTE * gcrdata, size_t length)
 	*/
 
 	/* count bad gcr lengths */
+	bad_gcr_map(gcrdata, length, badmap);
+
 	for (locked = 0, i = 0; i < length - 1; i++)
 	{
 		if (locked)
 		{
-			if (is_bad_gcr(gcrdata, length, i))
+			if (BAD_GCR_AT(badmap, i))
 				bad_len[bad_cnt]++;
 			else
 				locked = 0;
 		}
-		else if (is_bad_gcr(gcrdata, length, i))
+		else if (BAD_GCR_AT(badmap, i))
 		{
 			locked = 1;
 			bad_cnt++;
@@ -760,16 +752,21 @@ size_t check_fat(int track)
 {
 	size_t diff = 0;
 	char errorstring[0x1000];
+	track_compare compare;
 
-	if (track_length[track] > 0 && track_length[track+2] > 0 && track_length[track] != 8192 && track_length[track+2] != 8192)
+	if (disk->track_length[track] > 0 && disk->track_length[track+2] > 0 && disk->track_length[track] != 8192 && disk->track_length[track+2] != 8192)
 	{
-		diff = compare_tracks(
-		  track_buffer + (track * NIB_TRACK_LENGTH),
-		  track_buffer + ((track+2) * NIB_TRACK_LENGTH),
-		  track_length[track],
-		  track_length[track+2], 1, errorstring);
+		diff = compare_tracks_stats(
+		  disk->track_buffer + (track * NIB_TRACK_LENGTH),
+		  disk->track_buffer + ((track+2) * NIB_TRACK_LENGTH),
+		  disk->track_length[track],
+		  disk->track_length[track+2], 1, (verbose>1) ? COMPARE_ALL : 33, &compare, &disk->opt);
 
-		if(verbose>1) printf("%s",errorstring);
+		if(verbose>1)
+		{
+			format_track_compare(&compare, errorstring);
+			printf("%s",errorstring);
+		}
 
 		if (diff<=10)
 		{
@@ -800,8 +797,8 @@ size_t check_rapidlok(int track)
 	size_t end_sync = 0;
 	size_t synclen = 0;
 	size_t keylen = 0;		// extra sector with # of 0x7b
-	size_t tlength = track_length[track];
-	BYTE *gcrdata = track_buffer + (track * NIB_TRACK_LENGTH);
+	size_t tlength = disk->track_length[track];
+	BYTE *gcrdata = disk->track_buffer + (track * NIB_TRACK_LENGTH);
 
 	// extra sector is at the end.
 	// count the extra-sector (key) bytes.
@@ -39,6 +39,20 @@
 
 #define DENSITY_SAMPLES 2
 
+#define MAX_THREADS 64	/* upper limit for -j */
+
+/* Indexed NBZ: NIB style header with this magic, a table of NBZ_ENTRY_SIZE byte
+   entries (offset, length, crc) at 0x100, then the LZ blocks.
+   Each track is packed with pack_GCR_track() and compressed as a block of its own,
+   so a single track can be read without the others and a damaged block loses one track */
+#define NBZ_MAGIC			"MNIB-1541-NBZ"
+#define NBZ_VERSION		2
+#define NBZ_ENTRY_SIZE	12
+#define NBZ_LEVEL		5	/* default -Z compression level */
+#define NBZ_MAX_LEVEL	LZ_STREAM_MAXLEVEL	/* highest -Z level */
+#define NBZ_MAX_ENTRIES	((0x100 - 0x10) / 2)
+#define NBZ_CHUNK		0x1000	/* packed bytes handed to the LZ coder at a time */
+
 /* custom density maps for reading */
 #define DENSITY_STANDARD 0
 #define DENSITY_RAPIDLOK	1
@@ -78,33 +92,22 @@ extern BYTE drive;
 extern FILE * fplog;
 extern float motor_speed;
 extern size_t error_retries;
-extern int skew;
 extern int mode;
 extern int read_killer;
 extern int align_disk;
 extern int force_density;
 extern int track_match;
 extern int interactive_mode;
-extern int gap_match_length;
-extern int cap_min_ignore;
 extern int verbose;
 extern int ihs;
-extern int start_track, end_track, track_inc;
-extern int fix_gcr, reduce_sync, increase_sync;
-extern int imagetype, auto_capacity_adjust;
+extern int imagetype;
 extern int extended_parallel_test;
 extern int force_nosync;
 extern int rawmode;
-extern int rpm_real;
 extern int unformat_passes;
 extern int align_delay;
-extern int presync;
 extern int use_floppycode_srq;
 extern int override_srq;
-extern int extra_capacity_margin;
-extern int sync_align_buffer;
-extern int fattrack;
-extern int old_g64;
 extern int backwards;
 
 #include "ihs.h"
@@ -120,40 +123,59 @@ void parallel_test(int interations);
 int loadimage(char * filename);
 int writeimage(CBM_FILE fd);
 
+/* An image file held in memory, see open_image() */
+typedef struct
+{
+	BYTE *data;
+	size_t size;
+	int mapped;		/* data is mapped from the file, else read into the heap */
+} image_file;
+
 /* fileio.c */
-void parseargs(char *argv[]);
+void parseargs(char *argv[], nib_options *opt);
+void parse_nbz_level(char *arg, nib_options *opt);
 void switchusage(void);
+int open_image(char *filename, image_file *image);
+void close_image(image_file *image);
 int load_file(char *filename, BYTE *file_buffer);
 int save_file(char *filename, BYTE *file_buffer, int length);
-int read_nib(BYTE *file_buffer, int file_buffer_size, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
-int read_nb2(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
-int read_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
-int read_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
-int write_nib(BYTE*file_buffer, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
-int write_g64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
-int write_d64(char *filename, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
-size_t compress_halftrack(int halftrack, BYTE *track_buffer, BYTE track_density, size_t track_length);
-int align_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
-int rig_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
-int sync_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length, BYTE *track_alignment);
+nib_disk *new_disk(void);
+void free_disk(nib_disk *disk);
+int read_nib(BYTE *file_buffer, int file_buffer_size, nib_disk *disk);
+int read_nib_file(char *filename, nib_disk *disk);
+int read_nbz(char *filename, nib_disk *disk);
+int read_nbz_track(char *filename, nib_disk *disk, int halftrack);
+int read_nb2(char *filename, nib_disk *disk);
+int read_g64(char *filename, nib_disk *disk);
+int read_d64(char *filename, nib_disk *disk);
+int write_nib(BYTE*file_buffer, nib_disk *disk);
+int write_nib_file(char *filename, nib_disk *disk);
+int write_nbz(char *filename, nib_disk *disk);
+int write_g64(char *filename, nib_disk *disk);
+int write_d64(char *filename, nib_disk *disk);
+size_t compress_halftrack(int halftrack, BYTE *track_buffer, BYTE track_density, size_t track_length, size_t track_capacity, nib_options *opt);
+void for_each_track(void (*handler)(void *arg, int track), void *arg, int first, int last, int step, int jobs);
+int align_tracks(nib_disk *disk);
+int rig_tracks(nib_disk *disk);
+int sync_tracks(nib_disk *disk);
 int write_dword(FILE * fd, DWORD * buf, int num);
-unsigned int crc_dir_track(BYTE *track_buffer, size_t *track_length);
-unsigned int crc_all_tracks(BYTE *track_buffer, size_t *track_length);
-unsigned int md5_dir_track(BYTE *track_buffer, size_t *track_length, unsigned char *result);
-unsigned int md5_all_tracks(BYTE *track_buffer, size_t *track_length, unsigned char *result);
+unsigned int crc_dir_track(nib_disk *disk);
+unsigned int crc_all_tracks(nib_disk *disk);
+unsigned int md5_dir_track(nib_disk *disk, unsigned char *result);
+unsigned int md5_all_tracks(nib_disk *disk, unsigned char *result);
 
 /* read.c */
 BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer);
-BYTE paranoia_read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer);
-int read_floppy(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+BYTE paranoia_read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer, align_state * state, nib_options * opt);
+int read_floppy(CBM_FILE fd, nib_disk *disk);
 int write_nb2(CBM_FILE fd, char * filename);
 void get_disk_id(CBM_FILE fd);
 BYTE scan_density(CBM_FILE fd);
 int TrackAlignmentReport(CBM_FILE fd);
 
 /* write.c */
-void master_disk(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
-void master_disk_raw(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
+void master_disk(CBM_FILE fd, nib_disk *disk);
+void master_disk_raw(CBM_FILE fd, nib_disk *disk);
 void prep_track(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, int track, size_t tracklen);
 void write_raw(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length);
 void unformat_disk(CBM_FILE fd);
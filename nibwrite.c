@@ -15,7 +15,6 @@
 #include "gcr.h"
 #include "nibtools.h"
 #include "prot.h"
-#include "lz.h"
 
 int _dowildcard = 1;
 
@@ -23,17 +22,9 @@ char bitrate_range[4] = { 43 * 2, 31 * 2, 25 * 2, 18 * 2 };
 char bitrate_value[4] = { 0x00, 0x20, 0x40, 0x60 };
 char density_branch[4] = { 0xb1, 0xb5, 0xb7, 0xb9 };
 
-BYTE compressed_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE file_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE track_buffer[(MAX_HALFTRACKS_1541 + 2) * NIB_TRACK_LENGTH];
-BYTE track_density[MAX_HALFTRACKS_1541 + 2];
-BYTE track_alignment[MAX_HALFTRACKS_1541 + 2];
-size_t track_length[MAX_HALFTRACKS_1541 + 2];
-
-int file_buffer_size;
-int start_track, end_track, track_inc;
-int reduce_sync;
-int fix_gcr, aggressive_gcr;
+nib_disk *disk;
+
+int aggressive_gcr;
 int align;
 extern unsigned int lpt[4];
 extern int lpt_num;
@@ -42,29 +33,18 @@ int drivetype;
 int imagetype;
 int mode;
 int verify;
-int auto_capacity_adjust;
 int align_disk;
-int gap_match_length;
-int cap_min_ignore;
 int verbose = 0;
 float motor_speed;
-int skew = 0;
 int ihs = 0;
-int rpm_real;
 int unformat_passes;
 int align_delay;
-int increase_sync = 0;
-int presync = 0;
 BYTE fillbyte = 0xfe;
 BYTE drive = 8;
 char * cbm_adapter = "";
 int use_floppycode_srq = 0;
 int override_srq = 0;
-int extra_capacity_margin=5;
-int sync_align_buffer=0;
-int fattrack=0;
 int track_match=0;
-int old_g64=0;
 int read_killer=1;
 int extended_parallel_test=0;
 int backwards=0;
@@ -94,30 +74,27 @@ main(int argc, char *argv[])
 	bump = 1;  /* failing to bump sometimes give us wrong tracks on heavily protected disks */
 	reset = 1;
 
-	start_track =  2;
-	end_track = 82;
-	track_inc = 2;
+	if(!(disk = new_disk())) exit(0);
+
+	disk->opt.start_track =  2;
+	disk->opt.end_track = 82;
+	disk->opt.track_inc = 2;
 
-	reduce_sync = 4;
-	fix_gcr = 1;
+	disk->opt.reduce_sync = 4;
+	disk->opt.fix_gcr = 1;
 	align_disk = 0;
-	auto_capacity_adjust = 1;
+	disk->opt.auto_capacity_adjust = 1;
 	verbose = 1;
-	gap_match_length = 7;
-	cap_min_ignore = 0;
+	disk->opt.gap_match_length = 7;
+	disk->opt.cap_min_ignore = 0;
 	motor_speed = 300;
 	unformat_passes = 1;
 
 	mode = MODE_WRITE_DISK;
 	align = ALIGN_NONE;
 
-	/* clear heap buffers */
-	memset(compressed_buffer, 0x00, sizeof(compressed_buffer));
-	memset(file_buffer, 0x00, sizeof(file_buffer));
-	memset(track_buffer, 0x00, sizeof(track_buffer));
-
 	/* default is to reduce sync */
-	memset(reduce_map, REDUCE_SYNC, MAX_TRACKS_1541+1);
+	memset(disk->opt.reduce_map, REDUCE_SYNC, MAX_TRACKS_1541+1);
 
 	/* cache our arguments for logfile generation */
 	strcpy(argcache, "");
@@ -128,7 +105,7 @@ main(int argc, char *argv[])
 	}
 
 	while (--argc && (*(++argv)[0] == '-'))
-		parseargs(argv);
+		parseargs(argv, &disk->opt);
 
 	printf("\n");
 	if (argc > 0)	strcpy(filename, argv[0]);
@@ -208,35 +185,32 @@ int loadimage(char *filename)
 	/* read and remaster disk */
 	if (compare_extension(filename, "D64"))
 	{
-		if(!(read_d64(filename, track_buffer, track_density, track_length))) return 0;
+		if(!(read_d64(filename, disk))) return 0;
 	}
 	else if (compare_extension(filename, "G64"))
 	{
-		if(!(read_g64(filename, track_buffer, track_density, track_length))) return 0;
-		if(sync_align_buffer)	sync_tracks(track_buffer, track_density, track_length, track_alignment);
-		search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_g64(filename, disk))) return 0;
+		if(disk->opt.sync_align_buffer)	sync_tracks(disk);
+		search_fat_tracks(disk);
 	}
 	else if (compare_extension(filename, "NBZ"))
 	{
 		printf("Uncompressing NBZ...\n");
-		if(!(file_buffer_size = load_file(filename, compressed_buffer))) return 0;
-		if(!(file_buffer_size = LZ_Uncompress(compressed_buffer, file_buffer, file_buffer_size))) return 0;
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_nbz(filename, disk))) return 0;
+		align_tracks(disk);
+		search_fat_tracks(disk);
 	}
 	else if (compare_extension(filename, "NIB"))
 	{
-		if(!(file_buffer_size = load_file(filename, file_buffer))) return 0;
-		if(!(read_nib(file_buffer, file_buffer_size, track_buffer, track_density, track_length))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_nib_file(filename, disk))) return 0;
+		align_tracks(disk);
+		search_fat_tracks(disk);
 	}
 	else if (compare_extension(filename, "NB2"))
 	{
-		if(!(read_nb2(filename, track_buffer, track_density, track_length))) return 0;
-		align_tracks(track_buffer, track_density, track_length, track_alignment);
-		search_fat_tracks(track_buffer, track_density, track_length);
+		if(!(read_nb2(filename, disk))) return 0;
+		align_tracks(disk);
+		search_fat_tracks(disk);
 	}
 	else
 	{
@@ -252,19 +226,19 @@ int writeimage(CBM_FILE fd)
 	/* turn on motor and measure speed */
 	motor_on(fd);
 
-	if(auto_capacity_adjust)
+	if(disk->opt.auto_capacity_adjust)
 		adjust_target(fd);
 
-	if((fattrack)&&(fattrack!=99))
+	if(disk->fat_track)
 		unformat_disk(fd);
 
 	//if(align_disk)
 	//	init_aligned_disk(fd);
 
 	if(mode == MODE_WRITE_RAW)
-		master_disk_raw(fd, track_buffer, track_density, track_length);
+		master_disk_raw(fd, disk);
 	else
-		master_disk(fd, track_buffer, track_density, track_length);
+		master_disk(fd, disk);
 
 	step_to_halftrack(fd, 18 * 2);
 	printf("\n");
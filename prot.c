@@ -6,31 +6,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include "gcr.h"
 #include "prot.h"
 
-extern int fattrack;
-
 /* I don't like this kludge, but it is necessary to fix old files that lacked halftracks */
-void search_fat_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+void search_fat_tracks(nib_disk *disk)
 {
 	int track, numfats=0;
 	size_t diff=0;
-	char errorstring[0x1000];
+	track_compare compare;
+
+	disk->fat_track = 0;
 
-	if(!fattrack) /* autodetect fat tracks */
+	if(!disk->opt.fattrack) /* autodetect fat tracks */
 	{
 		//printf("Searching for fat tracks...\n");
 		for (track=2; track<=MAX_HALFTRACKS_1541-1; track+=2)
 		{
-			if (track_length[track] > 0 && track_length[track+2] > 0 &&
-				track_length[track] != 8192 && track_length[track+2] != 8192)
+			if (disk->track_length[track] > 0 && disk->track_length[track+2] > 0 &&
+				disk->track_length[track] != 8192 && disk->track_length[track+2] != 8192)
 			{
-				diff = compare_tracks(
-				  track_buffer + (track * NIB_TRACK_LENGTH),
-				  track_buffer + ((track+2) * NIB_TRACK_LENGTH),
-				  track_length[track],
-				  track_length[track+2], 1, errorstring);
+				diff = compare_tracks_stats(
+				  disk->track_buffer + (track * NIB_TRACK_LENGTH),
+				  disk->track_buffer + ((track+2) * NIB_TRACK_LENGTH),
+				  disk->track_length[track],
+				  disk->track_length[track+2], 1, (verbose>1) ? COMPARE_ALL : 1, &compare, &disk->opt);
 
 				if(verbose>1) printf("%4.1f: %d\n",(float)track/2,diff);
 
@@ -38,15 +39,16 @@ void search_fat_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_le
 				{
 					printf("Likely fat track found on T%d/%d (diff=%d)\n",track/2,(track/2)+1,(int)diff);
 
-					memcpy(track_buffer + ((track+1) * NIB_TRACK_LENGTH),
-						track_buffer + (track * NIB_TRACK_LENGTH),
+					memcpy(disk->track_buffer + ((track+1) * NIB_TRACK_LENGTH),
+						disk->track_buffer + (track * NIB_TRACK_LENGTH),
 						NIB_TRACK_LENGTH);
 
-					track_length[track+1] = track_length[track];
-					track_density[track+1] = track_density[track];
+					disk->track_length[track+1] = disk->track_length[track];
+					disk->track_density[track+1] = disk->track_density[track];
+					invalidate_track_index(disk, track+1);
 
 					if(!numfats)
-						fattrack=track;
+						disk->fat_track=track;
 					else
 					{
 						printf("These are likely not fat tracks, just repeat data - Ignoring\n");
@@ -57,28 +59,35 @@ void search_fat_tracks(BYTE *track_buffer, BYTE *track_density, size_t *track_le
 			}
 		}
 	}
-	else if(fattrack!=99) /* manually overridden */
+	else if(disk->opt.fattrack!=99) /* manually overridden */
 	{
-		printf("Handle FAT track on %d\n",fattrack/2);
+		printf("Handle FAT track on %d\n",disk->opt.fattrack/2);
+		disk->fat_track = disk->opt.fattrack;
 
-		memcpy(track_buffer + ((fattrack+1) * NIB_TRACK_LENGTH),
-			track_buffer + (fattrack * NIB_TRACK_LENGTH),
+		memcpy(disk->track_buffer + ((disk->opt.fattrack+1) * NIB_TRACK_LENGTH),
+			disk->track_buffer + (disk->opt.fattrack * NIB_TRACK_LENGTH),
 			NIB_TRACK_LENGTH);
 
-		track_length[fattrack+1] = track_length[fattrack];
-		track_density[fattrack+1] = track_density[fattrack];
+		disk->track_length[disk->opt.fattrack+1] = disk->track_length[disk->opt.fattrack];
+		disk->track_density[disk->opt.fattrack+1] = disk->track_density[disk->opt.fattrack];
+		invalidate_track_index(disk, disk->opt.fattrack+1);
 	}
 }
 
 /* this routine tries to "fix" non-sync aligned images created from RAW Kryoflux stream files */
-/* PROBLEM: This simple implementation can miss sync like 01111111 11111110 which is 14 bits and valid... */
+/* Syncs are found at any bit offset, so 14-bit syncs like 01111111 11111110 are handled too. */
+/* The span after a sync is moved in one copy so it starts on a byte. Moving it left takes
+   bits from this sync and gives them to the next one, moving it right does the opposite,
+   so data is kept and the track length does not change. Syncs are kept at 10 bits where
+   possible, and never cut below a full 0xff byte. */
 /* PROBLEM: Many KF G64s begin the track in the middle of a sector, and is missed by this routine also */
 size_t sync_align(BYTE *buffer, int length)
 {
-    int i, j;
-    int bytes, bits;
+    int i;
+	size_t sync, sync_end, next_sync, span_end, bits, pad, sync_len, next_len;
+	int left;
 	BYTE temp_buffer[NIB_TRACK_LENGTH];
-	//BYTE *marker_pos;
+	bitstream track;
 
 	memset(temp_buffer, 0x00, NIB_TRACK_LENGTH);
 
@@ -103,130 +112,133 @@ size_t sync_align(BYTE *buffer, int length)
     memcpy(buffer, temp_buffer, length);
     if(verbose>1) printf("{shuff:%d}", i);
 
-    // shift buffer left to edge of sync marks
-    for (i=0; i<length; i++)
-    {
-		if( ((buffer[i] == 0xff) && ((buffer[i+1] & 0x80) == 0x80) && (buffer[i+1] != 0xff)) ||
-			((buffer[i] == 0x7f) && ((buffer[i+1] & 0xc0) == 0xc0) && (buffer[i+1] != 0xff)) )
-		{
-			i++;  //set first byte to shift
-			bits=bytes=j=0;  //reset byte count
-
-			// find next (normal) sync
-			while(!((buffer[i+bytes] == 0xff) && (buffer[i+bytes+1] & 0x80)))
-			{
-				bytes++;
-				if(i+bytes>length) break;
-			}
-			if(verbose>1) printf("(%d)", bytes);
+	bitstream_init(&track, buffer, (size_t)length * 8);
 
-			//shift left until MSB cleared
-			while(buffer[i] & 0x80)
-			{
-				if(bits++>7)
-				{
-					if(verbose) printf("error shift too long!");
-					break;
-				}
+    // move each span to the byte edge after the sync before it
+	sync = bits_find_ones(&track, 0, SYNC_MIN_BITS);
+	while (sync != BITS_NOT_FOUND)
+	{
+		sync_end = sync + bits_count_ones(&track, sync, track.bits);
+		if (sync_end >= track.bits)
+			break;
+
+		next_sync = bits_find_ones(&track, sync_end, SYNC_MIN_BITS);
+		span_end = (next_sync == BITS_NOT_FOUND) ? track.bits : next_sync;
+		bits = sync_end & 7;
+		if (!bits)
+		{
+			sync = next_sync;
+			continue;
+		}
+		if(verbose>1) printf("(%d)", (int)((span_end - sync_end + 7) / 8));
+
+		/* keep both syncs at 10 bits if possible, else at a full 0xff byte */
+		pad = 8 - bits;
+		sync_len = sync_end - sync;
+		next_len = (next_sync == BITS_NOT_FOUND) ? track.bits : bits_count_ones(&track, next_sync, SYNC_MIN_BITS + 8);
+		if (sync_len >= SYNC_MIN_BITS + bits)
+			left = 1;
+		else if (next_len >= SYNC_MIN_BITS + pad)
+			left = 0;
+		else if (sync_len >= 8 + bits)
+			left = 1;
+		else if (next_len >= 8 + pad)
+			left = 0;
+		else
+		{
+			if(verbose>1) printf("[short]");
+			sync = next_sync;
+			continue;
+		}
 
-				for(j=0; j<bytes; j++)
-				{
-					if(i+j+1>length-1) j=bytes;
-					buffer[i+j] = (buffer[i+j] << 1) | ((buffer[i+j+1] & 0x80) >> 7);
-				}
-				//buffer[i+j] |= 0x1;
-			}
-			if(verbose>1) printf("[bits:%d]",bits);
+		if (left)
+		{
+			bits_copy(&track, sync_end - bits, &track, sync_end, span_end - sync_end);
+			bits_fill(&track, span_end - bits, bits, 1);
+			if(verbose>1) printf("[bits:%d]", (int)bits);
+			if (next_sync != BITS_NOT_FOUND)
+				next_sync -= bits;
 		}
-    }
+		else
+		{
+			/* bits pushed past the end of the track are lost */
+			bits_copy(&track, sync_end + pad, &track, sync_end, span_end - sync_end);
+			bits_fill(&track, sync_end, pad, 1);
+			if(verbose>1) printf("[pad:%d]", (int)pad);
+			if (next_sync != BITS_NOT_FOUND)
+				next_sync += pad;
+		}
+
+		sync = next_sync;
+	}
     return 1;
 }
 
 void shift_buffer_left(BYTE *buffer, int length, int n)
 {
-    int i;
-    BYTE tempbuf[NIB_TRACK_LENGTH + 1];
-    BYTE carry;
-    int carryshift = 8 - n;
-
-    memcpy(tempbuf, buffer, length);
-    tempbuf[length] = 0x00;
+	bitstream track;
 
-    // shift buffer left by n bits
-    for (i = 0; i < length; i++)
-    {
-        carry = tempbuf[i+1];
-        buffer[i] = (tempbuf[i] << n) | (carry >> carryshift);
-    }
+	bitstream_init(&track, buffer, (size_t)length * 8);
+	bits_shift(&track, n);
 }
 
 void shift_buffer_right(BYTE *buffer, int length, int n)
 {
-    int i;
-    BYTE tempbuf[NIB_TRACK_LENGTH];
-    BYTE carry;
-    int carryshift = 8 - n;
+	bitstream track;
 
-    memcpy(tempbuf, buffer, length);
-
-    // shift buffer right by n bits
-    carry = 0;
-    for (i = 0; i < length; i++)
-    {
-        buffer[i] = (tempbuf[i] >> n) | (carry << carryshift);
-        carry = tempbuf[i];
-    }
+	bitstream_init(&track, buffer, (size_t)length * 8);
+	bits_shift(&track, -n);
 }
 
 BYTE *
-align_vmax(BYTE * work_buffer, size_t tracklen)
+align_vmax(track_view * view)
 {
-	BYTE *pos, *buffer_end, *start_pos;
+	BYTE *start_pos;
+	size_t pos;
+	BYTE b;
 	int run;
 
 	/* Try to find V-MAX track marker bytes	*/
 
 	run = 0;
-	pos = work_buffer;
-	start_pos = work_buffer;
-	buffer_end = work_buffer + tracklen + 1;
+	start_pos = view->data;
 
-	while (pos < buffer_end)
+	for (pos = 0; pos < view->length + 1; pos++)
 	{
 		// duplicator's markers
-		if ( (*pos == 0x4b) || (*pos == 0x69) || (*pos == 0x49) || (*pos == 0x5a) || (*pos == 0xa5) )
+		b = VIEW_BYTE(view, pos);
+		if ( (b == 0x4b) || (b == 0x69) || (b == 0x49) || (b == 0x5a) || (b == 0xa5) )
 		{
-			if(!run) start_pos = pos;  // mark first byte
+			if(!run) start_pos = VIEW_PTR(view, pos);  // mark first byte
 			if (run > 5) return (start_pos); // assume this is it
 			run++;
 		}
 		else
 			run = 0;
-
-		pos++;
 	}
 	return (0);
 }
 
 BYTE *
-align_vmax_new(BYTE * work_buffer, size_t tracklen)
+align_vmax_new(track_view * view)
 {
-	BYTE *pos, *buffer_end, *key_temp, *key;
+	BYTE *key_temp, *key;
+	size_t pos;
+	BYTE b;
 	int run, longest;
 
 	run = 0;
 	longest = 0;
-	pos = work_buffer;
-	buffer_end = work_buffer + tracklen + 1;
 	key = key_temp = NULL;
 
 	/* try to find longest good gcr run */
-	while (pos < buffer_end - 2)
+	for (pos = 0; pos + 2 < view->length + 1; pos++)
 	{
-		if ( (*pos == 0x4b) || (*pos == 0x69) || (*pos == 0x49) || (*pos == 0x5a) || (*pos == 0xa5) )
+		b = VIEW_BYTE(view, pos);
+		if ( (b == 0x4b) || (b == 0x69) || (b == 0x49) || (b == 0x5a) || (b == 0xa5) )
 		{
 			if(run > 2)
-				key_temp = pos-run+1 ;
+				key_temp = VIEW_PTR(view, pos - run + 1);
 			run++;
 		}
 		else
@@ -238,68 +250,79 @@ align_vmax_new(BYTE * work_buffer, size_t tracklen)
 			}
 			run = 0;
 		}
-		pos++;
 	}
 	return(key);
 }
 
 BYTE *
-align_vmax_cw(BYTE * work_buffer, size_t tracklen)
+align_vmax_cw(track_view * view)
 {
-	BYTE *pos, *buffer_end, *start_pos;
-	int run;
-
-	run = 0;
-	pos = work_buffer;
-	start_pos = work_buffer;
-	buffer_end = work_buffer + tracklen + 1;
+	size_t pos;
 
 	/* Cinemaware titles have a marker $64 $a5 $a5 $a5 */
 
-	while (pos < buffer_end - 3)
+	for (pos = 0; pos + 3 < view->length + 1; pos++)
 	{
 		// duplicator's markers
-		if ( (*pos == 0x64) && (*(pos+1) == 0xa5) && (*(pos+2) == 0xa5) && (*(pos+3) == 0xa5) )
-			return (pos); // assume this is it
-		else
-			pos++;
+		if ( (VIEW_BYTE(view, pos) == 0x64) && (VIEW_BYTE(view, pos + 1) == 0xa5) &&
+			(VIEW_BYTE(view, pos + 2) == 0xa5) && (VIEW_BYTE(view, pos + 3) == 0xa5) )
+			return VIEW_PTR(view, pos); // assume this is it
 	}
 
 	return (0);
 }
 
+/* handler output goes to stdout, or into the track report when the track is aligned in parallel */
+static void
+align_report(align_state * state, const char * format, ...)
+{
+	va_list args;
+	size_t used;
+
+	va_start(args, format);
+	if (state->quiet)
+	{
+		used = strlen(state->report);
+		vsnprintf(state->report + used, sizeof(state->report) - used, format, args);
+	}
+	else
+		vprintf(format, args);
+	va_end(args);
+}
+
+/* shifts the view in place, the caller passes a copy it may modify */
 BYTE *
-align_pirateslayer(BYTE * work_buffer, size_t tracklen)
+align_pirateslayer(track_view * view, align_state * state)
 {
-	BYTE *pos, *buffer_end;
-	BYTE backup_buffer[NIB_TRACK_LENGTH*2];
+	BYTE backup_buffer[NIB_TRACK_LENGTH];
+	BYTE p[5];
+	size_t pos, i;
 	int shift;
 
 	/* backup since we are shifting */
-	memcpy(backup_buffer, work_buffer, NIB_TRACK_LENGTH*2);
+	memcpy(backup_buffer, view->data, view->length);
 
 	for(shift=0; shift<8; shift++)
 	{
-		pos = work_buffer;
-		buffer_end = work_buffer + tracklen + 1;
-
 		/* try to find pslayer signature */
-		while (pos < buffer_end-5)
+		for (pos = 0; pos + 5 < view->length + 1; pos++)
 		{
-			if ( ((pos[0] == 0xd7) && (pos[1] == 0xd7) && (pos[2] == 0xeb) && (pos[3] == 0xcc) && (pos[4] == 0xad)) ||   /* version 1 and version 2 */
+			for (i = 0; i < 5; i++)
+				p[i] = VIEW_BYTE(view, pos + i);
+
+			if ( ((p[0] == 0xd7) && (p[1] == 0xd7) && (p[2] == 0xeb) && (p[3] == 0xcc) && (p[4] == 0xad)) ||   /* version 1 and version 2 */
 				/* it also looks for another byte pattern just after that: $55 $AE $9B $55 $AD $55 $CB $AE $6B $AB $AD $AF, but we only flag first one */
-				((pos[0] == 0xeb) && (pos[1] == 0xd7) && (pos[2] == 0xaa) && (pos[3] == 0x55)) )  /* version 1 secondary check */
+				((p[0] == 0xeb) && (p[1] == 0xd7) && (p[2] == 0xaa) && (p[3] == 0x55)) )  /* version 1 secondary check */
 			{
-				return pos - 5;  /* back up a little */
+				return VIEW_PTR(view, pos + view->length - 5);  /* back up a little */
 			}
-			pos++;
 		}
-		printf(">>%d", shift+1);
-		shift_buffer_right(work_buffer, tracklen, 1);
+		align_report(state, ">>%d", shift+1);
+		shift_buffer_right(view->data, view->length, 1);
 	}
 
 	/* never found signature, restore original track data */
-	memcpy(work_buffer, backup_buffer, NIB_TRACK_LENGTH*2);
+	memcpy(view->data, backup_buffer, view->length);
 
 	return NULL;
 }
@@ -337,14 +360,43 @@ sync before sector 0.
 */
 
 
-/* RLTV: Global value. Early RL versions have TV info on T17, not T18.
+/* RL TV standard: Early RL versions have TV info on T17, not T18.
    RL TV standard is output only when RL version is recognized on T18,
-   so we have to remember this value. */
-static int RLTV = 0;
+   so align_state carries this value from track to track. */
+
+static BYTE *align_rl_linear(BYTE * work_buffer, size_t tracklen, align_state * state);
+static void print_rl_version(align_state * state);
 
 
+/* the RL parser walks two consecutive revolutions linearly */
 BYTE *
-align_rl_special(BYTE * work_buffer, size_t tracklen)
+align_rl_special(track_view * view, align_state * state)
+{
+	BYTE work_buffer[NIB_TRACK_LENGTH*2];
+	BYTE *key;
+
+	memset(work_buffer, 0, sizeof(work_buffer));
+	view_copy(view, 0, work_buffer, 2 * view->length);
+
+	state->rapidlok = 1;
+	key = align_rl_linear(work_buffer, view->length, state);
+	if (!state->quiet)
+		print_rl_version(state);
+
+	return key ? VIEW_PTR(view, key - work_buffer) : NULL;
+}
+
+/* prints what the handlers kept for a track aligned with a quiet align_state */
+void
+print_align_report(align_state * state)
+{
+	printf("%s", state->report);
+	if (state->rapidlok)
+		print_rl_version(state);
+}
+
+static BYTE *
+align_rl_linear(BYTE * work_buffer, size_t tracklen, align_state * state)
 {
 	BYTE *pos, *pos2, *pos3, *pos4, *pos5, *pos6, *buffer_end, *key, *key_PreKS_Sync, *key_PreSec0_Sync, *key_KS;
 	int longest, numGG, numFF, num55, num7B, num4B, numXX, Found_RL_TrackHeader, len_temp;
@@ -502,7 +554,7 @@ align_rl_special(BYTE * work_buffer, size_t tracklen)
 						pos5 = pos+183;
 						//printf("<%2X.%2X.%2X.%2X>",*pos2,*pos3,*pos4,*pos5);
 						/* RL1-TV: */
-						if ( (*pos2 == 0x54) && (*pos3 == 0xB4) && (*pos4 == 0xD5) && (*pos5 == 0x7B) ) RLTV = 1; /* 1=NTSC */
+						if ( (*pos2 == 0x54) && (*pos3 == 0xB4) && (*pos4 == 0xD5) && (*pos5 == 0x7B) ) state->rl_tv = 1; /* 1=NTSC */
 					}
 				}
 
@@ -535,9 +587,9 @@ align_rl_special(BYTE * work_buffer, size_t tracklen)
 						pos6 = pos+199;
 						//printf("<%2X.%2X.%2X.%2X.%2X>",*pos2,*pos3,*pos4,*pos5,*pos6);
 						/* RL2-TV: */
-						if ( (*pos2 == 0xF2) && (*pos3 == 0x65) && (*pos4 == 0xBF) && (*pos5 == 0x27) && (*pos6 == 0xDE) ) RLTV = 1; /* 1=NTSC */
-						if ( (*pos2 == 0x92) && (*pos3 == 0xBD) && (*pos4 == 0x3B) && (*pos5 == 0x2A) && (*pos6 == 0xD6) ) RLTV = 1; /* 1=NTSC */
-						if ( (*pos2 == 0xF2) && (*pos3 == 0x55) && (*pos4 == 0x2F) && (*pos5 == 0x25) && (*pos6 == 0x52) ) RLTV = 2; /* 1=PAL */
+						if ( (*pos2 == 0xF2) && (*pos3 == 0x65) && (*pos4 == 0xBF) && (*pos5 == 0x27) && (*pos6 == 0xDE) ) state->rl_tv = 1; /* 1=NTSC */
+						if ( (*pos2 == 0x92) && (*pos3 == 0xBD) && (*pos4 == 0x3B) && (*pos5 == 0x2A) && (*pos6 == 0xD6) ) state->rl_tv = 1; /* 1=NTSC */
+						if ( (*pos2 == 0xF2) && (*pos3 == 0x55) && (*pos4 == 0x2F) && (*pos5 == 0x25) && (*pos6 == 0x52) ) state->rl_tv = 2; /* 1=PAL */
 					}
 				}
 
@@ -562,9 +614,9 @@ align_rl_special(BYTE * work_buffer, size_t tracklen)
 						pos4 = pos+198;
 						pos5 = pos+199;
 						//printf("<%2X.%2X.%2X.%2X>",*pos2,*pos3,*pos4,*pos5);
-						if ( (*pos2 == 0xAF) && (*pos3 == 0x9A) && (*pos4 == 0xE6) && (*pos5 == 0xB5) ) RLTV = 1; /* RL6: 1=NTSC, RL7: 1=PAL!! */
-						if ( (*pos2 == 0x9E) && (*pos3 == 0xAA) && (*pos4 == 0xE5) && (*pos5 == 0x73) ) RLTV = 2; /* RL6: 2=PAL */
-						if ( (*pos2 == 0x96) && (*pos3 == 0xEA) && (*pos4 == 0xE5) && (*pos5 == 0xE9) ) RLTV = 3; /* RL7: 3=NTSC */
+						if ( (*pos2 == 0xAF) && (*pos3 == 0x9A) && (*pos4 == 0xE6) && (*pos5 == 0xB5) ) state->rl_tv = 1; /* RL6: 1=NTSC, RL7: 1=PAL!! */
+						if ( (*pos2 == 0x9E) && (*pos3 == 0xAA) && (*pos4 == 0xE5) && (*pos5 == 0x73) ) state->rl_tv = 2; /* RL6: 2=PAL */
+						if ( (*pos2 == 0x96) && (*pos3 == 0xEA) && (*pos4 == 0xE5) && (*pos5 == 0xE9) ) state->rl_tv = 3; /* RL7: 3=NTSC */
 					}
 				}
 				RLT17S0Identified = 0;
@@ -656,13 +708,13 @@ cont:
 	if ( (RL_Hdr_Found > 0) && ( (RL_Sec_Found > 0) || (DOS_Sec_Found > 0) ) )
 	{
 		/* RL track with $75 sector headers and $6B/$55 data sectors */
-		printf("[RL");
+		align_report(state, "[RL");
 		if (Found_Max_RL_TrackHeader == 1)
 		{
 			if (MaxNum4B > 0) /* reveal $7B extra sectors that contain randomly distributed $4B */
-				printf(":THX:%d+%d+%d{%d}+%d->%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNum4B, MaxNumXX, MaxNum55+MaxNum7B+MaxNumXX);
+				align_report(state, ":THX:%d+%d+%d{%d}+%d->%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNum4B, MaxNumXX, MaxNum55+MaxNum7B+MaxNumXX);
 			else
-				printf(":TH:%d+%d+%d+%d->%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNumXX, MaxNum55+MaxNum7B+MaxNumXX);
+				align_report(state, ":TH:%d+%d+%d+%d->%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNumXX, MaxNum55+MaxNum7B+MaxNumXX);
 		}
 		else
 		{
@@ -670,25 +722,25 @@ cont:
 			if (longest_PreSec0_Sync > 0)
 			{
 				if (DOSSecAlignRule == 1)
-					printf(":DOS-Sec0]"); /* align to DOS-Sec0 with longest preceding sync */
+					align_report(state, ":DOS-Sec0]"); /* align to DOS-Sec0 with longest preceding sync */
 				else
-					printf(":DOS-MaxSync]");
+					align_report(state, ":DOS-MaxSync]");
 				key = key_PreSec0_Sync; /* align to DOS-Hdr with longest preceding sync */
 			}
 			else
-				printf("]"); /* not even DOS sector found */
+				align_report(state, "]"); /* not even DOS sector found */
 		}
 	}
 	else if ( (DOS_Hdr_Found > 0) && (DOS_Sec_Found > 0) )
 	{
 		/* DOS track with $55/$52 IDs, no $75 IDs */
-		printf("[DOS");
+		align_report(state, "[DOS");
 		if (Found_Max_RL_TrackHeader == 1)
 		{
 			if (MaxNum4B > 0) /* reveal $7B extra sectors that contain randomly distributed $4B */
-				printf(":THX:%d+%d+%d{%d}+%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNum4B, MaxNumXX);
+				align_report(state, ":THX:%d+%d+%d{%d}+%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNum4B, MaxNumXX);
 			else
-				printf(":TH:%d+%d+%d+%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNumXX);
+				align_report(state, ":TH:%d+%d+%d+%d]", MaxNumFF, MaxNum55, MaxNum7B, MaxNumXX);
 		}
 		else
 		{
@@ -696,35 +748,43 @@ cont:
 			if (longest_PreSec0_Sync > 0)
 			{
 				if (DOSSecAlignRule == 1)
-					printf(":DOS-Sec0]"); /* align to DOS-Sec0 with longest preceding sync */
+					align_report(state, ":DOS-Sec0]"); /* align to DOS-Sec0 with longest preceding sync */
 				else
-					printf(":DOS-MaxSync]");
+					align_report(state, ":DOS-MaxSync]");
 				key = key_PreSec0_Sync; /* align to DOS-Hdr with longest preceding sync */
 			}
 			else
-				printf("]"); /* not even DOS sector found */
+				align_report(state, "]"); /* not even DOS sector found */
 		}
 	}
 	else if ( (RL_Sec_Found > 0) && (RL_Hdr_Found == 0) && (NonRLStruct == 0) && (100 < RL_Sec_Len) && (RL_Sec_Len < 350) )
 	{
 		/* RL-KS found, place it at end of track buffer */
-		printf("[RL-KS:%d]", RL_Sec_Len); /* KS in first half of double-track-buffer */
+		align_report(state, "[RL-KS:%d]", RL_Sec_Len); /* KS in first half of double-track-buffer */
 		key = key_KS + RL_Sec_Len; /* key --> first byte after RL-KS */
 		if (key >= work_buffer + tracklen)
 			key = key_PreKS_Sync; /* choose sync-start in first half of double-track-buffer */
 	}
 	else
-		printf("[Unknown!]"); /* Unknown track format */
+		align_report(state, "[Unknown!]"); /* Unknown track format */
+
+	state->rl_version = RLver;
+
+	return key;
+}
 
-	if (RLver)
+static void
+print_rl_version(align_state * state)
+{
+	if (state->rl_version)
 	{
-		printf("<RL%d", RLver);
-		if (RLver == 7)
+		printf("<RL%d", state->rl_version);
+		if (state->rl_version == 7)
 		{
 			/* TV is only printed when RL version is recognized */
-			if (RLTV == 1)
+			if (state->rl_tv == 1)
 				printf("-PAL> ");
-			else if (RLTV == 3)
+			else if (state->rl_tv == 3)
 				printf("-NTSC> ");
 			else
 				printf("-TV?> ");
@@ -732,9 +792,9 @@ cont:
 		else
 		{
 			/* TV is only printed when RL version is recognized */
-			if (RLTV == 1)
+			if (state->rl_tv == 1)
 				printf("-NTSC> ");
-			else if (RLTV == 2)
+			else if (state->rl_tv == 2)
 				printf("-PAL> ");
 			else
 				printf("-TV?> ");
@@ -742,30 +802,27 @@ cont:
 	}
 	else
 		printf(" ");
-
-	return key;
 }
 
 // Line up the track cycle to the start of the longest gap mark
 // this helps some custom protection tracks master properly
 BYTE *
-auto_gap(BYTE * work_buffer, size_t tracklen)
+auto_gap(track_view * view)
 {
-	BYTE *pos, *buffer_end, *key_temp, *key;
+	BYTE *key_temp, *key;
+	size_t pos;
 	int run, longest;
 
 	run = 0;
 	longest = 0;
-	pos = work_buffer;
-	buffer_end = work_buffer + tracklen + 1;
 	key = key_temp = NULL;
 
 	/* try to find longest run of any one byte */
-	while (pos < buffer_end - 2)
+	for (pos = 0; pos + 2 < view->length + 1; pos++)
 	{
-		if (*pos == *(pos + 1))	// && (*pos != 0x00 ))
+		if (VIEW_BYTE(view, pos) == VIEW_BYTE(view, pos + 1))	// && (*pos != 0x00 ))
 		{
-			key_temp = pos + 2;
+			key_temp = VIEW_PTR(view, pos + 2);
 			run++;
 		}
 		else
@@ -778,7 +835,6 @@ auto_gap(BYTE * work_buffer, size_t tracklen)
 			}
 			run = 0;
 		}
-		pos++;
 	}
 
 	/* last 5 bytes of gap */
@@ -794,25 +850,26 @@ auto_gap(BYTE * work_buffer, size_t tracklen)
 // we can line up the track cycle to this
 // in lieu of no other hints
 BYTE *
-find_bad_gap(BYTE * work_buffer, size_t tracklen)
+find_bad_gap(track_view * view)
 {
-	BYTE *pos, *buffer_end, *key_temp, *key;
+	BYTE *key_temp, *key;
+	BYTE badmap[BAD_GCR_MAP_SIZE(NIB_TRACK_LENGTH * 2)];
+	size_t pos;
 	int run, longest;
 
 	run = 0;
 	longest = 0;
-	pos = work_buffer;
-	buffer_end = work_buffer + tracklen + 1;
 	key = key_temp = NULL;
 
+	bad_gcr_map(view->data, view->length, badmap);
+
 	/* try to find longest bad gcr run */
-	while (pos < buffer_end)
+	for (pos = 0; pos < view->length + 1; pos++)
 	{
-		if (is_bad_gcr(work_buffer, buffer_end - work_buffer,
-		  pos - work_buffer))
+		if (BAD_GCR_AT(badmap, pos % view->length))
 		{
 			// mark next GCR byte
-			key_temp = pos + 1;
+			key_temp = VIEW_PTR(view, pos + 1);
 			run++;
 		}
 		else
@@ -824,7 +881,6 @@ find_bad_gap(BYTE * work_buffer, size_t tracklen)
 			}
 			run = 0;
 		}
-		pos++;
 	}
 
 	/* first byte after bad run */
@@ -834,24 +890,23 @@ find_bad_gap(BYTE * work_buffer, size_t tracklen)
 // Line up the track cycle to the start of the longest sync mark
 // this helps some custom protection tracks master properly
 BYTE *
-find_long_sync(BYTE * work_buffer, size_t tracklen)
+find_long_sync(track_view * view)
 {
-	BYTE *pos, *buffer_end, *key_temp, *key;
+	BYTE *key_temp, *key;
+	size_t pos;
 	int run, longest;
 
 	run = 0;
 	longest = 0;
-	pos = work_buffer;
-	buffer_end = work_buffer + tracklen + 1;
 	key = key_temp = NULL;
 
 	/* try to find longest sync run */
-	while (pos < buffer_end)
+	for (pos = 0; pos < view->length + 1; pos++)
 	{
-		if (*pos == 0xff)
+		if (VIEW_BYTE(view, pos) == 0xff)
 		{
 			if (run == 0)
-				key_temp = pos;
+				key_temp = VIEW_PTR(view, pos);
 
 			run++;
 		}
@@ -864,7 +919,6 @@ find_long_sync(BYTE * work_buffer, size_t tracklen)
 			}
 			run = 0;
 		}
-		pos++;
 	}
 
 	/* first byte of longest sync run */
@@ -15,6 +15,7 @@
 
 static BYTE diskid[3];
 extern int drivetype;
+extern nib_disk *disk;
 
 BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 {
@@ -132,7 +133,7 @@ BYTE read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 	return (density);
 }
 
-BYTE paranoia_read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
+BYTE paranoia_read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer, align_state * state, nib_options * opt)
 {
 	BYTE buffer1[NIB_TRACK_LENGTH];
 	BYTE buffer2[NIB_TRACK_LENGTH];
@@ -145,6 +146,7 @@ BYTE paranoia_read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 	BYTE denso, densn;
 	size_t i, l, badgcr, retries, errors, best;
 	char errorstring[0x1000];
+	track_compare compare;
 
 	badgcr = 0;
 	errors = 0;
@@ -178,7 +180,7 @@ BYTE paranoia_read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 
 		// Find track cycle and length
 		memset(cbufo, 0, NIB_TRACK_LENGTH);
-		leno = extract_GCR_track(cbufo, bufo, &align, halftrack/2, capacity_min[denso & 3], capacity_max[denso & 3]);
+		leno = extract_GCR_track(cbufo, bufo, &align, halftrack/2, capacity_min[denso & 3], capacity_max[denso & 3], state, opt);
 
 		printf("%d ", leno);
 		fprintf(fplog, "%d ", leno);
@@ -223,7 +225,7 @@ BYTE paranoia_read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 		}
 
 		// check for CBM DOS errors
-		errors = check_errors(cbufo, leno, halftrack, diskid, errorstring);
+		errors = check_errors(cbufo, leno, halftrack, diskid, errorstring, NULL);
 		fprintf(fplog, "%s", errorstring);
 
 		// If there are a lot of errors, the track probably doesn't contain
@@ -258,7 +260,7 @@ BYTE paranoia_read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 	}
 
 	// Fix bad GCR in track for compare
-	if ((badgcr = check_bad_gcr(cbufo, leno)) != 0)
+	if ((badgcr = check_bad_gcr(cbufo, leno, opt)) != 0)
 	{
 		printf(" (weakgcr:%d) ", badgcr);
 		fprintf(fplog, " (weakgcr:%d) ", badgcr);
@@ -278,30 +280,32 @@ BYTE paranoia_read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 			densn = read_halftrack(fd, halftrack, bufn);
 
 			memset(cbufn, 0, NIB_TRACK_LENGTH);
-			lenn = extract_GCR_track(cbufn, bufn, &align, halftrack/2, capacity_min[densn & 3], capacity_max[densn & 3]);
+			lenn = extract_GCR_track(cbufn, bufn, &align, halftrack/2, capacity_min[densn & 3], capacity_max[densn & 3], state, opt);
 
 			printf("%d ", lenn);
 			fprintf(fplog, "%d ", lenn);
 
 			// Fix bad GCR in track for compare
-			if ((badgcr = check_bad_gcr(cbufn, lenn)) != 0)
+			if ((badgcr = check_bad_gcr(cbufn, lenn, opt)) != 0)
 			{
 				//printf("(weakgcr:%d)", badgcr);
 				//fprintf(fplog, "(weakgcr:%d) ", badgcr);
 			}
 
-			// compare raw gcr data
-			gcr_diff = compare_tracks(cbufo, cbufn, leno, lenn, 1, errorstring);
-			if(verbose) printf("VERIFY: diff:%.4d ", (int)gcr_diff);
-			fprintf(fplog, "VERIFY: diff:%.4d ", (int)gcr_diff);
+			// compare raw gcr data, counting stops once it can't verify
+			gcr_diff = compare_tracks_stats(cbufo, cbufn, leno, lenn, 1, 10, &compare, opt);
+			if(verbose) printf("VERIFY: diff:%s%.4d ", compare.truncated ? ">" : "", (int)gcr_diff - compare.truncated);
+			fprintf(fplog, "VERIFY: diff:%s%.4d ", compare.truncated ? ">" : "", (int)gcr_diff - compare.truncated);
 			if(gcr_diff <= 10)
 			{
 				if(verbose) printf("OK ");
+				/* goes to the log below, with the track length */
+				format_track_compare(&compare, errorstring);
 				break;
 			}
 
 			// compare sector data
-			if (compare_sectors(cbufo, cbufn, leno, lenn, diskid, diskid, halftrack, errorstring) == sector_map[halftrack/2])
+			if (compare_sectors(cbufo, cbufn, leno, lenn, diskid, diskid, halftrack, errorstring, NULL, NULL) == sector_map[halftrack/2])
 			{
 				if(verbose) printf(" - sector match ");
 				fprintf(fplog, " - sector match ");
@@ -324,7 +328,7 @@ BYTE paranoia_read_halftrack(CBM_FILE fd, int halftrack, BYTE * buffer)
 }
 
 int
-read_floppy(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+read_floppy(CBM_FILE fd, nib_disk *disk)
 {
     int track;
     //size_t errors = 0;
@@ -334,10 +338,11 @@ read_floppy(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_
 	fprintf(fplog,"\n");
 
 	if(!rawmode) get_disk_id(fd);
+	invalidate_track_index(disk, -1);
 
 	//for (track = end_track; track >= start_track; track -= track_inc)
-	for (track = start_track; track <= end_track; track += track_inc)
-		track_density[track] = paranoia_read_halftrack(fd, track, track_buffer + (track * NIB_TRACK_LENGTH));
+	for (track = disk->opt.start_track; track <= disk->opt.end_track; track += disk->opt.track_inc)
+		disk->track_density[track] = paranoia_read_halftrack(fd, track, disk->track_buffer + (track * NIB_TRACK_LENGTH), &disk->align, &disk->opt);
 
 	step_to_halftrack(fd, 18*2);
 	return 1;
@@ -374,7 +379,7 @@ int write_nb2(CBM_FILE fd, char * filename)
 	get_disk_id(fd);
 
 	header_entry = 0;
-	for (track = start_track; track <= end_track; track += track_inc)
+	for (track = disk->opt.start_track; track <= disk->opt.end_track; track += disk->opt.track_inc)
 	{
 		memset(buffer, 0, sizeof(buffer));
 
@@ -575,7 +580,7 @@ int TrackAlignmentReport(CBM_FILE fd)
 	printf("\nStarting Track Alignment Analysis.\n");
 	printf("Make sure a disk is in the drive turned to side 1 ONLY!\n\n");
 
-	if (track_inc == 1)
+	if (disk->opt.track_inc == 1)
 	{
 		printf("    |           Full Track           |       Half Track (+0.5)       \n");
 		printf(" #T +--------------------------------+-------------------------------\n");
@@ -593,7 +598,7 @@ int TrackAlignmentReport(CBM_FILE fd)
 
 	motor_on(fd);
 
-	for (track = start_track; track <= end_track; track += track_inc)
+	for (track = disk->opt.start_track; track <= disk->opt.end_track; track += disk->opt.track_inc)
 	{
 		step_to_halftrack(fd, track);
 		density = scan_track(fd, track);
@@ -13,39 +13,41 @@
 #include "gcr.h"
 #include "nibtools.h"
 
+extern nib_disk *disk;
+
 void
-master_track(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, int track, size_t tracklen)
+master_track(CBM_FILE fd, nib_disk *disk, int track, size_t tracklen)
 {
 	int i,leader;
 	static BYTE last_density = -1;
 	BYTE rawtrack[NIB_TRACK_LENGTH*2];
 
-	if(track_inc==1) leader=0;
+	if(disk->opt.track_inc==1) leader=0;
 	else leader=10;
 
-	if(track_density[track] & BM_NO_SYNC)
+	if(disk->track_density[track] & BM_NO_SYNC)
 		memset(rawtrack, 0x55, sizeof(rawtrack));
 	else
 		memset(rawtrack, fillbyte, sizeof(rawtrack));
 
 	/* merge track data */
-	memcpy(rawtrack + leader, track_buffer + (track * NIB_TRACK_LENGTH), tracklen);
+	memcpy(rawtrack + leader, disk->track_buffer + (track * NIB_TRACK_LENGTH), tracklen);
 
 	/* check for and correct initial too short sync mark */
-	if( ((!(track_density[track] & BM_NO_SYNC)) &&
-	    (track_buffer[track * NIB_TRACK_LENGTH] == 0xff) &&
-	    (track_buffer[(track * NIB_TRACK_LENGTH) + 1] != 0xff)) || (presync) )
+	if( ((!(disk->track_density[track] & BM_NO_SYNC)) &&
+	    (disk->track_buffer[track * NIB_TRACK_LENGTH] == 0xff) &&
+	    (disk->track_buffer[(track * NIB_TRACK_LENGTH) + 1] != 0xff)) || (disk->opt.presync) )
 	{
-		if(presync>=leader) presync=leader-2;
-		if(verbose) printf("[presync:%d]",presync);
-		memset(rawtrack + leader - presync, 0xff, presync+1); // Overwrites first sync byte just in case it's not 0xFF
+		if(disk->opt.presync>=leader) disk->opt.presync=leader-2;
+		if(verbose) printf("[presync:%d]",disk->opt.presync);
+		memset(rawtrack + leader - disk->opt.presync, 0xff, disk->opt.presync+1); // Overwrites first sync byte just in case it's not 0xFF
 	}
 
 	/* handle short tracks */
-	if(tracklen < capacity[track_density[track]&3])
+	if(tracklen < capacity[disk->track_density[track]&3])
 	{
-			if(verbose) printf("[pad:%d]", capacity[track_density[track]&3] - tracklen);
-			tracklen = capacity[track_density[track]&3];
+			if(verbose) printf("[pad:%d]", capacity[disk->track_density[track]&3] - tracklen);
+			tracklen = capacity[disk->track_density[track]&3];
 	}
 
 	/* "fix" for track 18 mastering */
@@ -57,30 +59,30 @@ master_track(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, int track, si
 		replace_bytes(rawtrack, sizeof(rawtrack), 0x00, 0x01);
 
 	/* step to destination track and set density */
-	if((fattrack)&&(track==fattrack+2))
+	if((disk->fat_track)&&(track==disk->fat_track+2))
 		step_to_halftrack(fd, track+1);
 	else
 		step_to_halftrack(fd, track);
 
-	if((fattrack)&&((track==fattrack)||(track==fattrack+2)))
+	if((disk->fat_track)&&((track==disk->fat_track)||(track==disk->fat_track+2)))
 			printf("[fat track]");
 
-	if((track_density[track]&3) != last_density)
+	if((disk->track_density[track]&3) != last_density)
 	{
-		set_density(fd, track_density[track]&3);
+		set_density(fd, disk->track_density[track]&3);
 		if(verbose>1) printf("[D]");
-		last_density = track_density[track]&3;
+		last_density = disk->track_density[track]&3;
 	}
 
 	// try to do track alignment through simple timers
-	if((skew||align_disk) && (auto_capacity_adjust))
+	if((disk->opt.skew||align_disk) && (disk->opt.auto_capacity_adjust))
 	{
 		/* subtract overhead from one revolution;
 	    adjust for motor speed and density; */
 		align_delay = (int)((motor_speed*200000)/300)-18000; // roughly the step time is 18
-		align_delay += skew*1000;
+		align_delay += disk->opt.skew*1000;
 		if(align_delay>200000) align_delay-=200000;
-		printf("[skew:%d][delay:%d]", skew, align_delay);
+		printf("[skew:%d][delay:%d]", disk->opt.skew, align_delay);
 	    msleep(align_delay);
     }
 
@@ -120,24 +122,25 @@ master_track(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, int track, si
 }
 
 void
-master_disk(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+master_disk(CBM_FILE fd, nib_disk *disk)
 {
-	int track, verified, retries, added_sync=0, addsyncloops;
+	int track, verified, retries, added_sync=0;
 	size_t badgcr, length, verlen, verlen2;
 	BYTE verbuf1[NIB_TRACK_LENGTH], verbuf2[NIB_TRACK_LENGTH], verbuf3[NIB_TRACK_LENGTH], align;
-	size_t gcr_diff;
-	char errorstring[0x1000];
+	size_t gcr_diff, gcr_limit;
+	track_compare compare;
+	sync_lengthen sync_stats;
 
 	//if(track_inc==1) unformat_disk(fd);
 
-	for (track=backwards?end_track:start_track; backwards?(track>=start_track):(track<=end_track); backwards?(track-=track_inc):(track+=track_inc))
+	for (track=backwards?disk->opt.end_track:disk->opt.start_track; backwards?(track>=disk->opt.start_track):(track<=disk->opt.end_track); backwards?(track-=disk->opt.track_inc):(track+=disk->opt.track_inc))
 	{
 		/* double-check our sync-flag assumptions and process track for remaster */
-		track_density[track] =
-			check_sync_flags(track_buffer + (track * NIB_TRACK_LENGTH), track_density[track], track_length[track]);
+		disk->track_density[track] =
+			check_sync_flags(disk->track_buffer + (track * NIB_TRACK_LENGTH), disk->track_density[track], disk->track_length[track]);
 
 		/* engineer killer track */
-		if(track_density[track] & BM_FF_TRACK)
+		if(disk->track_density[track] & BM_FF_TRACK)
 		{
 				fill_track(fd, track, 0xFF);
 				if(verbose) printf("\n%4.1f: KILLED!",  (float) track / 2);
@@ -145,9 +148,9 @@ master_disk(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_
 		}
 
 		/* zero out empty tracks entirely */
-		if(!check_formatted(track_buffer + (track * NIB_TRACK_LENGTH), track_length[track]))
+		if(!check_formatted(disk->track_buffer + (track * NIB_TRACK_LENGTH), disk->track_length[track]))
 		{
-				if(track_inc!=1)
+				if(disk->opt.track_inc!=1)
 				{
 					fill_track(fd, track, 0x00);
 					if(verbose) printf("\n%4.1f: UNFORMATTED!",  (float) track / 2);
@@ -159,36 +162,38 @@ master_disk(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_
 		if(verbose)
 		{
 			printf("\n%4.1f: (", (float)track/2);
-			printf("%d", track_density[track]&3);
-			if ((track_density[track]&3) != speed_map[track/2]) printf("!");
-			printf(":%d) ", track_length[track]);
-			if (track_density[track] & BM_NO_SYNC) printf("NOSYNC ");
-			if (track_density[track] & BM_FF_TRACK) printf("KILLER ");
+			printf("%d", disk->track_density[track]&3);
+			if ((disk->track_density[track]&3) != speed_map[track/2]) printf("!");
+			printf(":%d) ", disk->track_length[track]);
+			if (disk->track_density[track] & BM_NO_SYNC) printf("NOSYNC ");
+			if (disk->track_density[track] & BM_FF_TRACK) printf("KILLER ");
 			printf("WRITE ");
 		}
 
 		/* loop last byte of track data for filler
 		   we do this before processing track in case we get wrong byte */
-		fillbyte = track_buffer[(track * NIB_TRACK_LENGTH) + track_length[track] - 1];
+		fillbyte = disk->track_buffer[(track * NIB_TRACK_LENGTH) + disk->track_length[track] - 1];
 		if(verbose) printf("[fill:$%.2x]", fillbyte);
 
-		if((increase_sync)&&(track_length[track])&&(!(track_density[track]&BM_NO_SYNC))&&(!(track_density[track]&BM_FF_TRACK)))
+		if((disk->opt.increase_sync)&&(disk->track_length[track])&&(!(disk->track_density[track]&BM_NO_SYNC))&&(!(disk->track_density[track]&BM_FF_TRACK)))
 		{
-			for(addsyncloops=0;addsyncloops<increase_sync;addsyncloops++)
-			{
-				added_sync = lengthen_sync(track_buffer + (track * NIB_TRACK_LENGTH), track_length[track], capacity[track_density[track]&3]);
-				track_length[track] += added_sync;
-				if(verbose) printf("[+sync:%d]", added_sync);
-			}
+			added_sync = lengthen_sync_by(disk->track_buffer + (track * NIB_TRACK_LENGTH), disk->track_length[track],
+				capacity[disk->track_density[track]&3], disk->opt.increase_sync, &sync_stats);
+			disk->track_length[track] += added_sync;
+			if(verbose) printf("[+sync:%d]", added_sync);
+			if((verbose>1)&&(sync_stats.syncs))
+				printf("(syncs:%d,%d-%d)", (int)sync_stats.syncs, (int)sync_stats.shortest, (int)sync_stats.longest);
 		}
 
-		badgcr = check_bad_gcr(track_buffer + (track * NIB_TRACK_LENGTH), track_length[track]);
+		/* sync and GCR fixes change the track in place */
+		invalidate_track_index(disk, track);
+		badgcr = check_bad_gcr(disk->track_buffer + (track * NIB_TRACK_LENGTH), disk->track_length[track], &disk->opt);
 		if(verbose) printf("[weak:%d]", badgcr);
 
-		length = compress_halftrack(track, track_buffer + (track * NIB_TRACK_LENGTH),
-			track_density[track], track_length[track]);
+		length = compress_halftrack(track, disk->track_buffer + (track * NIB_TRACK_LENGTH),
+			disk->track_density[track], disk->track_length[track], capacity[disk->track_density[track]&3], &disk->opt);
 
-		master_track(fd, track_buffer, track_density, track, length);
+		master_track(fd, disk, track, length);
 
 		if(track_match)	// Try to verify our write
 		{
@@ -196,16 +201,16 @@ master_disk(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_
 			while(!verified)
 			{
 				// Don't bother to compare unformatted or bad data
-				if (track_length[track] == NIB_TRACK_LENGTH) break;
+				if (disk->track_length[track] == NIB_TRACK_LENGTH) break;
 
 				memset(verbuf1, 0, NIB_TRACK_LENGTH);
-				if((ihs) && (!(track_density[track] & BM_NO_SYNC)))
+				if((ihs) && (!(disk->track_density[track] & BM_NO_SYNC)))
 					send_mnib_cmd(fd, FL_READIHS, NULL, 0);
 				else if (Use_SCPlus_IHS) // "-j"
 					send_mnib_cmd(fd, FL_IHS_READ_SCP, NULL, 0);
 				else
 				{
-					if ((track_density[track] & BM_NO_SYNC) || (track_density[track] & BM_FF_TRACK))
+					if ((disk->track_density[track] & BM_NO_SYNC) || (disk->track_density[track] & BM_FF_TRACK))
 						send_mnib_cmd(fd, FL_READWOSYNC, NULL, 0);
 					else
 						send_mnib_cmd(fd, FL_READNORMAL, NULL, 0);
@@ -215,22 +220,24 @@ master_disk(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_
 
 				memset(verbuf2, 0, NIB_TRACK_LENGTH);
 				memset(verbuf3, 0, NIB_TRACK_LENGTH);
-				verlen   = extract_GCR_track(verbuf2, verbuf1, &align, track/2, track_length[track], track_length[track]);
-				verlen2 = extract_GCR_track(verbuf3, track_buffer+(track * NIB_TRACK_LENGTH), &align, track/2, track_length[track], track_length[track]);
+				verlen   = extract_GCR_track(verbuf2, verbuf1, &align, track/2, disk->track_length[track], disk->track_length[track], &disk->align, &disk->opt);
+				verlen2 = extract_GCR_track(verbuf3, disk->track_buffer+(track * NIB_TRACK_LENGTH), &align, track/2, disk->track_length[track], disk->track_length[track], &disk->align, &disk->opt);
 
-				if(verbose) printf("\n      (%d:%d) VERIF", track_density[track]&3, verlen);
-				fprintf(fplog, "\n      (%d:%d) VERIF", track_density[track]&3, verlen);
+				if(verbose) printf("\n      (%d:%d) VERIF", disk->track_density[track]&3, verlen);
+				fprintf(fplog, "\n      (%d:%d) VERIF", disk->track_density[track]&3, verlen);
 
 				// Fix bad GCR in tracks for compare
-				badgcr = check_bad_gcr(verbuf2, track_length[track]);
+				badgcr = check_bad_gcr(verbuf2, disk->track_length[track], &disk->opt);
 				if(verbose>1) printf("(badgcr=%.4d:", badgcr);
-				badgcr = check_bad_gcr(verbuf3, track_length[track]);
+				badgcr = check_bad_gcr(verbuf3, disk->track_length[track], &disk->opt);
 				if(verbose>1) printf("%.4d)", badgcr);
 
-				// compare raw gcr data
-				gcr_diff = compare_tracks(verbuf3, verbuf2, verlen, verlen, 1, errorstring);
-				if(verbose) printf(" (diff:%.4d) ", (int)gcr_diff);
-				fprintf(fplog, " (diff:%.4d) ", (int)gcr_diff);
+				// compare raw gcr data, counting stops once it can't verify
+				gcr_limit = (size_t)sector_map[track/2]+10;
+				if(gcr_limit < badgcr) gcr_limit = badgcr;
+				gcr_diff = compare_tracks_stats(verbuf3, verbuf2, verlen, verlen, 1, gcr_limit, &compare, &disk->opt);
+				if(verbose) printf(" (diff:%s%.4d) ", compare.truncated ? ">" : "", (int)gcr_diff - compare.truncated);
+				fprintf(fplog, " (diff:%s%.4d) ", compare.truncated ? ">" : "", (int)gcr_diff - compare.truncated);
 
 
 				if(gcr_diff <= (size_t)sector_map[track/2]+10)
@@ -248,7 +255,7 @@ master_disk(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_
 					retries++;
 					printf("Retry %d ", retries);
 					fill_track(fd, track, 0x00);
-					master_track(fd, track_buffer, track_density, track, length);
+					master_track(fd, disk, track, length);
 				}
 				if(((track>70)&&(retries>=3))||(retries>=10))
 				{
@@ -261,7 +268,7 @@ master_disk(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_
 }
 
 void
-master_disk_raw(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *track_length)
+master_disk_raw(CBM_FILE fd, nib_disk *disk)
 {
 	int track, density;
 	BYTE trackbuf[NIB_TRACK_LENGTH];
@@ -269,7 +276,7 @@ master_disk_raw(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *tr
 	FILE *trkin = '\0';
 	size_t length;
 
-	for (track=backwards?end_track:start_track; backwards?(track>=start_track):(track<=end_track); backwards?(track-=track_inc):(track+=track_inc))
+	for (track=backwards?disk->opt.end_track:disk->opt.start_track; backwards?(track>=disk->opt.start_track):(track<=disk->opt.end_track); backwards?(track-=disk->opt.track_inc):(track+=disk->opt.track_inc))
 	{
 		printf("\n%4.1f:", (float) track / 2);
 
@@ -299,16 +306,16 @@ master_disk_raw(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *tr
 				length = NIB_TRACK_LENGTH;
 
 			/* process track */
-			memcpy(track_buffer + (track * NIB_TRACK_LENGTH), trackbuf, NIB_TRACK_LENGTH);
-			track_density[track] = check_sync_flags(track_buffer + (track * NIB_TRACK_LENGTH), density, length);
-			//length = compress_halftrack(track, track_buffer + (track * NIB_TRACK_LENGTH), track_density[track], length);
+			memcpy(disk->track_buffer + (track * NIB_TRACK_LENGTH), trackbuf, NIB_TRACK_LENGTH);
+			disk->track_density[track] = check_sync_flags(disk->track_buffer + (track * NIB_TRACK_LENGTH), density, length);
+			//length = compress_halftrack(track, disk->track_buffer + (track * NIB_TRACK_LENGTH), disk->track_density[track], length);
 
-			printf(" (%d", track_density[track] & 3);
-			if ( (track_density[track]&3) != speed_map[track/2])
+			printf(" (%d", disk->track_density[track] & 3);
+			if ( (disk->track_density[track]&3) != speed_map[track/2])
 				printf("!=%d", speed_map[track/2]);
-			if (track_density[track] & BM_NO_SYNC)
+			if (disk->track_density[track] & BM_NO_SYNC)
 					printf(":NOSYNC");
-			else if (track_density[track] & BM_FF_TRACK)
+			else if (disk->track_density[track] & BM_FF_TRACK)
 				printf(":KILLER");
 			printf(") (%d) ", length);
 
@@ -318,7 +325,7 @@ master_disk_raw(CBM_FILE fd, BYTE *track_buffer, BYTE *track_density, size_t *tr
 				printf(" (trunc:%d) ",  length - capacity[density & 3]);
 				length = capacity[density & 3];
 			}
-			master_track(fd, track_buffer, track_density, track, length);
+			master_track(fd, disk, track, length);
 		}
 		else
 			printf(" [missing track file - skipped]");
@@ -337,7 +344,7 @@ unformat_disk(CBM_FILE fd)
 
 	printf("Wiping/Unformatting...");
 
-	for (track = start_track; track <= end_track; track += 1/*track_inc*/)
+	for (track = disk->opt.start_track; track <= disk->opt.end_track; track += 1/*disk->opt.track_inc*/)
 	{
 		if(verbose>1) printf("\n%4.1f:",  (float) track/2);
 		for(i=0;i<unformat_passes; i++)
@@ -401,10 +408,10 @@ void adjust_target(CBM_FILE fd)
 		cap_high[i] = 0;
 		cap_low[i] = 0xffff;
 
-		if( (start_track < track_dens[i]) && (end_track > track_dens[i]))
+		if( (disk->opt.start_track < track_dens[i]) && (disk->opt.end_track > track_dens[i]))
 			step_to_halftrack(fd, track_dens[i]);
 		else
-			step_to_halftrack(fd, start_track);
+			step_to_halftrack(fd, disk->opt.start_track);
 
 		set_bitrate(fd, (BYTE)i);
 
@@ -443,17 +450,17 @@ void adjust_target(CBM_FILE fd)
 				break;
 		}
 
-		capacity[i] -= capacity_margin + extra_capacity_margin;
+		capacity[i] -= capacity_margin + disk->opt.extra_capacity_margin;
 	}
 
-	motor_speed = (float)((DENSITY3 / (capacity[3] + capacity_margin + extra_capacity_margin))
-							+(DENSITY2 / (capacity[2] + capacity_margin + extra_capacity_margin))
-							+(DENSITY1 / (capacity[1] + capacity_margin + extra_capacity_margin))
-							+(DENSITY0 / (capacity[0] + capacity_margin + extra_capacity_margin)) ) / 4;
+	motor_speed = (float)((DENSITY3 / (capacity[3] + capacity_margin + disk->opt.extra_capacity_margin))
+							+(DENSITY2 / (capacity[2] + capacity_margin + disk->opt.extra_capacity_margin))
+							+(DENSITY1 / (capacity[1] + capacity_margin + disk->opt.extra_capacity_margin))
+							+(DENSITY0 / (capacity[0] + capacity_margin + disk->opt.extra_capacity_margin)) ) / 4;
 
 	//printf("--------------------------------------------------\n");
 	printf("Motor speed: ~%.2f RPM.\n", motor_speed);
-	printf("Track capacity margin: %d\n", capacity_margin + extra_capacity_margin);
+	printf("Track capacity margin: %d\n", capacity_margin + disk->opt.extra_capacity_margin);
 
 	if( (motor_speed > 320) || (motor_speed < 280))
 	{
@@ -469,7 +476,7 @@ init_aligned_disk(CBM_FILE fd)
 
 	/* write all 0x55 */
 	printf("\nWiping/Unformatting...\n");
-	for (track = start_track; track <= end_track; track += 1)
+	for (track = disk->opt.start_track; track <= disk->opt.end_track; track += 1)
 	{
 		// step head
 		step_to_halftrack(fd, track);